@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+
+# Generates raqm-grapheme-table.h, the Grapheme_Cluster_Break property table
+# used by raqm.c, from the Unicode Character Database files
+# GraphemeBreakProperty.txt and emoji-data.txt.
+#
+# usage: ./gen-grapheme-table.py GraphemeBreakProperty.txt emoji-data.txt \
+#            > raqm-grapheme-table.h
+
+import sys
+
+if len (sys.argv) != 3:
+    sys.exit ("usage: %s GraphemeBreakProperty.txt emoji-data.txt" % sys.argv[0])
+
+# The order must match how raqm.c uses the values
+VALUES = [
+    "Other",
+    "CR",
+    "LF",
+    "Control",
+    "Extend",
+    "ZWJ",
+    "Regional_Indicator",
+    "Prepend",
+    "SpacingMark",
+    "L",
+    "V",
+    "T",
+    "LV",
+    "LVT",
+    # Characters with Extended_Pictographic=Yes, which are all Other
+    "Extended_Pictographic",
+]
+
+MAX_CODEPOINT = 0x10FFFF
+
+
+def read_ranges (path, wanted=None):
+    header = None
+    ranges = []
+    with open (path, encoding="utf-8") as f:
+        for line in f:
+            if header is None and line.startswith ("#"):
+                header = line.strip ()
+            line = line.split ("#", 1)[0].strip ()
+            if not line:
+                continue
+            codepoints, value = [s.strip () for s in line.split (";")[:2]]
+            if wanted is not None and value != wanted:
+                continue
+            if ".." in codepoints:
+                start, end = [int (s, 16) for s in codepoints.split ("..")]
+            else:
+                start = end = int (codepoints, 16)
+            ranges.append ((start, end, value))
+    return header, ranges
+
+
+gcb_header, gcb_ranges = read_ranges (sys.argv[1])
+emoji_header, emoji_ranges = read_ranges (sys.argv[2], "Extended_Pictographic")
+
+values = [0] * (MAX_CODEPOINT + 1)
+for start, end, value in gcb_ranges:
+    for u in range (start, end + 1):
+        values[u] = VALUES.index (value)
+for start, end, value in emoji_ranges:
+    for u in range (start, end + 1):
+        assert values[u] == 0, "U+%04X is Extended_Pictographic but not Other" % u
+        values[u] = VALUES.index (value)
+
+# Split the table into blocks, and find the block size giving the smallest
+# two-level table. The blocks hold two values per byte, the one of the even
+# character in the low four bits. Everything past the last block is Other.
+assert len (VALUES) <= 16
+last = max (u for u in range (MAX_CODEPOINT + 1) if values[u])
+
+best = None
+for shift in range (4, 10):
+    block_size = 1 << shift
+    blocks_len = (last >> shift) + 1
+    blocks = {}
+    index = []
+    for i in range (blocks_len):
+        block = tuple (values[i * block_size:(i + 1) * block_size])
+        index.append (blocks.setdefault (block, len (blocks)))
+    index_size = 1 if len (blocks) <= 256 else 2
+    size = len (index) * index_size + len (blocks) * block_size // 2
+    if best is None or size < best[0]:
+        best = (size, shift, index, blocks, index_size)
+
+size, shift, index, blocks, index_size = best
+
+print ("/* == Start of generated table == */")
+print ("/*")
+print (" * The following tables are generated by running:")
+print (" *")
+print (" *   ./gen-grapheme-table.py GraphemeBreakProperty.txt emoji-data.txt")
+print (" *")
+print (" * on files with these headers:")
+print (" *")
+print (" * %s" % gcb_header)
+print (" * %s" % emoji_header)
+print (" */")
+print ()
+print ("#ifndef RAQM_GRAPHEME_TABLE_H")
+print ("#define RAQM_GRAPHEME_TABLE_H")
+print ()
+print ("#define RAQM_GRAPHEME_TABLE_SHIFT %d" % shift)
+print ("#define RAQM_GRAPHEME_TABLE_LEN 0x%04Xu" % (len (index) << shift))
+print ()
+print ("static const uint%d_t _raqm_grapheme_index[%d] =" % (index_size * 8, len (index)))
+print ("{")
+for i in range (0, len (index), 16):
+    print ("  " + ", ".join ("%3d" % v for v in index[i:i + 16]) + ",")
+print ("};")
+print ()
+print ("static const uint8_t _raqm_grapheme_blocks[%d][%d] =" % (len (blocks), 1 << (shift - 1)))
+print ("{")
+for block in sorted (blocks, key=blocks.get):
+    packed = [block[i] | block[i + 1] << 4 for i in range (0, len (block), 2)]
+    print ("  {")
+    for i in range (0, len (packed), 16):
+        print ("    " + ", ".join ("0x%02X" % v for v in packed[i:i + 16]) + ",")
+    print ("  },")
+print ("};")
+print ()
+print ("#endif /* RAQM_GRAPHEME_TABLE_H */")
+print ()
+print ("/* == End of generated table == */")
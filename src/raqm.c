@@ -26,8 +26,19 @@
 #include "config.h"
 #endif
 
+/* For clock_gettime () */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
 #ifdef RAQM_SHEENBIDI
 #include <SheenBidi.h>
@@ -39,6 +50,7 @@
 #include <hb-ft.h>
 
 #include "raqm.h"
+#include "raqm-grapheme-table.h"
 
 /**
  * SECTION:raqm
@@ -167,38 +179,282 @@
   typedef FriBidiLevel _raqm_bidi_level_t;
 #endif
 
+typedef struct {
+  size_t pos;
+  size_t len;
+  _raqm_bidi_level_t level;
+} _raqm_bidi_run;
+
 typedef struct {
   FT_Face       ftface;
   int           ftloadflags;
   hb_language_t lang;
-  hb_script_t   script;
 } _raqm_text_info;
 
+/* An entry of the glyph extents cache of a #_raqm_run_font */
+typedef struct {
+  /* The glyph index plus one, or 0 for an empty slot */
+  uint32_t           key;
+  hb_glyph_extents_t extents;
+} _raqm_glyph_extents;
+
+/* A font shared by the runs of a layout using the same face and load flags,
+ * with the extents of its glyphs found by raqm_get_extents () */
+typedef struct {
+  FT_Face              ftface;
+  int                  ftloadflags;
+  hb_font_t           *font;
+
+  _raqm_glyph_extents *extents;
+  size_t               extents_len;
+  size_t               extents_capacity;
+} _raqm_run_font;
+
+/* A range of text sharing the same _raqm_text_info. Spans are kept sorted and
+ * cover the whole text, each span ends where the next one starts, and no two
+ * adjacent spans have the same text info. */
+typedef struct {
+  size_t          start;
+  _raqm_text_info info;
+} _raqm_text_span;
+
+/* A run of the itemization result, kept so that raqm_relayout() can skip
+ * script and bidi resolution */
+typedef struct {
+  uint32_t           pos;
+  uint32_t           len;
+  hb_direction_t     direction;
+  _raqm_bidi_level_t level;
+  hb_script_t        script;
+  _raqm_text_info    info;
+} _raqm_item;
+
 typedef struct _raqm_run raqm_run_t;
 
+typedef struct {
+  FT_Face         ftface;
+  int             ftloadflags;
+  FT_Size         ftsize;
+  FT_Size_Metrics ftsize_metrics;
+  hb_font_t      *font;
+} _raqm_font_cache_entry;
+
+/* The characters of the Basic Multilingual Plane a face has glyphs for, found
+ * as they are looked up: @checked has a bit set for every character looked
+ * up, and @covered for those of them the face has a glyph for */
+#define RAQM_COVERAGE_WORDS (0x10000 / 32)
+
+typedef struct {
+  FT_Face   ftface;
+  uint32_t *checked;
+  uint32_t *covered;
+} _raqm_coverage_entry;
+
+struct _raqm_font_cache {
+  int                     ref_count;
+
+  _raqm_font_cache_entry *entries;
+  size_t                  entries_len;
+  size_t                  entries_capacity;
+
+  _raqm_coverage_entry   *coverage;
+  size_t                  coverage_len;
+  size_t                  coverage_capacity;
+};
+
+/* HarfBuzz keeps up to this many characters of context around a run */
+#define RAQM_SHAPE_CACHE_CONTEXT_LEN 5
+/* Only runs up to this length (roughly a word) are cached */
+#define RAQM_SHAPE_CACHE_MAX_RUN_LEN 64
+
+/* How much raqm_layout_paragraphs_from_func () asks for at a time */
+#define RAQM_READ_CHUNK_LEN 65536
+
+typedef struct {
+  uint32_t             hash;
+
+  FT_Face              ftface;
+  int                  ftloadflags;
+  FT_Size              ftsize;
+  FT_Size_Metrics      ftsize_metrics;
+  hb_script_t          script;
+  hb_language_t        lang;
+  hb_direction_t       direction;
+
+  /* The run text, with its pre- and post-context. The post-context stops at
+   * the end of the text, so the run length is needed to tell where it
+   * starts. */
+  uint32_t            *text;
+  size_t               text_len;
+  size_t               pre_context_len;
+  size_t               run_len;
+
+  hb_glyph_info_t     *infos;
+  hb_glyph_position_t *positions;
+  unsigned int         glyphs_len;
+
+  int                  bucket_next;
+  int                  lru_prev;
+  int                  lru_next;
+} _raqm_shape_cache_entry;
+
+typedef struct {
+  _raqm_shape_cache_entry *entries;
+  size_t                   entries_len;
+  size_t                   entries_capacity;
+
+  int                     *buckets;
+  size_t                   buckets_len;
+
+  int                      lru_head;
+  int                      lru_tail;
+
+  size_t                   hits;
+  size_t                   misses;
+} _raqm_shape_cache;
+
+/* A glyph of the layout, in visual order, as needed by cursor queries */
+typedef struct {
+  int          x;        /* pen position before the glyph */
+  int          y;        /* y position of the line of the glyph */
+  int          x_advance;
+  int          max_end;  /* largest pen position after this or any
+                            previous glyph of the line */
+  uint32_t     cluster;
+  uint32_t     next_cluster;
+  raqm_run_t  *run;
+} _raqm_cursor_glyph;
+
+typedef struct _raqm_scratch_block _raqm_scratch_block;
+
+struct _raqm_scratch_block {
+  _raqm_scratch_block *next;
+  size_t               size;
+  size_t               used;
+};
+
+#define RAQM_SCRATCH_ALIGN 16
+#define RAQM_SCRATCH_HEADER_SIZE \
+  ((sizeof (_raqm_scratch_block) + RAQM_SCRATCH_ALIGN - 1) & \
+   ~(size_t) (RAQM_SCRATCH_ALIGN - 1))
+#define RAQM_SCRATCH_MIN_BLOCK_SIZE 4096
+
 struct _raqm {
   int              ref_count;
 
+  raqm_allocator_t allocator;
+  /* Memory for temporary arrays used during layout */
+  _raqm_scratch_block *scratch;
+
   uint32_t        *text;
-  char            *text_utf8;
   size_t           text_len;
   size_t           text_capacity_bytes;
 
-  _raqm_text_info *text_info;
+  /* UTF-8 offset tables, only set when the text was set using
+   * raqm_set_text_utf8() or raqm_set_text_utf16(), in which case they use
+   * UTF-16 code units instead of bytes */
+  uint32_t        *text_u32_to_u8;
+  uint32_t        *text_u8_to_u32;
+  size_t           text_utf8_len;
+  bool             text_utf16;
+
+  hb_script_t     *text_scripts;
+
+  _raqm_text_span *text_spans;
+  size_t           text_spans_len;
+  size_t           text_spans_capacity;
 
   raqm_direction_t base_dir;
   raqm_direction_t resolved_dir;
 
+  raqm_bidi_func_t bidi_func;
+  void            *bidi_user_data;
+  /* The visual order bidi runs of the last layout, valid until the text, the
+   * paragraph direction or the bidi function change */
+  _raqm_bidi_run  *bidi_runs;
+  size_t           bidi_runs_len;
+  size_t           bidi_runs_capacity;
+  raqm_direction_t bidi_resolved_dir;
+  bool             bidi_runs_valid;
+
   hb_feature_t    *features;
   size_t           features_len;
+  size_t           features_capacity;
+  /* The features added with raqm_add_font_feature_range () apply to the
+   * current text only, and are kept after the others */
+  size_t           global_features_len;
 
   raqm_run_t      *runs;
   raqm_run_t      *runs_pool;
+  /* Runs of the previous layout, whose buffers can be reused */
+  raqm_run_t      *stale_runs;
+  /* Set by raqm_replace_text() until the next layout, which then reuses the
+   * stale runs that did not change */
+  bool             reuse_stale_runs;
+
+  /* Runs of the last itemization, valid until the text, its properties or
+   * the paragraph direction change */
+  _raqm_item      *items;
+  size_t           items_len;
+  size_t           items_capacity;
+  bool             items_valid;
+  /* Set during raqm_relayout() when stale runs may be scaled to a new size */
+  bool             scale_stale_runs;
 
   raqm_glyph_t    *glyphs;
   size_t           glyphs_capacity;
 
+  raqm_glyph_t    *batch_glyphs;
+  size_t           batch_glyphs_capacity;
+
+  /* The text read by raqm_layout_paragraphs_from_func () and not laid out
+   * yet */
+  char            *read_buffer;
+  size_t           read_buffer_capacity;
+
+  /* The fonts made for the runs of the last layout */
+  _raqm_run_font  *run_fonts;
+  size_t           run_fonts_len;
+  size_t           run_fonts_capacity;
+
   int              invisible_glyph;
+
+  /* Faces used for characters not supported by their face */
+  FT_Face         *fallback_faces;
+  size_t           fallback_faces_len;
+
+  int              line_width;
+  raqm_line_t     *lines;
+  size_t           lines_len;
+  size_t           lines_capacity;
+
+  raqm_font_cache_t *font_cache;
+  _raqm_shape_cache *shape_cache;
+  raqm_layout_cache_t *layout_cache;
+
+  raqm_run_tasks_func_t shape_tasks_func;
+  void                 *shape_tasks_user_data;
+  size_t                shape_tasks_min_text_len;
+
+  bool                  stats_enabled;
+  raqm_stats_t          stats;
+  raqm_trace_func_t     trace_func;
+  void                 *trace_user_data;
+
+  /* Index for cursor queries, built on first use after each layout */
+  _raqm_cursor_glyph   *cursor_glyphs;
+  size_t                cursor_glyphs_capacity;
+  uint32_t             *cursor_char_glyphs;
+  size_t                cursor_char_glyphs_capacity;
+  size_t                cursor_glyphs_len;
+  int                   cursor_end_x;
+  int                   cursor_end_y;
+  bool                  cursor_index_valid;
+
+  /* Grapheme boundaries of the text, see _raqm_build_grapheme_breaks () */
+  uint32_t             *grapheme_breaks;
+  size_t                grapheme_breaks_capacity;
+  bool                  grapheme_breaks_valid;
 };
 
 struct _raqm_run {
@@ -206,41 +462,381 @@ struct _raqm_run {
   uint32_t       len;
 
   hb_direction_t direction;
+  _raqm_bidi_level_t level;
   hb_script_t    script;
+  hb_language_t  lang;
   hb_font_t     *font;
   hb_buffer_t   *buffer;
+  /* The most glyphs or characters @buffer held, to estimate its memory */
+  size_t         buffer_len;
+
+  /* Set while the run is waiting to be shaped by _raqm_shape () */
+  bool           shape_pending;
+  bool           shape_cacheable;
+  uint32_t       shape_cache_hash;
+
+  /* Set when the buffer was kept from the previous layout */
+  bool           shape_reused;
+  /* The face size and transform the buffer was shaped with, and how much
+   * its clusters moved by text edits since then */
+  FT_Size_Metrics shape_size_metrics;
+  FT_Matrix      shape_matrix;
+  int32_t        cluster_shift;
 
   raqm_run_t    *next;
 };
 
+/* Reference counts of objects that may be shared between threads */
+#if defined(_WIN32)
+typedef LONG _raqm_atomic_int;
+# define _raqm_atomic_inc(p) InterlockedIncrement (p)
+# define _raqm_atomic_dec(p) InterlockedDecrement (p)
+#elif defined(__GNUC__)
+typedef int _raqm_atomic_int;
+# define _raqm_atomic_inc(p) __atomic_add_fetch (p, 1, __ATOMIC_RELAXED)
+# define _raqm_atomic_dec(p) __atomic_sub_fetch (p, 1, __ATOMIC_ACQ_REL)
+#else
+/* No atomic operations known for this compiler */
+typedef int _raqm_atomic_int;
+# define _raqm_atomic_inc(p) (++*(p))
+# define _raqm_atomic_dec(p) (--*(p))
+#endif
+
+/* The result of a layout, never changed after raqm_freeze_layout(). All its
+ * arrays are allocated in the same block as the structure itself. */
+struct _raqm_layout_result {
+  _raqm_atomic_int  ref_count;
+
+  raqm_allocator_t  allocator;
+
+  raqm_glyph_t     *glyphs;
+  size_t            glyphs_len;
+
+  raqm_glyph_run_t *runs;
+  size_t            runs_len;
+
+  raqm_line_t      *lines;
+  size_t            lines_len;
+
+  raqm_direction_t  resolved_dir;
+
+  /* The size of the allocation, counted by layout caches */
+  size_t            size;
+};
+
+struct _raqm_feature_set {
+  _raqm_atomic_int  ref_count;
+
+  hb_feature_t     *features;
+  size_t            features_len;
+  size_t            features_capacity;
+};
+
+/* The key of a layout cache entry holds everything the output of
+ * raqm_layout() depends on: this header, followed by the text, its UTF-8 or
+ * UTF-16 offsets (if any), the properties of each text span, the face of each
+ * span and of each fallback face with its size and transform, and the font
+ * features. The bidi function is part of the header, since the levels and run
+ * order it gives can differ from the built-in ones. Keys are zero filled before being written, so that they can be
+ * compared with memcmp(). */
+typedef struct {
+  size_t           text_len;
+  size_t           text_utf8_len;
+  size_t           spans_len;
+  size_t           fallback_faces_len;
+  size_t           features_len;
+  bool             mapped;
+  raqm_direction_t base_dir;
+  int              invisible_glyph;
+  int              line_width;
+  raqm_bidi_func_t bidi_func;
+  void            *bidi_user_data;
+} _raqm_layout_key_header;
+
+typedef struct {
+  size_t        start;
+  int           ftloadflags;
+  hb_language_t lang;
+} _raqm_layout_key_span;
+
+typedef struct {
+  FT_Face   ftface;
+  FT_Size   ftsize;
+  FT_UShort x_ppem;
+  FT_UShort y_ppem;
+  FT_Fixed  x_scale;
+  FT_Fixed  y_scale;
+  FT_Matrix matrix;
+} _raqm_layout_key_face;
+
+typedef struct _raqm_layout_cache_entry _raqm_layout_cache_entry;
+
+/* An entry of a layout cache, followed by its key */
+struct _raqm_layout_cache_entry {
+  uint32_t                  hash;
+  size_t                    key_size;
+  size_t                    bytes;
+  raqm_layout_result_t     *result;
+
+  _raqm_layout_cache_entry *bucket_next;
+  _raqm_layout_cache_entry *lru_prev;
+  _raqm_layout_cache_entry *lru_next;
+};
+
+struct _raqm_layout_cache {
+  int                        ref_count;
+
+  size_t                     max_bytes;
+  size_t                     bytes;
+
+  _raqm_layout_cache_entry **buckets;
+  size_t                     buckets_len;
+  size_t                     entries_len;
+
+  _raqm_layout_cache_entry  *lru_head;
+  _raqm_layout_cache_entry  *lru_tail;
+
+  /* The key of the current lookup */
+  unsigned char             *key;
+  size_t                     key_capacity;
+
+  size_t                     hits;
+  size_t                     misses;
+  size_t                     evictions;
+};
+
+static uint64_t
+_raqm_now_ns (void)
+{
+#if defined(_WIN32)
+  LARGE_INTEGER count, frequency;
+  QueryPerformanceCounter (&count);
+  QueryPerformanceFrequency (&frequency);
+  return (uint64_t) (count.QuadPart * (1e9 / frequency.QuadPart));
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  return (uint64_t) (clock () * (1e9 / CLOCKS_PER_SEC));
+#endif
+}
+
+/* Start timing a layout phase, if stats or tracing are enabled */
+static uint64_t
+_raqm_phase_begin (raqm_t *rq)
+{
+  if (!rq->stats_enabled && !rq->trace_func)
+    return 0;
+
+  return _raqm_now_ns ();
+}
+
+static void
+_raqm_phase_end (raqm_t       *rq,
+                 raqm_phase_t  phase,
+                 uint64_t      start)
+{
+  uint64_t ns;
+
+  if (!rq->stats_enabled && !rq->trace_func)
+    return;
+
+  ns = _raqm_now_ns () - start;
+
+  if (rq->stats_enabled)
+    rq->stats.phase_ns[phase] += ns;
+
+  if (rq->trace_func)
+    rq->trace_func (rq, phase, ns, rq->trace_user_data);
+}
+
+static void *
+_raqm_malloc (raqm_t *rq,
+              size_t  size)
+{
+  if (rq->stats_enabled)
+  {
+    rq->stats.allocs++;
+    rq->stats.alloc_bytes += size;
+  }
+
+  if (rq->allocator.malloc_func)
+    return rq->allocator.malloc_func (size, rq->allocator.user_data);
+
+  return malloc (size);
+}
+
+static void *
+_raqm_realloc (raqm_t *rq,
+               void   *ptr,
+               size_t  size)
+{
+  if (rq->stats_enabled)
+  {
+    rq->stats.allocs++;
+    rq->stats.alloc_bytes += size;
+  }
+
+  if (rq->allocator.realloc_func)
+    return rq->allocator.realloc_func (ptr, size, rq->allocator.user_data);
+
+  return realloc (ptr, size);
+}
+
+static void
+_raqm_free (raqm_t *rq,
+            void   *ptr)
+{
+  if (!ptr)
+    return;
+
+  if (rq->allocator.free_func)
+    rq->allocator.free_func (ptr, rq->allocator.user_data);
+  else
+    free (ptr);
+}
+
+/* Allocate temporary memory that is valid until the end of the current
+ * raqm_layout() call */
+static void *
+_raqm_scratch_alloc (raqm_t *rq,
+                     size_t  size)
+{
+  _raqm_scratch_block *block = rq->scratch;
+  void *ptr;
+
+  size = (size + RAQM_SCRATCH_ALIGN - 1) & ~(size_t) (RAQM_SCRATCH_ALIGN - 1);
+
+  if (!block || block->size - block->used < size)
+  {
+    size_t block_size = block ? block->size * 2 : RAQM_SCRATCH_MIN_BLOCK_SIZE;
+
+    while (block_size < size)
+      block_size *= 2;
+
+    block = _raqm_malloc (rq, RAQM_SCRATCH_HEADER_SIZE + block_size);
+    if (!block)
+      return NULL;
+
+    block->next = rq->scratch;
+    block->size = block_size;
+    block->used = 0;
+    rq->scratch = block;
+  }
+
+  ptr = (char *) block + RAQM_SCRATCH_HEADER_SIZE + block->used;
+  block->used += size;
+
+  return ptr;
+}
+
+static void
+_raqm_scratch_free_blocks (raqm_t *rq)
+{
+  _raqm_scratch_block *block = rq->scratch;
+
+  while (block)
+  {
+    _raqm_scratch_block *next = block->next;
+    _raqm_free (rq, block);
+    block = next;
+  }
+
+  rq->scratch = NULL;
+}
+
+/* Release all scratch memory. When the last layout needed more than one
+ * block, they are replaced by a single block big enough for all of them, so
+ * that laying out similar text again does not allocate. */
+static void
+_raqm_scratch_reset (raqm_t *rq)
+{
+  _raqm_scratch_block *block = rq->scratch;
+  size_t size = 0;
+
+  if (!block)
+    return;
+
+  if (!block->next)
+  {
+    block->used = 0;
+    return;
+  }
+
+  for (; block != NULL; block = block->next)
+    size += block->size;
+
+  _raqm_scratch_free_blocks (rq);
+
+  block = _raqm_malloc (rq, RAQM_SCRATCH_HEADER_SIZE + size);
+  if (block)
+  {
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    rq->scratch = block;
+  }
+}
+
 static uint32_t
 _raqm_u8_to_u32_index (raqm_t   *rq,
                        uint32_t  index);
 
 static void
-_raqm_init_text_info (raqm_t *rq)
+_raqm_release_run_fonts (raqm_t *rq);
+
+static bool
+_raqm_reserve_text_spans (raqm_t *rq,
+                          size_t  len)
 {
-  hb_language_t default_lang = hb_language_get_default ();
-  for (size_t i = 0; i < rq->text_len; i++)
+  if (len > rq->text_spans_capacity)
   {
-    rq->text_info[i].ftface = NULL;
-    rq->text_info[i].ftloadflags = -1;
-    rq->text_info[i].lang = default_lang;
-    rq->text_info[i].script = HB_SCRIPT_INVALID;
+    size_t new_capacity = rq->text_spans_capacity ? rq->text_spans_capacity : 4;
+    void *new_spans;
+
+    while (new_capacity < len)
+      new_capacity *= 2;
+
+    new_spans = _raqm_realloc (rq, rq->text_spans,
+                               sizeof (_raqm_text_span) * new_capacity);
+    if (!new_spans)
+      return false;
+
+    rq->text_spans = new_spans;
+    rq->text_spans_capacity = new_capacity;
   }
+
+  return true;
+}
+
+static bool
+_raqm_init_text_info (raqm_t *rq)
+{
+  if (!_raqm_reserve_text_spans (rq, 1))
+    return false;
+
+  rq->text_spans[0].start = 0;
+  rq->text_spans[0].info.ftface = NULL;
+  rq->text_spans[0].info.ftloadflags = -1;
+  rq->text_spans[0].info.lang = hb_language_get_default ();
+  rq->text_spans_len = 1;
+
+  return true;
 }
 
 static void
 _raqm_release_text_info (raqm_t *rq)
 {
-  if (!rq->text_info)
-    return;
+  rq->items_valid = false;
 
-  for (size_t i = 0; i < rq->text_len; i++)
+  for (size_t i = 0; i < rq->text_spans_len; i++)
   {
-    if (rq->text_info[i].ftface)
-      FT_Done_Face (rq->text_info[i].ftface);
+    if (rq->text_spans[i].info.ftface)
+      FT_Done_Face (rq->text_spans[i].info.ftface);
   }
+
+  rq->text_spans_len = 0;
 }
 
 static bool
@@ -256,19 +852,135 @@ _raqm_compare_text_info (_raqm_text_info a,
   if (a.lang != b.lang)
     return false;
 
-  if (a.script != b.script)
+  return true;
+}
+
+static size_t
+_raqm_text_span_end (raqm_t *rq,
+                     size_t  span)
+{
+  if (span + 1 < rq->text_spans_len)
+    return rq->text_spans[span + 1].start;
+
+  return rq->text_len;
+}
+
+/* Find the span containing the character at @index */
+static size_t
+_raqm_find_text_span (raqm_t *rq,
+                      size_t  index)
+{
+  size_t lower = 0;
+  size_t upper = rq->text_spans_len;
+
+  while (upper - lower > 1)
+  {
+    size_t mid = (lower + upper) / 2;
+    if (rq->text_spans[mid].start <= index)
+      lower = mid;
+    else
+      upper = mid;
+  }
+
+  return lower;
+}
+
+/* Make sure a span starts at @index, splitting the span containing it if
+ * needed, and return that span */
+static bool
+_raqm_split_text_span (raqm_t *rq,
+                       size_t  index,
+                       size_t *span)
+{
+  size_t i;
+
+  if (index >= rq->text_len)
+  {
+    *span = rq->text_spans_len;
+    return true;
+  }
+
+  i = _raqm_find_text_span (rq, index);
+  if (rq->text_spans[i].start != index)
+  {
+    if (!_raqm_reserve_text_spans (rq, rq->text_spans_len + 1))
+      return false;
+
+    memmove (rq->text_spans + i + 2, rq->text_spans + i + 1,
+             sizeof (_raqm_text_span) * (rq->text_spans_len - i - 1));
+    rq->text_spans[i + 1].start = index;
+    rq->text_spans[i + 1].info = rq->text_spans[i].info;
+    if (rq->text_spans[i + 1].info.ftface)
+      FT_Reference_Face (rq->text_spans[i + 1].info.ftface);
+    rq->text_spans_len++;
+    i++;
+  }
+
+  *span = i;
+  return true;
+}
+
+/* Split the spans so that [@start, @end) is covered by whole spans, and return
+ * the range of spans covering it in @first and @last. */
+static bool
+_raqm_split_text_spans (raqm_t *rq,
+                        size_t  start,
+                        size_t  end,
+                        size_t *first,
+                        size_t *last)
+{
+  rq->items_valid = false;
+
+  if (!_raqm_split_text_span (rq, start, first))
+    return false;
+
+  if (!_raqm_split_text_span (rq, end, last))
     return false;
 
   return true;
 }
 
+/* Merge adjacent spans with equal text info in the range of spans
+ * [@first - 1, @last], after they have been modified. */
+static void
+_raqm_merge_text_spans (raqm_t *rq,
+                        size_t  first,
+                        size_t  last)
+{
+  size_t i, j;
+
+  if (first > 0)
+    first--;
+  if (last >= rq->text_spans_len)
+    last = rq->text_spans_len - 1;
+
+  for (i = first, j = first + 1; j < rq->text_spans_len; j++)
+  {
+    if (j <= last &&
+        _raqm_compare_text_info (rq->text_spans[i].info,
+                                 rq->text_spans[j].info))
+    {
+      if (rq->text_spans[j].info.ftface)
+        FT_Done_Face (rq->text_spans[j].info.ftface);
+      continue;
+    }
+
+    rq->text_spans[++i] = rq->text_spans[j];
+  }
+
+  rq->text_spans_len = i + 1;
+}
+
 static void
 _raqm_free_text(raqm_t* rq)
 {
-  free (rq->text);
+  _raqm_free (rq, rq->text);
   rq->text = NULL;
-  rq->text_info = NULL;
-  rq->text_utf8 = NULL;
+  rq->text_scripts = NULL;
+  rq->text_u32_to_u8 = NULL;
+  rq->text_u8_to_u32 = NULL;
+  rq->text_utf8_len = 0;
+  rq->text_utf16 = false;
   rq->text_len = 0;
   rq->text_capacity_bytes = 0;
 }
@@ -278,14 +990,18 @@ _raqm_alloc_text(raqm_t *rq,
                  size_t  len,
                  bool    need_utf8)
 {
-  /* Allocate contiguous memory block for texts and text_info */
-  size_t mem_size = (sizeof (uint32_t) + sizeof (_raqm_text_info)) * len;
+  /* Allocate contiguous memory block for texts, scripts and, for UTF-8 and
+   * UTF-16 input, the tables mapping between UTF-32 and input indices */
+  size_t mem_size = (sizeof (uint32_t) + sizeof (hb_script_t)) * len;
+
+  rq->bidi_runs_valid = false;
+
   if (need_utf8)
-    mem_size += sizeof (char) * len;
+    mem_size += sizeof (uint32_t) * 2 * (len + 1);
 
   if (mem_size > rq->text_capacity_bytes)
   {
-    void* new_mem = realloc (rq->text, mem_size);
+    void* new_mem = _raqm_realloc (rq, rq->text, mem_size);
     if (!new_mem)
     {
       _raqm_free_text (rq);
@@ -296,8 +1012,19 @@ _raqm_alloc_text(raqm_t *rq,
     rq->text = new_mem;
   }
 
-  rq->text_info = (_raqm_text_info*)(rq->text + len);
-  rq->text_utf8 = need_utf8 ? (char*)(rq->text_info + len) : NULL;
+  rq->text_scripts = (hb_script_t*)(rq->text + len);
+  if (need_utf8)
+  {
+    rq->text_u32_to_u8 = (uint32_t*)(rq->text_scripts + len);
+    rq->text_u8_to_u32 = rq->text_u32_to_u8 + len + 1;
+  }
+  else
+  {
+    rq->text_u32_to_u8 = NULL;
+    rq->text_u8_to_u32 = NULL;
+  }
+  rq->text_utf8_len = 0;
+  rq->text_utf16 = false;
 
   return true;
 }
@@ -312,22 +1039,34 @@ _raqm_alloc_run (raqm_t *rq)
   }
   else
   {
-    run = malloc (sizeof (raqm_run_t));
+    run = _raqm_malloc (rq, sizeof (raqm_run_t));
+    if (!run)
+      return NULL;
+
     run->font = NULL;
     run->buffer = NULL;
+    run->buffer_len = 0;
   }
 
   run->pos = 0;
   run->len = 0;
   run->direction = HB_DIRECTION_INVALID;
+  run->level = 0;
   run->script = HB_SCRIPT_INVALID;
+  run->lang = HB_LANGUAGE_INVALID;
+  run->shape_pending = false;
+  run->shape_cacheable = false;
+  run->shape_cache_hash = 0;
+  run->shape_reused = false;
+  run->cluster_shift = 0;
   run->next = NULL;
 
   return run;
 }
 
 static void
-_raqm_free_runs (raqm_run_t *runs)
+_raqm_free_runs (raqm_t     *rq,
+                 raqm_run_t *runs)
 {
   while (runs)
   {
@@ -340,54 +1079,249 @@ _raqm_free_runs (raqm_run_t *runs)
     if (run->font)
       hb_font_destroy (run->font);
 
-    free (run);
+    _raqm_free (rq, run);
   }
 }
 
-/**
- * raqm_create:
- *
- * Creates a new #raqm_t with all its internal states initialized to their
- * defaults.
- *
- * Return value:
- * A newly allocated #raqm_t with a reference count of 1. The initial reference
- * count should be released with raqm_destroy() when you are done using the
- * #raqm_t. Returns `NULL` in case of error.
- *
- * Since: 0.1
- */
-raqm_t *
+/* Return @runs to the pool, keeping their hb buffers for reuse */
+static void
+_raqm_recycle_runs (raqm_t     *rq,
+                    raqm_run_t *runs)
+{
+  raqm_run_t *run = runs;
+
+  while (run)
+  {
+    if (run->buffer)
+      hb_buffer_reset (run->buffer);
+
+    if (run->font)
+    {
+      hb_font_destroy (run->font);
+      run->font = NULL;
+    }
+
+    if (!run->next)
+    {
+      run->next = rq->runs_pool;
+      rq->runs_pool = runs;
+      break;
+    }
+
+    run = run->next;
+  }
+}
+
+static void
+_raqm_discard_stale_runs (raqm_t *rq)
+{
+  _raqm_recycle_runs (rq, rq->stale_runs);
+  rq->stale_runs = NULL;
+}
+
+/* Keep the runs of the current layout for reuse by the next one */
+static void
+_raqm_keep_stale_runs (raqm_t *rq)
+{
+  rq->cursor_index_valid = false;
+  rq->lines_len = 0;
+
+  if (!rq->runs)
+    return;
+
+  _raqm_discard_stale_runs (rq);
+  rq->stale_runs = rq->runs;
+  rq->runs = NULL;
+}
+
+static void
+_raqm_shape_cache_clear (raqm_t            *rq,
+                         _raqm_shape_cache *cache)
+{
+  if (!cache)
+    return;
+
+  for (size_t i = 0; i < cache->entries_len; i++)
+  {
+    _raqm_free (rq, cache->entries[i].text);
+    FT_Done_Face (cache->entries[i].ftface);
+  }
+
+  for (size_t i = 0; i < cache->buckets_len; i++)
+    cache->buckets[i] = -1;
+
+  cache->entries_len = 0;
+  cache->lru_head = -1;
+  cache->lru_tail = -1;
+}
+
+static void
+_raqm_shape_cache_destroy (raqm_t            *rq,
+                           _raqm_shape_cache *cache)
+{
+  if (!cache)
+    return;
+
+  _raqm_shape_cache_clear (rq, cache);
+  _raqm_free (rq, cache->entries);
+  _raqm_free (rq, cache->buckets);
+  _raqm_free (rq, cache);
+}
+
+/**
+ * raqm_create:
+ *
+ * Creates a new #raqm_t with all its internal states initialized to their
+ * defaults.
+ *
+ * Return value:
+ * A newly allocated #raqm_t with a reference count of 1. The initial reference
+ * count should be released with raqm_destroy() when you are done using the
+ * #raqm_t. Returns `NULL` in case of error.
+ *
+ * Since: 0.1
+ */
+raqm_t *
 raqm_create (void)
 {
+  return raqm_create_with_allocator (NULL);
+}
+
+/**
+ * raqm_create_with_allocator:
+ * @allocator: (nullable): the memory allocation functions to use, or `NULL`.
+ *
+ * Same as raqm_create(), but the memory owned by the new #raqm_t, including
+ * the #raqm_t itself, is allocated using the functions in @allocator instead
+ * of malloc(), realloc() and free(). Those functions must return memory
+ * aligned for any type, like malloc() does. If @allocator is `NULL`, or any
+ * of its functions is `NULL`, the standard functions are used instead.
+ *
+ * Memory allocated by HarfBuzz, FriBidi and FreeType, and by font caches
+ * shared between #raqm_t objects, is not affected.
+ *
+ * Once a layout has been done, the temporary memory it needs is kept in the
+ * #raqm_t, also across raqm_clear_contents(), so that laying out text of
+ * similar length again does not need to allocate it.
+ *
+ * Return value:
+ * A newly allocated #raqm_t with a reference count of 1. The initial reference
+ * count should be released with raqm_destroy() when you are done using the
+ * #raqm_t. Returns `NULL` in case of error.
+ *
+ * Since: 0.10
+ */
+raqm_t *
+raqm_create_with_allocator (const raqm_allocator_t *allocator)
+{
+  raqm_allocator_t funcs;
   raqm_t *rq;
 
-  rq = malloc (sizeof (raqm_t));
+  if (allocator &&
+      allocator->malloc_func && allocator->realloc_func && allocator->free_func)
+    funcs = *allocator;
+  else
+    memset (&funcs, 0, sizeof (raqm_allocator_t));
+
+  if (funcs.malloc_func)
+    rq = funcs.malloc_func (sizeof (raqm_t), funcs.user_data);
+  else
+    rq = malloc (sizeof (raqm_t));
   if (!rq)
     return NULL;
 
   rq->ref_count = 1;
 
+  rq->allocator = funcs;
+  rq->scratch = NULL;
+
   rq->base_dir = RAQM_DIRECTION_DEFAULT;
   rq->resolved_dir = RAQM_DIRECTION_DEFAULT;
 
+  rq->bidi_func = NULL;
+  rq->bidi_user_data = NULL;
+  rq->bidi_runs = NULL;
+  rq->bidi_runs_len = 0;
+  rq->bidi_runs_capacity = 0;
+  rq->bidi_resolved_dir = RAQM_DIRECTION_DEFAULT;
+  rq->bidi_runs_valid = false;
+
   rq->features = NULL;
   rq->features_len = 0;
+  rq->features_capacity = 0;
+  rq->global_features_len = 0;
 
   rq->invisible_glyph = 0;
 
+  rq->fallback_faces = NULL;
+  rq->fallback_faces_len = 0;
+
+  rq->line_width = 0;
+  rq->lines = NULL;
+  rq->lines_len = 0;
+  rq->lines_capacity = 0;
+
   rq->text = NULL;
-  rq->text_utf8 = NULL;
-  rq->text_info = NULL;
+  rq->text_u32_to_u8 = NULL;
+  rq->text_u8_to_u32 = NULL;
+  rq->text_utf8_len = 0;
+  rq->text_utf16 = false;
+  rq->text_scripts = NULL;
   rq->text_capacity_bytes = 0;
   rq->text_len = 0;
 
+  rq->text_spans = NULL;
+  rq->text_spans_len = 0;
+  rq->text_spans_capacity = 0;
+
   rq->runs = NULL;
   rq->runs_pool = NULL;
+  rq->stale_runs = NULL;
+  rq->reuse_stale_runs = false;
+
+  rq->items = NULL;
+  rq->items_len = 0;
+  rq->items_capacity = 0;
+  rq->items_valid = false;
+  rq->scale_stale_runs = false;
 
   rq->glyphs = NULL;
   rq->glyphs_capacity = 0;
 
+  rq->batch_glyphs = NULL;
+  rq->batch_glyphs_capacity = 0;
+  rq->read_buffer = NULL;
+  rq->read_buffer_capacity = 0;
+  rq->run_fonts = NULL;
+  rq->run_fonts_len = 0;
+  rq->run_fonts_capacity = 0;
+
+  rq->font_cache = NULL;
+  rq->shape_cache = NULL;
+  rq->layout_cache = NULL;
+
+  rq->shape_tasks_func = NULL;
+  rq->shape_tasks_user_data = NULL;
+  rq->shape_tasks_min_text_len = 0;
+
+  rq->stats_enabled = false;
+  memset (&rq->stats, 0, sizeof (raqm_stats_t));
+  rq->trace_func = NULL;
+  rq->trace_user_data = NULL;
+
+  rq->cursor_glyphs = NULL;
+  rq->cursor_glyphs_capacity = 0;
+  rq->cursor_char_glyphs = NULL;
+  rq->cursor_char_glyphs_capacity = 0;
+  rq->cursor_glyphs_len = 0;
+  rq->cursor_end_x = 0;
+  rq->cursor_end_y = 0;
+  rq->cursor_index_valid = false;
+
+  rq->grapheme_breaks = NULL;
+  rq->grapheme_breaks_capacity = 0;
+  rq->grapheme_breaks_valid = false;
+
   return rq;
 }
 
@@ -430,11 +1364,32 @@ raqm_destroy (raqm_t *rq)
 
   _raqm_release_text_info (rq);
   _raqm_free_text (rq);
-  _raqm_free_runs (rq->runs);
-  _raqm_free_runs (rq->runs_pool);
-  free (rq->glyphs);
-  free (rq->features);
-  free (rq);
+  _raqm_free (rq, rq->text_spans);
+  _raqm_free (rq, rq->bidi_runs);
+  _raqm_free_runs (rq, rq->runs);
+  _raqm_free_runs (rq, rq->runs_pool);
+  _raqm_free_runs (rq, rq->stale_runs);
+  _raqm_free (rq, rq->items);
+  _raqm_free (rq, rq->glyphs);
+  _raqm_free (rq, rq->batch_glyphs);
+  _raqm_free (rq, rq->read_buffer);
+  _raqm_release_run_fonts (rq);
+  for (size_t i = 0; i < rq->run_fonts_capacity; i++)
+    _raqm_free (rq, rq->run_fonts[i].extents);
+  _raqm_free (rq, rq->run_fonts);
+  _raqm_free (rq, rq->lines);
+  _raqm_free (rq, rq->cursor_glyphs);
+  _raqm_free (rq, rq->cursor_char_glyphs);
+  _raqm_free (rq, rq->grapheme_breaks);
+  _raqm_free (rq, rq->features);
+  for (size_t i = 0; i < rq->fallback_faces_len; i++)
+    FT_Done_Face (rq->fallback_faces[i]);
+  _raqm_free (rq, rq->fallback_faces);
+  raqm_font_cache_destroy (rq->font_cache);
+  _raqm_shape_cache_destroy (rq, rq->shape_cache);
+  raqm_layout_cache_destroy (rq->layout_cache);
+  _raqm_scratch_free_blocks (rq);
+  _raqm_free (rq, rq);
 }
 
 /**
@@ -454,29 +1409,15 @@ raqm_clear_contents (raqm_t *rq)
 
   _raqm_release_text_info (rq);
 
-  /* Return allocated runs to the pool, keep hb buffers for reuse */
-  raqm_run_t *run = rq->runs;
-  while (run)
-  {
-    if (run->buffer)
-      hb_buffer_reset (run->buffer);
-
-    if (run->font)
-    {
-      hb_font_destroy (run->font);
-      run->font = NULL;
-    }
-
-    if (!run->next)
-    {
-      run->next = rq->runs_pool;
-      rq->runs_pool = rq->runs;
-      rq->runs = NULL;
-      break;
-    }
-
-    run = run->next;
-  }
+  _raqm_recycle_runs (rq, rq->runs);
+  rq->runs = NULL;
+  _raqm_discard_stale_runs (rq);
+  rq->cursor_index_valid = false;
+  rq->grapheme_breaks_valid = false;
+  rq->bidi_runs_valid = false;
+  rq->lines_len = 0;
+  rq->features_len = rq->global_features_len;
+  _raqm_release_run_fonts (rq);
 
   rq->text_len = 0;
   rq->resolved_dir = RAQM_DIRECTION_DEFAULT;
@@ -519,7 +1460,12 @@ raqm_set_text (raqm_t         *rq,
 
   rq->text_len = len;
   memcpy (rq->text, text, sizeof (uint32_t) * len);
-  _raqm_init_text_info (rq);
+
+  if (!_raqm_init_text_info (rq))
+  {
+    rq->text_len = 0;
+    return false;
+  }
 
   return true;
 }
@@ -554,21 +1500,78 @@ _raqm_get_utf8_codepoint (const void *str,
   return (void *)s;
 }
 
+/* Number of bytes checked at once by the ASCII fast path of
+ * _raqm_u8_to_u32 () */
+#define RAQM_UTF8_CHUNK_LEN 8
+
+/* Whether the RAQM_UTF8_CHUNK_LEN bytes at @s are all ASCII and none of them
+ * is NUL, which ends the text */
+static bool
+_raqm_utf8_chunk_is_ascii (const char *s)
+{
+  uint64_t v;
+
+  memcpy (&v, s, sizeof (v));
+
+  return !((v | ((v - 0x0101010101010101ULL) & ~v)) & 0x8080808080808080ULL);
+}
+
+/* Decode UTF-8 @text into @unicode, while filling the tables mapping each
+ * UTF-32 index to the UTF-8 index of its first byte, and each UTF-8 byte to
+ * the UTF-32 index of the character it belongs to. Both tables have an extra
+ * entry for the end of text. Runs of ASCII are decoded a chunk at a time,
+ * in loops the compiler can vectorize. */
 static size_t
-_raqm_u8_to_u32 (const char *text, size_t len, uint32_t *unicode)
+_raqm_u8_to_u32 (const char *text,
+                 size_t      len,
+                 uint32_t   *unicode,
+                 uint32_t   *u32_to_u8,
+                 uint32_t   *u8_to_u32)
 {
   size_t in_len = 0;
-  uint32_t *out_utf32 = unicode;
+  size_t out_len = 0;
   const char *in_utf8 = text;
 
-  while ((*in_utf8 != '\0') && (in_len < len))
+  while ((in_len < len) && (*in_utf8 != '\0'))
   {
-    in_utf8 = _raqm_get_utf8_codepoint (in_utf8, out_utf32);
-    ++out_utf32;
-    ++in_len;
+    const char *next;
+    size_t end;
+
+    if (len - in_len >= RAQM_UTF8_CHUNK_LEN &&
+        _raqm_utf8_chunk_is_ascii (in_utf8))
+    {
+      for (size_t i = 0; i < RAQM_UTF8_CHUNK_LEN; i++)
+      {
+        unicode[out_len + i] = (unsigned char) in_utf8[i];
+        u32_to_u8[out_len + i] = in_len + i;
+        u8_to_u32[in_len + i] = out_len + i;
+      }
+
+      in_utf8 += RAQM_UTF8_CHUNK_LEN;
+      in_len += RAQM_UTF8_CHUNK_LEN;
+      out_len += RAQM_UTF8_CHUNK_LEN;
+      continue;
+    }
+
+    next = _raqm_get_utf8_codepoint (in_utf8, unicode + out_len);
+    end = in_len + (next - in_utf8);
+
+    if (end > len)
+      end = len;
+
+    u32_to_u8[out_len] = in_len;
+    for (; in_len < end; in_len++)
+      u8_to_u32[in_len] = out_len;
+
+    in_utf8 = next;
+    out_len++;
   }
 
-  return (out_utf32 - unicode);
+  u32_to_u8[out_len] = in_len;
+  for (; in_len <= len; in_len++)
+    u8_to_u32[in_len] = out_len;
+
+  return out_len;
 }
 
 /**
@@ -603,256 +1606,404 @@ raqm_set_text_utf8 (raqm_t     *rq,
   if (!_raqm_alloc_text(rq, len, true))
       return false;
 
-  rq->text_len = _raqm_u8_to_u32 (text, len, rq->text);
-  memcpy (rq->text_utf8, text, sizeof (char) * len);
-  _raqm_init_text_info (rq);
+  rq->text_len = _raqm_u8_to_u32 (text, len, rq->text,
+                                  rq->text_u32_to_u8, rq->text_u8_to_u32);
+  rq->text_utf8_len = len;
+
+  if (!_raqm_init_text_info (rq))
+  {
+    rq->text_len = 0;
+    return false;
+  }
 
   return true;
 }
 
-/**
- * raqm_set_par_direction:
- * @rq: a #raqm_t.
- * @dir: the direction of the paragraph.
- *
- * Sets the paragraph direction, also known as block direction in CSS. For
- * horizontal text, this controls the overall direction in the Unicode
- * Bidirectional Algorithm, so when the text is mainly right-to-left (with or
- * without some left-to-right) text, then the base direction should be set to
- * #RAQM_DIRECTION_RTL and vice versa.
- *
- * The default is #RAQM_DIRECTION_DEFAULT, which determines the paragraph
- * direction based on the first character with strong bidi type (see [rule
- * P2](https://unicode.org/reports/tr9/#P2) in Unicode Bidirectional Algorithm),
- * which can be good enough for many cases but has problems when a mainly
- * right-to-left paragraph starts with a left-to-right character and vice versa
- * as the detected paragraph direction will be the wrong one, or when text does
- * not contain any characters with string bidi types (e.g. only punctuation or
- * numbers) as this will default to left-to-right paragraph direction.
- *
- * For vertical, top-to-bottom text, #RAQM_DIRECTION_TTB should be used. Raqm,
- * however, provides limited vertical text support and does not handle rotated
- * horizontal text in vertical text, instead everything is treated as vertical
- * text.
- *
- * Return value:
- * `true` if no errors happened, `false` otherwise.
- *
- * Since: 0.1
- */
-bool
-raqm_set_par_direction (raqm_t          *rq,
-                        raqm_direction_t dir)
+/* Decode UTF-16 @text into @unicode, filling the same tables as
+ * _raqm_u8_to_u32 () but with UTF-16 code unit indices. Unpaired surrogates
+ * are replaced with U+FFFD. */
+static size_t
+_raqm_u16_to_u32 (const uint16_t *text,
+                  size_t          len,
+                  uint32_t       *unicode,
+                  uint32_t       *u32_to_u16,
+                  uint32_t       *u16_to_u32)
 {
-  if (!rq)
-    return false;
+  size_t in_len = 0;
+  size_t out_len = 0;
 
-  rq->base_dir = dir;
+  while ((in_len < len) && (text[in_len] != 0))
+  {
+    uint32_t ch = text[in_len];
+    size_t end = in_len + 1;
 
-  return true;
+    if (ch >= 0xD800 && ch <= 0xDBFF && end < len &&
+        text[end] >= 0xDC00 && text[end] <= 0xDFFF)
+    {
+      ch = 0x10000 + ((ch - 0xD800) << 10) + (text[end] - 0xDC00);
+      end++;
+    }
+    else if (ch >= 0xD800 && ch <= 0xDFFF)
+      ch = 0xFFFD;
+
+    unicode[out_len] = ch;
+    u32_to_u16[out_len] = in_len;
+    for (; in_len < end; in_len++)
+      u16_to_u32[in_len] = out_len;
+
+    out_len++;
+  }
+
+  u32_to_u16[out_len] = in_len;
+  for (; in_len <= len; in_len++)
+    u16_to_u32[in_len] = out_len;
+
+  return out_len;
 }
 
 /**
- * raqm_set_language:
+ * raqm_set_text_utf16:
  * @rq: a #raqm_t.
- * @lang: a BCP47 language code.
- * @start: index of first character that should use @face.
- * @len: number of characters using @face.
+ * @text: (array length=len): a UTF-16 encoded text string.
+ * @len: the length of @text in UTF-16 code units.
  *
- * Sets a [BCP47 language
- * code](https://www.w3.org/International/articles/language-tags/) to be used
- * for @len-number of characters staring at @start.  The @start and @len are
- * input string array indices (i.e. counting bytes in UTF-8 and scaler values
- * in UTF-32).
+ * Same as raqm_set_text(), but for text encoded in UTF-16 encoding, in the
+ * byte order of the platform. Unpaired surrogates are replaced with U+FFFD.
  *
- * This method can be used repeatedly to set different languages for different
- * parts of the text.
+ * Indices passed to and returned by other functions, like glyph clusters,
+ * character ranges and cursor positions, are then counted in UTF-16 code
+ * units.
  *
  * Return value:
  * `true` if no errors happened, `false` otherwise.
  *
- * Stability:
- * Unstable
- *
- * Since: 0.2
+ * Since: 0.10
  */
 bool
-raqm_set_language (raqm_t       *rq,
-                   const char   *lang,
-                   size_t        start,
-                   size_t        len)
+raqm_set_text_utf16 (raqm_t         *rq,
+                     const uint16_t *text,
+                     size_t          len)
 {
-  hb_language_t language;
-  size_t end = start + len;
+  if (!rq || !text)
+    return false;
 
-  if (!rq)
+  /* Call raqm_clear_contents to reuse this raqm_t */
+  if (rq->text_len)
     return false;
 
-  if (!rq->text_len)
+  /* Empty string, don’t fail but do nothing */
+  if (!len)
     return true;
 
-  if (rq->text_utf8)
+  if (!_raqm_alloc_text(rq, len, true))
+      return false;
+
+  rq->text_len = _raqm_u16_to_u32 (text, len, rq->text,
+                                   rq->text_u32_to_u8, rq->text_u8_to_u32);
+  rq->text_utf8_len = len;
+  rq->text_utf16 = true;
+
+  if (!_raqm_init_text_info (rq))
   {
-    start = _raqm_u8_to_u32_index (rq, start);
-    end = _raqm_u8_to_u32_index (rq, end);
+    rq->text_len = 0;
+    return false;
   }
 
-  if (start >= rq->text_len || end > rq->text_len)
-    return false;
+  return true;
+}
 
-  if (!rq->text_info)
-    return false;
+/* Update the text span starts after replacing [@start, @start + @len) with
+ * @text_len characters. The new characters take the properties of the first
+ * replaced one, or for insertions of the character before them. */
+static void
+_raqm_replace_text_spans (raqm_t *rq,
+                          size_t  start,
+                          size_t  len,
+                          size_t  text_len,
+                          size_t  new_len)
+{
+  size_t i, j;
 
-  language = hb_language_from_string (lang, -1);
-  for (size_t i = start; i < end; i++)
+  for (i = 1; i < rq->text_spans_len; i++)
   {
-    rq->text_info[i].lang = language;
+    size_t span_start = rq->text_spans[i].start;
+
+    if (span_start < start || (span_start == start && len))
+      continue;
+
+    if (span_start < start + len)
+      rq->text_spans[i].start = start + text_len;
+    else
+      rq->text_spans[i].start = span_start - len + text_len;
   }
 
-  return true;
+  /* Drop the spans that became empty, keeping at least one */
+  for (i = 0, j = 0; i < rq->text_spans_len; i++)
+  {
+    size_t end = i + 1 < rq->text_spans_len ? rq->text_spans[i + 1].start
+                                            : new_len;
+
+    if (end <= rq->text_spans[i].start && (j || i + 1 < rq->text_spans_len))
+    {
+      if (rq->text_spans[i].info.ftface)
+        FT_Done_Face (rq->text_spans[i].info.ftface);
+      continue;
+    }
+
+    rq->text_spans[j++] = rq->text_spans[i];
+  }
+
+  rq->text_spans_len = j;
+  rq->text_spans[0].start = 0;
+
+  _raqm_merge_text_spans (rq, 0, rq->text_spans_len);
 }
 
 /**
- * raqm_add_font_feature:
+ * raqm_replace_text:
  * @rq: a #raqm_t.
- * @feature: (transfer none): a font feature string.
- * @len: length of @feature, -1 for `NULL`-terminated.
+ * @start: index of the first character to replace.
+ * @len: number of characters to replace.
+ * @text: (nullable): a UTF-32 encoded text string to insert.
+ * @text_len: the length of @text.
  *
- * Adds a font feature to be used by the #raqm_t during text layout. This is
- * usually used to turn on optional font features that are not enabled by
- * default, for example `dlig` or `ss01`, but can be also used to turn off
- * default font features.
+ * Replaces @len characters of the text of @rq starting at @start with @text,
+ * e.g. after the text was edited. This can be called after raqm_layout(), and
+ * the next raqm_layout() will reuse the shaping results of the runs that were
+ * not affected by the edits, instead of shaping the whole text again.
  *
- * @feature is string representing a single font feature, in the syntax
- * understood by hb_feature_from_string().
+ * Runs are reused when their text, face, load flags, size and transform did
+ * not change, so a face must not be changed in other ways between the two
+ * layouts, e.g. with FT_Set_Var_Design_Coordinates(). Only the first layout
+ * after the edits reuses runs.
  *
- * This function can be called repeatedly, new features will be appended to the
- * end of the features list and can potentially override previous features.
+ * The new characters get the same properties (e.g. face and language) as the
+ * first replaced character, or for insertions as the character before them.
+ *
+ * This can only be used with text set by raqm_set_text(), and not by
+ * raqm_set_text_utf8() or raqm_set_text_utf16(). Features that apply to ranges of the text
+ * will still apply to the same character indices after the edit.
  *
  * Return value:
- * `true` if parsing @feature succeeded, `false` otherwise.
+ * `true` if no errors happened, `false` otherwise.
  *
- * Since: 0.1
+ * Since: 0.10
  */
 bool
-raqm_add_font_feature (raqm_t     *rq,
-                       const char *feature,
-                       int         len)
+raqm_replace_text (raqm_t         *rq,
+                   size_t          start,
+                   size_t          len,
+                   const uint32_t *text,
+                   size_t          text_len)
 {
-  hb_bool_t ok;
-  hb_feature_t fea;
+  size_t old_len, new_len;
 
-  if (!rq)
+  if (!rq || (text_len && !text))
     return false;
 
-  ok = hb_feature_from_string (feature, len, &fea);
-  if (ok)
+  if (rq->text_u8_to_u32)
+    return false;
+
+  old_len = rq->text_len;
+  if (start > old_len || len > old_len - start)
+    return false;
+
+  if (!rq->text_spans_len && !_raqm_init_text_info (rq))
+    return false;
+
+  new_len = old_len - len + text_len;
+  rq->items_valid = false;
+
+  /* Keep the runs whose text and context did not change, moving the ones
+   * after the edit. Features applied to ranges of text would apply to other
+   * characters after the edit, so nothing can be kept with them. */
+  _raqm_keep_stale_runs (rq);
+  for (size_t i = 0; i < rq->features_len; i++)
   {
-    void* new_features = realloc (rq->features,
-                                  sizeof (hb_feature_t) * (rq->features_len + 1));
-    if (!new_features)
-      return false;
+    if (rq->features[i].start != HB_FEATURE_GLOBAL_START ||
+        rq->features[i].end != HB_FEATURE_GLOBAL_END)
+    {
+      _raqm_discard_stale_runs (rq);
+      break;
+    }
+  }
+  {
+    raqm_run_t *kept = NULL;
+    raqm_run_t *last = NULL;
+    raqm_run_t *run = rq->stale_runs;
 
-    rq->features = new_features;
-    rq->features[rq->features_len] = fea;
-    rq->features_len++;
+    while (run)
+    {
+      raqm_run_t *next = run->next;
+
+      run->next = NULL;
+      if (start + len + RAQM_SHAPE_CACHE_CONTEXT_LEN > run->pos &&
+          start < run->pos + run->len + RAQM_SHAPE_CACHE_CONTEXT_LEN)
+      {
+        _raqm_recycle_runs (rq, run);
+      }
+      else
+      {
+        if (run->pos >= start + len)
+        {
+          run->pos = run->pos - len + text_len;
+          run->cluster_shift += (int32_t) text_len - (int32_t) len;
+        }
+
+        if (last)
+          last->next = run;
+        else
+          kept = run;
+        last = run;
+      }
+
+      run = next;
+    }
+
+    rq->stale_runs = kept;
   }
 
-  return ok;
-}
+  if (new_len > old_len)
+  {
+    if (!_raqm_alloc_text (rq, new_len, false))
+    {
+      raqm_clear_contents (rq);
+      return false;
+    }
+  }
 
-static hb_font_t *
-_raqm_create_hb_font (raqm_t *rq,
-                      FT_Face face,
-                      int     loadflags)
-{
-  hb_font_t *font = hb_ft_font_create_referenced (face);
+  memmove (rq->text + start + text_len, rq->text + start + len,
+           sizeof (uint32_t) * (old_len - start - len));
+  if (text_len)
+    memcpy (rq->text + start, text, sizeof (uint32_t) * text_len);
 
-  if (loadflags >= 0)
-    hb_ft_font_set_load_flags (font, loadflags);
+  if (new_len <= old_len)
+    _raqm_alloc_text (rq, new_len, false);
 
-  return font;
+  _raqm_replace_text_spans (rq, start, len, text_len, new_len);
+  rq->text_len = new_len;
+  rq->grapheme_breaks_valid = false;
+  rq->reuse_stale_runs = true;
+
+  return true;
 }
 
-static bool
-_raqm_set_freetype_face (raqm_t *rq,
-                         FT_Face face,
-                         size_t  start,
-                         size_t  end)
+/**
+ * raqm_set_par_direction:
+ * @rq: a #raqm_t.
+ * @dir: the direction of the paragraph.
+ *
+ * Sets the paragraph direction, also known as block direction in CSS. For
+ * horizontal text, this controls the overall direction in the Unicode
+ * Bidirectional Algorithm, so when the text is mainly right-to-left (with or
+ * without some left-to-right) text, then the base direction should be set to
+ * #RAQM_DIRECTION_RTL and vice versa.
+ *
+ * The default is #RAQM_DIRECTION_DEFAULT, which determines the paragraph
+ * direction based on the first character with strong bidi type (see [rule
+ * P2](https://unicode.org/reports/tr9/#P2) in Unicode Bidirectional Algorithm),
+ * which can be good enough for many cases but has problems when a mainly
+ * right-to-left paragraph starts with a left-to-right character and vice versa
+ * as the detected paragraph direction will be the wrong one, or when text does
+ * not contain any characters with string bidi types (e.g. only punctuation or
+ * numbers) as this will default to left-to-right paragraph direction.
+ *
+ * For vertical, top-to-bottom text, #RAQM_DIRECTION_TTB should be used. Raqm,
+ * however, provides limited vertical text support and does not handle rotated
+ * horizontal text in vertical text, instead everything is treated as vertical
+ * text.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.1
+ */
+bool
+raqm_set_par_direction (raqm_t          *rq,
+                        raqm_direction_t dir)
 {
   if (!rq)
     return false;
 
-  if (!rq->text_len)
-    return true;
-
-  if (start >= rq->text_len || end > rq->text_len)
-    return false;
-
-  if (!rq->text_info)
-    return false;
+  if (dir != rq->base_dir)
+    rq->bidi_runs_valid = false;
 
-  for (size_t i = start; i < end; i++)
-  {
-    if (rq->text_info[i].ftface)
-        FT_Done_Face (rq->text_info[i].ftface);
-    rq->text_info[i].ftface = face;
-    FT_Reference_Face (face);
-  }
+  rq->base_dir = dir;
+  rq->items_valid = false;
 
   return true;
 }
 
 /**
- * raqm_set_freetype_face:
+ * raqm_set_bidi_func:
  * @rq: a #raqm_t.
- * @face: an #FT_Face.
+ * @func: (nullable): a function running the bidi algorithm, or `NULL`.
+ * @user_data: data passed to @func.
  *
- * Sets an #FT_Face to be used for all characters in @rq.
+ * Sets a function that raqm_layout() uses instead of the built-in bidi
+ * implementation to find the embedding levels of the text, e.g. to use
+ * another bidi library, or one better suited to the text. Passing `NULL`
+ * restores the built-in implementation. Left-to-right text with no
+ * characters that need the bidi algorithm, and vertical text, are laid out
+ * without calling @func.
  *
- * See also raqm_set_freetype_face_range().
+ * The bidi runs are kept between layouts, so @func is only called again once
+ * the text or the paragraph direction change.
  *
  * Return value:
  * `true` if no errors happened, `false` otherwise.
  *
- * Since: 0.1
+ * Since: 0.10
  */
 bool
-raqm_set_freetype_face (raqm_t *rq,
-                        FT_Face face)
+raqm_set_bidi_func (raqm_t           *rq,
+                    raqm_bidi_func_t  func,
+                    void             *user_data)
 {
-  return _raqm_set_freetype_face (rq, face, 0, rq->text_len);
+  if (!rq)
+    return false;
+
+  rq->bidi_func = func;
+  rq->bidi_user_data = user_data;
+  rq->bidi_runs_valid = false;
+  rq->items_valid = false;
+
+  return true;
 }
 
 /**
- * raqm_set_freetype_face_range:
+ * raqm_set_language:
  * @rq: a #raqm_t.
- * @face: an #FT_Face.
+ * @lang: a BCP47 language code.
  * @start: index of first character that should use @face.
  * @len: number of characters using @face.
  *
- * Sets an #FT_Face to be used for @len-number of characters staring at @start.
- * The @start and @len are input string array indices (i.e. counting bytes in
- * UTF-8 and scaler values in UTF-32).
- *
- * This method can be used repeatedly to set different faces for different
- * parts of the text. It is the responsibility of the client to make sure that
- * face ranges cover the whole text.
+ * Sets a [BCP47 language
+ * code](https://www.w3.org/International/articles/language-tags/) to be used
+ * for @len-number of characters staring at @start.  The @start and @len are
+ * input string array indices (i.e. counting bytes in UTF-8, code units in
+ * UTF-16 and scaler values in UTF-32).
  *
- * See also raqm_set_freetype_face().
+ * This method can be used repeatedly to set different languages for different
+ * parts of the text.
  *
  * Return value:
  * `true` if no errors happened, `false` otherwise.
  *
- * Since: 0.1
+ * Stability:
+ * Unstable
+ *
+ * Since: 0.2
  */
 bool
-raqm_set_freetype_face_range (raqm_t *rq,
-                              FT_Face face,
-                              size_t  start,
-                              size_t  len)
+raqm_set_language (raqm_t       *rq,
+                   const char   *lang,
+                   size_t        start,
+                   size_t        len)
 {
+  hb_language_t language;
   size_t end = start + len;
+  size_t first, last;
 
   if (!rq)
     return false;
@@ -860,1131 +2011,6208 @@ raqm_set_freetype_face_range (raqm_t *rq,
   if (!rq->text_len)
     return true;
 
-  if (rq->text_utf8)
+  if (rq->text_u8_to_u32)
   {
     start = _raqm_u8_to_u32_index (rq, start);
     end = _raqm_u8_to_u32_index (rq, end);
   }
 
-  return _raqm_set_freetype_face (rq, face, start, end);
-}
+  if (start >= rq->text_len || end > rq->text_len)
+    return false;
 
-static bool
-_raqm_set_freetype_load_flags (raqm_t *rq,
-                               int     flags,
-                               size_t  start,
-                               size_t  end)
-{
-  if (!rq)
+  if (!rq->text_spans_len)
     return false;
 
-  if (!rq->text_len)
+  if (start == end)
     return true;
 
-  if (start >= rq->text_len || end > rq->text_len)
+  if (!_raqm_split_text_spans (rq, start, end, &first, &last))
     return false;
 
-  if (!rq->text_info)
-    return false;
+  language = hb_language_from_string (lang, -1);
+  for (size_t i = first; i < last; i++)
+    rq->text_spans[i].info.lang = language;
 
-  for (size_t i = start; i < end; i++)
-    rq->text_info[i].ftloadflags = flags;
+  _raqm_merge_text_spans (rq, first, last);
 
   return true;
 }
 
-/**
- * raqm_set_freetype_load_flags:
- * @rq: a #raqm_t.
- * @flags: FreeType load flags.
- *
- * Sets the load flags passed to FreeType when loading glyphs, should be the
- * same flags used by the client when rendering FreeType glyphs.
- *
- * This requires version of HarfBuzz that has hb_ft_font_set_load_flags(), for
- * older version the flags will be ignored.
- *
- * Return value:
- * `true` if no errors happened, `false` otherwise.
- *
- * Since: 0.3
- */
-bool
-raqm_set_freetype_load_flags (raqm_t *rq,
-                              int     flags)
+/* Insert @len features at @index of the features of @rq */
+static bool
+_raqm_insert_features (raqm_t             *rq,
+                       size_t              index,
+                       const hb_feature_t *features,
+                       size_t              len)
 {
-  return _raqm_set_freetype_load_flags(rq, flags, 0, rq->text_len);
+  if (rq->features_len + len > rq->features_capacity)
+  {
+    size_t new_capacity = rq->features_capacity ? rq->features_capacity : 4;
+    void *new_features;
+
+    while (new_capacity < rq->features_len + len)
+      new_capacity *= 2;
+
+    new_features = _raqm_realloc (rq, rq->features,
+                                  sizeof (hb_feature_t) * new_capacity);
+    if (!new_features)
+      return false;
+
+    rq->features = new_features;
+    rq->features_capacity = new_capacity;
+  }
+
+  memmove (rq->features + index + len, rq->features + index,
+           sizeof (hb_feature_t) * (rq->features_len - index));
+  memcpy (rq->features + index, features, sizeof (hb_feature_t) * len);
+  rq->features_len += len;
+
+  return true;
 }
 
 /**
- * raqm_set_freetype_load_flags_range:
+ * raqm_add_font_feature:
  * @rq: a #raqm_t.
- * @flags: FreeType load flags.
- * @start: index of first character that should use @flags.
- * @len: number of characters using @flags.
- *
- * Sets the load flags passed to FreeType when loading glyphs for @len-number
- * of characters staring at @start. Flags should be the same as used by the
- * client when rendering corresponding FreeType glyphs. The @start and @len
- * are input string array indices (i.e. counting bytes in UTF-8 and scaler
- * values in UTF-32).
+ * @feature: (transfer none): a font feature string.
+ * @len: length of @feature, -1 for `NULL`-terminated.
  *
- * This method can be used repeatedly to set different flags for different
- * parts of the text. It is the responsibility of the client to make sure that
- * flag ranges cover the whole text.
+ * Adds a font feature to be used by the #raqm_t during text layout. This is
+ * usually used to turn on optional font features that are not enabled by
+ * default, for example `dlig` or `ss01`, but can be also used to turn off
+ * default font features.
  *
- * This requires version of HarfBuzz that has hb_ft_font_set_load_flags(), for
- * older version the flags will be ignored.
+ * @feature is string representing a single font feature, in the syntax
+ * understood by hb_feature_from_string().
  *
- * See also raqm_set_freetype_load_flags().
+ * This function can be called repeatedly, new features will be appended to the
+ * end of the features list and can potentially override previous features.
  *
  * Return value:
- * `true` if no errors happened, `false` otherwise.
+ * `true` if parsing @feature succeeded, `false` otherwise.
  *
- * Since: 0.9
+ * Since: 0.1
  */
 bool
-raqm_set_freetype_load_flags_range (raqm_t *rq,
-                                    int     flags,
-                                    size_t  start,
-                                    size_t  len)
+raqm_add_font_feature (raqm_t     *rq,
+                       const char *feature,
+                       int         len)
 {
-  size_t end = start + len;
+  hb_bool_t ok;
+  hb_feature_t fea;
 
   if (!rq)
     return false;
 
-  if (!rq->text_len)
-    return true;
-
-  if (rq->text_utf8)
+  ok = hb_feature_from_string (feature, len, &fea);
+  if (ok)
   {
-    start = _raqm_u8_to_u32_index (rq, start);
-    end = _raqm_u8_to_u32_index (rq, end);
+    _raqm_shape_cache_clear (rq, rq->shape_cache);
+    _raqm_discard_stale_runs (rq);
+
+    if (!_raqm_insert_features (rq, rq->global_features_len, &fea, 1))
+      return false;
+    rq->global_features_len++;
   }
 
-  return _raqm_set_freetype_load_flags (rq, flags, start, end);
+  return ok;
 }
 
 /**
- * raqm_set_invisible_glyph:
+ * raqm_add_font_feature_range:
  * @rq: a #raqm_t.
- * @gid: glyph id to use for invisible glyphs.
- *
- * Sets the glyph id to be used for invisible glyhphs.
- *
- * If @gid is negative, invisible glyphs will be suppressed from the output.
+ * @feature: (transfer none): a font feature string.
+ * @len: length of @feature, -1 for `NULL`-terminated.
+ * @start: index of first character that should use @feature.
+ * @range_len: number of characters using @feature.
  *
- * If @gid is zero, invisible glyphs will be rendered as space.
+ * Same as raqm_add_font_feature(), but applies @feature only to the given
+ * range of the text, overriding any range in @feature itself. The text
+ * must have been set already, and the indices are in the same units as the
+ * clusters of raqm_get_glyphs(), i.e. bytes for text set with
+ * raqm_set_text_utf8().
  *
- * If @gid is a positive number, it will be used for invisible glyphs.
+ * Features added with this function apply to the current text only, and
+ * are removed by raqm_clear_contents(). They come after the features added
+ * with raqm_add_font_feature() and raqm_add_font_feature_set(), and so
+ * override them. Runs of text using them are not added to the shape cache.
  *
  * Return value:
- * `true` if no errors happened, `false` otherwise.
+ * `true` if parsing @feature succeeded and the range is valid, `false`
+ * otherwise.
  *
- * Since: 0.6
+ * Since: 0.10
  */
 bool
-raqm_set_invisible_glyph (raqm_t *rq,
-                          int gid)
+raqm_add_font_feature_range (raqm_t     *rq,
+                             const char *feature,
+                             int         len,
+                             size_t      start,
+                             size_t      range_len)
 {
-  if (!rq)
+  hb_feature_t fea;
+  size_t end;
+
+  if (!rq || !hb_feature_from_string (feature, len, &fea))
     return false;
 
-  rq->invisible_glyph = gid;
-  return true;
-}
+  if (!rq->text_len || range_len > SIZE_MAX - start)
+    return false;
 
-static bool
-_raqm_itemize (raqm_t *rq);
+  end = start + range_len;
+  if (rq->text_u8_to_u32)
+  {
+    if (end > UINT32_MAX)
+      return false;
 
-static bool
-_raqm_shape (raqm_t *rq);
+    start = _raqm_u8_to_u32_index (rq, start);
+    end = _raqm_u8_to_u32_index (rq, end);
+  }
+
+  if (start >= rq->text_len || end > rq->text_len)
+    return false;
+
+  if (start == end)
+    return true;
+
+  fea.start = start;
+  fea.end = end;
+
+  _raqm_discard_stale_runs (rq);
+
+  return _raqm_insert_features (rq, rq->features_len, &fea, 1);
+}
 
 /**
- * raqm_layout:
+ * raqm_add_font_feature_set:
  * @rq: a #raqm_t.
+ * @set: a #raqm_feature_set_t.
  *
- * Run the text layout process on @rq. This is the main Raqm function where the
- * Unicode Bidirectional Text algorithm will be applied to the text in @rq,
- * text shaping, and any other part of the layout process.
+ * Adds all the features of @set, as raqm_add_font_feature() would add each
+ * of them, but without parsing them again.
  *
  * Return value:
- * `true` if the layout process was successful, `false` otherwise.
+ * `true` if no errors happened, `false` otherwise.
  *
- * Since: 0.1
+ * Since: 0.10
  */
 bool
-raqm_layout (raqm_t *rq)
+raqm_add_font_feature_set (raqm_t                   *rq,
+                           const raqm_feature_set_t *set)
 {
-  if (!rq)
+  if (!rq || !set)
     return false;
 
-  if (!rq->text_len)
+  if (!set->features_len)
     return true;
 
-  if (!rq->text_info)
-    return false;
-
-  for (size_t i = 0; i < rq->text_len; i++)
-  {
-      if (!rq->text_info[i].ftface)
-          return false;
-  }
-
-  if (!_raqm_itemize (rq))
-    return false;
+  _raqm_shape_cache_clear (rq, rq->shape_cache);
+  _raqm_discard_stale_runs (rq);
 
-  if (!_raqm_shape (rq))
+  if (!_raqm_insert_features (rq, rq->global_features_len, set->features,
+                              set->features_len))
     return false;
+  rq->global_features_len += set->features_len;
 
   return true;
 }
 
-static uint32_t
-_raqm_u32_to_u8_index (raqm_t   *rq,
-                       uint32_t  index);
-
 /**
- * raqm_get_glyphs:
- * @rq: a #raqm_t.
- * @length: (out): output array length.
+ * raqm_feature_set_create:
  *
- * Gets the final result of Raqm layout process, an array of #raqm_glyph_t
- * containing the glyph indices in the font, their positions and other possible
- * information.
+ * Creates a new, empty #raqm_feature_set_t. A feature set holds font
+ * features parsed once with raqm_feature_set_add(), that can then be added
+ * to any number of #raqm_t objects with raqm_add_font_feature_set(), e.g.
+ * for each string laid out with the same features.
  *
- * Return value: (transfer none):
- * An array of #raqm_glyph_t, or `NULL` in case of error. This is owned by @rq
- * and must not be freed.
+ * Once all features are added, the set is not modified anymore, and can be
+ * used from several threads at the same time, including
+ * raqm_feature_set_reference() and raqm_feature_set_destroy().
  *
- * Since: 0.1
+ * Return value:
+ * A newly allocated #raqm_feature_set_t with a reference count of 1, or
+ * `NULL` in case of error.
+ *
+ * Since: 0.10
  */
-raqm_glyph_t *
-raqm_get_glyphs (raqm_t *rq,
-                 size_t *length)
+raqm_feature_set_t *
+raqm_feature_set_create (void)
 {
-  size_t count = 0;
+  raqm_feature_set_t *set;
 
-  if (!rq || !rq->runs || !length)
-  {
-    if (length)
-      *length = 0;
+  set = malloc (sizeof (raqm_feature_set_t));
+  if (!set)
     return NULL;
-  }
-
-  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
-    count += hb_buffer_get_length (run->buffer);
 
-  if (count > rq->glyphs_capacity)
-  {
-    void* new_mem = realloc (rq->glyphs, sizeof (raqm_glyph_t) * count);
-    if (!new_mem)
-    {
-      *length = 0;
-      return NULL;
-    }
-    
-    rq->glyphs = new_mem;
-    rq->glyphs_capacity = count;
-  }
+  set->ref_count = 1;
+  set->features = NULL;
+  set->features_len = 0;
+  set->features_capacity = 0;
 
-  *length = count;
+  return set;
+}
 
-  RAQM_TEST ("Glyph information:\n");
+/**
+ * raqm_feature_set_reference:
+ * @set: a #raqm_feature_set_t.
+ *
+ * Increases the reference count on @set by one.
+ *
+ * Return value:
+ * The referenced #raqm_feature_set_t.
+ *
+ * Since: 0.10
+ */
+raqm_feature_set_t *
+raqm_feature_set_reference (raqm_feature_set_t *set)
+{
+  if (set)
+    _raqm_atomic_inc (&set->ref_count);
 
-  count = 0;
-  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
-  {
-    size_t len;
-    hb_glyph_info_t *info;
-    hb_glyph_position_t *position;
+  return set;
+}
 
-    len = hb_buffer_get_length (run->buffer);
-    info = hb_buffer_get_glyph_infos (run->buffer, NULL);
-    position = hb_buffer_get_glyph_positions (run->buffer, NULL);
+/**
+ * raqm_feature_set_destroy:
+ * @set: a #raqm_feature_set_t.
+ *
+ * Decreases the reference count on @set by one. If the result is zero, then
+ * @set is freed.
+ *
+ * Since: 0.10
+ */
+void
+raqm_feature_set_destroy (raqm_feature_set_t *set)
+{
+  if (!set || _raqm_atomic_dec (&set->ref_count) != 0)
+    return;
 
-    for (size_t i = 0; i < len; i++)
-    {
-      rq->glyphs[count + i].index = info[i].codepoint;
-      rq->glyphs[count + i].cluster = info[i].cluster;
-      rq->glyphs[count + i].x_advance = position[i].x_advance;
-      rq->glyphs[count + i].y_advance = position[i].y_advance;
-      rq->glyphs[count + i].x_offset = position[i].x_offset;
-      rq->glyphs[count + i].y_offset = position[i].y_offset;
-      rq->glyphs[count + i].ftface = rq->text_info[info[i].cluster].ftface;
+  free (set->features);
+  free (set);
+}
 
-      RAQM_TEST ("glyph [%d]\tx_offset: %d\ty_offset: %d\tx_advance: %d\tfont: %s\n",
-          rq->glyphs[count + i].index, rq->glyphs[count + i].x_offset,
-          rq->glyphs[count + i].y_offset, rq->glyphs[count + i].x_advance,
-          rq->glyphs[count + i].ftface->family_name);
-    }
+/**
+ * raqm_feature_set_add:
+ * @set: a #raqm_feature_set_t.
+ * @feature: (transfer none): a font feature string.
+ * @len: length of @feature, -1 for `NULL`-terminated.
+ *
+ * Parses @feature, in the syntax understood by hb_feature_from_string(), and
+ * appends it to @set.
+ *
+ * Return value:
+ * `true` if parsing @feature succeeded, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_feature_set_add (raqm_feature_set_t *set,
+                      const char         *feature,
+                      int                 len)
+{
+  hb_feature_t fea;
 
-    count += len;
-  }
+  if (!set || !hb_feature_from_string (feature, len, &fea))
+    return false;
 
-  if (rq->text_utf8)
+  if (set->features_len == set->features_capacity)
   {
-#ifdef RAQM_TESTING
-    RAQM_TEST ("\nUTF-32 clusters:");
-    for (size_t i = 0; i < count; i++)
-      RAQM_TEST (" %02d", rq->glyphs[i].cluster);
-    RAQM_TEST ("\n");
-#endif
-
-    for (size_t i = 0; i < count; i++)
-      rq->glyphs[i].cluster = _raqm_u32_to_u8_index (rq,
-                                                     rq->glyphs[i].cluster);
+    size_t new_capacity = set->features_capacity ? set->features_capacity * 2 : 4;
+    void *new_features = realloc (set->features,
+                                  sizeof (hb_feature_t) * new_capacity);
+    if (!new_features)
+      return false;
 
-#ifdef RAQM_TESTING
-    RAQM_TEST ("UTF-8 clusters: ");
-    for (size_t i = 0; i < count; i++)
-      RAQM_TEST (" %02d", rq->glyphs[i].cluster);
-    RAQM_TEST ("\n");
-#endif
+    set->features = new_features;
+    set->features_capacity = new_capacity;
   }
-  return rq->glyphs;
+
+  set->features[set->features_len++] = fea;
+
+  return true;
 }
 
 /**
- * raqm_get_par_resolved_direction:
- * @rq: a #raqm_t.
+ * raqm_font_cache_create:
  *
- * Gets the resolved direction of the paragraph;
+ * Creates a new, empty #raqm_font_cache_t. A font cache keeps the HarfBuzz
+ * font objects created for each #FT_Face and load flags combination alive
+ * between layouts, so that repeated layouts with the same faces do not have to
+ * recreate them. The cache can be attached to one or more #raqm_t objects
+ * with raqm_set_font_cache().
+ *
+ * The cache keeps a reference to every face used with it, until the face is
+ * dropped with raqm_font_cache_invalidate() or the cache is destroyed.
  *
  * Return value:
- * The #raqm_direction_t specifying the resolved direction of text,
- * or #RAQM_DIRECTION_DEFAULT if raqm_layout() has not been called on @rq.
+ * A newly allocated #raqm_font_cache_t with a reference count of 1, or `NULL`
+ * in case of error.
  *
- * Since: 0.8
+ * Since: 0.10
  */
-RAQM_API raqm_direction_t
-raqm_get_par_resolved_direction (raqm_t *rq)
+raqm_font_cache_t *
+raqm_font_cache_create (void)
 {
-  if (!rq)
-    return RAQM_DIRECTION_DEFAULT;
+  raqm_font_cache_t *cache;
 
-  return rq->resolved_dir;
+  cache = malloc (sizeof (raqm_font_cache_t));
+  if (!cache)
+    return NULL;
+
+  cache->ref_count = 1;
+  cache->entries = NULL;
+  cache->entries_len = 0;
+  cache->entries_capacity = 0;
+  cache->coverage = NULL;
+  cache->coverage_len = 0;
+  cache->coverage_capacity = 0;
+
+  return cache;
 }
 
 /**
- * raqm_get_direction_at_index:
- * @rq: a #raqm_t.
- * @index: (in): character index.
+ * raqm_font_cache_reference:
+ * @cache: a #raqm_font_cache_t.
  *
- * Gets the resolved direction of the character at specified index;
+ * Increases the reference count on @cache by one.
  *
  * Return value:
- * The #raqm_direction_t specifying the resolved direction of text at the
- * specified index, or #RAQM_DIRECTION_DEFAULT if raqm_layout() has not been
- * called on @rq.
+ * The referenced #raqm_font_cache_t.
  *
- * Since: 0.8
+ * Since: 0.10
  */
-RAQM_API raqm_direction_t
-raqm_get_direction_at_index (raqm_t *rq,
-                             size_t index)
+raqm_font_cache_t *
+raqm_font_cache_reference (raqm_font_cache_t *cache)
 {
-  if (!rq)
-    return RAQM_DIRECTION_DEFAULT;
+  if (cache)
+    cache->ref_count++;
 
-  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  return cache;
+}
+
+/**
+ * raqm_font_cache_destroy:
+ * @cache: a #raqm_font_cache_t.
+ *
+ * Decreases the reference count on @cache by one. If the result is zero, then
+ * @cache and all the cached fonts are freed.
+ *
+ * Since: 0.10
+ */
+void
+raqm_font_cache_destroy (raqm_font_cache_t *cache)
+{
+  if (!cache || --cache->ref_count != 0)
+    return;
+
+  raqm_font_cache_invalidate (cache, NULL);
+  free (cache->entries);
+  free (cache->coverage);
+  free (cache);
+}
+
+/**
+ * raqm_font_cache_invalidate:
+ * @cache: a #raqm_font_cache_t.
+ * @face: an #FT_Face, or `NULL`.
+ *
+ * Drops all cached fonts created for @face, or all cached fonts if @face is
+ * `NULL`, and releases the references the cache holds on them. This also
+ * drops the character coverage cached for fallback faces.
+ *
+ * Changes to the character size of a face are detected automatically, but
+ * this must be called after any other change to @face that affects its glyph
+ * metrics (e.g. FT_Set_Transform() or changing variation coordinates) for the
+ * change to be reflected in subsequent layouts.
+ *
+ * Since: 0.10
+ */
+void
+raqm_font_cache_invalidate (raqm_font_cache_t *cache,
+                            FT_Face            face)
+{
+  size_t len = 0;
+
+  if (!cache)
+    return;
+
+  for (size_t i = 0; i < cache->entries_len; i++)
   {
-    if (run->pos <= index && index < run->pos + run->len) {
-      switch (run->direction) {
-        case HB_DIRECTION_LTR:
-          return RAQM_DIRECTION_LTR;
-        case HB_DIRECTION_RTL:
-          return RAQM_DIRECTION_RTL;
-        case HB_DIRECTION_TTB:
-          return RAQM_DIRECTION_TTB;
-        default:
-          return RAQM_DIRECTION_DEFAULT;
-      }
+    if (!face || cache->entries[i].ftface == face)
+      hb_font_destroy (cache->entries[i].font);
+    else
+      cache->entries[len++] = cache->entries[i];
+  }
+
+  cache->entries_len = len;
+
+  len = 0;
+  for (size_t i = 0; i < cache->coverage_len; i++)
+  {
+    if (!face || cache->coverage[i].ftface == face)
+    {
+      FT_Done_Face (cache->coverage[i].ftface);
+      free (cache->coverage[i].checked);
     }
+    else
+      cache->coverage[len++] = cache->coverage[i];
   }
 
-  return RAQM_DIRECTION_DEFAULT;
+  cache->coverage_len = len;
 }
 
-static bool
-_raqm_resolve_scripts (raqm_t *rq);
-
-static hb_direction_t
-_raqm_hb_dir (raqm_t *rq, _raqm_bidi_level_t level)
+/**
+ * raqm_set_font_cache:
+ * @rq: a #raqm_t.
+ * @cache: a #raqm_font_cache_t, or `NULL`.
+ *
+ * Sets the font cache to be used by @rq during layout, @rq will hold a
+ * reference to @cache. The same cache can be shared by several #raqm_t
+ * objects, as long as they are not used concurrently from different threads.
+ *
+ * Passing `NULL` will stop @rq from using a font cache, and HarfBuzz font
+ * objects will be created again on each layout.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_set_font_cache (raqm_t            *rq,
+                     raqm_font_cache_t *cache)
 {
-  hb_direction_t dir = HB_DIRECTION_LTR;
+  if (!rq)
+    return false;
 
-  if (rq->base_dir == RAQM_DIRECTION_TTB)
-      dir = HB_DIRECTION_TTB;
-  else if (RAQM_BIDI_LEVEL_IS_RTL(level))
-      dir = HB_DIRECTION_RTL;
+  raqm_font_cache_reference (cache);
+  raqm_font_cache_destroy (rq->font_cache);
+  rq->font_cache = cache;
 
-  return dir;
+  return true;
 }
 
-typedef struct {
-  size_t pos;
-  size_t len;
-  _raqm_bidi_level_t level;
-} _raqm_bidi_run;
-
-#ifdef RAQM_SHEENBIDI
-static _raqm_bidi_run *
-_raqm_bidi_itemize (raqm_t *rq, size_t *run_count)
+static hb_font_t *
+_raqm_create_hb_font_uncached (FT_Face face,
+                               int     loadflags)
 {
-  _raqm_bidi_run *runs;
-  SBAlgorithmRef bidi;
-  SBParagraphRef par;
-  SBUInteger par_len;
-  SBLineRef line;
-
-  SBLevel base_level = SBLevelDefaultLTR;
-  SBCodepointSequence input = {
-     SBStringEncodingUTF32,
-     (void *) rq->text,
-     rq->text_len
-  };
-
-  if (rq->base_dir == RAQM_DIRECTION_RTL)
-    base_level = 1;
-  else if (rq->base_dir == RAQM_DIRECTION_LTR)
-    base_level = 0;
-
-  /* paragraph */
-  bidi = SBAlgorithmCreate (&input);
-  par = SBAlgorithmCreateParagraph (bidi, 0, INT32_MAX, base_level);
-  par_len = SBParagraphGetLength (par);
+  hb_font_t *font = hb_ft_font_create_referenced (face);
 
-  /* lines */
-  line = SBParagraphCreateLine (par, 0, par_len);
-  *run_count = SBLineGetRunCount (line);
+  if (loadflags >= 0)
+    hb_ft_font_set_load_flags (font, loadflags);
 
-  if (SBParagraphGetBaseLevel (par) == 0)
-    rq->resolved_dir = RAQM_DIRECTION_LTR;
-  else
-    rq->resolved_dir = RAQM_DIRECTION_RTL;
+  return font;
+}
 
-  runs = malloc (sizeof (_raqm_bidi_run) * (*run_count));
-  if (runs)
-  {
-    const SBRun *sheenbidi_runs = SBLineGetRunsPtr(line);
+static bool
+_raqm_font_cache_size_changed (_raqm_font_cache_entry *entry)
+{
+  FT_Size size = entry->ftface->size;
 
-    for (size_t i = 0; i < (*run_count); ++i)
-    {
-      runs[i].pos = sheenbidi_runs[i].offset;
-      runs[i].len = sheenbidi_runs[i].length;
-      runs[i].level = sheenbidi_runs[i].level;
-    }
-  }
+  if (size != entry->ftsize)
+    return true;
 
-  SBLineRelease (line);
-  SBParagraphRelease (par);
-  SBAlgorithmRelease (bidi);
+  if (!size)
+    return false;
 
-  return runs;
+  return size->metrics.x_ppem != entry->ftsize_metrics.x_ppem ||
+         size->metrics.y_ppem != entry->ftsize_metrics.y_ppem ||
+         size->metrics.x_scale != entry->ftsize_metrics.x_scale ||
+         size->metrics.y_scale != entry->ftsize_metrics.y_scale;
 }
-#else
+
 static void
-_raqm_reverse_run (_raqm_bidi_run *run, const size_t len)
+_raqm_font_cache_entry_update_size (_raqm_font_cache_entry *entry)
 {
-  assert (run);
-
-  for (size_t i = 0; i < len / 2; i++)
-  {
-    _raqm_bidi_run temp = run[i];
-    run[i] = run[len - 1 - i];
-    run[len - 1 - i] = temp;
-  }
+  entry->ftsize = entry->ftface->size;
+  if (entry->ftsize)
+    entry->ftsize_metrics = entry->ftsize->metrics;
 }
 
-static _raqm_bidi_run *
-_raqm_reorder_runs (const FriBidiCharType *types,
-                    const size_t len,
-                    const FriBidiParType base_dir,
-                    /* input and output */
-                    FriBidiLevel *levels,
-                    /* output */
-                    size_t *run_count)
+static hb_font_t *
+_raqm_font_cache_get (raqm_font_cache_t *cache,
+                      FT_Face            face,
+                      int                loadflags)
 {
-  FriBidiLevel level;
-  FriBidiLevel last_level = -1;
-  FriBidiLevel max_level = 0;
-  size_t run_start = 0;
-  size_t run_index = 0;
-  _raqm_bidi_run *runs = NULL;
-  size_t count = 0;
+  _raqm_font_cache_entry *entry;
 
-  if (len == 0)
+  for (size_t i = 0; i < cache->entries_len; i++)
   {
-    *run_count = 0;
-    return NULL;
-  }
-
-  assert (types);
-  assert (levels);
+    entry = &cache->entries[i];
+    if (entry->ftface == face && entry->ftloadflags == loadflags)
+    {
+      if (_raqm_font_cache_size_changed (entry))
+      {
+        hb_ft_font_changed (entry->font);
+        _raqm_font_cache_entry_update_size (entry);
+      }
 
-  /* L1. Reset the embedding levels of some chars:
-     4. any sequence of white space characters at the end of the line. */
-  for (int i = len - 1;
-       i >= 0 && FRIBIDI_IS_EXPLICIT_OR_BN_OR_WS (types[i]); i--)
-  {
-    levels[i] = FRIBIDI_DIR_TO_LEVEL (base_dir);
+      return hb_font_reference (entry->font);
+    }
   }
 
-  /* Find max_level of the line.  We don't reuse the paragraph
-   * max_level, both for a cleaner API, and that the line max_level
-   * may be far less than paragraph max_level. */
-  for (int i = len - 1; i >= 0; i--)
+  if (cache->entries_len == cache->entries_capacity)
   {
-    if (levels[i] > max_level)
-       max_level = levels[i];
+    size_t new_capacity = cache->entries_capacity ? cache->entries_capacity * 2 : 4;
+    void *new_entries = realloc (cache->entries,
+                                 sizeof (_raqm_font_cache_entry) * new_capacity);
+    if (!new_entries)
+      return _raqm_create_hb_font_uncached (face, loadflags);
+
+    cache->entries = new_entries;
+    cache->entries_capacity = new_capacity;
   }
 
-  for (size_t i = 0; i < len; i++)
-  {
-    if (levels[i] != last_level)
-      count++;
+  entry = &cache->entries[cache->entries_len++];
+  entry->ftface = face;
+  entry->ftloadflags = loadflags;
+  entry->font = _raqm_create_hb_font_uncached (face, loadflags);
+  _raqm_font_cache_entry_update_size (entry);
 
-    last_level = levels[i];
-  }
+  return hb_font_reference (entry->font);
+}
 
-  runs = malloc (sizeof (_raqm_bidi_run) * count);
+/* Get a font for a run of the layout being itemized. Runs with the same
+ * face and load flags share one font, until _raqm_release_run_fonts (). */
+static hb_font_t *
+_raqm_create_hb_font (raqm_t *rq,
+                      FT_Face face,
+                      int     loadflags)
+{
+  hb_font_t *font;
 
-  while (run_start < len)
+  /* Look from the end, since consecutive runs most often share a font */
+  for (size_t i = rq->run_fonts_len; i > 0; i--)
   {
-    size_t run_end = run_start;
-    while (run_end < len && levels[run_start] == levels[run_end])
-    {
-      run_end++;
-    }
+    _raqm_run_font *entry = &rq->run_fonts[i - 1];
 
-    runs[run_index].pos = run_start;
-    runs[run_index].level = levels[run_start];
-    runs[run_index].len = run_end - run_start;
-    run_start = run_end;
-    run_index++;
+    if (entry->ftface == face && entry->ftloadflags == loadflags)
+      return hb_font_reference (entry->font);
   }
 
-  /* L2. Reorder. */
-  for (level = max_level; level > 0; level--)
+  if (rq->font_cache)
+    font = _raqm_font_cache_get (rq->font_cache, face, loadflags);
+  else
+    font = _raqm_create_hb_font_uncached (face, loadflags);
+
+  /* Failing to keep the font only means that it is not shared */
+  if (rq->run_fonts_len == rq->run_fonts_capacity)
   {
-    for (int i = count - 1; i >= 0; i--)
+    size_t new_capacity = rq->run_fonts_capacity ? rq->run_fonts_capacity * 2 : 4;
+    void *new_fonts = _raqm_realloc (rq, rq->run_fonts,
+                                     sizeof (_raqm_run_font) * new_capacity);
+    if (!new_fonts)
+      return font;
+
+    rq->run_fonts = new_fonts;
+    for (size_t i = rq->run_fonts_capacity; i < new_capacity; i++)
     {
-      if (runs[i].level >= level)
-      {
-        int end = i;
-        for (i--; (i >= 0 && runs[i].level >= level); i--)
-            ;
-        _raqm_reverse_run (runs + i + 1, end - i);
-      }
+      rq->run_fonts[i].extents = NULL;
+      rq->run_fonts[i].extents_len = 0;
+      rq->run_fonts[i].extents_capacity = 0;
     }
+    rq->run_fonts_capacity = new_capacity;
   }
 
-  *run_count = count;
-  return runs;
+  rq->run_fonts[rq->run_fonts_len].ftface = face;
+  rq->run_fonts[rq->run_fonts_len].ftloadflags = loadflags;
+  rq->run_fonts[rq->run_fonts_len].font = hb_font_reference (font);
+  rq->run_fonts_len++;
+
+  return font;
 }
 
-static _raqm_bidi_run *
-_raqm_bidi_itemize (raqm_t *rq, size_t *run_count)
+/* Drop the references of @rq to the fonts of its runs, before making the
+ * runs of a new layout. The memory of the extents caches is kept. */
+static void
+_raqm_release_run_fonts (raqm_t *rq)
 {
-  FriBidiParType par_type = FRIBIDI_PAR_ON;
-  _raqm_bidi_run *runs = NULL;
-
-  FriBidiCharType *types;
-  _raqm_bidi_level_t *levels;
-  int max_level = 0;
-  FriBidiBracketType *btypes;
+  for (size_t i = 0; i < rq->run_fonts_len; i++)
+  {
+    _raqm_run_font *entry = &rq->run_fonts[i];
 
-  types = calloc (rq->text_len, sizeof (FriBidiCharType));
-  btypes = calloc (rq->text_len, sizeof (FriBidiBracketType));
-  levels = calloc (rq->text_len, sizeof (_raqm_bidi_level_t));
+    hb_font_destroy (entry->font);
+    if (entry->extents_len)
+      memset (entry->extents, 0,
+              sizeof (_raqm_glyph_extents) * entry->extents_capacity);
+    entry->extents_len = 0;
+  }
 
-  if (!types || !levels || !btypes)
-    goto done;
+  rq->run_fonts_len = 0;
+}
 
-  if (rq->base_dir == RAQM_DIRECTION_RTL)
-    par_type = FRIBIDI_PAR_RTL;
-  else if (rq->base_dir == RAQM_DIRECTION_LTR)
-    par_type = FRIBIDI_PAR_LTR;
+static _raqm_coverage_entry *
+_raqm_font_cache_get_coverage (raqm_font_cache_t *cache,
+                               FT_Face            face)
+{
+  _raqm_coverage_entry *entry;
 
-  fribidi_get_bidi_types (rq->text, rq->text_len, types);
-  fribidi_get_bracket_types (rq->text, rq->text_len, types, btypes);
-  max_level = fribidi_get_par_embedding_levels_ex (types, btypes,
-                                                   rq->text_len, &par_type,
-                                                   levels);
+  for (size_t i = 0; i < cache->coverage_len; i++)
+  {
+    if (cache->coverage[i].ftface == face)
+      return &cache->coverage[i];
+  }
 
-  if (par_type == FRIBIDI_PAR_LTR)
-    rq->resolved_dir = RAQM_DIRECTION_LTR;
-  else
-    rq->resolved_dir = RAQM_DIRECTION_RTL;
+  if (cache->coverage_len == cache->coverage_capacity)
+  {
+    size_t new_capacity = cache->coverage_capacity ? cache->coverage_capacity * 2 : 4;
+    void *new_coverage = realloc (cache->coverage,
+                                  sizeof (_raqm_coverage_entry) * new_capacity);
+    if (!new_coverage)
+      return NULL;
 
-  if (max_level == 0)
-    goto done;
+    cache->coverage = new_coverage;
+    cache->coverage_capacity = new_capacity;
+  }
 
-  /* Get the number of bidi runs */
-  runs = _raqm_reorder_runs (types, rq->text_len, par_type, levels, run_count);
+  entry = &cache->coverage[cache->coverage_len];
+  entry->checked = calloc (2 * RAQM_COVERAGE_WORDS, sizeof (uint32_t));
+  if (!entry->checked)
+    return NULL;
 
-done:
-  free (types);
-  free (levels);
-  free (btypes);
+  entry->covered = entry->checked + RAQM_COVERAGE_WORDS;
+  entry->ftface = face;
+  FT_Reference_Face (face);
+  cache->coverage_len++;
 
-  return runs;
+  return entry;
 }
-#endif
 
+/* Whether @face has a glyph for @ch, using the coverage cached in the font
+ * cache of @rq if it has one */
 static bool
-_raqm_itemize (raqm_t *rq)
+_raqm_face_has_char (raqm_t   *rq,
+                     FT_Face   face,
+                     uint32_t  ch)
 {
-  _raqm_bidi_run *runs = NULL;
-  raqm_run_t *last;
-  size_t run_count = 0;
-  bool ok = true;
+  _raqm_coverage_entry *coverage = NULL;
+  uint32_t mask = (uint32_t) 1 << (ch & 31);
 
-#ifdef RAQM_TESTING
-  switch (rq->base_dir)
-  {
-    case RAQM_DIRECTION_RTL:
-      RAQM_TEST ("Direction is: RTL\n\n");
-      break;
-    case RAQM_DIRECTION_LTR:
-      RAQM_TEST ("Direction is: LTR\n\n");
-      break;
-    case RAQM_DIRECTION_TTB:
-      RAQM_TEST ("Direction is: TTB\n\n");
-      break;
-    case RAQM_DIRECTION_DEFAULT:
-    default:
-      RAQM_TEST ("Direction is: DEFAULT\n\n");
-      break;
-  }
-#endif
+  if (rq->font_cache && ch < 0x10000)
+    coverage = _raqm_font_cache_get_coverage (rq->font_cache, face);
 
-  if (!_raqm_resolve_scripts (rq))
-  {
-    ok = false;
-    goto done;
-  }
+  if (!coverage)
+    return FT_Get_Char_Index (face, ch) != 0;
 
-  if (rq->base_dir == RAQM_DIRECTION_TTB)
+  if (!(coverage->checked[ch >> 5] & mask))
   {
-    /* Treat every thing as LTR in vertical text */
-    run_count = 1;
-    rq->resolved_dir = RAQM_DIRECTION_TTB;
-    runs = malloc (sizeof (_raqm_bidi_run));
-    if (runs)
-    {
-      runs->pos = 0;
-      runs->len = rq->text_len;
-      runs->level = 0;
-    }
-  } else {
-    runs = _raqm_bidi_itemize (rq, &run_count);
+    coverage->checked[ch >> 5] |= mask;
+    if (FT_Get_Char_Index (face, ch))
+      coverage->covered[ch >> 5] |= mask;
   }
 
-  if (!runs)
-  {
-    ok = false;
-    goto done;
-  }
+  return coverage->covered[ch >> 5] & mask;
+}
 
-#ifdef RAQM_TESTING
-  RAQM_TEST ("Number of runs before script itemization: %zu\n\n", run_count);
+static bool
+_raqm_set_freetype_face (raqm_t *rq,
+                         FT_Face face,
+                         size_t  start,
+                         size_t  end)
+{
+  size_t first, last;
 
-  RAQM_TEST ("BiDi Runs:\n");
-  for (size_t i = 0; i < run_count; i++)
-  {
-    RAQM_TEST ("run[%zu]:\t start: %zu\tlength: %zu\tlevel: %d\n",
-               i, runs[i].pos, runs[i].len, runs[i].level);
-  }
-  RAQM_TEST ("\n");
-#endif
+  if (!rq)
+    return false;
 
-  last = NULL;
-  for (size_t i = 0; i < run_count; i++)
-  {
-    raqm_run_t *run = _raqm_alloc_run (rq);
-    if (!run)
-    {
-      ok = false;
-      goto done;
-    }
+  if (!rq->text_len)
+    return true;
 
-    if (!rq->runs)
-      rq->runs = run;
+  if (start >= rq->text_len || end > rq->text_len)
+    return false;
 
-    if (last)
-      last->next = run;
+  if (!rq->text_spans_len)
+    return false;
 
-    run->direction = _raqm_hb_dir (rq, runs[i].level);
+  if (start == end)
+    return true;
 
-    if (HB_DIRECTION_IS_BACKWARD (run->direction))
-    {
-      run->pos = runs[i].pos + runs[i].len - 1;
-      run->script = rq->text_info[run->pos].script;
-      run->font = _raqm_create_hb_font (rq, rq->text_info[run->pos].ftface,
-          rq->text_info[run->pos].ftloadflags);
-      for (int j = runs[i].len - 1; j >= 0; j--)
-      {
-        _raqm_text_info info = rq->text_info[runs[i].pos + j];
-        if (!_raqm_compare_text_info (rq->text_info[run->pos], info))
-        {
-          raqm_run_t *newrun = _raqm_alloc_run (rq);
-          if (!newrun)
-          {
-            ok = false;
-            goto done;
-          }
-          newrun->pos = runs[i].pos + j;
-          newrun->len = 1;
-          newrun->direction = _raqm_hb_dir (rq, runs[i].level);
-          newrun->script = info.script;
-          newrun->font = _raqm_create_hb_font (rq, info.ftface,
-              info.ftloadflags);
-          run->next = newrun;
-          run = newrun;
-        }
-        else
+  if (!_raqm_split_text_spans (rq, start, end, &first, &last))
+    return false;
+
+  for (size_t i = first; i < last; i++)
+  {
+    if (rq->text_spans[i].info.ftface)
+        FT_Done_Face (rq->text_spans[i].info.ftface);
+    rq->text_spans[i].info.ftface = face;
+    FT_Reference_Face (face);
+  }
+
+  _raqm_merge_text_spans (rq, first, last);
+
+  return true;
+}
+
+/**
+ * raqm_set_freetype_face:
+ * @rq: a #raqm_t.
+ * @face: an #FT_Face.
+ *
+ * Sets an #FT_Face to be used for all characters in @rq.
+ *
+ * See also raqm_set_freetype_face_range().
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.1
+ */
+bool
+raqm_set_freetype_face (raqm_t *rq,
+                        FT_Face face)
+{
+  return _raqm_set_freetype_face (rq, face, 0, rq->text_len);
+}
+
+/**
+ * raqm_set_freetype_face_range:
+ * @rq: a #raqm_t.
+ * @face: an #FT_Face.
+ * @start: index of first character that should use @face.
+ * @len: number of characters using @face.
+ *
+ * Sets an #FT_Face to be used for @len-number of characters staring at @start.
+ * The @start and @len are input string array indices (i.e. counting bytes in
+ * UTF-8, code units in UTF-16 and scaler values in UTF-32).
+ *
+ * This method can be used repeatedly to set different faces for different
+ * parts of the text. It is the responsibility of the client to make sure that
+ * face ranges cover the whole text.
+ *
+ * See also raqm_set_freetype_face().
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.1
+ */
+bool
+raqm_set_freetype_face_range (raqm_t *rq,
+                              FT_Face face,
+                              size_t  start,
+                              size_t  len)
+{
+  size_t end = start + len;
+
+  if (!rq)
+    return false;
+
+  if (!rq->text_len)
+    return true;
+
+  if (rq->text_u8_to_u32)
+  {
+    start = _raqm_u8_to_u32_index (rq, start);
+    end = _raqm_u8_to_u32_index (rq, end);
+  }
+
+  return _raqm_set_freetype_face (rq, face, start, end);
+}
+
+static bool
+_raqm_set_freetype_load_flags (raqm_t *rq,
+                               int     flags,
+                               size_t  start,
+                               size_t  end)
+{
+  size_t first, last;
+
+  if (!rq)
+    return false;
+
+  if (!rq->text_len)
+    return true;
+
+  if (start >= rq->text_len || end > rq->text_len)
+    return false;
+
+  if (!rq->text_spans_len)
+    return false;
+
+  if (start == end)
+    return true;
+
+  if (!_raqm_split_text_spans (rq, start, end, &first, &last))
+    return false;
+
+  for (size_t i = first; i < last; i++)
+    rq->text_spans[i].info.ftloadflags = flags;
+
+  _raqm_merge_text_spans (rq, first, last);
+
+  return true;
+}
+
+/**
+ * raqm_set_freetype_load_flags:
+ * @rq: a #raqm_t.
+ * @flags: FreeType load flags.
+ *
+ * Sets the load flags passed to FreeType when loading glyphs, should be the
+ * same flags used by the client when rendering FreeType glyphs.
+ *
+ * This requires version of HarfBuzz that has hb_ft_font_set_load_flags(), for
+ * older version the flags will be ignored.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.3
+ */
+bool
+raqm_set_freetype_load_flags (raqm_t *rq,
+                              int     flags)
+{
+  return _raqm_set_freetype_load_flags(rq, flags, 0, rq->text_len);
+}
+
+/**
+ * raqm_set_freetype_load_flags_range:
+ * @rq: a #raqm_t.
+ * @flags: FreeType load flags.
+ * @start: index of first character that should use @flags.
+ * @len: number of characters using @flags.
+ *
+ * Sets the load flags passed to FreeType when loading glyphs for @len-number
+ * of characters staring at @start. Flags should be the same as used by the
+ * client when rendering corresponding FreeType glyphs. The @start and @len
+ * are input string array indices (i.e. counting bytes in UTF-8, code units
+ * in UTF-16 and scaler values in UTF-32).
+ *
+ * This method can be used repeatedly to set different flags for different
+ * parts of the text. It is the responsibility of the client to make sure that
+ * flag ranges cover the whole text.
+ *
+ * This requires version of HarfBuzz that has hb_ft_font_set_load_flags(), for
+ * older version the flags will be ignored.
+ *
+ * See also raqm_set_freetype_load_flags().
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.9
+ */
+bool
+raqm_set_freetype_load_flags_range (raqm_t *rq,
+                                    int     flags,
+                                    size_t  start,
+                                    size_t  len)
+{
+  size_t end = start + len;
+
+  if (!rq)
+    return false;
+
+  if (!rq->text_len)
+    return true;
+
+  if (rq->text_u8_to_u32)
+  {
+    start = _raqm_u8_to_u32_index (rq, start);
+    end = _raqm_u8_to_u32_index (rq, end);
+  }
+
+  return _raqm_set_freetype_load_flags (rq, flags, start, end);
+}
+
+/**
+ * raqm_set_fallback_faces:
+ * @rq: a #raqm_t.
+ * @faces: (array length=len) (nullable): the fallback faces, in order of
+ * preference.
+ * @len: the number of faces in @faces.
+ *
+ * Sets faces to use for characters that the face set for them with
+ * raqm_set_freetype_face() or raqm_set_freetype_face_range() has no glyphs
+ * for. During layout, each grapheme cluster the face of its first character
+ * does not fully support uses the first face of @faces that does, or failing
+ * that the first one that supports its first character. Clusters continuing
+ * text of the same script keep the fallback face used for it when that face
+ * supports them, so that runs of one script are not split on characters
+ * like spaces and punctuation. Other properties of the text, like the load
+ * flags and language, are kept.
+ *
+ * Unlike the properties of the text, the fallback faces are kept by
+ * raqm_clear_contents(). @rq keeps a reference to the faces. Passing a @len
+ * of zero removes all fallback faces.
+ *
+ * If @rq has a font cache (see raqm_set_font_cache()), the characters each
+ * face supports are cached in it, and the cache can then be shared with
+ * other #raqm_t objects to avoid looking them up again.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_set_fallback_faces (raqm_t        *rq,
+                         const FT_Face *faces,
+                         size_t         len)
+{
+  FT_Face *new_faces = NULL;
+
+  if (!rq || (len && !faces))
+    return false;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    if (!faces[i])
+      return false;
+  }
+
+  if (len)
+  {
+    new_faces = _raqm_malloc (rq, sizeof (FT_Face) * len);
+    if (!new_faces)
+      return false;
+
+    for (size_t i = 0; i < len; i++)
+    {
+      new_faces[i] = faces[i];
+      FT_Reference_Face (faces[i]);
+    }
+  }
+
+  for (size_t i = 0; i < rq->fallback_faces_len; i++)
+    FT_Done_Face (rq->fallback_faces[i]);
+  _raqm_free (rq, rq->fallback_faces);
+
+  rq->fallback_faces = new_faces;
+  rq->fallback_faces_len = len;
+  rq->items_valid = false;
+
+  return true;
+}
+
+/**
+ * raqm_set_invisible_glyph:
+ * @rq: a #raqm_t.
+ * @gid: glyph id to use for invisible glyphs.
+ *
+ * Sets the glyph id to be used for invisible glyhphs.
+ *
+ * If @gid is negative, invisible glyphs will be suppressed from the output.
+ *
+ * If @gid is zero, invisible glyphs will be rendered as space.
+ *
+ * If @gid is a positive number, it will be used for invisible glyphs.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.6
+ */
+bool
+raqm_set_invisible_glyph (raqm_t *rq,
+                          int gid)
+{
+  if (!rq)
+    return false;
+
+  if (rq->invisible_glyph != gid)
+  {
+    _raqm_shape_cache_clear (rq, rq->shape_cache);
+    _raqm_discard_stale_runs (rq);
+  }
+
+  rq->invisible_glyph = gid;
+  return true;
+}
+
+/**
+ * raqm_set_line_width:
+ * @rq: a #raqm_t.
+ * @width: the maximum width of a line, or zero.
+ *
+ * Sets the maximum width of the lines the paragraph is broken into by
+ * raqm_layout(), in the same units as the glyph advances. Lines are broken at
+ * the line break opportunities of the Unicode Line Breaking Algorithm, and a
+ * line is only wider than @width when it has no break opportunity. Mandatory
+ * breaks, e.g. after a newline, always start a new line when @width is not
+ * zero.
+ *
+ * If @width is zero, which is the default, the paragraph is laid out as a
+ * single line. Vertical text is always laid out as a single line.
+ *
+ * See raqm_get_lines().
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_set_line_width (raqm_t *rq,
+                     int     width)
+{
+  if (!rq || width < 0)
+    return false;
+
+  rq->line_width = width;
+  return true;
+}
+
+/**
+ * raqm_set_shape_cache_size:
+ * @rq: a #raqm_t.
+ * @max_entries: maximum number of cached runs, or 0 to disable the cache.
+ *
+ * Enables caching the shaping results of short runs (roughly words) in @rq,
+ * so that laying out the same words again with the same font and properties
+ * reuses the previous results instead of shaping them again. The cache is
+ * kept across raqm_clear_contents(), and when it is full the least recently
+ * used entry is dropped.
+ *
+ * Cached runs are matched by their text and surrounding context, font, load
+ * flags, character size, script, language, direction, font features
+ * and invisible glyph setting. Changes to the face other than its character
+ * size (e.g. variation coordinates) are not detected, so the cache should be
+ * reset by calling this function again after such changes.
+ *
+ * The cache is disabled by default. Calling this function always drops all
+ * previously cached entries.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_set_shape_cache_size (raqm_t *rq,
+                           size_t  max_entries)
+{
+  _raqm_shape_cache *cache;
+  size_t buckets_len = 1;
+
+  if (!rq)
+    return false;
+
+  _raqm_shape_cache_destroy (rq, rq->shape_cache);
+  rq->shape_cache = NULL;
+
+  if (!max_entries)
+    return true;
+
+  while (buckets_len < max_entries * 2)
+    buckets_len *= 2;
+
+  cache = _raqm_malloc (rq, sizeof (_raqm_shape_cache));
+  if (!cache)
+    return false;
+
+  memset (cache, 0, sizeof (_raqm_shape_cache));
+  cache->entries = _raqm_malloc (rq,
+                                 sizeof (_raqm_shape_cache_entry) * max_entries);
+  cache->buckets = _raqm_malloc (rq, sizeof (int) * buckets_len);
+  if (!cache->entries || !cache->buckets)
+  {
+    _raqm_shape_cache_destroy (rq, cache);
+    return false;
+  }
+
+  cache->entries_capacity = max_entries;
+  cache->buckets_len = buckets_len;
+  _raqm_shape_cache_clear (rq, cache);
+
+  rq->shape_cache = cache;
+
+  return true;
+}
+
+/**
+ * raqm_get_shape_cache_stats:
+ * @rq: a #raqm_t.
+ * @hits: (out) (optional): number of runs found in the cache.
+ * @misses: (out) (optional): number of runs that had to be shaped.
+ *
+ * Gets the number of cache hits and misses since the shape cache of @rq was
+ * enabled with raqm_set_shape_cache_size(). Runs that are not eligible for
+ * caching count as misses.
+ *
+ * Return value:
+ * `true` if @rq has a shape cache, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_shape_cache_stats (raqm_t *rq,
+                            size_t *hits,
+                            size_t *misses)
+{
+  if (!rq || !rq->shape_cache)
+    return false;
+
+  if (hits)
+    *hits = rq->shape_cache->hits;
+  if (misses)
+    *misses = rq->shape_cache->misses;
+
+  return true;
+}
+
+/**
+ * raqm_set_shape_tasks_func:
+ * @rq: a #raqm_t.
+ * @func: (nullable): a function running the shaping tasks, or `NULL`.
+ * @user_data: data passed to @func.
+ * @min_text_len: the minimum text length, in characters, for using @func.
+ *
+ * Sets a function that raqm_layout() uses to shape independent runs of the
+ * text concurrently, e.g. on a caller-owned thread pool. Runs using the same
+ * #FT_Face are always shaped in the same task, since FreeType faces are not
+ * thread-safe, so @func is only used when the text has more than one face.
+ * Texts shorter than @min_text_len are always shaped serially.
+ *
+ * The same #FT_Face must not be used by other threads while raqm_layout() is
+ * running. The output of raqm_get_glyphs() is the same with or without
+ * @func.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_set_shape_tasks_func (raqm_t                *rq,
+                           raqm_run_tasks_func_t  func,
+                           void                  *user_data,
+                           size_t                 min_text_len)
+{
+  if (!rq)
+    return false;
+
+  rq->shape_tasks_func = func;
+  rq->shape_tasks_user_data = user_data;
+  rq->shape_tasks_min_text_len = min_text_len;
+
+  return true;
+}
+
+/**
+ * raqm_set_stats_enabled:
+ * @rq: a #raqm_t.
+ * @enabled: whether to collect statistics.
+ *
+ * Enables or disables collecting statistics about the layouts done with @rq,
+ * see raqm_get_stats(). Collecting statistics is disabled by default, and has
+ * no cost when disabled. The statistics are reset when they get enabled.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_set_stats_enabled (raqm_t *rq,
+                        bool    enabled)
+{
+  if (!rq)
+    return false;
+
+  if (enabled && !rq->stats_enabled)
+    memset (&rq->stats, 0, sizeof (raqm_stats_t));
+
+  rq->stats_enabled = enabled;
+
+  return true;
+}
+
+/**
+ * raqm_get_stats:
+ * @rq: a #raqm_t.
+ * @stats: (out): output statistics.
+ *
+ * Gets the statistics collected since they were enabled with
+ * raqm_set_stats_enabled() or last reset with raqm_reset_stats(). They add
+ * up over all layouts done in that time, including raqm_clear_contents()
+ * calls.
+ *
+ * Return value:
+ * `true` if statistics are enabled, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_stats (raqm_t       *rq,
+                raqm_stats_t *stats)
+{
+  if (!rq || !stats || !rq->stats_enabled)
+    return false;
+
+  *stats = rq->stats;
+
+  return true;
+}
+
+/**
+ * raqm_reset_stats:
+ * @rq: a #raqm_t.
+ *
+ * Resets the statistics collected in @rq to zero.
+ *
+ * Since: 0.10
+ */
+void
+raqm_reset_stats (raqm_t *rq)
+{
+  if (!rq)
+    return;
+
+  memset (&rq->stats, 0, sizeof (raqm_stats_t));
+}
+
+/* The estimated memory of the hb buffer of @run, which keeps room for the most
+ * glyphs it held */
+static size_t
+_raqm_run_buffer_bytes (raqm_run_t *run)
+{
+  if (!run->buffer)
+    return 0;
+
+  return run->buffer_len *
+         (sizeof (hb_glyph_info_t) + sizeof (hb_glyph_position_t));
+}
+
+static void
+_raqm_add_runs_usage (raqm_run_t          *runs,
+                      size_t              *len,
+                      raqm_memory_usage_t *usage)
+{
+  for (raqm_run_t *run = runs; run != NULL; run = run->next)
+  {
+    (*len)++;
+    usage->run_bytes += sizeof (raqm_run_t);
+    usage->buffer_bytes += _raqm_run_buffer_bytes (run);
+  }
+}
+
+/**
+ * raqm_get_memory_usage:
+ * @rq: a #raqm_t.
+ * @usage: (out): the memory used by @rq.
+ *
+ * Gets the memory held by @rq, including what raqm_clear_contents() keeps to
+ * make the next layouts faster, but not the font, shape and layout caches,
+ * whose size is limited when they are created. See raqm_trim_memory().
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_memory_usage (raqm_t              *rq,
+                       raqm_memory_usage_t *usage)
+{
+  size_t other = 0;
+  size_t runs_len = 0;
+
+  if (!rq || !usage)
+    return false;
+
+  memset (usage, 0, sizeof (raqm_memory_usage_t));
+
+  usage->text_bytes = rq->text_capacity_bytes;
+  usage->glyph_bytes = sizeof (raqm_glyph_t) *
+                       (rq->glyphs_capacity + rq->batch_glyphs_capacity);
+
+  _raqm_add_runs_usage (rq->runs, &runs_len, usage);
+  _raqm_add_runs_usage (rq->stale_runs, &runs_len, usage);
+  _raqm_add_runs_usage (rq->runs_pool, &usage->pooled_runs, usage);
+  usage->runs = runs_len + usage->pooled_runs;
+
+  for (_raqm_scratch_block *block = rq->scratch; block; block = block->next)
+    usage->scratch_bytes += RAQM_SCRATCH_HEADER_SIZE + block->size;
+
+  other += sizeof (_raqm_text_span) * rq->text_spans_capacity;
+  other += sizeof (_raqm_bidi_run) * rq->bidi_runs_capacity;
+  other += sizeof (hb_feature_t) * rq->features_capacity;
+  other += sizeof (_raqm_item) * rq->items_capacity;
+  other += rq->read_buffer_capacity;
+  other += sizeof (_raqm_run_font) * rq->run_fonts_capacity;
+  for (size_t i = 0; i < rq->run_fonts_capacity; i++)
+    other += sizeof (_raqm_glyph_extents) * rq->run_fonts[i].extents_capacity;
+  other += sizeof (FT_Face) * rq->fallback_faces_len;
+  other += sizeof (raqm_line_t) * rq->lines_capacity;
+  other += sizeof (_raqm_cursor_glyph) * rq->cursor_glyphs_capacity;
+  other += sizeof (uint32_t) * rq->cursor_char_glyphs_capacity;
+  other += sizeof (uint32_t) * rq->grapheme_breaks_capacity;
+  usage->other_bytes = other;
+
+  usage->total_bytes = sizeof (raqm_t) + usage->text_bytes +
+                       usage->glyph_bytes + usage->run_bytes +
+                       usage->buffer_bytes + usage->scratch_bytes +
+                       usage->other_bytes;
+
+  return true;
+}
+
+/* Free the pooled runs that do not fit in @max_bytes, with their buffers,
+ * keeping the others */
+static void
+_raqm_trim_run_pool (raqm_t *rq,
+                     size_t  max_bytes)
+{
+  raqm_run_t **link = &rq->runs_pool;
+  size_t bytes = 0;
+
+  while (*link)
+  {
+    raqm_run_t *run = *link;
+    size_t run_bytes = sizeof (raqm_run_t) + _raqm_run_buffer_bytes (run);
+
+    if (run_bytes > max_bytes - bytes)
+    {
+      *link = run->next;
+      run->next = NULL;
+      _raqm_free_runs (rq, run);
+    }
+    else
+    {
+      bytes += run_bytes;
+      link = &run->next;
+    }
+  }
+}
+
+#define RAQM_TRIM_ARRAY(array, capacity) \
+  do { \
+    if ((capacity) > max_bytes / sizeof (*(array))) \
+    { \
+      _raqm_free (rq, array); \
+      (array) = NULL; \
+      (capacity) = 0; \
+    } \
+  } while (0)
+
+/**
+ * raqm_trim_memory:
+ * @rq: a #raqm_t.
+ * @max_bytes: the most bytes to keep in each array.
+ *
+ * Frees the memory kept by @rq for reuse in every array bigger than
+ * @max_bytes, so that a single long paragraph does not leave a long-lived
+ * #raqm_t holding the memory it needed. Arrays that fit in @max_bytes, which
+ * should be chosen above what the typical text needs, are kept, and so are
+ * the pooled runs and their HarfBuzz buffers up to @max_bytes in total.
+ *
+ * The text, glyph and line arrays hold the current layout, and are only
+ * trimmed when @rq has no text, e.g. after raqm_clear_contents(). Trimming
+ * them makes the array returned by raqm_layout_batch() invalid. This must not
+ * be called from the functions called by raqm_layout().
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_trim_memory (raqm_t *rq,
+                  size_t  max_bytes)
+{
+  if (!rq)
+    return false;
+
+  /* The scratch memory is only used during layout */
+  if (rq->scratch &&
+      RAQM_SCRATCH_HEADER_SIZE + rq->scratch->size > max_bytes)
+    _raqm_scratch_free_blocks (rq);
+
+  _raqm_trim_run_pool (rq, max_bytes);
+
+  if (rq->text_len || rq->runs)
+    return true;
+
+  if (rq->text_capacity_bytes > max_bytes)
+    _raqm_free_text (rq);
+
+  RAQM_TRIM_ARRAY (rq->text_spans, rq->text_spans_capacity);
+  RAQM_TRIM_ARRAY (rq->bidi_runs, rq->bidi_runs_capacity);
+  rq->bidi_runs_valid = false;
+  RAQM_TRIM_ARRAY (rq->items, rq->items_capacity);
+  rq->items_valid = false;
+  RAQM_TRIM_ARRAY (rq->glyphs, rq->glyphs_capacity);
+  RAQM_TRIM_ARRAY (rq->batch_glyphs, rq->batch_glyphs_capacity);
+  RAQM_TRIM_ARRAY (rq->read_buffer, rq->read_buffer_capacity);
+  for (size_t i = 0; i < rq->run_fonts_capacity; i++)
+  {
+    _raqm_run_font *entry = &rq->run_fonts[i];
+
+    RAQM_TRIM_ARRAY (entry->extents, entry->extents_capacity);
+  }
+  RAQM_TRIM_ARRAY (rq->lines, rq->lines_capacity);
+  RAQM_TRIM_ARRAY (rq->cursor_glyphs, rq->cursor_glyphs_capacity);
+  RAQM_TRIM_ARRAY (rq->cursor_char_glyphs, rq->cursor_char_glyphs_capacity);
+  RAQM_TRIM_ARRAY (rq->grapheme_breaks, rq->grapheme_breaks_capacity);
+
+  return true;
+}
+
+#undef RAQM_TRIM_ARRAY
+
+/**
+ * raqm_set_trace_func:
+ * @rq: a #raqm_t.
+ * @func: (nullable): a function called after each layout phase, or `NULL`.
+ * @user_data: data passed to @func.
+ *
+ * Sets a function that is called at the end of each phase of raqm_layout()
+ * and raqm_get_glyphs() with the time the phase took, e.g. to feed a
+ * tracing tool. This works whether statistics are enabled or not.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_set_trace_func (raqm_t            *rq,
+                     raqm_trace_func_t  func,
+                     void              *user_data)
+{
+  if (!rq)
+    return false;
+
+  rq->trace_func = func;
+  rq->trace_user_data = user_data;
+
+  return true;
+}
+
+static bool
+_raqm_itemize (raqm_t *rq);
+
+static bool
+_raqm_shape (raqm_t *rq);
+
+static bool
+_raqm_break_lines (raqm_t *rq);
+
+/* Keep the runs made by _raqm_itemize () for raqm_relayout (). Failing to
+ * allocate the items only means that the next relayout is a full one. */
+static void
+_raqm_save_items (raqm_t *rq)
+{
+  size_t len = 0;
+
+  rq->items_valid = false;
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+    len++;
+
+  if (len > rq->items_capacity)
+  {
+    void *new_mem = _raqm_realloc (rq, rq->items, sizeof (_raqm_item) * len);
+    if (!new_mem)
+      return;
+
+    rq->items = new_mem;
+    rq->items_capacity = len;
+  }
+
+  len = 0;
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    _raqm_item *item = &rq->items[len++];
+
+    item->pos = run->pos;
+    item->len = run->len;
+    item->direction = run->direction;
+    item->level = run->level;
+    item->script = run->script;
+    item->info = rq->text_spans[_raqm_find_text_span (rq, run->pos)].info;
+    item->info.ftface = hb_ft_font_get_face (run->font);
+  }
+
+  rq->items_len = len;
+  rq->items_valid = true;
+}
+
+/* Create the runs of the last layout again from its items */
+static bool
+_raqm_restore_items (raqm_t *rq)
+{
+  uint64_t start = _raqm_phase_begin (rq);
+  raqm_run_t *last = NULL;
+  bool ok = true;
+
+  _raqm_release_run_fonts (rq);
+
+  for (size_t i = 0; i < rq->items_len; i++)
+  {
+    _raqm_item *item = &rq->items[i];
+    raqm_run_t *run = _raqm_alloc_run (rq);
+
+    if (!run)
+    {
+      ok = false;
+      break;
+    }
+
+    run->pos = item->pos;
+    run->len = item->len;
+    run->direction = item->direction;
+    run->level = item->level;
+    run->script = item->script;
+    run->lang = item->info.lang;
+    run->font = _raqm_create_hb_font (rq, item->info.ftface,
+                                      item->info.ftloadflags);
+
+    if (last)
+      last->next = run;
+    else
+      rq->runs = run;
+
+    last = run;
+  }
+
+  _raqm_phase_end (rq, RAQM_PHASE_RUNS, start);
+
+  return ok;
+}
+
+static void
+_raqm_update_buffer_lens (raqm_t *rq)
+{
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    size_t len = hb_buffer_get_length (run->buffer);
+
+    if (run->len > len)
+      len = run->len;
+    if (len > run->buffer_len)
+      run->buffer_len = len;
+  }
+}
+
+/* Shape the runs of @rq and break them into lines */
+static bool
+_raqm_layout_runs (raqm_t *rq)
+{
+  uint64_t start;
+  bool ok;
+
+  start = _raqm_phase_begin (rq);
+  ok = _raqm_shape (rq);
+  _raqm_phase_end (rq, RAQM_PHASE_SHAPE, start);
+
+  if (ok)
+  {
+    _raqm_update_buffer_lens (rq);
+
+    start = _raqm_phase_begin (rq);
+    ok = _raqm_break_lines (rq);
+    _raqm_phase_end (rq, RAQM_PHASE_LINES, start);
+
+    _raqm_update_buffer_lens (rq);
+  }
+
+  if (ok && rq->stats_enabled)
+  {
+    for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+    {
+      rq->stats.runs++;
+      rq->stats.glyphs += hb_buffer_get_length (run->buffer);
+      if (run->shape_reused)
+        rq->stats.reused_runs++;
+    }
+  }
+
+  return ok;
+}
+
+/**
+ * raqm_layout:
+ * @rq: a #raqm_t.
+ *
+ * Run the text layout process on @rq. This is the main Raqm function where the
+ * Unicode Bidirectional Text algorithm will be applied to the text in @rq,
+ * text shaping, and any other part of the layout process.
+ *
+ * All the text is shaped again, unless raqm_replace_text() was called since
+ * the previous layout.
+ *
+ * Return value:
+ * `true` if the layout process was successful, `false` otherwise.
+ *
+ * Since: 0.1
+ */
+bool
+raqm_layout (raqm_t *rq)
+{
+  bool ok;
+
+  if (!rq)
+    return false;
+
+  _raqm_keep_stale_runs (rq);
+  if (!rq->reuse_stale_runs)
+    _raqm_discard_stale_runs (rq);
+  rq->reuse_stale_runs = false;
+
+  if (rq->stats_enabled)
+    rq->stats.layouts++;
+
+  if (!rq->text_len)
+    return true;
+
+  if (!rq->text_spans_len)
+    return false;
+
+  for (size_t i = 0; i < rq->text_spans_len; i++)
+  {
+      if (!rq->text_spans[i].info.ftface)
+          return false;
+  }
+
+  ok = _raqm_itemize (rq);
+  if (ok)
+  {
+    _raqm_save_items (rq);
+    ok = _raqm_layout_runs (rq);
+  }
+
+  _raqm_scratch_reset (rq);
+
+  return ok;
+}
+
+/**
+ * raqm_relayout:
+ * @rq: a #raqm_t.
+ * @scale: whether glyph positions may be scaled instead of shaping again.
+ *
+ * Same as raqm_layout(), but keeps the result of script detection and the
+ * Unicode Bidirectional Algorithm from the previous layout of @rq, and only
+ * shapes the text and breaks it into lines again. This is meant for laying
+ * out the same text after changing the size or the transform of its faces,
+ * e.g. when zooming. If the text, its faces, load flags or languages, or the
+ * paragraph direction changed since the previous layout, a full layout is
+ * done instead.
+ *
+ * If @scale is `true`, runs that did not change other than by the size of
+ * their face keep their glyphs, and the glyph positions are scaled to the new
+ * size instead of shaping the runs again. This is only done for scalable faces
+ * without hinting and transforms, as a hinted layout does not scale linearly,
+ * and the scaled positions can still differ from shaping again by a unit due
+ * to rounding, and ignore size-dependent font data like device tables. Runs
+ * that were split by line breaking are always shaped again. Runs are matched
+ * by their face, load flags and transform only, so @scale must be `false` if
+ * a face was changed in other ways, e.g. with FT_Set_Var_Design_Coordinates().
+ * If @scale is `false`, all the text is shaped again.
+ *
+ * Return value:
+ * `true` if the layout process was successful, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_relayout (raqm_t *rq,
+               bool    scale)
+{
+  bool ok;
+
+  if (!rq)
+    return false;
+
+  if (!rq->items_valid)
+    return raqm_layout (rq);
+
+  _raqm_keep_stale_runs (rq);
+  if (!scale)
+    _raqm_discard_stale_runs (rq);
+
+  if (rq->stats_enabled)
+    rq->stats.layouts++;
+
+  ok = _raqm_restore_items (rq);
+  if (ok)
+  {
+    rq->scale_stale_runs = scale;
+    ok = _raqm_layout_runs (rq);
+    rq->scale_stale_runs = false;
+  }
+
+  _raqm_scratch_reset (rq);
+
+  return ok;
+}
+
+static uint32_t
+_raqm_u32_to_u8_index (raqm_t   *rq,
+                       uint32_t  index);
+
+/**
+ * raqm_get_glyphs:
+ * @rq: a #raqm_t.
+ * @length: (out): output array length.
+ *
+ * Gets the final result of Raqm layout process, an array of #raqm_glyph_t
+ * containing the glyph indices in the font, their positions and other possible
+ * information.
+ *
+ * Return value: (transfer none):
+ * An array of #raqm_glyph_t, or `NULL` in case of error. This is owned by @rq
+ * and must not be freed.
+ *
+ * Since: 0.1
+ */
+raqm_glyph_t *
+raqm_get_glyphs (raqm_t *rq,
+                 size_t *length)
+{
+  size_t count = 0;
+  uint64_t start;
+
+  if (!rq || !rq->runs || !length)
+  {
+    if (length)
+      *length = 0;
+    return NULL;
+  }
+
+  start = _raqm_phase_begin (rq);
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+    count += hb_buffer_get_length (run->buffer);
+
+  if (count > rq->glyphs_capacity)
+  {
+    void* new_mem = _raqm_realloc (rq, rq->glyphs,
+                                   sizeof (raqm_glyph_t) * count);
+    if (!new_mem)
+    {
+      *length = 0;
+      return NULL;
+    }
+    
+    rq->glyphs = new_mem;
+    rq->glyphs_capacity = count;
+  }
+
+  *length = count;
+
+  RAQM_TEST ("Glyph information:\n");
+
+  count = 0;
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    size_t len;
+    hb_glyph_info_t *info;
+    hb_glyph_position_t *position;
+    FT_Face ftface;
+
+    len = hb_buffer_get_length (run->buffer);
+    info = hb_buffer_get_glyph_infos (run->buffer, NULL);
+    position = hb_buffer_get_glyph_positions (run->buffer, NULL);
+    ftface = hb_ft_font_get_face (run->font);
+
+    for (size_t i = 0; i < len; i++)
+    {
+      rq->glyphs[count + i].index = info[i].codepoint;
+      rq->glyphs[count + i].cluster = info[i].cluster;
+      rq->glyphs[count + i].x_advance = position[i].x_advance;
+      rq->glyphs[count + i].y_advance = position[i].y_advance;
+      rq->glyphs[count + i].x_offset = position[i].x_offset;
+      rq->glyphs[count + i].y_offset = position[i].y_offset;
+      rq->glyphs[count + i].ftface = ftface;
+
+      RAQM_TEST ("glyph [%d]\tx_offset: %d\ty_offset: %d\tx_advance: %d\tfont: %s\n",
+          rq->glyphs[count + i].index, rq->glyphs[count + i].x_offset,
+          rq->glyphs[count + i].y_offset, rq->glyphs[count + i].x_advance,
+          rq->glyphs[count + i].ftface->family_name);
+    }
+
+    count += len;
+  }
+
+  if (rq->text_u8_to_u32)
+  {
+#ifdef RAQM_TESTING
+    RAQM_TEST ("\nUTF-32 clusters:");
+    for (size_t i = 0; i < count; i++)
+      RAQM_TEST (" %02d", rq->glyphs[i].cluster);
+    RAQM_TEST ("\n");
+#endif
+
+    for (size_t i = 0; i < count; i++)
+      rq->glyphs[i].cluster = _raqm_u32_to_u8_index (rq,
+                                                     rq->glyphs[i].cluster);
+
+#ifdef RAQM_TESTING
+    RAQM_TEST (rq->text_utf16 ? "UTF-16 clusters:" : "UTF-8 clusters: ");
+    for (size_t i = 0; i < count; i++)
+      RAQM_TEST (" %02d", rq->glyphs[i].cluster);
+    RAQM_TEST ("\n");
+#endif
+  }
+
+  _raqm_phase_end (rq, RAQM_PHASE_GLYPHS, start);
+
+  return rq->glyphs;
+}
+
+/* Append the glyphs of the current layout of @rq to its batch glyphs */
+static bool
+_raqm_append_batch_glyphs (raqm_t *rq,
+                           size_t *offset)
+{
+  raqm_glyph_t *glyphs;
+  size_t len;
+
+  glyphs = raqm_get_glyphs (rq, &len);
+  if (!len)
+    return true;
+
+  if (*offset + len > rq->batch_glyphs_capacity)
+  {
+    size_t new_capacity = rq->batch_glyphs_capacity * 2;
+    void *new_mem;
+
+    if (new_capacity < *offset + len)
+      new_capacity = *offset + len;
+
+    new_mem = _raqm_realloc (rq, rq->batch_glyphs,
+                             sizeof (raqm_glyph_t) * new_capacity);
+    if (!new_mem)
+      return false;
+
+    rq->batch_glyphs = new_mem;
+    rq->batch_glyphs_capacity = new_capacity;
+  }
+
+  memcpy (rq->batch_glyphs + *offset, glyphs, sizeof (raqm_glyph_t) * len);
+  *offset += len;
+
+  return true;
+}
+
+/**
+ * raqm_layout_batch:
+ * @rq: a #raqm_t.
+ * @items: (array length=items_len): the paragraphs to lay out.
+ * @items_len: the number of items.
+ * @offsets: (out caller-allocates) (array): output array of @items_len + 1
+ * glyph offsets.
+ * @length: (out): output array length.
+ *
+ * Lays out many independent paragraphs in one call, reusing the runs, buffers
+ * and fonts of @rq between them. This is equivalent to calling
+ * raqm_clear_contents(), raqm_set_text_utf8(), raqm_set_par_direction(),
+ * raqm_set_freetype_face(), raqm_set_language() (if the item has one),
+ * raqm_layout() and raqm_get_glyphs() for each item, and concatenating the
+ * resulting glyph arrays. Font features, the invisible glyph, and the font and
+ * shape caches of @rq apply to all items.
+ *
+ * The glyphs of item `i` are at indices `offsets[i]` to `offsets[i + 1] - 1`
+ * of the returned array, and their clusters are byte indices into the text
+ * of that item.
+ *
+ * The text contents of @rq are cleared when the function returns, and its
+ * paragraph direction is left unchanged.
+ *
+ * Return value: (transfer none):
+ * An array of #raqm_glyph_t, or `NULL` in case of error or if there were no
+ * glyphs. This is owned by @rq and remains valid until the next call to this
+ * function or raqm_destroy(), and must not be freed.
+ *
+ * Since: 0.10
+ */
+raqm_glyph_t *
+raqm_layout_batch (raqm_t                   *rq,
+                   const raqm_layout_item_t *items,
+                   size_t                    items_len,
+                   size_t                   *offsets,
+                   size_t                   *length)
+{
+  raqm_direction_t base_dir;
+  size_t count = 0;
+  bool ok = true;
+
+  if (length)
+    *length = 0;
+
+  if (!rq || (items_len && (!items || !offsets)) || !length)
+    return NULL;
+
+  base_dir = rq->base_dir;
+
+  for (size_t i = 0; i < items_len && ok; i++)
+  {
+    const raqm_layout_item_t *item = &items[i];
+
+    offsets[i] = count;
+
+    raqm_clear_contents (rq);
+
+    ok = raqm_set_text_utf8 (rq, item->text, item->len) &&
+         raqm_set_par_direction (rq, item->direction) &&
+         raqm_set_freetype_face (rq, item->face);
+
+    if (ok && item->language)
+      ok = raqm_set_language (rq, item->language, 0, item->len);
+
+    ok = ok &&
+         raqm_layout (rq) &&
+         _raqm_append_batch_glyphs (rq, &count);
+  }
+
+  raqm_clear_contents (rq);
+  rq->base_dir = base_dir;
+
+  if (!ok)
+    return NULL;
+
+  if (items_len)
+    offsets[items_len] = count;
+
+  *length = count;
+  return count ? rq->batch_glyphs : NULL;
+}
+
+/* The length of the paragraph separator (Bidi_Class B) at the start of
+ * @text, or 0 if there is none. A CR LF pair is a single separator. */
+static size_t
+_raqm_paragraph_separator_len (const char *text,
+                               size_t      len)
+{
+  const unsigned char *s = (const unsigned char *) text;
+
+  switch (s[0])
+  {
+    case 0x0D:
+      return len > 1 && s[1] == 0x0A ? 2 : 1;
+    case 0x0A:
+    case 0x1C:
+    case 0x1D:
+    case 0x1E:
+      return 1;
+    case 0xC2:
+      /* U+0085 NEXT LINE */
+      return len > 1 && s[1] == 0x85 ? 2 : 0;
+    case 0xE2:
+      /* U+2029 PARAGRAPH SEPARATOR */
+      return len > 2 && s[1] == 0x80 && s[2] == 0xA9 ? 3 : 0;
+    default:
+      return 0;
+  }
+}
+
+/* Lay out the paragraphs of @text, which starts at @offset of the whole
+ * text, and pass each of them to @func. Unless @final is set, the text
+ * after the last separator is left for more text to be appended, and so is
+ * a separator that more text could make longer. Sets @consumed to the
+ * length of the paragraphs laid out. */
+static bool
+_raqm_layout_paragraphs (raqm_t                *rq,
+                         const char            *text,
+                         size_t                 len,
+                         size_t                 offset,
+                         bool                   final,
+                         FT_Face                face,
+                         raqm_paragraph_func_t  func,
+                         void                  *user_data,
+                         size_t                *consumed)
+{
+  size_t start = 0;
+  size_t i = 0;
+
+  *consumed = 0;
+
+  while (i < len)
+  {
+    unsigned char c = text[i];
+    size_t sep_len;
+
+    if (c > 0x1E && c != 0xC2 && c != 0xE2)
+    {
+      i++;
+      continue;
+    }
+
+    /* Wait for the rest of a separator that may be cut short */
+    if (!final && ((c == 0x0D && len - i < 2) ||
+                   (c == 0xC2 && len - i < 2) ||
+                   (c == 0xE2 && len - i < 3)))
+      break;
+
+    sep_len = _raqm_paragraph_separator_len (text + i, len - i);
+    if (!sep_len)
+    {
+      i++;
+      continue;
+    }
+
+    i += sep_len;
+
+    raqm_clear_contents (rq);
+    if (!raqm_set_text_utf8 (rq, text + start, i - start) ||
+        !raqm_set_freetype_face (rq, face) ||
+        !raqm_layout (rq) ||
+        !func (rq, offset + start, i - start, user_data))
+      return false;
+
+    start = i;
+    *consumed = start;
+  }
+
+  if (final && start < len)
+  {
+    raqm_clear_contents (rq);
+    if (!raqm_set_text_utf8 (rq, text + start, len - start) ||
+        !raqm_set_freetype_face (rq, face) ||
+        !raqm_layout (rq) ||
+        !func (rq, offset + start, len - start, user_data))
+      return false;
+
+    *consumed = len;
+  }
+
+  return true;
+}
+
+/**
+ * raqm_layout_paragraphs:
+ * @rq: a #raqm_t.
+ * @text: a UTF-8 encoded text string, e.g. a memory mapped file.
+ * @len: the length of @text in bytes.
+ * @face: the #FT_Face to use for @text.
+ * @func: the function to call for each paragraph.
+ * @user_data: the data to pass to @func.
+ *
+ * Splits @text into paragraphs as in rule P1 of the Unicode Bidirectional
+ * Algorithm, and lays them out one by one. Each paragraph keeps its
+ * separator at its end. This is equivalent to calling
+ * raqm_clear_contents(), raqm_set_text_utf8(), raqm_set_freetype_face() and
+ * raqm_layout() for each paragraph, then @func, but only the paragraph
+ * being laid out is held in memory, and the memory used by @rq is reused
+ * between paragraphs.
+ *
+ * The paragraph direction, font features, fallback faces, line width, and
+ * the caches of @rq apply to all paragraphs. @func can get the output with
+ * raqm_get_glyphs() or the other functions for it; clusters are byte
+ * indices into the paragraph. To lay out or render paragraphs
+ * concurrently, @func can hand raqm_freeze_layout() results to other
+ * threads.
+ *
+ * The text contents of @rq are cleared when the function returns.
+ *
+ * Return value:
+ * `true` if all paragraphs were laid out and passed to @func, `false` in
+ * case of error or if @func returned `false`.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_layout_paragraphs (raqm_t                *rq,
+                        const char            *text,
+                        size_t                 len,
+                        FT_Face                face,
+                        raqm_paragraph_func_t  func,
+                        void                  *user_data)
+{
+  size_t consumed;
+  bool ok;
+
+  if (!rq || (len && !text) || !func)
+    return false;
+
+  ok = _raqm_layout_paragraphs (rq, text, len, 0, true, face, func, user_data,
+                                &consumed);
+  raqm_clear_contents (rq);
+
+  return ok;
+}
+
+/**
+ * raqm_layout_paragraphs_from_func:
+ * @rq: a #raqm_t.
+ * @read_func: the function to read the text with.
+ * @read_data: the data to pass to @read_func.
+ * @face: the #FT_Face to use for the text.
+ * @func: the function to call for each paragraph.
+ * @user_data: the data to pass to @func.
+ *
+ * Same as raqm_layout_paragraphs(), but for UTF-8 text read in chunks with
+ * @read_func until it returns 0. The text is kept in a buffer of @rq that
+ * only grows to hold the largest paragraph, and the offsets passed to @func
+ * count bytes from the start of the whole text.
+ *
+ * Return value:
+ * `true` if all paragraphs were laid out and passed to @func, `false` in
+ * case of error or if @func returned `false`.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_layout_paragraphs_from_func (raqm_t                *rq,
+                                  raqm_read_func_t       read_func,
+                                  void                  *read_data,
+                                  FT_Face                face,
+                                  raqm_paragraph_func_t  func,
+                                  void                  *user_data)
+{
+  size_t len = 0;
+  size_t offset = 0;
+  bool ok = true;
+
+  if (!rq || !read_func || !func)
+    return false;
+
+  while (ok)
+  {
+    size_t consumed, read_len;
+
+    if (rq->read_buffer_capacity - len < RAQM_READ_CHUNK_LEN)
+    {
+      size_t new_capacity = rq->read_buffer_capacity ?
+                            rq->read_buffer_capacity * 2 :
+                            RAQM_READ_CHUNK_LEN;
+      void *new_buffer;
+
+      while (new_capacity - len < RAQM_READ_CHUNK_LEN)
+        new_capacity *= 2;
+
+      new_buffer = _raqm_realloc (rq, rq->read_buffer, new_capacity);
+      if (!new_buffer)
+      {
+        ok = false;
+        break;
+      }
+
+      rq->read_buffer = new_buffer;
+      rq->read_buffer_capacity = new_capacity;
+    }
+
+    read_len = read_func (rq->read_buffer + len,
+                          rq->read_buffer_capacity - len, read_data);
+    len += read_len;
+
+    ok = _raqm_layout_paragraphs (rq, rq->read_buffer, len, offset,
+                                  read_len == 0, face, func, user_data,
+                                  &consumed);
+    if (read_len == 0)
+      break;
+
+    memmove (rq->read_buffer, rq->read_buffer + consumed, len - consumed);
+    len -= consumed;
+    offset += consumed;
+  }
+
+  raqm_clear_contents (rq);
+
+  return ok;
+}
+
+static raqm_direction_t
+_raqm_raqm_dir (hb_direction_t dir)
+{
+  switch (dir) {
+    case HB_DIRECTION_LTR:
+      return RAQM_DIRECTION_LTR;
+    case HB_DIRECTION_RTL:
+      return RAQM_DIRECTION_RTL;
+    case HB_DIRECTION_TTB:
+      return RAQM_DIRECTION_TTB;
+    default:
+      return RAQM_DIRECTION_DEFAULT;
+  }
+}
+
+/**
+ * raqm_get_glyph_arrays:
+ * @rq: a #raqm_t.
+ * @length: (out): number of glyphs.
+ * @indices: (out caller-allocates) (array) (optional): output glyph indices.
+ * @x_advances: (out caller-allocates) (array) (optional): output x advances.
+ * @y_advances: (out caller-allocates) (array) (optional): output y advances.
+ * @x_offsets: (out caller-allocates) (array) (optional): output x offsets.
+ * @y_offsets: (out caller-allocates) (array) (optional): output y offsets.
+ * @clusters: (out caller-allocates) (array) (optional): output clusters.
+ *
+ * Gets the same glyph information as raqm_get_glyphs(), but writes each field
+ * directly to a separate caller-provided array of @length elements in a single
+ * pass, without an intermediate array of #raqm_glyph_t. Any of the arrays can
+ * be `NULL` to skip that field, so calling this with all of them `NULL` just
+ * gets the number of glyphs. The face of each glyph can be found using
+ * raqm_get_glyph_runs().
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_glyph_arrays (raqm_t       *rq,
+                       size_t       *length,
+                       unsigned int *indices,
+                       int          *x_advances,
+                       int          *y_advances,
+                       int          *x_offsets,
+                       int          *y_offsets,
+                       uint32_t     *clusters)
+{
+  size_t count = 0;
+
+  if (!rq || !length)
+    return false;
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    unsigned int len;
+    hb_glyph_info_t *info;
+    hb_glyph_position_t *position;
+
+    info = hb_buffer_get_glyph_infos (run->buffer, &len);
+    position = hb_buffer_get_glyph_positions (run->buffer, NULL);
+
+    for (unsigned int i = 0; i < len; i++)
+    {
+      if (indices)
+        indices[count + i] = info[i].codepoint;
+      if (x_advances)
+        x_advances[count + i] = position[i].x_advance;
+      if (y_advances)
+        y_advances[count + i] = position[i].y_advance;
+      if (x_offsets)
+        x_offsets[count + i] = position[i].x_offset;
+      if (y_offsets)
+        y_offsets[count + i] = position[i].y_offset;
+      if (clusters)
+      {
+        if (rq->text_u8_to_u32)
+          clusters[count + i] = _raqm_u32_to_u8_index (rq, info[i].cluster);
+        else
+          clusters[count + i] = info[i].cluster;
+      }
+    }
+
+    count += len;
+  }
+
+  *length = count;
+  return true;
+}
+
+/**
+ * raqm_get_glyph_runs:
+ * @rq: a #raqm_t.
+ * @runs: (out caller-allocates) (array) (optional): output array of runs.
+ * @length: (inout): the length of @runs on input, the number of runs on
+ * output.
+ *
+ * Gets the runs of the output glyphs, i.e. the ranges of glyphs that share the
+ * same face and direction. The glyph ranges index the output of
+ * raqm_get_glyphs() and raqm_get_glyph_arrays().
+ *
+ * If @runs is `NULL`, or not long enough, only the number of runs is set, so
+ * that the caller can allocate enough space.
+ *
+ * Return value:
+ * `true` if all runs were written to @runs, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_glyph_runs (raqm_t           *rq,
+                     raqm_glyph_run_t *runs,
+                     size_t           *length)
+{
+  size_t count = 0;
+  size_t glyphs_count = 0;
+  bool ok;
+
+  if (!rq || !length)
+    return false;
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+    count++;
+
+  ok = runs && *length >= count;
+  *length = count;
+  if (!ok)
+    return false;
+
+  count = 0;
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    size_t len = hb_buffer_get_length (run->buffer);
+
+    runs[count].start = glyphs_count;
+    runs[count].len = len;
+    runs[count].direction = _raqm_raqm_dir (run->direction);
+    runs[count].ftface = hb_ft_font_get_face (run->font);
+
+    glyphs_count += len;
+    count++;
+  }
+
+  return true;
+}
+
+/* Round the 26.6 @value to a multiple of 2^@shift, and store it divided by
+ * 2^@shift in @packed, if it fits */
+static bool
+_raqm_quantize (hb_position_t  value,
+                unsigned int   shift,
+                int16_t       *packed)
+{
+  int64_t quantized = value;
+
+  if (shift)
+    quantized = (quantized + ((int64_t) 1 << (shift - 1))) >> shift;
+
+  if (quantized < INT16_MIN || quantized > INT16_MAX)
+    return false;
+
+  *packed = (int16_t) quantized;
+  return true;
+}
+
+/* The bytes of a packed run of @len glyphs, keeping the next header aligned */
+static size_t
+_raqm_packed_run_size (size_t len)
+{
+  size_t size = sizeof (raqm_packed_run_t) + sizeof (raqm_packed_glyph_t) * len;
+
+  return (size + sizeof (FT_Face) - 1) & ~(sizeof (FT_Face) - 1);
+}
+
+/**
+ * raqm_get_packed_glyphs:
+ * @rq: a #raqm_t.
+ * @shift: the number of low bits to drop from the 26.6 positions.
+ * @buffer: (out caller-allocates) (optional): the output buffer.
+ * @size: (inout): the size of @buffer in bytes on input, the number of bytes
+ * of the output on output.
+ *
+ * Gets the same glyphs as raqm_get_glyphs() in a compact format, e.g. to copy
+ * to vertex buffers for rendering from a glyph atlas. For each run of glyphs
+ * sharing the same face and direction, @buffer gets a #raqm_packed_run_t,
+ * directly followed by the #raqm_packed_glyph_t of its glyphs. The next
+ * header starts `header->size` bytes after the start of the current one.
+ * The headers hold #FT_Face pointers, so @buffer must be aligned for them,
+ * as memory from malloc() is.
+ *
+ * The positions are rounded to multiples of 2^@shift, and divided by 2^@shift,
+ * so a @shift of 0 keeps them in 26.6 format and a @shift of 6 turns them to
+ * whole pixels. The glyphs have no clusters, which can be found using
+ * raqm_get_glyph_arrays().
+ *
+ * If @buffer is `NULL`, or not big enough, only @size is set, so that the
+ * caller can allocate enough space. If a glyph index or position does not fit
+ * in 16 bits, @size is set to zero.
+ *
+ * Return value:
+ * `true` if all glyphs were written to @buffer, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_packed_glyphs (raqm_t       *rq,
+                        unsigned int  shift,
+                        void         *buffer,
+                        size_t       *size)
+{
+  char *out = buffer;
+  size_t needed = 0;
+  size_t glyphs_count = 0;
+
+  if (!rq || !size || shift > 16)
+    return false;
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+    needed += _raqm_packed_run_size (hb_buffer_get_length (run->buffer));
+
+  if (needed && (!buffer || *size < needed))
+  {
+    *size = needed;
+    return false;
+  }
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    raqm_packed_run_t *header = (raqm_packed_run_t *) out;
+    raqm_packed_glyph_t *glyphs = (raqm_packed_glyph_t *) (header + 1);
+    unsigned int len;
+    hb_glyph_info_t *info;
+    hb_glyph_position_t *position;
+
+    info = hb_buffer_get_glyph_infos (run->buffer, &len);
+    position = hb_buffer_get_glyph_positions (run->buffer, NULL);
+
+    header->ftface = hb_ft_font_get_face (run->font);
+    header->start = glyphs_count;
+    header->len = len;
+    header->size = _raqm_packed_run_size (len);
+    header->direction = _raqm_raqm_dir (run->direction);
+
+    for (unsigned int i = 0; i < len; i++)
+    {
+      if (info[i].codepoint > UINT16_MAX ||
+          !_raqm_quantize (position[i].x_advance, shift, &glyphs[i].x_advance) ||
+          !_raqm_quantize (position[i].y_advance, shift, &glyphs[i].y_advance) ||
+          !_raqm_quantize (position[i].x_offset, shift, &glyphs[i].x_offset) ||
+          !_raqm_quantize (position[i].y_offset, shift, &glyphs[i].y_offset))
+      {
+        *size = 0;
+        return false;
+      }
+
+      glyphs[i].index = info[i].codepoint;
+    }
+
+    out += header->size;
+    glyphs_count += len;
+  }
+
+  *size = needed;
+  return true;
+}
+
+/**
+ * raqm_get_lines:
+ * @rq: a #raqm_t.
+ * @lines: (out caller-allocates) (array) (optional): output array of lines.
+ * @length: (inout): the length of @lines on input, the number of lines on
+ * output.
+ *
+ * Gets the lines of the last layout, see raqm_set_line_width(). The lines are
+ * in order, and the glyphs of each line are in visual order.
+ *
+ * If @lines is `NULL`, or not long enough, only the number of lines is set,
+ * so that the caller can allocate enough space.
+ *
+ * Return value:
+ * `true` if all lines were written to @lines, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_lines (raqm_t      *rq,
+                raqm_line_t *lines,
+                size_t      *length)
+{
+  bool ok;
+
+  if (!rq || !length)
+    return false;
+
+  ok = lines && *length >= rq->lines_len;
+  *length = rq->lines_len;
+  if (!ok)
+    return false;
+
+  for (size_t i = 0; i < rq->lines_len; i++)
+  {
+    lines[i] = rq->lines[i];
+
+    if (rq->text_u8_to_u32)
+    {
+      size_t start = rq->lines[i].start;
+      size_t end = start + rq->lines[i].len;
+
+      lines[i].start = _raqm_u32_to_u8_index (rq, start);
+      lines[i].len = _raqm_u32_to_u8_index (rq, end) - lines[i].start;
+    }
+  }
+
+  return true;
+}
+
+#define RAQM_RESULT_ALIGN(size) \
+  (((size) + RAQM_SCRATCH_ALIGN - 1) & ~(size_t) (RAQM_SCRATCH_ALIGN - 1))
+
+/* Find the ink extents of @glyph in @font, from the extents cache of the
+ * font when it has one */
+static bool
+_raqm_get_glyph_extents (raqm_t             *rq,
+                         hb_font_t          *font,
+                         hb_codepoint_t      glyph,
+                         hb_glyph_extents_t *extents)
+{
+  _raqm_run_font *entry = NULL;
+  size_t mask, i;
+
+  for (size_t j = 0; j < rq->run_fonts_len; j++)
+  {
+    if (rq->run_fonts[j].font == font)
+    {
+      entry = &rq->run_fonts[j];
+      break;
+    }
+  }
+
+  /* Keep the table at most half full */
+  if (entry && (entry->extents_len + 1) * 2 > entry->extents_capacity)
+  {
+    size_t new_capacity = entry->extents_capacity ? entry->extents_capacity * 2 : 64;
+    _raqm_glyph_extents *new_extents;
+
+    new_extents = _raqm_malloc (rq, sizeof (_raqm_glyph_extents) * new_capacity);
+    if (new_extents)
+    {
+      memset (new_extents, 0, sizeof (_raqm_glyph_extents) * new_capacity);
+      for (size_t j = 0; j < entry->extents_capacity; j++)
+      {
+        if (!entry->extents[j].key)
+          continue;
+
+        i = (entry->extents[j].key * 2654435761u) & (new_capacity - 1);
+        while (new_extents[i].key)
+          i = (i + 1) & (new_capacity - 1);
+        new_extents[i] = entry->extents[j];
+      }
+
+      _raqm_free (rq, entry->extents);
+      entry->extents = new_extents;
+      entry->extents_capacity = new_capacity;
+    }
+    else
+      entry = NULL;
+  }
+
+  if (!entry)
+    return hb_font_get_glyph_extents (font, glyph, extents);
+
+  mask = entry->extents_capacity - 1;
+  i = ((glyph + 1) * 2654435761u) & mask;
+  for (; entry->extents[i].key; i = (i + 1) & mask)
+  {
+    if (entry->extents[i].key == glyph + 1)
+    {
+      *extents = entry->extents[i].extents;
+      return true;
+    }
+  }
+
+  /* Glyphs without extents are cached as empty */
+  if (!hb_font_get_glyph_extents (font, glyph, extents))
+    memset (extents, 0, sizeof (hb_glyph_extents_t));
+
+  entry->extents[i].key = glyph + 1;
+  entry->extents[i].extents = *extents;
+  entry->extents_len++;
+
+  return true;
+}
+
+/* Add the glyphs of @run, starting at the pen position (@x, @y), to
+ * @extents, and move the pen past them */
+static void
+_raqm_add_run_extents (raqm_t         *rq,
+                       raqm_run_t     *run,
+                       int            *x,
+                       int            *y,
+                       raqm_extents_t *extents,
+                       bool           *has_ink)
+{
+  hb_glyph_info_t *info;
+  hb_glyph_position_t *pos;
+  unsigned int len;
+  bool identity;
+
+  info = hb_buffer_get_glyph_infos (run->buffer, &len);
+  pos = hb_buffer_get_glyph_positions (run->buffer, NULL);
+  identity = run->shape_matrix.xx == 0x10000 && run->shape_matrix.xy == 0 &&
+             run->shape_matrix.yx == 0 && run->shape_matrix.yy == 0x10000;
+
+  for (unsigned int i = 0; i < len; i++)
+  {
+    hb_glyph_extents_t glyph;
+    FT_Vector corners[4];
+    int origin_x = *x + pos[i].x_offset;
+    int origin_y = *y + pos[i].y_offset;
+
+    *x += pos[i].x_advance;
+    *y += pos[i].y_advance;
+    extents->x_advance += pos[i].x_advance;
+    extents->y_advance += pos[i].y_advance;
+
+    if (!_raqm_get_glyph_extents (rq, run->font, info[i].codepoint, &glyph) ||
+        (glyph.width == 0 && glyph.height == 0))
+      continue;
+
+    /* The box is in font space, while the positions were transformed */
+    corners[0].x = corners[3].x = glyph.x_bearing;
+    corners[1].x = corners[2].x = glyph.x_bearing + glyph.width;
+    corners[0].y = corners[1].y = glyph.y_bearing;
+    corners[2].y = corners[3].y = glyph.y_bearing + glyph.height;
+
+    for (int j = 0; j < 4; j++)
+    {
+      int corner_x, corner_y;
+
+      if (!identity)
+        FT_Vector_Transform (&corners[j], &run->shape_matrix);
+
+      corner_x = origin_x + corners[j].x;
+      corner_y = origin_y + corners[j].y;
+
+      if (!*has_ink)
+      {
+        extents->x_min = extents->x_max = corner_x;
+        extents->y_min = extents->y_max = corner_y;
+        *has_ink = true;
+        continue;
+      }
+
+      if (corner_x < extents->x_min)
+        extents->x_min = corner_x;
+      if (corner_x > extents->x_max)
+        extents->x_max = corner_x;
+      if (corner_y < extents->y_min)
+        extents->y_min = corner_y;
+      if (corner_y > extents->y_max)
+        extents->y_max = corner_y;
+    }
+  }
+}
+
+/**
+ * raqm_get_extents:
+ * @rq: a #raqm_t.
+ * @extents: (out): the extents of the layout.
+ *
+ * Gets the sum of the advances of all glyphs, and the box covering their
+ * ink. The box is relative to the origin of the first glyph, with y
+ * increasing upwards as in glyph offsets. The glyphs of each line start
+ * from x zero at the baseline of the line, see raqm_get_lines(). If no
+ * glyph has any ink, the box is all zeros.
+ *
+ * The extents of each glyph are found with hb_font_get_glyph_extents() the
+ * first time they are needed after raqm_layout(), and kept for the other
+ * glyphs of the layout using the same font, so laying text out costs
+ * nothing more for callers who don't ask for extents.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_extents (raqm_t         *rq,
+                  raqm_extents_t *extents)
+{
+  size_t glyphs_count = 0;
+  size_t line = 0;
+  bool has_ink = false;
+  int x = 0, y = 0;
+
+  if (!rq || !extents)
+    return false;
+
+  memset (extents, 0, sizeof (raqm_extents_t));
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    size_t next = line;
+
+    /* Runs never cross lines, so move the pen to the start of the line of
+     * this run when it is a new one */
+    while (next + 1 < rq->lines_len &&
+           glyphs_count >= rq->lines[next].glyph_start +
+                           rq->lines[next].glyph_len)
+      next++;
+
+    if (next != line)
+    {
+      line = next;
+      x = 0;
+      y = -rq->lines[line].y;
+    }
+
+    _raqm_add_run_extents (rq, run, &x, &y, extents, &has_ink);
+    glyphs_count += hb_buffer_get_length (run->buffer);
+  }
+
+  return true;
+}
+
+/**
+ * raqm_get_glyph_run_extents:
+ * @rq: a #raqm_t.
+ * @index: the index of a run, as returned by raqm_get_glyph_runs().
+ * @extents: (out): the extents of the run.
+ *
+ * Same as raqm_get_extents(), but for the glyphs of one run only, and
+ * relative to the origin of the first glyph of the run.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise, e.g. if @index is not
+ * the index of a run.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_glyph_run_extents (raqm_t         *rq,
+                            size_t          index,
+                            raqm_extents_t *extents)
+{
+  raqm_run_t *run;
+  bool has_ink = false;
+  int x = 0, y = 0;
+
+  if (!rq || !extents)
+    return false;
+
+  run = rq->runs;
+  for (size_t i = 0; run != NULL && i < index; i++)
+    run = run->next;
+
+  if (!run)
+    return false;
+
+  memset (extents, 0, sizeof (raqm_extents_t));
+  _raqm_add_run_extents (rq, run, &x, &y, extents, &has_ink);
+
+  return true;
+}
+
+/**
+ * raqm_freeze_layout:
+ * @rq: a #raqm_t.
+ *
+ * Copies the output of the last layout of @rq, i.e. what raqm_get_glyphs(),
+ * raqm_get_glyph_runs(), raqm_get_lines() and
+ * raqm_get_par_resolved_direction() return, into a new
+ * #raqm_layout_result_t. The result does not depend on @rq, which can be
+ * cleared with raqm_clear_contents() and reused, or destroyed, right away.
+ *
+ * The result is never modified, so it can be read from any number of
+ * threads at the same time, and raqm_layout_result_reference() and
+ * raqm_layout_result_destroy() can be called from any thread. The #FT_Face
+ * objects of its glyphs are not referenced by the result, and must be kept
+ * alive for as long as they are used.
+ *
+ * The result is allocated with the allocator of @rq, see
+ * raqm_create_with_allocator(), so the allocator must stay usable until the
+ * result is destroyed.
+ *
+ * Return value: (transfer full):
+ * A new #raqm_layout_result_t, or `NULL` in case of error. It must be freed
+ * with raqm_layout_result_destroy().
+ *
+ * Since: 0.10
+ */
+raqm_layout_result_t *
+raqm_freeze_layout (raqm_t *rq)
+{
+  raqm_layout_result_t *result;
+  size_t glyphs_len = 0, runs_len = 0;
+  size_t glyphs_offset, runs_offset, lines_offset, size;
+  size_t count = 0;
+
+  if (!rq)
+    return NULL;
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    glyphs_len += hb_buffer_get_length (run->buffer);
+    runs_len++;
+  }
+
+  glyphs_offset = RAQM_RESULT_ALIGN (sizeof (raqm_layout_result_t));
+  runs_offset = glyphs_offset +
+                RAQM_RESULT_ALIGN (sizeof (raqm_glyph_t) * glyphs_len);
+  lines_offset = runs_offset +
+                 RAQM_RESULT_ALIGN (sizeof (raqm_glyph_run_t) * runs_len);
+  size = lines_offset + sizeof (raqm_line_t) * rq->lines_len;
+
+  result = _raqm_malloc (rq, size);
+  if (!result)
+    return NULL;
+
+  result->ref_count = 1;
+  result->allocator = rq->allocator;
+  result->glyphs = (raqm_glyph_t *) ((char *) result + glyphs_offset);
+  result->glyphs_len = glyphs_len;
+  result->runs = (raqm_glyph_run_t *) ((char *) result + runs_offset);
+  result->runs_len = runs_len;
+  result->lines = (raqm_line_t *) ((char *) result + lines_offset);
+  result->lines_len = rq->lines_len;
+  result->resolved_dir = rq->resolved_dir;
+  result->size = size;
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    unsigned int len;
+    hb_glyph_info_t *info;
+    hb_glyph_position_t *position;
+    FT_Face ftface;
+
+    info = hb_buffer_get_glyph_infos (run->buffer, &len);
+    position = hb_buffer_get_glyph_positions (run->buffer, NULL);
+    ftface = hb_ft_font_get_face (run->font);
+
+    for (unsigned int i = 0; i < len; i++)
+    {
+      raqm_glyph_t *glyph = &result->glyphs[count + i];
+
+      glyph->index = info[i].codepoint;
+      glyph->x_advance = position[i].x_advance;
+      glyph->y_advance = position[i].y_advance;
+      glyph->x_offset = position[i].x_offset;
+      glyph->y_offset = position[i].y_offset;
+      glyph->ftface = ftface;
+      if (rq->text_u8_to_u32)
+        glyph->cluster = _raqm_u32_to_u8_index (rq, info[i].cluster);
+      else
+        glyph->cluster = info[i].cluster;
+    }
+
+    count += len;
+  }
+
+  raqm_get_glyph_runs (rq, result->runs, &runs_len);
+  raqm_get_lines (rq, result->lines, &result->lines_len);
+
+  return result;
+}
+
+/**
+ * raqm_layout_result_reference:
+ * @result: a #raqm_layout_result_t.
+ *
+ * Increases the reference count on @result by one. This prevents @result
+ * from being destroyed until a matching call to raqm_layout_result_destroy()
+ * is made. This can be called from any thread.
+ *
+ * Return value:
+ * The referenced #raqm_layout_result_t.
+ *
+ * Since: 0.10
+ */
+raqm_layout_result_t *
+raqm_layout_result_reference (raqm_layout_result_t *result)
+{
+  if (result)
+    _raqm_atomic_inc (&result->ref_count);
+
+  return result;
+}
+
+/**
+ * raqm_layout_result_destroy:
+ * @result: a #raqm_layout_result_t.
+ *
+ * Decreases the reference count on @result by one. If the result is zero,
+ * then @result is freed. This can be called from any thread.
+ * See raqm_layout_result_reference().
+ *
+ * Since: 0.10
+ */
+void
+raqm_layout_result_destroy (raqm_layout_result_t *result)
+{
+  if (!result || _raqm_atomic_dec (&result->ref_count) != 0)
+    return;
+
+  if (result->allocator.free_func)
+    result->allocator.free_func (result, result->allocator.user_data);
+  else
+    free (result);
+}
+
+/**
+ * raqm_layout_result_get_glyphs:
+ * @result: a #raqm_layout_result_t.
+ * @length: (out): output array length.
+ *
+ * Gets the glyphs of @result, as raqm_get_glyphs() returned them for the
+ * layout @result was made from.
+ *
+ * Return value: (transfer none):
+ * An array of #raqm_glyph_t, or `NULL` if there are no glyphs. This is owned
+ * by @result and must not be modified or freed.
+ *
+ * Since: 0.10
+ */
+const raqm_glyph_t *
+raqm_layout_result_get_glyphs (const raqm_layout_result_t *result,
+                               size_t                     *length)
+{
+  if (!result || !length)
+  {
+    if (length)
+      *length = 0;
+    return NULL;
+  }
+
+  *length = result->glyphs_len;
+  return result->glyphs_len ? result->glyphs : NULL;
+}
+
+/**
+ * raqm_layout_result_get_glyph_runs:
+ * @result: a #raqm_layout_result_t.
+ * @length: (out): output array length.
+ *
+ * Gets the glyph runs of @result, see raqm_get_glyph_runs().
+ *
+ * Return value: (transfer none):
+ * An array of #raqm_glyph_run_t, or `NULL` if there are no runs. This is
+ * owned by @result and must not be modified or freed.
+ *
+ * Since: 0.10
+ */
+const raqm_glyph_run_t *
+raqm_layout_result_get_glyph_runs (const raqm_layout_result_t *result,
+                                   size_t                     *length)
+{
+  if (!result || !length)
+  {
+    if (length)
+      *length = 0;
+    return NULL;
+  }
+
+  *length = result->runs_len;
+  return result->runs_len ? result->runs : NULL;
+}
+
+/**
+ * raqm_layout_result_get_lines:
+ * @result: a #raqm_layout_result_t.
+ * @length: (out): output array length.
+ *
+ * Gets the lines of @result, see raqm_get_lines().
+ *
+ * Return value: (transfer none):
+ * An array of #raqm_line_t, or `NULL` if there are no lines. This is owned
+ * by @result and must not be modified or freed.
+ *
+ * Since: 0.10
+ */
+const raqm_line_t *
+raqm_layout_result_get_lines (const raqm_layout_result_t *result,
+                              size_t                     *length)
+{
+  if (!result || !length)
+  {
+    if (length)
+      *length = 0;
+    return NULL;
+  }
+
+  *length = result->lines_len;
+  return result->lines_len ? result->lines : NULL;
+}
+
+/**
+ * raqm_layout_result_get_par_resolved_direction:
+ * @result: a #raqm_layout_result_t.
+ *
+ * Gets the resolved direction of the paragraph of @result, see
+ * raqm_get_par_resolved_direction().
+ *
+ * Return value:
+ * The #raqm_direction_t specifying the resolved direction of text.
+ *
+ * Since: 0.10
+ */
+raqm_direction_t
+raqm_layout_result_get_par_resolved_direction (const raqm_layout_result_t *result)
+{
+  if (!result)
+    return RAQM_DIRECTION_DEFAULT;
+
+  return result->resolved_dir;
+}
+
+/**
+ * raqm_layout_cache_create:
+ * @max_bytes: the maximum amount of memory used by the cached layouts.
+ *
+ * Creates a new, empty #raqm_layout_cache_t. A layout cache keeps the
+ * results of raqm_layout_cached(), keyed by everything they depend on: the
+ * text, its faces with their sizes and transforms, load flags and languages,
+ * the fallback faces, the paragraph direction, the font features, the
+ * invisible glyph and the line width. Laying out the same paragraph again,
+ * with any #raqm_t using the cache, returns the cached result without doing
+ * any layout.
+ *
+ * When the cached results would use more than @max_bytes, the least recently
+ * used ones are dropped. The cache can be attached to one or more #raqm_t
+ * objects with raqm_set_layout_cache(), but must not be used by several of
+ * them concurrently. The results it returns can be, see
+ * raqm_freeze_layout().
+ *
+ * The cache keeps a reference to every face used by a cached layout, until
+ * the layout is dropped.
+ *
+ * Return value:
+ * A newly allocated #raqm_layout_cache_t with a reference count of 1, or
+ * `NULL` in case of error.
+ *
+ * Since: 0.10
+ */
+raqm_layout_cache_t *
+raqm_layout_cache_create (size_t max_bytes)
+{
+  raqm_layout_cache_t *cache;
+
+  cache = malloc (sizeof (raqm_layout_cache_t));
+  if (!cache)
+    return NULL;
+
+  memset (cache, 0, sizeof (raqm_layout_cache_t));
+  cache->ref_count = 1;
+  cache->max_bytes = max_bytes;
+
+  return cache;
+}
+
+/**
+ * raqm_layout_cache_reference:
+ * @cache: a #raqm_layout_cache_t.
+ *
+ * Increases the reference count on @cache by one.
+ *
+ * Return value:
+ * The referenced #raqm_layout_cache_t.
+ *
+ * Since: 0.10
+ */
+raqm_layout_cache_t *
+raqm_layout_cache_reference (raqm_layout_cache_t *cache)
+{
+  if (cache)
+    cache->ref_count++;
+
+  return cache;
+}
+
+/**
+ * raqm_layout_cache_destroy:
+ * @cache: a #raqm_layout_cache_t.
+ *
+ * Decreases the reference count on @cache by one. If the result is zero, then
+ * @cache is freed, and the references it holds on the cached results are
+ * released.
+ *
+ * Since: 0.10
+ */
+void
+raqm_layout_cache_destroy (raqm_layout_cache_t *cache)
+{
+  if (!cache || --cache->ref_count != 0)
+    return;
+
+  raqm_layout_cache_clear (cache);
+  free (cache->buckets);
+  free (cache->key);
+  free (cache);
+}
+
+/* The faces of @key, and their number */
+static _raqm_layout_key_face *
+_raqm_layout_key_faces (unsigned char *key,
+                        size_t        *len)
+{
+  _raqm_layout_key_header *header = (_raqm_layout_key_header *) key;
+  size_t offset = RAQM_RESULT_ALIGN (sizeof (_raqm_layout_key_header));
+
+  offset += RAQM_RESULT_ALIGN (sizeof (uint32_t) * header->text_len);
+  if (header->mapped)
+    offset += RAQM_RESULT_ALIGN (sizeof (uint32_t) * (header->text_len + 1));
+  offset += RAQM_RESULT_ALIGN (sizeof (_raqm_layout_key_span) *
+                               header->spans_len);
+
+  *len = header->spans_len + header->fallback_faces_len;
+  return (_raqm_layout_key_face *) (key + offset);
+}
+
+static unsigned char *
+_raqm_layout_cache_entry_key (_raqm_layout_cache_entry *entry)
+{
+  return (unsigned char *) entry +
+         RAQM_RESULT_ALIGN (sizeof (_raqm_layout_cache_entry));
+}
+
+static void
+_raqm_layout_cache_lru_unlink (raqm_layout_cache_t      *cache,
+                               _raqm_layout_cache_entry *entry)
+{
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+}
+
+static void
+_raqm_layout_cache_lru_push (raqm_layout_cache_t      *cache,
+                             _raqm_layout_cache_entry *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head)
+    cache->lru_head->lru_prev = entry;
+  else
+    cache->lru_tail = entry;
+  cache->lru_head = entry;
+}
+
+static void
+_raqm_layout_cache_remove (raqm_layout_cache_t      *cache,
+                           _raqm_layout_cache_entry *entry)
+{
+  _raqm_layout_cache_entry **link;
+  _raqm_layout_key_face *faces;
+  size_t faces_len;
+
+  link = &cache->buckets[entry->hash & (cache->buckets_len - 1)];
+  while (*link != entry)
+    link = &(*link)->bucket_next;
+  *link = entry->bucket_next;
+
+  _raqm_layout_cache_lru_unlink (cache, entry);
+
+  faces = _raqm_layout_key_faces (_raqm_layout_cache_entry_key (entry),
+                                  &faces_len);
+  for (size_t i = 0; i < faces_len; i++)
+    FT_Done_Face (faces[i].ftface);
+
+  raqm_layout_result_destroy (entry->result);
+  cache->bytes -= entry->bytes;
+  cache->entries_len--;
+  free (entry);
+}
+
+/**
+ * raqm_layout_cache_clear:
+ * @cache: a #raqm_layout_cache_t.
+ *
+ * Drops all cached layouts. Changes to the character size and transform of
+ * faces are detected automatically, but this must be called after any other
+ * change to a face that affects its glyphs or metrics (e.g. changing
+ * variation coordinates) for the change to be reflected in subsequent
+ * layouts.
+ *
+ * Since: 0.10
+ */
+void
+raqm_layout_cache_clear (raqm_layout_cache_t *cache)
+{
+  if (!cache)
+    return;
+
+  while (cache->lru_head)
+    _raqm_layout_cache_remove (cache, cache->lru_head);
+}
+
+/**
+ * raqm_layout_cache_get_stats:
+ * @cache: a #raqm_layout_cache_t.
+ * @stats: (out): the statistics of @cache.
+ *
+ * Gets the number of lookups that found a cached layout and those that did
+ * not, the number of layouts dropped to stay within the memory budget of
+ * @cache, and the number and memory use of the layouts currently cached.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_layout_cache_get_stats (raqm_layout_cache_t       *cache,
+                             raqm_layout_cache_stats_t *stats)
+{
+  if (!cache || !stats)
+    return false;
+
+  stats->hits = cache->hits;
+  stats->misses = cache->misses;
+  stats->evictions = cache->evictions;
+  stats->entries = cache->entries_len;
+  stats->bytes = cache->bytes;
+
+  return true;
+}
+
+/**
+ * raqm_set_layout_cache:
+ * @rq: a #raqm_t.
+ * @cache: a #raqm_layout_cache_t, or `NULL`.
+ *
+ * Sets the layout cache to be used by raqm_layout_cached() with @rq. @rq
+ * will hold a reference to @cache until another cache is set or @rq is
+ * destroyed. If @cache is `NULL`, raqm_layout_cached() always lays the text
+ * out.
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_set_layout_cache (raqm_t              *rq,
+                       raqm_layout_cache_t *cache)
+{
+  if (!rq)
+    return false;
+
+  raqm_layout_cache_reference (cache);
+  raqm_layout_cache_destroy (rq->layout_cache);
+  rq->layout_cache = cache;
+
+  return true;
+}
+
+static void
+_raqm_get_shape_state (FT_Face          ftface,
+                       FT_Size_Metrics *metrics,
+                       FT_Matrix       *matrix);
+
+static void
+_raqm_layout_key_set_face (_raqm_layout_key_face *face,
+                           FT_Face                ftface)
+{
+  FT_Size_Metrics metrics;
+
+  _raqm_get_shape_state (ftface, &metrics, &face->matrix);
+  face->ftface = ftface;
+  face->ftsize = ftface->size;
+  face->x_ppem = metrics.x_ppem;
+  face->y_ppem = metrics.y_ppem;
+  face->x_scale = metrics.x_scale;
+  face->y_scale = metrics.y_scale;
+}
+
+/* Write the key of the layout of @rq to the key buffer of @cache */
+static bool
+_raqm_layout_cache_build_key (raqm_layout_cache_t *cache,
+                              raqm_t              *rq,
+                              size_t              *key_size)
+{
+  _raqm_layout_key_header *header;
+  _raqm_layout_key_span *spans;
+  _raqm_layout_key_face *faces;
+  size_t text_offset, map_offset, spans_offset, faces_offset;
+  size_t features_offset, size;
+  bool mapped = rq->text_u8_to_u32 != NULL;
+
+  for (size_t i = 0; i < rq->text_spans_len; i++)
+  {
+    if (!rq->text_spans[i].info.ftface)
+      return false;
+  }
+
+  text_offset = RAQM_RESULT_ALIGN (sizeof (_raqm_layout_key_header));
+  map_offset = text_offset +
+               RAQM_RESULT_ALIGN (sizeof (uint32_t) * rq->text_len);
+  spans_offset = map_offset;
+  if (mapped)
+    spans_offset += RAQM_RESULT_ALIGN (sizeof (uint32_t) * (rq->text_len + 1));
+  faces_offset = spans_offset +
+                 RAQM_RESULT_ALIGN (sizeof (_raqm_layout_key_span) *
+                                    rq->text_spans_len);
+  features_offset = faces_offset +
+                    RAQM_RESULT_ALIGN (sizeof (_raqm_layout_key_face) *
+                                       (rq->text_spans_len +
+                                        rq->fallback_faces_len));
+  size = features_offset + sizeof (hb_feature_t) * rq->features_len;
+
+  if (size > cache->key_capacity)
+  {
+    void *new_key = realloc (cache->key, size);
+    if (!new_key)
+      return false;
+
+    cache->key = new_key;
+    cache->key_capacity = size;
+  }
+
+  memset (cache->key, 0, size);
+
+  header = (_raqm_layout_key_header *) cache->key;
+  header->text_len = rq->text_len;
+  header->text_utf8_len = mapped ? rq->text_utf8_len : 0;
+  header->spans_len = rq->text_spans_len;
+  header->fallback_faces_len = rq->fallback_faces_len;
+  header->features_len = rq->features_len;
+  header->mapped = mapped;
+  header->base_dir = rq->base_dir;
+  header->invisible_glyph = rq->invisible_glyph;
+  header->line_width = rq->line_width;
+  header->bidi_func = rq->bidi_func;
+  header->bidi_user_data = rq->bidi_func ? rq->bidi_user_data : NULL;
+
+  if (rq->text_len)
+    memcpy (cache->key + text_offset, rq->text,
+            sizeof (uint32_t) * rq->text_len);
+  if (mapped)
+    memcpy (cache->key + map_offset, rq->text_u32_to_u8,
+            sizeof (uint32_t) * (rq->text_len + 1));
+
+  spans = (_raqm_layout_key_span *) (cache->key + spans_offset);
+  faces = (_raqm_layout_key_face *) (cache->key + faces_offset);
+  for (size_t i = 0; i < rq->text_spans_len; i++)
+  {
+    spans[i].start = rq->text_spans[i].start;
+    spans[i].ftloadflags = rq->text_spans[i].info.ftloadflags;
+    spans[i].lang = rq->text_spans[i].info.lang;
+    _raqm_layout_key_set_face (&faces[i], rq->text_spans[i].info.ftface);
+  }
+  for (size_t i = 0; i < rq->fallback_faces_len; i++)
+    _raqm_layout_key_set_face (&faces[rq->text_spans_len + i],
+                               rq->fallback_faces[i]);
+
+  if (rq->features_len)
+    memcpy (cache->key + features_offset, rq->features,
+            sizeof (hb_feature_t) * rq->features_len);
+
+  *key_size = size;
+  return true;
+}
+
+static _raqm_layout_cache_entry *
+_raqm_layout_cache_lookup (raqm_layout_cache_t *cache,
+                           uint32_t             hash,
+                           size_t               key_size)
+{
+  _raqm_layout_cache_entry *entry;
+
+  if (!cache->buckets_len)
+    return NULL;
+
+  for (entry = cache->buckets[hash & (cache->buckets_len - 1)];
+       entry != NULL;
+       entry = entry->bucket_next)
+  {
+    if (entry->hash == hash && entry->key_size == key_size &&
+        memcmp (_raqm_layout_cache_entry_key (entry), cache->key,
+                key_size) == 0)
+      return entry;
+  }
+
+  return NULL;
+}
+
+static bool
+_raqm_layout_cache_grow_buckets (raqm_layout_cache_t *cache)
+{
+  size_t buckets_len = cache->buckets_len ? cache->buckets_len * 2 : 64;
+  _raqm_layout_cache_entry **buckets;
+
+  buckets = malloc (sizeof (_raqm_layout_cache_entry *) * buckets_len);
+  if (!buckets)
+    return false;
+
+  for (size_t i = 0; i < buckets_len; i++)
+    buckets[i] = NULL;
+
+  for (size_t i = 0; i < cache->buckets_len; i++)
+  {
+    _raqm_layout_cache_entry *entry = cache->buckets[i];
+
+    while (entry)
+    {
+      _raqm_layout_cache_entry *next = entry->bucket_next;
+      size_t bucket = entry->hash & (buckets_len - 1);
+
+      entry->bucket_next = buckets[bucket];
+      buckets[bucket] = entry;
+      entry = next;
+    }
+  }
+
+  free (cache->buckets);
+  cache->buckets = buckets;
+  cache->buckets_len = buckets_len;
+
+  return true;
+}
+
+/* Store @result with the current key of @cache, dropping the least recently
+ * used entries to stay within the memory budget */
+static void
+_raqm_layout_cache_insert (raqm_layout_cache_t  *cache,
+                           uint32_t              hash,
+                           size_t                key_size,
+                           raqm_layout_result_t *result)
+{
+  _raqm_layout_cache_entry *entry;
+  _raqm_layout_key_face *faces;
+  size_t faces_len, bytes, bucket;
+
+  bytes = RAQM_RESULT_ALIGN (sizeof (_raqm_layout_cache_entry)) + key_size;
+  if (bytes + result->size > cache->max_bytes)
+    return;
+
+  if (cache->entries_len >= cache->buckets_len &&
+      !_raqm_layout_cache_grow_buckets (cache))
+    return;
+
+  entry = malloc (bytes);
+  if (!entry)
+    return;
+
+  while (cache->bytes + bytes + result->size > cache->max_bytes)
+  {
+    _raqm_layout_cache_remove (cache, cache->lru_tail);
+    cache->evictions++;
+  }
+
+  entry->hash = hash;
+  entry->key_size = key_size;
+  entry->bytes = bytes + result->size;
+  entry->result = raqm_layout_result_reference (result);
+  memcpy (_raqm_layout_cache_entry_key (entry), cache->key, key_size);
+
+  faces = _raqm_layout_key_faces (_raqm_layout_cache_entry_key (entry),
+                                  &faces_len);
+  for (size_t i = 0; i < faces_len; i++)
+    FT_Reference_Face (faces[i].ftface);
+
+  bucket = hash & (cache->buckets_len - 1);
+  entry->bucket_next = cache->buckets[bucket];
+  cache->buckets[bucket] = entry;
+  _raqm_layout_cache_lru_push (cache, entry);
+
+  cache->bytes += entry->bytes;
+  cache->entries_len++;
+}
+
+static uint32_t
+_raqm_hash_bytes (uint32_t    hash,
+                  const void *data,
+                  size_t      len);
+
+/**
+ * raqm_layout_cached:
+ * @rq: a #raqm_t.
+ *
+ * Returns the layout of the text of @rq, as raqm_freeze_layout() would return
+ * it after raqm_layout(), from the layout cache of @rq if it has the same
+ * layout, see raqm_set_layout_cache(). Otherwise the text is laid out, and
+ * the result added to the cache.
+ *
+ * When the layout is found in the cache, @rq is not laid out, and has no
+ * output until the next call to raqm_layout(), i.e. raqm_get_glyphs() and
+ * the other functions returning the output of @rq must not be used.
+ *
+ * Return value: (transfer full):
+ * A #raqm_layout_result_t, or `NULL` in case of error. It must be freed with
+ * raqm_layout_result_destroy().
+ *
+ * Since: 0.10
+ */
+raqm_layout_result_t *
+raqm_layout_cached (raqm_t *rq)
+{
+  raqm_layout_cache_t *cache;
+  _raqm_layout_cache_entry *entry;
+  raqm_layout_result_t *result;
+  size_t key_size;
+  uint32_t hash;
+
+  if (!rq)
+    return NULL;
+
+  cache = rq->layout_cache;
+  if (!cache || !_raqm_layout_cache_build_key (cache, rq, &key_size))
+  {
+    if (!raqm_layout (rq))
+      return NULL;
+    return raqm_freeze_layout (rq);
+  }
+
+  hash = _raqm_hash_bytes (2166136261u, cache->key, key_size);
+  entry = _raqm_layout_cache_lookup (cache, hash, key_size);
+  if (entry)
+  {
+    cache->hits++;
+    _raqm_layout_cache_lru_unlink (cache, entry);
+    _raqm_layout_cache_lru_push (cache, entry);
+    _raqm_keep_stale_runs (rq);
+    return raqm_layout_result_reference (entry->result);
+  }
+
+  cache->misses++;
+
+  if (!raqm_layout (rq))
+    return NULL;
+
+  result = raqm_freeze_layout (rq);
+  if (result)
+    _raqm_layout_cache_insert (cache, hash, key_size, result);
+
+  return result;
+}
+
+/**
+ * raqm_get_par_resolved_direction:
+ * @rq: a #raqm_t.
+ *
+ * Gets the resolved direction of the paragraph;
+ *
+ * Return value:
+ * The #raqm_direction_t specifying the resolved direction of text,
+ * or #RAQM_DIRECTION_DEFAULT if raqm_layout() has not been called on @rq.
+ *
+ * Since: 0.8
+ */
+RAQM_API raqm_direction_t
+raqm_get_par_resolved_direction (raqm_t *rq)
+{
+  if (!rq)
+    return RAQM_DIRECTION_DEFAULT;
+
+  return rq->resolved_dir;
+}
+
+/**
+ * raqm_get_direction_at_index:
+ * @rq: a #raqm_t.
+ * @index: (in): character index.
+ *
+ * Gets the resolved direction of the character at specified index;
+ *
+ * Return value:
+ * The #raqm_direction_t specifying the resolved direction of text at the
+ * specified index, or #RAQM_DIRECTION_DEFAULT if raqm_layout() has not been
+ * called on @rq.
+ *
+ * Since: 0.8
+ */
+RAQM_API raqm_direction_t
+raqm_get_direction_at_index (raqm_t *rq,
+                             size_t index)
+{
+  if (!rq)
+    return RAQM_DIRECTION_DEFAULT;
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    if (run->pos <= index && index < run->pos + run->len)
+      return _raqm_raqm_dir (run->direction);
+  }
+
+  return RAQM_DIRECTION_DEFAULT;
+}
+
+static bool
+_raqm_resolve_scripts (raqm_t *rq);
+
+static bool
+_raqm_is_simple_text (raqm_t      *rq,
+                      hb_script_t *script);
+
+static void
+_raqm_resolve_simple_scripts (raqm_t      *rq,
+                              hb_script_t  script);
+
+static hb_direction_t
+_raqm_hb_dir (raqm_t *rq, _raqm_bidi_level_t level)
+{
+  hb_direction_t dir = HB_DIRECTION_LTR;
+
+  if (rq->base_dir == RAQM_DIRECTION_TTB)
+      dir = HB_DIRECTION_TTB;
+  else if (RAQM_BIDI_LEVEL_IS_RTL(level))
+      dir = HB_DIRECTION_RTL;
+
+  return dir;
+}
+
+static void
+_raqm_reverse_run (_raqm_bidi_run *run, const size_t len)
+{
+  assert (run);
+
+  for (size_t i = 0; i < len / 2; i++)
+  {
+    _raqm_bidi_run temp = run[i];
+    run[i] = run[len - 1 - i];
+    run[len - 1 - i] = temp;
+  }
+}
+
+/* Split the text into runs of the same embedding level, @levels being the
+ * levels after rule L1, and put them in visual order */
+static _raqm_bidi_run *
+_raqm_reorder_runs (raqm_t        *rq,
+                    const uint8_t *levels,
+                    const size_t   len,
+                    /* output */
+                    size_t        *run_count)
+{
+  uint8_t level;
+  int last_level = -1;
+  uint8_t max_level = 0;
+  size_t run_start = 0;
+  size_t run_index = 0;
+  _raqm_bidi_run *runs = NULL;
+  size_t count = 0;
+
+  if (len == 0)
+  {
+    *run_count = 0;
+    return NULL;
+  }
+
+  assert (levels);
+
+  /* Find max_level of the line.  We don't reuse the paragraph
+   * max_level, both for a cleaner API, and that the line max_level
+   * may be far less than paragraph max_level. */
+  for (int i = len - 1; i >= 0; i--)
+  {
+    if (levels[i] > max_level)
+       max_level = levels[i];
+  }
+
+  for (size_t i = 0; i < len; i++)
+  {
+    if (levels[i] != last_level)
+      count++;
+
+    last_level = levels[i];
+  }
+
+  runs = _raqm_scratch_alloc (rq, sizeof (_raqm_bidi_run) * count);
+  if (!runs)
+    return NULL;
+
+  while (run_start < len)
+  {
+    size_t run_end = run_start;
+    while (run_end < len && levels[run_start] == levels[run_end])
+    {
+      run_end++;
+    }
+
+    runs[run_index].pos = run_start;
+    runs[run_index].level = levels[run_start];
+    runs[run_index].len = run_end - run_start;
+    run_start = run_end;
+    run_index++;
+  }
+
+  /* L2. Reorder. */
+  for (level = max_level; level > 0; level--)
+  {
+    for (int i = count - 1; i >= 0; i--)
+    {
+      if (runs[i].level >= level)
+      {
+        int end = i;
+        for (i--; (i >= 0 && runs[i].level >= level); i--)
+            ;
+        _raqm_reverse_run (runs + i + 1, end - i);
+      }
+    }
+  }
+
+  *run_count = count;
+  return runs;
+}
+
+#ifdef RAQM_SHEENBIDI
+static _raqm_bidi_run *
+_raqm_builtin_bidi_itemize (raqm_t *rq, size_t *run_count)
+{
+  _raqm_bidi_run *runs;
+  SBAlgorithmRef bidi;
+  SBParagraphRef par;
+  SBUInteger par_len;
+  SBLineRef line;
+
+  SBLevel base_level = SBLevelDefaultLTR;
+  SBCodepointSequence input = {
+     SBStringEncodingUTF32,
+     (void *) rq->text,
+     rq->text_len
+  };
+
+  if (rq->base_dir == RAQM_DIRECTION_RTL)
+    base_level = 1;
+  else if (rq->base_dir == RAQM_DIRECTION_LTR)
+    base_level = 0;
+
+  /* paragraph */
+  bidi = SBAlgorithmCreate (&input);
+  par = SBAlgorithmCreateParagraph (bidi, 0, INT32_MAX, base_level);
+  par_len = SBParagraphGetLength (par);
+
+  /* lines */
+  line = SBParagraphCreateLine (par, 0, par_len);
+  *run_count = SBLineGetRunCount (line);
+
+  if (SBParagraphGetBaseLevel (par) == 0)
+    rq->resolved_dir = RAQM_DIRECTION_LTR;
+  else
+    rq->resolved_dir = RAQM_DIRECTION_RTL;
+
+  runs = _raqm_scratch_alloc (rq, sizeof (_raqm_bidi_run) * (*run_count));
+  if (runs)
+  {
+    const SBRun *sheenbidi_runs = SBLineGetRunsPtr(line);
+
+    for (size_t i = 0; i < (*run_count); ++i)
+    {
+      runs[i].pos = sheenbidi_runs[i].offset;
+      runs[i].len = sheenbidi_runs[i].length;
+      runs[i].level = sheenbidi_runs[i].level;
+    }
+  }
+
+  SBLineRelease (line);
+  SBParagraphRelease (par);
+  SBAlgorithmRelease (bidi);
+
+  return runs;
+}
+#else
+static _raqm_bidi_run *
+_raqm_builtin_bidi_itemize (raqm_t *rq, size_t *run_count)
+{
+  FriBidiParType par_type = FRIBIDI_PAR_ON;
+
+  FriBidiCharType *types;
+  _raqm_bidi_level_t *levels;
+  int max_level = 0;
+  FriBidiBracketType *btypes;
+
+  types = _raqm_scratch_alloc (rq, sizeof (FriBidiCharType) * rq->text_len);
+  btypes = _raqm_scratch_alloc (rq,
+                                sizeof (FriBidiBracketType) * rq->text_len);
+  levels = _raqm_scratch_alloc (rq,
+                                sizeof (_raqm_bidi_level_t) * rq->text_len);
+
+  if (!types || !levels || !btypes)
+    return NULL;
+
+  if (rq->base_dir == RAQM_DIRECTION_RTL)
+    par_type = FRIBIDI_PAR_RTL;
+  else if (rq->base_dir == RAQM_DIRECTION_LTR)
+    par_type = FRIBIDI_PAR_LTR;
+
+  fribidi_get_bidi_types (rq->text, rq->text_len, types);
+  fribidi_get_bracket_types (rq->text, rq->text_len, types, btypes);
+  max_level = fribidi_get_par_embedding_levels_ex (types, btypes,
+                                                   rq->text_len, &par_type,
+                                                   levels);
+
+  if (par_type == FRIBIDI_PAR_LTR)
+    rq->resolved_dir = RAQM_DIRECTION_LTR;
+  else
+    rq->resolved_dir = RAQM_DIRECTION_RTL;
+
+  if (max_level == 0)
+    return NULL;
+
+  /* L1. Reset the embedding levels of some chars:
+     4. any sequence of white space characters at the end of the line. */
+  for (int i = rq->text_len - 1;
+       i >= 0 && FRIBIDI_IS_EXPLICIT_OR_BN_OR_WS (types[i]); i--)
+  {
+    levels[i] = FRIBIDI_DIR_TO_LEVEL (par_type);
+  }
+
+  /* Get the number of bidi runs. The levels are never negative, so they can
+   * be read as uint8_t. */
+  return _raqm_reorder_runs (rq, (const uint8_t *) levels, rq->text_len,
+                             run_count);
+}
+#endif
+
+static _raqm_bidi_run *
+_raqm_func_bidi_itemize (raqm_t *rq, size_t *run_count)
+{
+  uint8_t *levels;
+  uint8_t par_level = 0;
+
+  levels = _raqm_scratch_alloc (rq, sizeof (uint8_t) * rq->text_len);
+  if (!levels)
+    return NULL;
+
+  if (!rq->bidi_func (rq->text, rq->text_len, rq->base_dir, levels,
+                      &par_level, rq->bidi_user_data))
+    return NULL;
+
+  if (RAQM_BIDI_LEVEL_IS_RTL (par_level))
+    rq->resolved_dir = RAQM_DIRECTION_RTL;
+  else
+    rq->resolved_dir = RAQM_DIRECTION_LTR;
+
+  return _raqm_reorder_runs (rq, levels, rq->text_len, run_count);
+}
+
+/* Run the bidi algorithm on the text, or reuse the runs of the last layout
+ * when neither the text nor the paragraph direction changed since */
+static _raqm_bidi_run *
+_raqm_bidi_itemize (raqm_t *rq, size_t *run_count)
+{
+  _raqm_bidi_run *runs;
+
+  if (rq->bidi_runs_valid)
+  {
+    if (rq->stats_enabled)
+      rq->stats.reused_bidi_runs += rq->bidi_runs_len;
+
+    rq->resolved_dir = rq->bidi_resolved_dir;
+    *run_count = rq->bidi_runs_len;
+    return rq->bidi_runs;
+  }
+
+  if (rq->bidi_func)
+    runs = _raqm_func_bidi_itemize (rq, run_count);
+  else
+    runs = _raqm_builtin_bidi_itemize (rq, run_count);
+
+  if (!runs)
+    return NULL;
+
+  /* Failing to keep the runs only means that the next layout runs the bidi
+   * algorithm again */
+  if (*run_count > rq->bidi_runs_capacity)
+  {
+    _raqm_bidi_run *new_runs = _raqm_realloc (rq, rq->bidi_runs,
+                                              sizeof (_raqm_bidi_run) *
+                                              *run_count);
+    if (!new_runs)
+      return runs;
+
+    rq->bidi_runs = new_runs;
+    rq->bidi_runs_capacity = *run_count;
+  }
+
+  memcpy (rq->bidi_runs, runs, sizeof (_raqm_bidi_run) * *run_count);
+  rq->bidi_runs_len = *run_count;
+  rq->bidi_resolved_dir = rq->resolved_dir;
+  rq->bidi_runs_valid = true;
+
+  return rq->bidi_runs;
+}
+
+static bool
+_raqm_build_grapheme_breaks (raqm_t *rq);
+
+static size_t
+_raqm_grapheme_end (raqm_t *rq,
+                    size_t  index);
+
+/* Whether @face supports the characters [@start, @end) of the text, ignoring
+ * those that need no glyph, like controls and variation selectors */
+static bool
+_raqm_face_has_chars (raqm_t  *rq,
+                      FT_Face  face,
+                      size_t   start,
+                      size_t   end)
+{
+  hb_unicode_funcs_t *unicode_funcs = hb_unicode_funcs_get_default ();
+
+  for (size_t i = start; i < end; i++)
+  {
+    uint32_t ch = rq->text[i];
+    hb_unicode_general_category_t category;
+
+    if (_raqm_face_has_char (rq, face, ch))
+      continue;
+
+    category = hb_unicode_general_category (unicode_funcs, ch);
+    if (category == HB_UNICODE_GENERAL_CATEGORY_CONTROL ||
+        category == HB_UNICODE_GENERAL_CATEGORY_FORMAT ||
+        (ch >= 0xFE00 && ch <= 0xFE0F) || (ch >= 0xE0100 && ch <= 0xE01EF))
+      continue;
+
+    return false;
+  }
+
+  return true;
+}
+
+/* The face to use for the grapheme cluster [@start, @end) when its face
+ * @face does not support it */
+static FT_Face
+_raqm_find_fallback_face (raqm_t  *rq,
+                          FT_Face  face,
+                          size_t   start,
+                          size_t   end)
+{
+  for (size_t i = 0; i < rq->fallback_faces_len; i++)
+  {
+    if (_raqm_face_has_chars (rq, rq->fallback_faces[i], start, end))
+      return rq->fallback_faces[i];
+  }
+
+  for (size_t i = 0; i < rq->fallback_faces_len; i++)
+  {
+    if (_raqm_face_has_char (rq, rq->fallback_faces[i], rq->text[start]))
+      return rq->fallback_faces[i];
+  }
+
+  return face;
+}
+
+/* Choose the face of each character, using the fallback faces for the
+ * grapheme clusters not supported by their face. This needs the scripts
+ * of the text to be resolved. */
+static FT_Face *
+_raqm_resolve_fallback_faces (raqm_t *rq)
+{
+  FT_Face *faces;
+  bool fallback = false;
+  size_t end;
+
+  if (!_raqm_build_grapheme_breaks (rq))
+    return NULL;
+
+  faces = _raqm_scratch_alloc (rq, sizeof (FT_Face) * rq->text_len);
+  if (!faces)
+    return NULL;
+
+  for (size_t start = 0; start < rq->text_len; start = end)
+  {
+    size_t span = _raqm_find_text_span (rq, start);
+    FT_Face face = rq->text_spans[span].info.ftface;
+    FT_Face primary = face;
+
+    end = _raqm_grapheme_end (rq, start) + 1;
+
+    /* Keep the fallback face of the previous cluster for the rest of the
+     * text of its script, if it can */
+    if (fallback && rq->text_scripts[start] == rq->text_scripts[start - 1] &&
+        _raqm_face_has_chars (rq, faces[start - 1], start, end))
+      face = faces[start - 1];
+    else if (!_raqm_face_has_chars (rq, face, start, end))
+      face = _raqm_find_fallback_face (rq, face, start, end);
+
+    fallback = face != primary;
+    for (size_t i = start; i < end; i++)
+      faces[i] = face;
+  }
+
+  return faces;
+}
+
+static bool
+_raqm_itemize (raqm_t *rq)
+{
+  _raqm_bidi_run *runs = NULL;
+  raqm_run_t *last;
+  size_t last_bidi_run = 0;
+  size_t run_count = 0;
+  uint64_t start;
+  hb_script_t simple_script;
+  FT_Face *faces = NULL;
+  bool simple;
+  bool ok = true;
+
+#ifdef RAQM_TESTING
+  switch (rq->base_dir)
+  {
+    case RAQM_DIRECTION_RTL:
+      RAQM_TEST ("Direction is: RTL\n\n");
+      break;
+    case RAQM_DIRECTION_LTR:
+      RAQM_TEST ("Direction is: LTR\n\n");
+      break;
+    case RAQM_DIRECTION_TTB:
+      RAQM_TEST ("Direction is: TTB\n\n");
+      break;
+    case RAQM_DIRECTION_DEFAULT:
+    default:
+      RAQM_TEST ("Direction is: DEFAULT\n\n");
+      break;
+  }
+#endif
+
+  start = _raqm_phase_begin (rq);
+  simple = _raqm_is_simple_text (rq, &simple_script);
+  if (simple)
+    _raqm_resolve_simple_scripts (rq, simple_script);
+  else
+    ok = _raqm_resolve_scripts (rq);
+  _raqm_phase_end (rq, RAQM_PHASE_SCRIPTS, start);
+  if (!ok)
+    goto done;
+
+  start = _raqm_phase_begin (rq);
+  if (simple)
+  {
+    /* A single left-to-right run, as the bidi algorithm would find */
+    run_count = 1;
+    rq->resolved_dir = RAQM_DIRECTION_LTR;
+    runs = _raqm_scratch_alloc (rq, sizeof (_raqm_bidi_run));
+    if (runs)
+    {
+      runs->pos = 0;
+      runs->len = rq->text_len;
+      runs->level = 0;
+    }
+  }
+  else if (rq->base_dir == RAQM_DIRECTION_TTB)
+  {
+    /* Treat every thing as LTR in vertical text */
+    run_count = 1;
+    rq->resolved_dir = RAQM_DIRECTION_TTB;
+    runs = _raqm_scratch_alloc (rq, sizeof (_raqm_bidi_run));
+    if (runs)
+    {
+      runs->pos = 0;
+      runs->len = rq->text_len;
+      runs->level = 0;
+    }
+  } else {
+    runs = _raqm_bidi_itemize (rq, &run_count);
+  }
+  _raqm_phase_end (rq, RAQM_PHASE_BIDI, start);
+
+  if (!runs)
+  {
+    ok = false;
+    goto done;
+  }
+
+  if (rq->stats_enabled)
+    rq->stats.bidi_runs += run_count;
+
+  start = _raqm_phase_begin (rq);
+
+  if (rq->fallback_faces_len)
+  {
+    faces = _raqm_resolve_fallback_faces (rq);
+    if (!faces)
+    {
+      ok = false;
+      goto done;
+    }
+  }
+
+#ifdef RAQM_TESTING
+  RAQM_TEST ("Number of runs before script itemization: %zu\n\n", run_count);
+
+  RAQM_TEST ("BiDi Runs:\n");
+  for (size_t i = 0; i < run_count; i++)
+  {
+    RAQM_TEST ("run[%zu]:\t start: %zu\tlength: %zu\tlevel: %d\n",
+               i, runs[i].pos, runs[i].len, runs[i].level);
+  }
+  RAQM_TEST ("\n");
+#endif
+
+  _raqm_release_run_fonts (rq);
+
+  last = NULL;
+  for (size_t i = 0; i < run_count; i++)
+  {
+    hb_direction_t direction = _raqm_hb_dir (rq, runs[i].level);
+    size_t run_start = runs[i].pos;
+    size_t run_end = runs[i].pos + runs[i].len;
+
+    /* Split the BiDi run on text span, script and fallback face boundaries,
+     * in visual order */
+    while (run_start < run_end)
+    {
+      size_t span, start, end;
+      hb_script_t script;
+      FT_Face face;
+      hb_font_t *font;
+      raqm_run_t *newrun;
+
+      if (HB_DIRECTION_IS_BACKWARD (direction))
+      {
+        end = run_end;
+        span = _raqm_find_text_span (rq, end - 1);
+        start = rq->text_spans[span].start;
+        if (start < run_start)
+          start = run_start;
+
+        script = rq->text_scripts[end - 1];
+        for (size_t j = end - 1; j > start; j--)
+        {
+          if (rq->text_scripts[j - 1] != script)
+          {
+            start = j;
+            break;
+          }
+        }
+        for (size_t j = end - 1; faces && j > start; j--)
+        {
+          if (faces[j - 1] != faces[end - 1])
+          {
+            start = j;
+            break;
+          }
+        }
+        run_end = start;
+      }
+      else
+      {
+        start = run_start;
+        span = _raqm_find_text_span (rq, start);
+        end = _raqm_text_span_end (rq, span);
+        if (end > run_end)
+          end = run_end;
+
+        script = rq->text_scripts[start];
+        for (size_t j = start + 1; !simple && j < end; j++)
+        {
+          if (rq->text_scripts[j] != script)
+          {
+            end = j;
+            break;
+          }
+        }
+        for (size_t j = start + 1; faces && j < end; j++)
+        {
+          if (faces[j] != faces[start])
+          {
+            end = j;
+            break;
+          }
+        }
+        run_start = end;
+      }
+
+      face = faces ? faces[start] : rq->text_spans[span].info.ftface;
+      font = _raqm_create_hb_font (rq, face,
+                                   rq->text_spans[span].info.ftloadflags);
+
+      /* Extend the previous run of this BiDi run when nothing that affects
+       * shaping changed, e.g. at a text span boundary that the fallback
+       * faces hide */
+      if (last && last_bidi_run == i && last->font == font &&
+          last->script == script &&
+          last->lang == rq->text_spans[span].info.lang)
+      {
+        if (HB_DIRECTION_IS_BACKWARD (direction))
+          last->pos = start;
+        last->len += end - start;
+        hb_font_destroy (font);
+        continue;
+      }
+
+      newrun = _raqm_alloc_run (rq);
+      if (!newrun)
+      {
+        hb_font_destroy (font);
+        ok = false;
+        goto done;
+      }
+
+      newrun->pos = start;
+      newrun->len = end - start;
+      newrun->direction = direction;
+      newrun->level = runs[i].level;
+      newrun->script = script;
+      newrun->lang = rq->text_spans[span].info.lang;
+      newrun->font = font;
+      last_bidi_run = i;
+
+      if (!rq->runs)
+        rq->runs = newrun;
+
+      if (last)
+        last->next = newrun;
+
+      last = newrun;
+    }
+  }
+
+#ifdef RAQM_TESTING
+  run_count = 0;
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+    run_count++;
+  RAQM_TEST ("Number of runs after script itemization: %zu\n\n", run_count);
+
+  run_count = 0;
+  RAQM_TEST ("Final Runs:\n");
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    SCRIPT_TO_STRING (run->script);
+    RAQM_TEST ("run[%zu]:\t start: %d\tlength: %d\tdirection: %s\tscript: %s\tfont: %s\n",
+               run_count++, run->pos, run->len,
+               hb_direction_to_string (run->direction), buff,
+               hb_ft_font_get_face (run->font)->family_name);
+  }
+  RAQM_TEST ("\n");
+#endif
+
+  _raqm_phase_end (rq, RAQM_PHASE_RUNS, start);
+
+done:
+  return ok;
+}
+
+/* Stack to handle script detection */
+typedef struct {
+  size_t       capacity;
+  size_t       size;
+  int         *pair_index;
+  hb_script_t *script;
+} _raqm_stack_t;
+
+/* Special paired characters for script detection */
+static size_t paired_len = 34;
+static const uint32_t paired_chars[] =
+{
+  0x0028, 0x0029, /* ascii paired punctuation */
+  0x003c, 0x003e,
+  0x005b, 0x005d,
+  0x007b, 0x007d,
+  0x00ab, 0x00bb, /* guillemets */
+  0x2018, 0x2019, /* general punctuation */
+  0x201c, 0x201d,
+  0x2039, 0x203a,
+  0x3008, 0x3009, /* chinese paired punctuation */
+  0x300a, 0x300b,
+  0x300c, 0x300d,
+  0x300e, 0x300f,
+  0x3010, 0x3011,
+  0x3014, 0x3015,
+  0x3016, 0x3017,
+  0x3018, 0x3019,
+  0x301a, 0x301b
+};
+
+/* Stack handling functions */
+static _raqm_stack_t *
+_raqm_stack_new (raqm_t *rq,
+                 size_t  max)
+{
+  _raqm_stack_t *stack;
+  stack = _raqm_scratch_alloc (rq, sizeof (_raqm_stack_t));
+  if (!stack)
+    return NULL;
+
+  stack->script = _raqm_scratch_alloc (rq, sizeof (hb_script_t) * max);
+  if (!stack->script)
+    return NULL;
+
+  stack->pair_index = _raqm_scratch_alloc (rq, sizeof (int) * max);
+  if (!stack->pair_index)
+    return NULL;
+
+  stack->size = 0;
+  stack->capacity = max;
+
+  return stack;
+}
+
+static bool
+_raqm_stack_pop (_raqm_stack_t *stack)
+{
+  if (!stack->size)
+  {
+    RAQM_DBG ("Stack is Empty\n");
+    return false;
+  }
+
+  stack->size--;
+
+  return true;
+}
+
+static hb_script_t
+_raqm_stack_top (_raqm_stack_t *stack)
+{
+  if (!stack->size)
+  {
+    RAQM_DBG ("Stack is Empty\n");
+    return HB_SCRIPT_INVALID; /* XXX: check this */
+  }
+
+  return stack->script[stack->size];
+}
+
+static bool
+_raqm_stack_push (_raqm_stack_t *stack,
+                  hb_script_t    script,
+                  int            pair_index)
+{
+  if (stack->size == stack->capacity)
+  {
+    RAQM_DBG ("Stack is Full\n");
+    return false;
+  }
+
+  stack->size++;
+  stack->script[stack->size] = script;
+  stack->pair_index[stack->size] = pair_index;
+
+  return true;
+}
+
+static int
+_get_pair_index (const uint32_t ch)
+{
+  int lower = 0;
+  int upper = paired_len - 1;
+
+  while (lower <= upper)
+  {
+    int mid = (lower + upper) / 2;
+    if (ch < paired_chars[mid])
+      upper = mid - 1;
+    else if (ch > paired_chars[mid])
+      lower = mid + 1;
+    else
+      return mid;
+  }
+
+  return -1;
+}
+
+#define STACK_IS_EMPTY(script)     ((script)->size <= 0)
+#define IS_OPEN(pair_index)        (((pair_index) & 1) == 0)
+
+#ifdef RAQM_TESTING
+static void
+_raqm_test_scripts (raqm_t     *rq,
+                    const char *title)
+{
+  RAQM_TEST ("%s:\n", title);
+  for (size_t i = 0; i < rq->text_len; ++i)
+  {
+    SCRIPT_TO_STRING (rq->text_scripts[i]);
+    RAQM_TEST ("script for ch[%zu]\t%s\n", i, buff);
+  }
+  RAQM_TEST ("\n");
+}
+#endif
+
+/* Whether @ch may have a right-to-left, Arabic number or explicit bidi type,
+ * or be a paragraph separator. This covers all the blocks where Unicode
+ * assigns or reserves such characters, so that in a text without any of
+ * them, the bidi algorithm resolves every character to level 0 in a
+ * left-to-right or default direction paragraph. */
+static bool
+_raqm_may_be_rtl (uint32_t ch)
+{
+  if (ch < 0x80)
+    return ch == 0x0A || ch == 0x0D || (ch >= 0x1C && ch <= 0x1E);
+
+  return ch == 0x0085 ||
+         (ch >= 0x0590 && ch <= 0x08FF) ||
+         (ch >= 0x200E && ch <= 0x200F) ||
+         (ch >= 0x2028 && ch <= 0x202E) ||
+         (ch >= 0x2066 && ch <= 0x2069) ||
+         (ch >= 0xFB1D && ch <= 0xFDFF) ||
+         (ch >= 0xFE70 && ch <= 0xFEFF) ||
+         (ch >= 0x10800 && ch <= 0x10FFF) ||
+         (ch >= 0x1E800 && ch <= 0x1EFFF);
+}
+
+/* Check whether the text of @rq is laid out as a single left-to-right run of
+ * one script with one set of text properties, which is the case for most
+ * short strings, so that script detection and the bidi algorithm can be
+ * skipped. On success, @script is the script _raqm_resolve_scripts () would
+ * give to every character: the only script of the text other than Common and
+ * Inherited, provided no paired character comes before it, or Common if the
+ * text starts with a Common character and has no other script. */
+static bool
+_raqm_is_simple_text (raqm_t      *rq,
+                      hb_script_t *script)
+{
+  hb_unicode_funcs_t *unicode_funcs = hb_unicode_funcs_get_default ();
+  bool paired = false;
+
+  if (rq->base_dir != RAQM_DIRECTION_DEFAULT &&
+      rq->base_dir != RAQM_DIRECTION_LTR)
+    return false;
+
+  if (rq->text_spans_len != 1)
+    return false;
+
+  *script = HB_SCRIPT_COMMON;
+  for (size_t i = 0; i < rq->text_len; i++)
+  {
+    uint32_t ch = rq->text[i];
+    hb_script_t ch_script;
+
+    if (_raqm_may_be_rtl (ch))
+      return false;
+
+    /* ASCII letters are Latin and everything else is Common */
+    if (ch < 0x80)
+      ch_script = (ch | 0x20) - 'a' < 26 ? HB_SCRIPT_LATIN : HB_SCRIPT_COMMON;
+    else
+      ch_script = hb_unicode_script (unicode_funcs, ch);
+
+    if (ch_script == HB_SCRIPT_COMMON || ch_script == HB_SCRIPT_INHERITED)
+    {
+      if (*script != HB_SCRIPT_COMMON)
+        continue;
+
+      if (i == 0 && ch_script == HB_SCRIPT_INHERITED)
+        return false;
+
+      if (ch_script == HB_SCRIPT_COMMON && _get_pair_index (ch) >= 0)
+        paired = true;
+    }
+    else if (*script == HB_SCRIPT_COMMON)
+    {
+      if (paired)
+        return false;
+
+      *script = ch_script;
+    }
+    else if (ch_script != *script)
+      return false;
+  }
+
+  return true;
+}
+
+static void
+_raqm_resolve_simple_scripts (raqm_t      *rq,
+                              hb_script_t  script)
+{
+#ifdef RAQM_TESTING
+  hb_unicode_funcs_t *unicode_funcs = hb_unicode_funcs_get_default ();
+
+  for (size_t i = 0; i < rq->text_len; ++i)
+    rq->text_scripts[i] = hb_unicode_script (unicode_funcs, rq->text[i]);
+  _raqm_test_scripts (rq, "Before script detection");
+#endif
+
+  for (size_t i = 0; i < rq->text_len; ++i)
+    rq->text_scripts[i] = script;
+
+#ifdef RAQM_TESTING
+  _raqm_test_scripts (rq, "After script detection");
+#endif
+}
+
+/* Resolve the script for each character in the input string, if the character
+ * script is common or inherited it takes the script of the character before it
+ * except paired characters which we try to make them use the same script. We
+ * then split the BiDi runs, if necessary, on script boundaries.
+ */
+static bool
+_raqm_resolve_scripts (raqm_t *rq)
+{
+  int last_script_index = -1;
+  int last_set_index = -1;
+  hb_script_t last_script = HB_SCRIPT_INVALID;
+  _raqm_stack_t *stack = NULL;
+  hb_unicode_funcs_t* unicode_funcs = hb_unicode_funcs_get_default ();
+
+  for (size_t i = 0; i < rq->text_len; ++i)
+    rq->text_scripts[i] = hb_unicode_script (unicode_funcs, rq->text[i]);
+
+#ifdef RAQM_TESTING
+  _raqm_test_scripts (rq, "Before script detection");
+#endif
+
+  stack = _raqm_stack_new (rq, rq->text_len);
+  if (!stack)
+    return false;
+
+  for (int i = 0; i < (int) rq->text_len; i++)
+  {
+    if (rq->text_scripts[i] == HB_SCRIPT_COMMON && last_script_index != -1)
+    {
+      int pair_index = _get_pair_index (rq->text[i]);
+      if (pair_index >= 0)
+      {
+        if (IS_OPEN (pair_index))
         {
-          run->len++;
-          run->pos = runs[i].pos + j;
+          /* is a paired character */
+          rq->text_scripts[i] = last_script;
+          last_set_index = i;
+          _raqm_stack_push (stack, rq->text_scripts[i], pair_index);
+        }
+        else
+        {
+          /* is a close paired character */
+          /* find matching opening (by getting the last even index for current
+           * odd index) */
+          while (!STACK_IS_EMPTY (stack) &&
+                 stack->pair_index[stack->size] != (pair_index & ~1))
+          {
+            _raqm_stack_pop (stack);
+          }
+          if (!STACK_IS_EMPTY (stack))
+          {
+            rq->text_scripts[i] = _raqm_stack_top (stack);
+            last_script = rq->text_scripts[i];
+            last_set_index = i;
+          }
+          else
+          {
+            rq->text_scripts[i] = last_script;
+            last_set_index = i;
+          }
         }
       }
+      else
+      {
+        rq->text_scripts[i] = last_script;
+        last_set_index = i;
+      }
+    }
+    else if (rq->text_scripts[i] == HB_SCRIPT_INHERITED &&
+             last_script_index != -1)
+    {
+      rq->text_scripts[i] = last_script;
+      last_set_index = i;
+    }
+    else
+    {
+      for (int j = last_set_index + 1; j < i; ++j)
+        rq->text_scripts[j] = rq->text_scripts[i];
+      last_script = rq->text_scripts[i];
+      last_script_index = i;
+      last_set_index = i;
+    }
+  }
+
+  /* Loop backwards and change any remaining Common or Inherit characters to
+   * take the script if the next character.
+   * https://github.com/HOST-Oman/libraqm/issues/95
+   */
+  for (int i = rq->text_len - 2; i >= 0;  --i)
+  {
+    if (rq->text_scripts[i] == HB_SCRIPT_INHERITED ||
+        rq->text_scripts[i] == HB_SCRIPT_COMMON)
+      rq->text_scripts[i] = rq->text_scripts[i + 1];
+  }
+
+#ifdef RAQM_TESTING
+  _raqm_test_scripts (rq, "After script detection");
+#endif
+
+  return true;
+}
+
+/* Same as FT_MulFix (), which rounds half away from zero, but inlined so
+ * that the loop in _raqm_transform_positions () can be vectorized */
+static int64_t
+_raqm_mul_fix (int64_t a,
+               int64_t b)
+{
+  int64_t ab = a * b;
+
+  return (ab + 0x8000 - (ab < 0)) >> 16;
+}
+
+/* Same as calling FT_Vector_Transform () on the advance and the offset of
+ * each of @pos */
+static void
+_raqm_transform_positions (hb_glyph_position_t *pos,
+                           unsigned int         len,
+                           const FT_Matrix     *matrix)
+{
+  int64_t xx = matrix->xx, xy = matrix->xy, yx = matrix->yx, yy = matrix->yy;
+
+  for (unsigned int i = 0; i < len; i++)
+  {
+    int64_t x_advance = pos[i].x_advance, y_advance = pos[i].y_advance;
+    int64_t x_offset = pos[i].x_offset, y_offset = pos[i].y_offset;
+
+    pos[i].x_advance = _raqm_mul_fix (x_advance, xx) +
+                       _raqm_mul_fix (y_advance, xy);
+    pos[i].y_advance = _raqm_mul_fix (x_advance, yx) +
+                       _raqm_mul_fix (y_advance, yy);
+    pos[i].x_offset = _raqm_mul_fix (x_offset, xx) +
+                      _raqm_mul_fix (y_offset, xy);
+    pos[i].y_offset = _raqm_mul_fix (x_offset, yx) +
+                      _raqm_mul_fix (y_offset, yy);
+  }
+}
+
+/* The part of the text HarfBuzz sees when shaping @run, i.e. the run and its
+ * context */
+static void
+_raqm_shape_cache_run_text (raqm_t     *rq,
+                            raqm_run_t *run,
+                            size_t     *start,
+                            size_t     *end)
+{
+  *start = run->pos;
+  if (*start > RAQM_SHAPE_CACHE_CONTEXT_LEN)
+    *start -= RAQM_SHAPE_CACHE_CONTEXT_LEN;
+  else
+    *start = 0;
+
+  *end = run->pos + run->len + RAQM_SHAPE_CACHE_CONTEXT_LEN;
+  if (*end > rq->text_len)
+    *end = rq->text_len;
+}
+
+static uint32_t
+_raqm_hash_bytes (uint32_t    hash,
+                  const void *data,
+                  size_t      len)
+{
+  const unsigned char *bytes = data;
+
+  /* FNV-1a */
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static uint32_t
+_raqm_shape_cache_hash (raqm_t     *rq,
+                        raqm_run_t *run)
+{
+  FT_Face ftface = hb_ft_font_get_face (run->font);
+  int ftloadflags = hb_ft_font_get_load_flags (run->font);
+  uint32_t hash = 2166136261u;
+  size_t start, end;
+
+  _raqm_shape_cache_run_text (rq, run, &start, &end);
+
+  hash = _raqm_hash_bytes (hash, &ftface, sizeof (ftface));
+  hash = _raqm_hash_bytes (hash, &ftloadflags, sizeof (ftloadflags));
+  hash = _raqm_hash_bytes (hash, &run->script, sizeof (run->script));
+  hash = _raqm_hash_bytes (hash, &run->lang, sizeof (run->lang));
+  hash = _raqm_hash_bytes (hash, &run->direction, sizeof (run->direction));
+  hash = _raqm_hash_bytes (hash, &run->len, sizeof (run->len));
+  hash = _raqm_hash_bytes (hash, rq->text + start,
+                           sizeof (uint32_t) * (end - start));
+
+  return hash;
+}
+
+static bool
+_raqm_shape_cache_entry_matches (raqm_t                  *rq,
+                                 raqm_run_t              *run,
+                                 _raqm_shape_cache_entry *entry,
+                                 uint32_t                 hash)
+{
+  FT_Face ftface = hb_ft_font_get_face (run->font);
+  size_t start, end;
+
+  if (entry->hash != hash ||
+      entry->ftface != ftface ||
+      entry->ftloadflags != hb_ft_font_get_load_flags (run->font) ||
+      entry->script != run->script ||
+      entry->lang != run->lang ||
+      entry->direction != run->direction)
+    return false;
+
+  if (entry->ftsize != ftface->size)
+    return false;
+
+  if (ftface->size &&
+      (entry->ftsize_metrics.x_ppem != ftface->size->metrics.x_ppem ||
+       entry->ftsize_metrics.y_ppem != ftface->size->metrics.y_ppem ||
+       entry->ftsize_metrics.x_scale != ftface->size->metrics.x_scale ||
+       entry->ftsize_metrics.y_scale != ftface->size->metrics.y_scale))
+    return false;
+
+  _raqm_shape_cache_run_text (rq, run, &start, &end);
+  if (entry->text_len != end - start ||
+      entry->pre_context_len != run->pos - start ||
+      entry->run_len != run->len)
+    return false;
+
+  return memcmp (entry->text, rq->text + start,
+                 sizeof (uint32_t) * entry->text_len) == 0;
+}
+
+static void
+_raqm_shape_cache_lru_unlink (_raqm_shape_cache *cache,
+                              int                index)
+{
+  _raqm_shape_cache_entry *entry = &cache->entries[index];
+
+  if (entry->lru_prev >= 0)
+    cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+
+  if (entry->lru_next >= 0)
+    cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+}
+
+static void
+_raqm_shape_cache_lru_push (_raqm_shape_cache *cache,
+                            int                index)
+{
+  _raqm_shape_cache_entry *entry = &cache->entries[index];
+
+  entry->lru_prev = -1;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head >= 0)
+    cache->entries[cache->lru_head].lru_prev = index;
+  else
+    cache->lru_tail = index;
+  cache->lru_head = index;
+}
+
+/* Fill the buffer of @run from the cache, if it has a matching entry */
+static bool
+_raqm_shape_cache_lookup (raqm_t     *rq,
+                          raqm_run_t *run,
+                          uint32_t    hash)
+{
+  _raqm_shape_cache *cache = rq->shape_cache;
+  int index = cache->buckets[hash & (cache->buckets_len - 1)];
+  _raqm_shape_cache_entry *entry;
+  hb_glyph_info_t *info;
+  hb_glyph_position_t *pos;
+
+  while (index >= 0 &&
+         !_raqm_shape_cache_entry_matches (rq, run, &cache->entries[index], hash))
+    index = cache->entries[index].bucket_next;
+
+  if (index < 0)
+    return false;
+
+  entry = &cache->entries[index];
+
+  hb_buffer_set_content_type (run->buffer, HB_BUFFER_CONTENT_TYPE_GLYPHS);
+  if (!hb_buffer_set_length (run->buffer, entry->glyphs_len))
+  {
+    hb_buffer_clear_contents (run->buffer);
+    return false;
+  }
+
+  info = hb_buffer_get_glyph_infos (run->buffer, NULL);
+  memcpy (info, entry->infos, sizeof (hb_glyph_info_t) * entry->glyphs_len);
+  for (unsigned int i = 0; i < entry->glyphs_len; i++)
+    info[i].cluster += run->pos;
+
+  pos = hb_buffer_get_glyph_positions (run->buffer, NULL);
+  memcpy (pos, entry->positions,
+          sizeof (hb_glyph_position_t) * entry->glyphs_len);
+
+  _raqm_shape_cache_lru_unlink (cache, index);
+  _raqm_shape_cache_lru_push (cache, index);
+
+  return true;
+}
+
+/* Store the shaped buffer of @run in the cache, dropping the least recently
+ * used entry if the cache is full */
+static void
+_raqm_shape_cache_insert (raqm_t     *rq,
+                          raqm_run_t *run,
+                          uint32_t    hash)
+{
+  _raqm_shape_cache *cache = rq->shape_cache;
+  _raqm_shape_cache_entry *entry;
+  FT_Face ftface = hb_ft_font_get_face (run->font);
+  hb_glyph_info_t *info;
+  hb_glyph_position_t *pos;
+  unsigned int len;
+  size_t start, end;
+  int index;
+  void *mem;
+
+  info = hb_buffer_get_glyph_infos (run->buffer, &len);
+  pos = hb_buffer_get_glyph_positions (run->buffer, NULL);
+  _raqm_shape_cache_run_text (rq, run, &start, &end);
+
+  mem = _raqm_malloc (rq, sizeof (uint32_t) * (end - start) +
+                (sizeof (hb_glyph_info_t) + sizeof (hb_glyph_position_t)) * len);
+  if (!mem)
+    return;
+
+  if (cache->entries_len < cache->entries_capacity)
+  {
+    index = cache->entries_len++;
+  }
+  else
+  {
+    /* Evict the least recently used entry */
+    int *link;
+
+    index = cache->lru_tail;
+    entry = &cache->entries[index];
+
+    link = &cache->buckets[entry->hash & (cache->buckets_len - 1)];
+    while (*link != index)
+      link = &cache->entries[*link].bucket_next;
+    *link = entry->bucket_next;
+
+    _raqm_shape_cache_lru_unlink (cache, index);
+    _raqm_free (rq, entry->text);
+    FT_Done_Face (entry->ftface);
+  }
+
+  entry = &cache->entries[index];
+  entry->hash = hash;
+  entry->ftface = ftface;
+  FT_Reference_Face (ftface);
+  entry->ftloadflags = hb_ft_font_get_load_flags (run->font);
+  entry->ftsize = ftface->size;
+  if (ftface->size)
+    entry->ftsize_metrics = ftface->size->metrics;
+  entry->script = run->script;
+  entry->lang = run->lang;
+  entry->direction = run->direction;
+
+  entry->text = mem;
+  entry->text_len = end - start;
+  entry->pre_context_len = run->pos - start;
+  entry->run_len = run->len;
+  memcpy (entry->text, rq->text + start, sizeof (uint32_t) * entry->text_len);
+
+  entry->glyphs_len = len;
+  entry->infos = (hb_glyph_info_t *) (entry->text + entry->text_len);
+  entry->positions = (hb_glyph_position_t *) (entry->infos + len);
+  memcpy (entry->infos, info, sizeof (hb_glyph_info_t) * len);
+  for (unsigned int i = 0; i < len; i++)
+    entry->infos[i].cluster -= run->pos;
+  memcpy (entry->positions, pos, sizeof (hb_glyph_position_t) * len);
+
+  entry->bucket_next = cache->buckets[hash & (cache->buckets_len - 1)];
+  cache->buckets[hash & (cache->buckets_len - 1)] = index;
+  _raqm_shape_cache_lru_push (cache, index);
+}
+
+static void
+_raqm_shape_run (raqm_t     *rq,
+                 raqm_run_t *run)
+{
+  hb_buffer_add_utf32 (run->buffer, rq->text, rq->text_len,
+                       run->pos, run->len);
+
+  hb_shape_full (run->font, run->buffer, rq->features, rq->features_len,
+                 NULL);
+}
+
+typedef struct {
+  raqm_t  *rq;
+  FT_Face  ftface;
+} _raqm_shape_task;
+
+/* Shape all pending runs using the face of the task */
+static void
+_raqm_shape_task_func (void *data)
+{
+  _raqm_shape_task *task = data;
+
+  for (raqm_run_t *run = task->rq->runs; run != NULL; run = run->next)
+  {
+    if (run->shape_pending && hb_ft_font_get_face (run->font) == task->ftface)
+      _raqm_shape_run (task->rq, run);
+  }
+}
+
+/* Shape the pending runs through the shape tasks function, one task per
+ * face. Returns false if the runs should be shaped serially instead. */
+static bool
+_raqm_shape_concurrently (raqm_t *rq)
+{
+  _raqm_shape_task *tasks = NULL;
+  void **tasks_data;
+  size_t tasks_len = 0;
+  size_t runs_len = 0;
+
+  if (!rq->shape_tasks_func || rq->text_len < rq->shape_tasks_min_text_len)
+    return false;
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+    runs_len++;
+
+  if (runs_len < 2)
+    return false;
+
+  tasks = _raqm_scratch_alloc (rq, (sizeof (_raqm_shape_task) +
+                                    sizeof (void *)) * runs_len);
+  if (!tasks)
+    return false;
+  tasks_data = (void **) (tasks + runs_len);
+
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    FT_Face ftface = hb_ft_font_get_face (run->font);
+    size_t i;
+
+    if (!run->shape_pending)
+      continue;
+
+    for (i = 0; i < tasks_len; i++)
+    {
+      if (tasks[i].ftface == ftface)
+        break;
+    }
+
+    if (i == tasks_len)
+    {
+      tasks[i].rq = rq;
+      tasks[i].ftface = ftface;
+      tasks_data[i] = &tasks[i];
+      tasks_len++;
+    }
+  }
+
+  if (tasks_len < 2)
+    return false;
+
+  rq->shape_tasks_func (_raqm_shape_task_func, tasks_data, tasks_len,
+                        rq->shape_tasks_user_data);
+
+  return true;
+}
+
+static bool
+_raqm_same_size_metrics (FT_Size_Metrics a,
+                         FT_Size_Metrics b)
+{
+  return a.x_ppem == b.x_ppem && a.y_ppem == b.y_ppem &&
+         a.x_scale == b.x_scale && a.y_scale == b.y_scale;
+}
+
+static void
+_raqm_get_shape_state (FT_Face          ftface,
+                       FT_Size_Metrics *metrics,
+                       FT_Matrix       *matrix)
+{
+  memset (metrics, 0, sizeof (FT_Size_Metrics));
+  if (ftface->size)
+    *metrics = ftface->size->metrics;
+
+  FT_Get_Transform (ftface, matrix, NULL);
+}
+
+/* Whether glyph positions shaped at the size @from can be scaled to the
+ * current size of @ftface instead of shaping again, during raqm_relayout ().
+ * Unhinted positions are linear in the font scale, up to rounding. */
+static bool
+_raqm_can_scale_run (raqm_t          *rq,
+                     FT_Face          ftface,
+                     int              ftloadflags,
+                     FT_Size_Metrics  from,
+                     FT_Matrix        matrix)
+{
+  return rq->scale_stale_runs &&
+         FT_IS_SCALABLE (ftface) &&
+         (ftloadflags & FT_LOAD_NO_HINTING) &&
+         !(ftloadflags & FT_LOAD_NO_SCALE) &&
+         from.x_scale && from.y_scale &&
+         matrix.xx == 0x10000 && matrix.xy == 0 &&
+         matrix.yx == 0 && matrix.yy == 0x10000;
+}
+
+static void
+_raqm_scale_run (raqm_run_t      *run,
+                 FT_Size_Metrics  from,
+                 FT_Size_Metrics  to)
+{
+  unsigned int len;
+  hb_glyph_position_t *pos = hb_buffer_get_glyph_positions (run->buffer, &len);
+
+  for (unsigned int i = 0; i < len; i++)
+  {
+    pos[i].x_advance = FT_MulDiv (pos[i].x_advance, to.x_scale, from.x_scale);
+    pos[i].x_offset = FT_MulDiv (pos[i].x_offset, to.x_scale, from.x_scale);
+    pos[i].y_advance = FT_MulDiv (pos[i].y_advance, to.y_scale, from.y_scale);
+    pos[i].y_offset = FT_MulDiv (pos[i].y_offset, to.y_scale, from.y_scale);
+  }
+}
+
+/* Take the buffer of a run of the previous layout that is identical to @run.
+ * @hint is the stale run to try first, and is updated to the one after the
+ * matched run, as runs usually keep their order. */
+static bool
+_raqm_reuse_stale_run (raqm_t      *rq,
+                       raqm_run_t  *run,
+                       raqm_run_t **hint)
+{
+  FT_Face ftface = hb_ft_font_get_face (run->font);
+  int ftloadflags = hb_ft_font_get_load_flags (run->font);
+  FT_Size_Metrics metrics;
+  FT_Matrix matrix;
+  raqm_run_t *stale = NULL;
+  hb_buffer_t *buffer;
+  size_t buffer_len;
+  bool scale;
+
+  if (!rq->stale_runs)
+    return false;
+
+  for (int pass = 0; pass < 2 && !stale; pass++)
+  {
+    raqm_run_t *candidate = pass ? rq->stale_runs : *hint;
+
+    for (; candidate != NULL; candidate = candidate->next)
+    {
+      if (candidate->pos == run->pos && candidate->len == run->len)
+      {
+        stale = candidate;
+        break;
+      }
+
+      /* Only look at the hinted run on the first pass */
+      if (!pass)
+        break;
     }
-    else
+  }
+
+  if (!stale ||
+      stale->direction != run->direction ||
+      stale->script != run->script ||
+      stale->lang != run->lang ||
+      hb_ft_font_get_face (stale->font) != ftface ||
+      hb_ft_font_get_load_flags (stale->font) != ftloadflags)
+    return false;
+
+  _raqm_get_shape_state (ftface, &metrics, &matrix);
+  if (memcmp (&stale->shape_matrix, &matrix, sizeof (FT_Matrix)) != 0)
+    return false;
+
+  scale = !_raqm_same_size_metrics (stale->shape_size_metrics, metrics);
+  if (scale && !_raqm_can_scale_run (rq, ftface, ftloadflags,
+                                     stale->shape_size_metrics, matrix))
+    return false;
+
+  buffer = run->buffer;
+  run->buffer = stale->buffer;
+  stale->buffer = buffer;
+  buffer_len = run->buffer_len;
+  run->buffer_len = stale->buffer_len;
+  stale->buffer_len = buffer_len;
+  if (scale)
+    _raqm_scale_run (run, stale->shape_size_metrics, metrics);
+  run->shape_size_metrics = metrics;
+  run->shape_matrix = matrix;
+
+  if (stale->cluster_shift)
+  {
+    unsigned int len;
+    hb_glyph_info_t *info = hb_buffer_get_glyph_infos (run->buffer, &len);
+
+    for (unsigned int i = 0; i < len; i++)
+      info[i].cluster += stale->cluster_shift;
+  }
+
+  /* An empty run never matches, so this one can't be reused twice */
+  stale->len = 0;
+  *hint = stale->next;
+
+  return true;
+}
+
+/* Prepare the buffer of @run for shaping */
+static void
+_raqm_setup_run_buffer (raqm_t     *rq,
+                        raqm_run_t *run)
+{
+  hb_buffer_flags_t hb_buffer_flags = HB_BUFFER_FLAG_BOT | HB_BUFFER_FLAG_EOT;
+
+  if (rq->invisible_glyph < 0)
+    hb_buffer_flags |= HB_BUFFER_FLAG_REMOVE_DEFAULT_IGNORABLES;
+
+  if (!run->buffer)
+    run->buffer = hb_buffer_create ();
+  else
+    hb_buffer_clear_contents (run->buffer);
+
+  hb_buffer_set_script (run->buffer, run->script);
+  hb_buffer_set_language (run->buffer, run->lang);
+  hb_buffer_set_direction (run->buffer, run->direction);
+  hb_buffer_set_flags (run->buffer, hb_buffer_flags);
+
+  if (rq->invisible_glyph > 0)
+    hb_buffer_set_invisible_glyph (run->buffer, rq->invisible_glyph);
+}
+
+/* The size and transform of a face, kept by _raqm_shape () for the runs
+ * that follow using the same face */
+typedef struct {
+  FT_Face         ftface;
+  FT_Size_Metrics metrics;
+  FT_Matrix       matrix;
+  bool            identity;
+} _raqm_shape_state;
+
+static void
+_raqm_update_shape_state (_raqm_shape_state *state,
+                          FT_Face            ftface)
+{
+  if (state->ftface == ftface)
+    return;
+
+  _raqm_get_shape_state (ftface, &state->metrics, &state->matrix);
+  state->ftface = ftface;
+  state->identity = state->matrix.xx == 0x10000 && state->matrix.xy == 0 &&
+                    state->matrix.yx == 0 && state->matrix.yy == 0x10000;
+}
+
+/* Apply the transform of the face of @run to its glyph positions, after
+ * shaping. @state caches the transform between runs, and is updated if the
+ * face of @run is another one. */
+static void
+_raqm_transform_run (raqm_run_t        *run,
+                     _raqm_shape_state *state)
+{
+  hb_glyph_position_t *pos;
+  unsigned int len;
+
+  _raqm_update_shape_state (state, hb_ft_font_get_face (run->font));
+  run->shape_size_metrics = state->metrics;
+  run->shape_matrix = state->matrix;
+  if (state->identity)
+    return;
+
+  pos = hb_buffer_get_glyph_positions (run->buffer, &len);
+  _raqm_transform_positions (pos, len, &state->matrix);
+}
+
+/* Whether the shape of @run can be cached. Features that apply to part of
+ * the text are not in the cache key, so runs using any of them are not */
+static bool
+_raqm_shape_cacheable (raqm_t     *rq,
+                       raqm_run_t *run)
+{
+  if (!rq->shape_cache || run->len > RAQM_SHAPE_CACHE_MAX_RUN_LEN)
+    return false;
+
+  for (size_t i = 0; i < rq->features_len; i++)
+  {
+    const hb_feature_t *fea = &rq->features[i];
+
+    if (fea->start == HB_FEATURE_GLOBAL_START &&
+        fea->end == HB_FEATURE_GLOBAL_END)
+      continue;
+
+    if (fea->start < run->pos + run->len && fea->end > run->pos)
+      return false;
+  }
+
+  return true;
+}
+
+static bool
+_raqm_shape (raqm_t *rq)
+{
+  _raqm_shape_state state = { NULL };
+
+  /* Reuse the buffers of unchanged runs, set up the other buffers and fill
+   * what we can from the shape cache */
+  raqm_run_t *hint = rq->stale_runs;
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    run->shape_reused = _raqm_reuse_stale_run (rq, run, &hint);
+    run->shape_pending = false;
+    if (run->shape_reused)
+      continue;
+
+    _raqm_setup_run_buffer (rq, run);
+
+    run->shape_pending = true;
+    run->shape_cacheable = _raqm_shape_cacheable (rq, run);
+    if (run->shape_cacheable)
     {
-      run->pos = runs[i].pos;
-      run->script = rq->text_info[run->pos].script;
-      run->font = _raqm_create_hb_font (rq, rq->text_info[run->pos].ftface,
-          rq->text_info[run->pos].ftloadflags);
-      for (size_t j = 0; j < runs[i].len; j++)
+      run->shape_cache_hash = _raqm_shape_cache_hash (rq, run);
+      if (_raqm_shape_cache_lookup (rq, run, run->shape_cache_hash))
       {
-        _raqm_text_info info = rq->text_info[runs[i].pos + j];
-        if (!_raqm_compare_text_info (rq->text_info[run->pos], info))
-        {
-          raqm_run_t *newrun = _raqm_alloc_run (rq);
-          if (!newrun)
-          {
-            ok = false;
-            goto done;
-          }
-          newrun->pos = runs[i].pos + j;
-          newrun->len = 1;
-          newrun->direction = _raqm_hb_dir (rq, runs[i].level);
-          newrun->script = info.script;
-          newrun->font = _raqm_create_hb_font (rq, info.ftface,
-              info.ftloadflags);
-          run->next = newrun;
-          run = newrun;
-        }
-        else
-          run->len++;
+        rq->shape_cache->hits++;
+        if (rq->stats_enabled)
+          rq->stats.shape_cache_hits++;
+        run->shape_pending = false;
       }
     }
+  }
 
-    last = run;
-    last->next = NULL;
+  /* Shape the rest */
+  if (!_raqm_shape_concurrently (rq))
+  {
+    for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+    {
+      if (run->shape_pending)
+        _raqm_shape_run (rq, run);
+    }
   }
 
-#ifdef RAQM_TESTING
-  run_count = 0;
-  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
-    run_count++;
-  RAQM_TEST ("Number of runs after script itemization: %zu\n\n", run_count);
+  _raqm_discard_stale_runs (rq);
 
-  run_count = 0;
-  RAQM_TEST ("Final Runs:\n");
   for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
   {
-    SCRIPT_TO_STRING (run->script);
-    RAQM_TEST ("run[%zu]:\t start: %d\tlength: %d\tdirection: %s\tscript: %s\tfont: %s\n",
-               run_count++, run->pos, run->len,
-               hb_direction_to_string (run->direction), buff,
-               rq->text_info[run->pos].ftface->family_name);
+    if (run->shape_reused)
+      continue;
+
+    if (run->shape_pending && run->shape_cacheable)
+    {
+      rq->shape_cache->misses++;
+      if (rq->stats_enabled)
+        rq->stats.shape_cache_misses++;
+      _raqm_shape_cache_insert (rq, run, run->shape_cache_hash);
+    }
+    run->shape_pending = false;
+
+    _raqm_transform_run (run, &state);
   }
-  RAQM_TEST ("\n");
-#endif
 
-done:
-  free (runs);
+  return true;
+}
 
-  return ok;
+typedef enum
+{
+  RAQM_LINE_BREAK_NONE,
+  RAQM_LINE_BREAK_ALLOWED,
+  RAQM_LINE_BREAK_MANDATORY
+} _raqm_line_break_t;
+
+/* The line breaking classes of UAX #14 that matter for the rules we
+ * implement, with similar classes merged */
+typedef enum
+{
+  RAQM_LINE_CLASS_AL, /* letters, numbers and anything else */
+  RAQM_LINE_CLASS_BK, /* mandatory break, including NL */
+  RAQM_LINE_CLASS_CR,
+  RAQM_LINE_CLASS_LF,
+  RAQM_LINE_CLASS_SP,
+  RAQM_LINE_CLASS_ZW,
+  RAQM_LINE_CLASS_GL, /* glue, including WJ */
+  RAQM_LINE_CLASS_BA, /* break after, including HY */
+  RAQM_LINE_CLASS_OP, /* opening punctuation */
+  RAQM_LINE_CLASS_CL, /* closing punctuation, including CP, EX, IS and SY */
+  RAQM_LINE_CLASS_ID, /* ideographs, including Hangul and emoji */
+  RAQM_LINE_CLASS_CM  /* combining marks, including ZWJ */
+} _raqm_line_class_t;
+
+static _raqm_line_class_t
+_raqm_get_line_class (hb_codepoint_t ch)
+{
+  switch (ch)
+  {
+    case 0x000A:
+      return RAQM_LINE_CLASS_LF;
+
+    case 0x000D:
+      return RAQM_LINE_CLASS_CR;
+
+    case 0x000B: case 0x000C: case 0x0085: case 0x2028: case 0x2029:
+      return RAQM_LINE_CLASS_BK;
+
+    case 0x0020:
+      return RAQM_LINE_CLASS_SP;
+
+    case 0x200B:
+      return RAQM_LINE_CLASS_ZW;
+
+    case 0x00A0: case 0x0F0C: case 0x180E: case 0x2007: case 0x2011:
+    case 0x202F: case 0x2060: case 0xFEFF:
+      return RAQM_LINE_CLASS_GL;
+
+    case 0x0009: case 0x002D: case 0x007C: case 0x00AD: case 0x058A:
+    case 0x1680: case 0x2010: case 0x2012: case 0x2013: case 0x205F:
+    case 0x3000:
+      return RAQM_LINE_CLASS_BA;
+
+    case 0x0028: case 0x005B: case 0x007B: case 0x00A1: case 0x00BF:
+    case 0x3008: case 0x300A: case 0x300C: case 0x300E: case 0x3010:
+    case 0x3014: case 0xFF08: case 0xFF3B: case 0xFF5B:
+      return RAQM_LINE_CLASS_OP;
+
+    case 0x0021: case 0x0029: case 0x002C: case 0x002E: case 0x002F:
+    case 0x003A: case 0x003B: case 0x003F: case 0x005D: case 0x007D:
+    case 0x3001: case 0x3002: case 0x3009: case 0x300B: case 0x300D:
+    case 0x300F: case 0x3011: case 0x3015: case 0xFF01: case 0xFF09:
+    case 0xFF0C: case 0xFF0E: case 0xFF1A: case 0xFF1B: case 0xFF1F:
+    case 0xFF3D: case 0xFF5D:
+      return RAQM_LINE_CLASS_CL;
+
+    case 0x200C: case 0x200D:
+      return RAQM_LINE_CLASS_CM;
+
+    default:
+      break;
+  }
+
+  if ((ch >= 0x2000 && ch <= 0x2006) || (ch >= 0x2008 && ch <= 0x200A))
+    return RAQM_LINE_CLASS_BA;
+
+  if ((ch >= 0x2E80 && ch <= 0x2FFF) || (ch >= 0x3040 && ch <= 0x30FF) ||
+      (ch >= 0x3400 && ch <= 0x4DBF) || (ch >= 0x4E00 && ch <= 0x9FFF) ||
+      (ch >= 0xAC00 && ch <= 0xD7A3) || (ch >= 0xF900 && ch <= 0xFAFF) ||
+      (ch >= 0xFF01 && ch <= 0xFF60) || (ch >= 0x1F300 && ch <= 0x1FAFF) ||
+      (ch >= 0x20000 && ch <= 0x3FFFD))
+    return RAQM_LINE_CLASS_ID;
+
+  switch ((int) hb_unicode_general_category (hb_unicode_funcs_get_default (),
+                                             ch))
+  {
+    case HB_UNICODE_GENERAL_CATEGORY_NON_SPACING_MARK:
+    case HB_UNICODE_GENERAL_CATEGORY_SPACING_MARK:
+    case HB_UNICODE_GENERAL_CATEGORY_ENCLOSING_MARK:
+      return RAQM_LINE_CLASS_CM;
+
+    default:
+      return RAQM_LINE_CLASS_AL;
+  }
 }
 
-/* Stack to handle script detection */
-typedef struct {
-  size_t       capacity;
-  size_t       size;
-  int         *pair_index;
-  hb_script_t *script;
-} _raqm_stack_t;
+/* White space that hangs at the end of a line, and that takes the paragraph
+ * level there (L1) */
+static bool
+_raqm_is_line_space (hb_codepoint_t ch)
+{
+  return ch == 0x0009 || ch == 0x0020 || ch == 0x0085 || ch == 0x1680 ||
+         ch == 0x205F || ch == 0x3000 || ch == 0x2028 || ch == 0x2029 ||
+         (ch >= 0x000A && ch <= 0x000D) ||
+         (ch >= 0x2000 && ch <= 0x2006) || (ch >= 0x2008 && ch <= 0x200A);
+}
 
-/* Special paired characters for script detection */
-static size_t paired_len = 34;
-static const uint32_t paired_chars[] =
+/* Finds the line break opportunity before each character of the text, using
+ * the rules of UAX #14 for the classes above */
+static void
+_raqm_find_line_breaks (raqm_t  *rq,
+                        uint8_t *breaks)
 {
-  0x0028, 0x0029, /* ascii paired punctuation */
-  0x003c, 0x003e,
-  0x005b, 0x005d,
-  0x007b, 0x007d,
-  0x00ab, 0x00bb, /* guillemets */
-  0x2018, 0x2019, /* general punctuation */
-  0x201c, 0x201d,
-  0x2039, 0x203a,
-  0x3008, 0x3009, /* chinese paired punctuation */
-  0x300a, 0x300b,
-  0x300c, 0x300d,
-  0x300e, 0x300f,
-  0x3010, 0x3011,
-  0x3014, 0x3015,
-  0x3016, 0x3017,
-  0x3018, 0x3019,
-  0x301a, 0x301b
-};
+  _raqm_line_class_t prev = RAQM_LINE_CLASS_AL;
+  /* The class of the last character before any spaces preceding the
+   * current one */
+  _raqm_line_class_t before_spaces = RAQM_LINE_CLASS_AL;
+
+  for (size_t i = 0; i < rq->text_len; i++)
+  {
+    _raqm_line_class_t cls = _raqm_get_line_class (rq->text[i]);
+    _raqm_line_break_t brk = RAQM_LINE_BREAK_NONE;
+
+    if (i == 0)
+      brk = RAQM_LINE_BREAK_NONE; /* LB2 */
+    else if (prev == RAQM_LINE_CLASS_BK)
+      brk = RAQM_LINE_BREAK_MANDATORY; /* LB4 */
+    else if (prev == RAQM_LINE_CLASS_CR && cls == RAQM_LINE_CLASS_LF)
+      brk = RAQM_LINE_BREAK_NONE; /* LB5 */
+    else if (prev == RAQM_LINE_CLASS_CR || prev == RAQM_LINE_CLASS_LF)
+      brk = RAQM_LINE_BREAK_MANDATORY; /* LB5 */
+    else if (cls == RAQM_LINE_CLASS_BK || cls == RAQM_LINE_CLASS_CR ||
+             cls == RAQM_LINE_CLASS_LF)
+      brk = RAQM_LINE_BREAK_NONE; /* LB6 */
+    else if (cls == RAQM_LINE_CLASS_SP || cls == RAQM_LINE_CLASS_ZW)
+      brk = RAQM_LINE_BREAK_NONE; /* LB7 */
+    else if (before_spaces == RAQM_LINE_CLASS_ZW)
+      brk = RAQM_LINE_BREAK_ALLOWED; /* LB8 */
+    else if (cls == RAQM_LINE_CLASS_CM && prev != RAQM_LINE_CLASS_SP)
+      brk = RAQM_LINE_BREAK_NONE; /* LB9 */
+    else if (prev == RAQM_LINE_CLASS_GL)
+      brk = RAQM_LINE_BREAK_NONE; /* LB11, LB12 */
+    else if (cls == RAQM_LINE_CLASS_GL && prev != RAQM_LINE_CLASS_SP &&
+             prev != RAQM_LINE_CLASS_BA)
+      brk = RAQM_LINE_BREAK_NONE; /* LB11, LB12a */
+    else if (cls == RAQM_LINE_CLASS_CL)
+      brk = RAQM_LINE_BREAK_NONE; /* LB13 */
+    else if (before_spaces == RAQM_LINE_CLASS_OP)
+      brk = RAQM_LINE_BREAK_NONE; /* LB14 */
+    else if (prev == RAQM_LINE_CLASS_SP)
+      brk = RAQM_LINE_BREAK_ALLOWED; /* LB18 */
+    else if (cls == RAQM_LINE_CLASS_BA)
+      brk = RAQM_LINE_BREAK_NONE; /* LB21 */
+    else if (prev == RAQM_LINE_CLASS_BA)
+      brk = RAQM_LINE_BREAK_ALLOWED; /* LB31 */
+    else if (prev == RAQM_LINE_CLASS_ID || cls == RAQM_LINE_CLASS_ID)
+      brk = RAQM_LINE_BREAK_ALLOWED; /* LB31 */
+    else
+      brk = RAQM_LINE_BREAK_NONE; /* LB28 and the like */
+
+    breaks[i] = brk;
 
+    /* Combining marks take the class of their base (LB9), or are
+     * alphabetic when they have none (LB10) */
+    if (cls == RAQM_LINE_CLASS_CM)
+    {
+      if (i == 0 || prev == RAQM_LINE_CLASS_BK || prev == RAQM_LINE_CLASS_CR ||
+          prev == RAQM_LINE_CLASS_LF || prev == RAQM_LINE_CLASS_SP ||
+          prev == RAQM_LINE_CLASS_ZW)
+        cls = RAQM_LINE_CLASS_AL;
+      else
+        cls = prev;
+    }
+
+    if (cls != RAQM_LINE_CLASS_SP)
+      before_spaces = cls;
+    prev = cls;
+  }
+}
+
+static void
+_raqm_reshape_run (raqm_t     *rq,
+                   raqm_run_t *run)
+{
+  _raqm_shape_state state = { NULL };
+
+  _raqm_setup_run_buffer (rq, run);
+  _raqm_shape_run (rq, run);
+  _raqm_transform_run (run, &state);
+}
+
+/* Splits @run at the character @pos, inserting the run of the characters
+ * from @pos after it. The glyphs are split between the two runs, unless
+ * HarfBuzz says it is not safe to break there, in which case both runs are
+ * shaped again. */
+static bool
+_raqm_split_run (raqm_t     *rq,
+                 raqm_run_t *run,
+                 uint32_t    pos)
+{
+  bool backward = HB_DIRECTION_IS_BACKWARD (run->direction);
+  raqm_run_t *newrun;
+  hb_glyph_info_t *info;
+  hb_glyph_position_t *position;
+  unsigned int len, split, boundary;
+
+  newrun = _raqm_alloc_run (rq);
+  if (!newrun)
+    return false;
+
+  if (!newrun->buffer)
+    newrun->buffer = hb_buffer_create ();
+
+  newrun->pos = pos;
+  newrun->len = run->pos + run->len - pos;
+  newrun->direction = run->direction;
+  newrun->level = run->level;
+  newrun->script = run->script;
+  newrun->lang = run->lang;
+  newrun->font = hb_font_reference (run->font);
+  newrun->shape_reused = run->shape_reused;
+  newrun->shape_size_metrics = run->shape_size_metrics;
+  newrun->shape_matrix = run->shape_matrix;
+
+  run->len = pos - run->pos;
+  newrun->next = run->next;
+  run->next = newrun;
+
+  /* The glyphs of the characters before @pos come first in the buffer,
+   * except in backward runs */
+  info = hb_buffer_get_glyph_infos (run->buffer, &len);
+  position = hb_buffer_get_glyph_positions (run->buffer, NULL);
+  for (split = 0; split < len; split++)
+  {
+    if ((info[split].cluster >= pos) != backward)
+      break;
+  }
+
+  /* The first glyph of the cluster starting at @pos */
+  boundary = backward ? split - 1 : split;
+  if ((backward ? split > 0 : split < len) &&
+      (hb_glyph_info_get_glyph_flags (&info[boundary]) &
+       HB_GLYPH_FLAG_UNSAFE_TO_BREAK))
+  {
+    _raqm_reshape_run (rq, run);
+    _raqm_reshape_run (rq, newrun);
+    return true;
+  }
+
+  if (backward)
+  {
+    hb_buffer_append (newrun->buffer, run->buffer, 0, split);
+    memmove (info, info + split, sizeof (hb_glyph_info_t) * (len - split));
+    memmove (position, position + split,
+             sizeof (hb_glyph_position_t) * (len - split));
+    hb_buffer_set_length (run->buffer, len - split);
+  }
+  else
+  {
+    hb_buffer_append (newrun->buffer, run->buffer, split, len);
+    hb_buffer_set_length (run->buffer, split);
+  }
+
+  return true;
+}
+
+/* Makes *@run the run starting at @pos, splitting the run containing it if
+ * needed. *@run must not be after that run. */
+static bool
+_raqm_split_runs_at (raqm_t      *rq,
+                     raqm_run_t **run,
+                     size_t       pos)
+{
+  while (*run && (*run)->pos + (*run)->len <= pos)
+    *run = (*run)->next;
+
+  if (*run && (*run)->pos < pos)
+  {
+    if (!_raqm_split_run (rq, *run, pos))
+      return false;
+    *run = (*run)->next;
+  }
+
+  return true;
+}
+
+static int
+_raqm_compare_runs (const void *a,
+                    const void *b)
+{
+  const raqm_run_t *run_a = *(raqm_run_t * const *) a;
+  const raqm_run_t *run_b = *(raqm_run_t * const *) b;
+
+  if (run_a->pos < run_b->pos)
+    return -1;
+
+  return run_a->pos > run_b->pos;
+}
+
+/* L2. Reorders the runs of a line, given in logical order */
 static void
-_raqm_stack_free (_raqm_stack_t *stack)
+_raqm_reorder_line_runs (raqm_run_t **runs,
+                         size_t       count)
 {
-  free (stack->script);
-  free (stack->pair_index);
-  free (stack);
+  int max_level = 0;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    if (runs[i]->level > max_level)
+      max_level = runs[i]->level;
+  }
+
+  for (int level = max_level; level > 0; level--)
+  {
+    for (int i = count - 1; i >= 0; i--)
+    {
+      if (runs[i]->level >= level)
+      {
+        int end = i;
+        for (i--; (i >= 0 && runs[i]->level >= level); i--)
+            ;
+
+        for (int j = 0; j < (end - i) / 2; j++)
+        {
+          raqm_run_t *temp = runs[i + 1 + j];
+          runs[i + 1 + j] = runs[end - j];
+          runs[end - j] = temp;
+        }
+      }
+    }
+  }
 }
 
-/* Stack handling functions */
-static _raqm_stack_t *
-_raqm_stack_new (size_t max)
+static bool
+_raqm_add_line (raqm_t *rq,
+                size_t  start,
+                size_t  end)
 {
-  _raqm_stack_t *stack;
-  stack = calloc (1, sizeof (_raqm_stack_t));
-  if (!stack)
-    return NULL;
+  raqm_line_t *line;
 
-  stack->script = malloc (sizeof (hb_script_t) * max);
-  if (!stack->script)
+  if (rq->lines_len == rq->lines_capacity)
   {
-    _raqm_stack_free (stack);
-    return NULL;
-  }
+    size_t capacity = rq->lines_capacity ? rq->lines_capacity * 2 : 4;
+    void *new_mem = _raqm_realloc (rq, rq->lines,
+                                   sizeof (raqm_line_t) * capacity);
+    if (!new_mem)
+      return false;
 
-  stack->pair_index = malloc (sizeof (int) * max);
-  if (!stack->pair_index)
-  {
-    _raqm_stack_free (stack);
-    return NULL;
+    rq->lines = new_mem;
+    rq->lines_capacity = capacity;
   }
 
-  stack->size = 0;
-  stack->capacity = max;
+  line = &rq->lines[rq->lines_len++];
+  line->start = start;
+  line->len = end - start;
+  line->glyph_start = 0;
+  line->glyph_len = 0;
+  line->width = 0;
+  line->y = 0;
 
-  return stack;
+  return true;
 }
 
+/* Finds where the lines of the paragraph end, filling each line with as
+ * many characters as fit and breaking at the last opportunity before. Lines
+ * only end at the start of a cluster, which is marked in @cluster_starts. */
 static bool
-_raqm_stack_pop (_raqm_stack_t *stack)
+_raqm_find_lines (raqm_t  *rq,
+                  uint8_t *cluster_starts)
 {
-  if (!stack->size)
-  {
-    RAQM_DBG ("Stack is Empty\n");
+  int *advances;
+  uint8_t *breaks;
+  size_t line_start = 0, last_break = 0;
+  int64_t width = 0, break_width = 0;
+  bool mandatory = false;
+
+  advances = _raqm_scratch_alloc (rq, sizeof (int) * rq->text_len);
+  breaks = _raqm_scratch_alloc (rq, rq->text_len);
+  if (!advances || !breaks)
     return false;
-  }
 
-  stack->size--;
+  /* The advance of each cluster, in logical order */
+  memset (advances, 0, sizeof (int) * rq->text_len);
+  memset (cluster_starts, 0, rq->text_len);
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    unsigned int len;
+    hb_glyph_info_t *info = hb_buffer_get_glyph_infos (run->buffer, &len);
+    hb_glyph_position_t *position = hb_buffer_get_glyph_positions (run->buffer,
+                                                                   NULL);
 
-  return true;
-}
+    cluster_starts[run->pos] = true;
+    for (unsigned int i = 0; i < len; i++)
+    {
+      if (info[i].cluster < rq->text_len)
+      {
+        advances[info[i].cluster] += position[i].x_advance;
+        cluster_starts[info[i].cluster] = true;
+      }
+    }
+  }
 
-static hb_script_t
-_raqm_stack_top (_raqm_stack_t *stack)
-{
-  if (!stack->size)
+  _raqm_find_line_breaks (rq, breaks);
+
+  for (size_t i = 0; i < rq->text_len; i++)
   {
-    RAQM_DBG ("Stack is Empty\n");
-    return HB_SCRIPT_INVALID; /* XXX: check this */
+    /* A mandatory break inside a cluster moves to the end of the cluster */
+    if (i > line_start && breaks[i] == RAQM_LINE_BREAK_MANDATORY)
+      mandatory = true;
+
+    if (mandatory && cluster_starts[i])
+    {
+      if (!_raqm_add_line (rq, line_start, i))
+        return false;
+      line_start = last_break = i;
+      width = 0;
+      mandatory = false;
+    }
+    else if (i > line_start && breaks[i] == RAQM_LINE_BREAK_ALLOWED &&
+             cluster_starts[i])
+    {
+      last_break = i;
+      break_width = width;
+    }
+
+    /* Spaces at the end of a line do not count */
+    width += advances[i];
+    if (width > rq->line_width && last_break > line_start &&
+        !_raqm_is_line_space (rq->text[i]))
+    {
+      if (!_raqm_add_line (rq, line_start, last_break))
+        return false;
+      line_start = last_break;
+      width -= break_width;
+    }
   }
 
-  return stack->script[stack->size];
+  return _raqm_add_line (rq, line_start, rq->text_len);
 }
 
+/* Splits the runs at the ends of the lines and reorders them per line.
+ * @cluster_starts marks the characters starting a cluster, see
+ * _raqm_find_lines(). */
 static bool
-_raqm_stack_push (_raqm_stack_t *stack,
-                  hb_script_t    script,
-                  int            pair_index)
+_raqm_reorder_lines (raqm_t        *rq,
+                     const uint8_t *cluster_starts)
 {
-  if (stack->size == stack->capacity)
-  {
-    RAQM_DBG ("Stack is Full\n");
-    return false;
-  }
+  _raqm_bidi_level_t par_level = rq->resolved_dir == RAQM_DIRECTION_RTL;
+  raqm_run_t **runs, *run, *last;
+  size_t runs_len = 0;
 
-  stack->size++;
-  stack->script[stack->size] = script;
-  stack->pair_index[stack->size] = pair_index;
+  /* Put the runs in logical order */
+  for (run = rq->runs; run != NULL; run = run->next)
+    runs_len++;
 
-  return true;
-}
+  runs = _raqm_scratch_alloc (rq, sizeof (raqm_run_t *) * runs_len);
+  if (!runs)
+    return false;
 
-static int
-_get_pair_index (const uint32_t ch)
-{
-  int lower = 0;
-  int upper = paired_len - 1;
+  runs_len = 0;
+  for (run = rq->runs; run != NULL; run = run->next)
+    runs[runs_len++] = run;
 
-  while (lower <= upper)
+  qsort (runs, runs_len, sizeof (raqm_run_t *), _raqm_compare_runs);
+  for (size_t i = 0; i + 1 < runs_len; i++)
+    runs[i]->next = runs[i + 1];
+  runs[runs_len - 1]->next = NULL;
+  rq->runs = runs[0];
+
+  run = rq->runs;
+  for (size_t i = 0; i + 1 < rq->lines_len; i++)
   {
-    int mid = (lower + upper) / 2;
-    if (ch < paired_chars[mid])
-      upper = mid - 1;
-    else if (ch > paired_chars[mid])
-      lower = mid + 1;
-    else
-      return mid;
+    if (!_raqm_split_runs_at (rq, &run,
+                              rq->lines[i].start + rq->lines[i].len))
+      return false;
   }
 
-  return -1;
-}
+  /* L1. Reset the embedding levels of the white space at the end of each
+   * line, other than the last one whose levels the bidi algorithm set */
+  run = rq->runs;
+  for (size_t i = 0; i + 1 < rq->lines_len; i++)
+  {
+    size_t start = rq->lines[i].start;
+    size_t end = start + rq->lines[i].len;
+    size_t ws = end;
+    bool reset = false;
 
-#define STACK_IS_EMPTY(script)     ((script)->size <= 0)
-#define IS_OPEN(pair_index)        (((pair_index) & 1) == 0)
+    while (ws > start && _raqm_is_line_space (rq->text[ws - 1]))
+      ws--;
 
-/* Resolve the script for each character in the input string, if the character
- * script is common or inherited it takes the script of the character before it
- * except paired characters which we try to make them use the same script. We
- * then split the BiDi runs, if necessary, on script boundaries.
- */
-static bool
-_raqm_resolve_scripts (raqm_t *rq)
-{
-  int last_script_index = -1;
-  int last_set_index = -1;
-  hb_script_t last_script = HB_SCRIPT_INVALID;
-  _raqm_stack_t *stack = NULL;
-  hb_unicode_funcs_t* unicode_funcs = hb_unicode_funcs_get_default ();
+    /* Runs can only be split between clusters */
+    while (ws < end && !cluster_starts[ws])
+      ws++;
 
-  for (size_t i = 0; i < rq->text_len; ++i)
-    rq->text_info[i].script = hb_unicode_script (unicode_funcs, rq->text[i]);
+    if (ws == end)
+      continue;
 
-#ifdef RAQM_TESTING
-  RAQM_TEST ("Before script detection:\n");
-  for (size_t i = 0; i < rq->text_len; ++i)
-  {
-    SCRIPT_TO_STRING (rq->text_info[i].script);
-    RAQM_TEST ("script for ch[%zu]\t%s\n", i, buff);
-  }
-  RAQM_TEST ("\n");
-#endif
+    while (run->pos + run->len <= ws)
+      run = run->next;
 
-  stack = _raqm_stack_new (rq->text_len);
-  if (!stack)
-    return false;
+    for (raqm_run_t *r = run; r != NULL && r->pos < end; r = r->next)
+    {
+      if (r->pos + r->len > ws && r->level != par_level)
+        reset = true;
+    }
 
-  for (int i = 0; i < (int) rq->text_len; i++)
-  {
-    if (rq->text_info[i].script == HB_SCRIPT_COMMON && last_script_index != -1)
+    if (reset)
     {
-      int pair_index = _get_pair_index (rq->text[i]);
-      if (pair_index >= 0)
+      if (!_raqm_split_runs_at (rq, &run, ws))
+        return false;
+
+      /* The runs take the direction of the paragraph, and are shaped again
+       * in that direction if they had the other one */
+      for (; run != NULL && run->pos < end; run = run->next)
       {
-        if (IS_OPEN (pair_index))
-        {
-          /* is a paired character */
-          rq->text_info[i].script = last_script;
-          last_set_index = i;
-          _raqm_stack_push (stack, rq->text_info[i].script, pair_index);
-        }
-        else
+        hb_direction_t direction = _raqm_hb_dir (rq, par_level);
+
+        run->level = par_level;
+        if (run->direction != direction)
         {
-          /* is a close paired character */
-          /* find matching opening (by getting the last even index for current
-           * odd index) */
-          while (!STACK_IS_EMPTY (stack) &&
-                 stack->pair_index[stack->size] != (pair_index & ~1))
-          {
-            _raqm_stack_pop (stack);
-          }
-          if (!STACK_IS_EMPTY (stack))
-          {
-            rq->text_info[i].script = _raqm_stack_top (stack);
-            last_script = rq->text_info[i].script;
-            last_set_index = i;
-          }
-          else
-          {
-            rq->text_info[i].script = last_script;
-            last_set_index = i;
-          }
+          run->direction = direction;
+          _raqm_reshape_run (rq, run);
         }
       }
+    }
+  }
+
+  /* L2. Reorder the runs of each line */
+  runs_len = 0;
+  for (run = rq->runs; run != NULL; run = run->next)
+    runs_len++;
+
+  runs = _raqm_scratch_alloc (rq, sizeof (raqm_run_t *) * runs_len);
+  if (!runs)
+    return false;
+
+  run = rq->runs;
+  last = NULL;
+  for (size_t i = 0; i < rq->lines_len; i++)
+  {
+    size_t end = rq->lines[i].start + rq->lines[i].len;
+    size_t count = 0;
+
+    for (; run != NULL && run->pos < end; run = run->next)
+      runs[count++] = run;
+
+    _raqm_reorder_line_runs (runs, count);
+
+    for (size_t j = 0; j < count; j++)
+    {
+      if (last)
+        last->next = runs[j];
       else
-      {
-        rq->text_info[i].script = last_script;
-        last_set_index = i;
-      }
+        rq->runs = runs[j];
+      last = runs[j];
     }
-    else if (rq->text_info[i].script == HB_SCRIPT_INHERITED &&
-             last_script_index != -1)
+  }
+  if (last)
+    last->next = NULL;
+
+  return true;
+}
+
+/* Breaks the paragraph into lines, see raqm_set_line_width() */
+static bool
+_raqm_break_lines (raqm_t *rq)
+{
+  raqm_run_t *run;
+  size_t glyphs_count = 0;
+  int y = 0;
+
+  rq->lines_len = 0;
+
+  if (rq->line_width > 0 && rq->base_dir != RAQM_DIRECTION_TTB)
+  {
+    uint8_t *cluster_starts = _raqm_scratch_alloc (rq, rq->text_len);
+
+    if (!cluster_starts || !_raqm_find_lines (rq, cluster_starts))
+      return false;
+
+    if (rq->lines_len > 1 && !_raqm_reorder_lines (rq, cluster_starts))
+      return false;
+  }
+  else if (!_raqm_add_line (rq, 0, rq->text_len))
+  {
+    return false;
+  }
+
+  run = rq->runs;
+  for (size_t i = 0; i < rq->lines_len; i++)
+  {
+    raqm_line_t *line = &rq->lines[i];
+    FT_Pos height = 0;
+
+    line->glyph_start = glyphs_count;
+    for (; run != NULL && run->pos < line->start + line->len; run = run->next)
     {
-      rq->text_info[i].script = last_script;
-      last_set_index = i;
+      unsigned int len;
+      hb_glyph_position_t *position;
+      FT_Face ftface = hb_ft_font_get_face (run->font);
+
+      position = hb_buffer_get_glyph_positions (run->buffer, &len);
+      for (unsigned int j = 0; j < len; j++)
+        line->width += position[j].x_advance;
+      glyphs_count += len;
+
+      if (ftface->size && ftface->size->metrics.height > height)
+        height = ftface->size->metrics.height;
     }
-    else
+    line->glyph_len = glyphs_count - line->glyph_start;
+    line->y = y;
+    y += height;
+  }
+
+#ifdef RAQM_TESTING
+  if (rq->line_width > 0)
+  {
+    RAQM_TEST ("Lines:\n");
+    for (size_t i = 0; i < rq->lines_len; i++)
     {
-      for (int j = last_set_index + 1; j < i; ++j)
-        rq->text_info[j].script = rq->text_info[i].script;
-      last_script = rq->text_info[i].script;
-      last_script_index = i;
-      last_set_index = i;
+      RAQM_TEST ("line[%zu]:\t start: %zu\tlength: %zu\tglyphs: %zu\twidth: %d\ty: %d\n",
+                 i, rq->lines[i].start, rq->lines[i].len,
+                 rq->lines[i].glyph_len, rq->lines[i].width, rq->lines[i].y);
     }
+    RAQM_TEST ("\n");
   }
+#endif
 
-  /* Loop backwards and change any remaining Common or Inherit characters to
-   * take the script if the next character.
-   * https://github.com/HOST-Oman/libraqm/issues/95
-   */
-  for (int i = rq->text_len - 2; i >= 0;  --i)
+  return true;
+}
+
+/* Convert index from UTF-32 to UTF-8 */
+static uint32_t
+_raqm_u32_to_u8_index (raqm_t   *rq,
+                       uint32_t  index)
+{
+  if (index > rq->text_len)
+    return rq->text_utf8_len + (index - rq->text_len);
+
+  return rq->text_u32_to_u8[index];
+}
+
+/* Convert index from UTF-8 to UTF-32 */
+static uint32_t
+_raqm_u8_to_u32_index (raqm_t   *rq,
+                       uint32_t  index)
+{
+  if (index > rq->text_utf8_len)
+    return rq->text_len + (index - rq->text_utf8_len);
+
+  return rq->text_u8_to_u32[index];
+}
+
+/* Grapheme_Cluster_Break property values, in the order of the values of
+ * raqm-grapheme-table.h */
+typedef enum
+{
+  RAQM_GRAPHEM_OTHER,
+  RAQM_GRAPHEM_CR,
+  RAQM_GRAPHEM_LF,
+  RAQM_GRAPHEM_CONTROL,
+  RAQM_GRAPHEM_EXTEND,
+  RAQM_GRAPHEM_ZWJ,
+  RAQM_GRAPHEM_REGIONAL_INDICATOR,
+  RAQM_GRAPHEM_PREPEND,
+  RAQM_GRAPHEM_SPACING_MARK,
+  RAQM_GRAPHEM_L,
+  RAQM_GRAPHEM_V,
+  RAQM_GRAPHEM_T,
+  RAQM_GRAPHEM_LV,
+  RAQM_GRAPHEM_LVT,
+  RAQM_GRAPHEM_EXTENDED_PICTOGRAPHIC
+} _raqm_grapheme_t;
+
+static _raqm_grapheme_t
+_raqm_get_grapheme_break (hb_codepoint_t ch)
+{
+  uint8_t pair;
+
+  if (ch >= RAQM_GRAPHEME_TABLE_LEN)
+    return RAQM_GRAPHEM_OTHER;
+
+  pair = _raqm_grapheme_blocks[_raqm_grapheme_index[ch >> RAQM_GRAPHEME_TABLE_SHIFT]]
+                              [(ch & ((1 << RAQM_GRAPHEME_TABLE_SHIFT) - 1)) >> 1];
+
+  return (_raqm_grapheme_t) ((ch & 1) ? pair >> 4 : pair & 0x0F);
+}
+
+/* Whether a grapheme boundary is allowed between characters of the
+ * Grapheme_Cluster_Break properties @l and @r. @pict_zwj is set when @l is a
+ * ZWJ following an emoji and its extending characters, and @odd_ri when @l
+ * is an odd regional indicator of a sequence of them. */
+static bool
+_raqm_allowed_grapheme_boundary (_raqm_grapheme_t l,
+                                 _raqm_grapheme_t r,
+                                 bool             pict_zwj,
+                                 bool             odd_ri)
+{
+  if (l == RAQM_GRAPHEM_CR && r == RAQM_GRAPHEM_LF)
+    return false; /*Do not break between a CR and LF GB3*/
+  if (l == RAQM_GRAPHEM_CONTROL || l == RAQM_GRAPHEM_CR ||
+      l == RAQM_GRAPHEM_LF || r == RAQM_GRAPHEM_CONTROL ||
+      r == RAQM_GRAPHEM_CR || r == RAQM_GRAPHEM_LF)
+    return true; /*Break before and after CONTROL GB4, GB5*/
+  if (l == RAQM_GRAPHEM_L &&
+      (r == RAQM_GRAPHEM_L || r == RAQM_GRAPHEM_V ||
+       r == RAQM_GRAPHEM_LV || r == RAQM_GRAPHEM_LVT))
+    return false; /*Do not break Hangul syllable sequences. GB6*/
+  if ((l == RAQM_GRAPHEM_LV || l == RAQM_GRAPHEM_V) &&
+      (r == RAQM_GRAPHEM_V || r == RAQM_GRAPHEM_T))
+    return false; /*GB7*/
+  if ((l == RAQM_GRAPHEM_LVT || l == RAQM_GRAPHEM_T) && r == RAQM_GRAPHEM_T)
+    return false; /*GB8*/
+  if (r == RAQM_GRAPHEM_EXTEND || r == RAQM_GRAPHEM_ZWJ)
+    return false; /*Do not break before extending characters or ZWJ. GB9*/
+  /*Do not break before SpacingMarks, or after Prepend characters.GB9a, GB9b*/
+  if (r == RAQM_GRAPHEM_SPACING_MARK)
+    return false;
+  if (l == RAQM_GRAPHEM_PREPEND)
+    return false;
+  if (pict_zwj && r == RAQM_GRAPHEM_EXTENDED_PICTOGRAPHIC)
+    return false; /*Do not break within emoji ZWJ sequences. GB11*/
+  if (odd_ri && r == RAQM_GRAPHEM_REGIONAL_INDICATOR)
+    return false; /*Do not break within emoji flag sequences. GB12, GB13*/
+  return true; /*Otherwise, break everywhere. GB999*/
+}
+
+/* Find the grapheme boundaries of the text, if the text changed since they
+ * were last found: bit i of rq->grapheme_breaks is set when a boundary is
+ * allowed after the character at index i. */
+static bool
+_raqm_build_grapheme_breaks (raqm_t *rq)
+{
+  size_t words = (rq->text_len + 31) / 32;
+  uint32_t *breaks;
+  _raqm_grapheme_t l, r = RAQM_GRAPHEM_OTHER;
+  bool in_pict = false, pict_zwj = false;
+  size_t ri_count = 0;
+
+  if (rq->grapheme_breaks_valid)
+    return true;
+
+  if (words > rq->grapheme_breaks_capacity)
   {
-    if (rq->text_info[i].script == HB_SCRIPT_INHERITED ||
-        rq->text_info[i].script == HB_SCRIPT_COMMON)
-      rq->text_info[i].script = rq->text_info[i + 1].script;
+    breaks = _raqm_realloc (rq, rq->grapheme_breaks,
+                            sizeof (uint32_t) * words);
+    if (!breaks)
+      return false;
+
+    rq->grapheme_breaks = breaks;
+    rq->grapheme_breaks_capacity = words;
   }
 
-#ifdef RAQM_TESTING
-  RAQM_TEST ("After script detection:\n");
-  for (size_t i = 0; i < rq->text_len; ++i)
+  breaks = rq->grapheme_breaks;
+  memset (breaks, 0, sizeof (uint32_t) * words);
+
+  if (rq->text_len)
+    r = _raqm_get_grapheme_break (rq->text[0]);
+
+  for (size_t i = 0; i + 1 < rq->text_len; i++)
   {
-    SCRIPT_TO_STRING (rq->text_info[i].script);
-    RAQM_TEST ("script for ch[%zu]\t%s\n", i, buff);
+    l = r;
+    r = _raqm_get_grapheme_break (rq->text[i + 1]);
+
+    /* State for GB11: whether the text up to here is an emoji followed by
+     * extending characters, and then a ZWJ */
+    pict_zwj = l == RAQM_GRAPHEM_ZWJ && in_pict;
+    in_pict = l == RAQM_GRAPHEM_EXTENDED_PICTOGRAPHIC ||
+              (in_pict && l == RAQM_GRAPHEM_EXTEND);
+    /* State for GB12 and GB13: the length of the regional indicator
+     * sequence ending here */
+    ri_count = l == RAQM_GRAPHEM_REGIONAL_INDICATOR ? ri_count + 1 : 0;
+
+    if (_raqm_allowed_grapheme_boundary (l, r, pict_zwj, ri_count & 1))
+      breaks[i / 32] |= (uint32_t) 1 << (i % 32);
   }
-  RAQM_TEST ("\n");
-#endif
 
-  _raqm_stack_free (stack);
+  if (rq->text_len)
+  {
+    size_t last = rq->text_len - 1;
+    breaks[last / 32] |= (uint32_t) 1 << (last % 32);
+  }
 
+  rq->grapheme_breaks_valid = true;
   return true;
 }
 
-static void
-_raqm_ft_transform (int      *x,
-                    int      *y,
-                    FT_Matrix matrix)
+/* Whether a grapheme boundary is allowed after the character at @index, the
+ * end of the text always being one. Needs _raqm_build_grapheme_breaks (). */
+static bool
+_raqm_grapheme_boundary_after (raqm_t *rq,
+                               size_t  index)
 {
-  FT_Vector vector;
-  vector.x = *x;
-  vector.y = *y;
+  if (index + 1 >= rq->text_len)
+    return true;
+
+  return (rq->grapheme_breaks[index / 32] >> (index % 32)) & 1;
+}
+
+/* Index of the last character of the grapheme containing @index */
+static size_t
+_raqm_grapheme_end (raqm_t *rq,
+                    size_t  index)
+{
+  while (index < rq->text_len)
+  {
+    if (_raqm_grapheme_boundary_after (rq, index))
+      break;
 
-  FT_Vector_Transform (&vector, &matrix);
+    ++index;
+  }
 
-  *x = vector.x;
-  *y = vector.y;
+  return index;
 }
 
+#define RAQM_CURSOR_NO_GLYPH UINT32_MAX
+
+/* Builds the cursor index of the current layout: the glyphs in visual order
+ * with their pen positions, and for each character the first of these glyphs
+ * whose cluster range contains it. */
 static bool
-_raqm_shape (raqm_t *rq)
+_raqm_build_cursor_index (raqm_t *rq)
 {
-  hb_buffer_flags_t hb_buffer_flags = HB_BUFFER_FLAG_BOT | HB_BUFFER_FLAG_EOT;
+  _raqm_cursor_glyph *glyphs;
+  uint32_t *char_glyphs;
+  size_t count = 0, g = 0, line = 0;
+  int x = 0, y = 0, max_end = INT_MIN;
 
-  if (rq->invisible_glyph < 0)
-    hb_buffer_flags |= HB_BUFFER_FLAG_REMOVE_DEFAULT_IGNORABLES;
+  if (!_raqm_build_grapheme_breaks (rq))
+    return false;
+
+  if (rq->cursor_index_valid)
+    return true;
 
   for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+    count += hb_buffer_get_length (run->buffer);
+
+  if (count >= RAQM_CURSOR_NO_GLYPH)
+    return false;
+
+  if (count > rq->cursor_glyphs_capacity)
+  {
+    glyphs = _raqm_realloc (rq, rq->cursor_glyphs,
+                            sizeof (_raqm_cursor_glyph) * count);
+    if (!glyphs)
+      return false;
+
+    rq->cursor_glyphs = glyphs;
+    rq->cursor_glyphs_capacity = count;
+  }
+
+  if (rq->text_len > rq->cursor_char_glyphs_capacity)
   {
-    if (!run->buffer)
-      run->buffer = hb_buffer_create ();
+    char_glyphs = _raqm_realloc (rq, rq->cursor_char_glyphs,
+                                 sizeof (uint32_t) * rq->text_len);
+    if (!char_glyphs)
+      return false;
+
+    rq->cursor_char_glyphs = char_glyphs;
+    rq->cursor_char_glyphs_capacity = rq->text_len;
+  }
 
-    hb_buffer_add_utf32 (run->buffer, rq->text, rq->text_len,
-                         run->pos, run->len);
-    hb_buffer_set_script (run->buffer, run->script);
-    hb_buffer_set_language (run->buffer, rq->text_info[run->pos].lang);
-    hb_buffer_set_direction (run->buffer, run->direction);
-    hb_buffer_set_flags (run->buffer, hb_buffer_flags);
+  glyphs = rq->cursor_glyphs;
+  char_glyphs = rq->cursor_char_glyphs;
 
-    if (rq->invisible_glyph > 0)
-      hb_buffer_set_invisible_glyph (run->buffer, rq->invisible_glyph);
+  for (size_t i = 0; i < rq->text_len; i++)
+    char_glyphs[i] = RAQM_CURSOR_NO_GLYPH;
 
-    hb_shape_full (run->font, run->buffer, rq->features, rq->features_len,
-                   NULL);
+  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  {
+    size_t len;
+    hb_glyph_info_t *info;
+    hb_glyph_position_t *position;
+    len = hb_buffer_get_length (run->buffer);
+    info = hb_buffer_get_glyph_infos (run->buffer, NULL);
+    position = hb_buffer_get_glyph_positions (run->buffer, NULL);
 
+    /* Lines start at zero, and don't share runs */
+    while (line + 1 < rq->lines_len && g >= rq->lines[line + 1].glyph_start)
     {
-      FT_Matrix matrix;
-      hb_glyph_position_t *pos;
-      unsigned int len;
+      line++;
+      x = 0;
+      y = rq->lines[line].y;
+      max_end = INT_MIN;
+    }
 
-      FT_Get_Transform (hb_ft_font_get_face (run->font), &matrix, NULL);
-      pos = hb_buffer_get_glyph_positions (run->buffer, &len);
-      for (unsigned int i = 0; i < len; i++)
+    for (size_t i = 0; i < len; i++, g++)
+    {
+      uint32_t curr_cluster = info[i].cluster;
+      uint32_t next_cluster = curr_cluster;
+
+      /* The cluster following this one in logical order */
+      if (run->direction == HB_DIRECTION_LTR)
       {
-        _raqm_ft_transform (&pos[i].x_advance, &pos[i].y_advance, matrix);
-        _raqm_ft_transform (&pos[i].x_offset, &pos[i].y_offset, matrix);
+        for (size_t j = i + 1; j < len && next_cluster == curr_cluster; j++)
+          next_cluster = info[j].cluster;
+      }
+      else
+      {
+        for (int j = i - 1; i != 0 && j >= 0 && next_cluster == curr_cluster;
+             j--)
+          next_cluster = info[j].cluster;
       }
-    }
-  }
 
-  return true;
-}
+      if (next_cluster == curr_cluster)
+        next_cluster = run->pos + run->len;
 
-/* Count equivalent UTF-8 bytes in codepoint */
-static size_t
-_raqm_count_codepoint_utf8_bytes (uint32_t chr)
-{
-  if (0 == ((uint32_t) 0xffffff80 & chr))
-    return 1;
-  else if (0 == ((uint32_t) 0xfffff800 & chr))
-    return 2;
-  else if (0 == ((uint32_t) 0xffff0000 & chr))
-    return 3;
-  else
-    return 4;
-}
+      glyphs[g].x = x;
+      glyphs[g].y = y;
+      glyphs[g].x_advance = position[i].x_advance;
+      glyphs[g].cluster = curr_cluster;
+      glyphs[g].next_cluster = next_cluster;
+      glyphs[g].run = run;
 
-/* Convert index from UTF-32 to UTF-8 */
-static uint32_t
-_raqm_u32_to_u8_index (raqm_t   *rq,
-                       uint32_t  index)
-{
-  size_t length = 0;
+      x += position[i].x_advance;
+      if (x > max_end)
+        max_end = x;
+      glyphs[g].max_end = max_end;
+
+      for (size_t c = curr_cluster; c < next_cluster && c < rq->text_len; c++)
+      {
+        if (char_glyphs[c] == RAQM_CURSOR_NO_GLYPH)
+          char_glyphs[c] = g;
+      }
+    }
+  }
 
-  for (uint32_t i = 0; i < index; ++i)
-    length += _raqm_count_codepoint_utf8_bytes (rq->text[i]);
+  rq->cursor_glyphs_len = count;
+  rq->cursor_end_x = x;
+  rq->cursor_end_y = y;
+  rq->cursor_index_valid = true;
 
-  return length;
+  return true;
 }
 
-/* Convert index from UTF-8 to UTF-32 */
-static uint32_t
-_raqm_u8_to_u32_index (raqm_t   *rq,
-                       uint32_t  index)
+/* Cursor position after the grapheme ending at @index, see
+ * raqm_index_to_position() */
+static void
+_raqm_cursor_position (raqm_t *rq,
+                       size_t *index,
+                       int    *x,
+                       int    *y)
 {
-  const unsigned char *s = (const unsigned char *) rq->text_utf8;
-  const unsigned char *t = s;
-  size_t length = 0;
+  uint32_t g = rq->cursor_char_glyphs[*index];
+  _raqm_cursor_glyph *glyph;
 
-  while (((size_t) (s - t) < index) && ('\0' != *s))
+  if (g == RAQM_CURSOR_NO_GLYPH)
   {
-    if (0xf0 == (0xf8 & *s))
-      s += 4;
-    else if (0xe0 == (0xf0 & *s))
-      s += 3;
-    else if (0xc0 == (0xe0 & *s))
-      s += 2;
-    else
-      s += 1;
-
-    length++;
+    *x = rq->cursor_end_x;
+    *y = rq->cursor_end_y;
+    return;
   }
 
-  if ((size_t) (s-t) > index)
-    length--;
-
-  return length;
+  glyph = &rq->cursor_glyphs[g];
+  *x = glyph->x;
+  *y = glyph->y;
+  if (glyph->run->direction != HB_DIRECTION_RTL)
+    *x += glyph->x_advance;
+  *index = glyph->cluster;
 }
 
-static bool
-_raqm_allowed_grapheme_boundary (hb_codepoint_t l_char,
-                                hb_codepoint_t r_char);
-
-static bool
-_raqm_in_hangul_syllable (hb_codepoint_t ch);
-
 /**
  * raqm_index_to_position:
  * @rq: a #raqm_t.
@@ -1996,6 +8224,9 @@ _raqm_in_hangul_syllable (hb_codepoint_t ch);
  * is right-to-left, then the cursor will be at the left of it, whereas if the
  * character is left-to-right, then the cursor will be at the right of it.
  *
+ * The position is relative to the start of the line of the character, and @y
+ * is the position of that line, see #raqm_line_t.
+ *
  * Return value:
  * `true` if the process was successful, `false` otherwise.
  *
@@ -2007,74 +8238,123 @@ raqm_index_to_position (raqm_t *rq,
                         int *x,
                         int *y)
 {
-  /* We don't currently support multiline, so y is always 0 */
   *y = 0;
   *x = 0;
 
   if (rq == NULL)
     return false;
 
-  if (rq->text_utf8)
+  if (rq->text_u8_to_u32)
     *index = _raqm_u8_to_u32_index (rq, *index);
 
   if (*index >= rq->text_len)
     return false;
 
+  if (!_raqm_build_cursor_index (rq))
+    return false;
+
   RAQM_TEST ("\n");
 
-  while (*index < rq->text_len)
-  {
-    if (_raqm_allowed_grapheme_boundary (rq->text[*index], rq->text[*index + 1]))
-      break;
+  *index = _raqm_grapheme_end (rq, *index);
+  _raqm_cursor_position (rq, index, x, y);
 
-    ++*index;
-  }
+  if (rq->text_u8_to_u32)
+    *index = _raqm_u32_to_u8_index (rq, *index);
+  RAQM_TEST ("The position is %d at index %zu\n",*x ,*index);
+  return true;
+}
 
-  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+/**
+ * raqm_get_grapheme_positions:
+ * @rq: a #raqm_t.
+ * @indices: (out) (nullable): output character indices.
+ * @x: (out) (nullable): output x positions.
+ * @y: (out) (nullable): output y positions.
+ * @length: (inout): the length of the output arrays on input, and the number
+ * of graphemes on output.
+ *
+ * Calculates the cursor positions of all graphemes of the text at once. For
+ * the grapheme at position `i` in logical order, @indices[i], @x[i] and @y[i]
+ * are the same as the output of raqm_index_to_position() for the first
+ * character of the grapheme, but this takes time proportional to the text
+ * length instead of each call doing so.
+ *
+ * The output arrays can be %NULL to get only the number of graphemes.
+ *
+ * Return value:
+ * `true` if the positions were written to the non-%NULL arrays, `false` if
+ * the arrays are too short or an error happened.
+ *
+ * Since: 0.10
+ */
+bool
+raqm_get_grapheme_positions (raqm_t *rq,
+                             size_t *indices,
+                             int    *x,
+                             int    *y,
+                             size_t *length)
+{
+  size_t capacity, count = 0;
+
+  if (!rq || !length)
+    return false;
+
+  if (!_raqm_build_cursor_index (rq))
+    return false;
+
+  capacity = *length;
+
+  for (size_t start = 0; start < rq->text_len; count++)
   {
-    size_t len;
-    hb_glyph_info_t *info;
-    hb_glyph_position_t *position;
-    len = hb_buffer_get_length (run->buffer);
-    info = hb_buffer_get_glyph_infos (run->buffer, NULL);
-    position = hb_buffer_get_glyph_positions (run->buffer, NULL);
+    size_t index = _raqm_grapheme_end (rq, start);
+    int pos_x, pos_y;
 
-    for (size_t i = 0; i < len; i++)
+    start = index + 1;
+    if (count >= capacity)
+      continue;
+
+    _raqm_cursor_position (rq, &index, &pos_x, &pos_y);
+
+    if (indices)
     {
-      uint32_t curr_cluster = info[i].cluster;
-      uint32_t next_cluster = curr_cluster;
-      *x += position[i].x_advance;
+      if (rq->text_u8_to_u32)
+        index = _raqm_u32_to_u8_index (rq, index);
+      indices[count] = index;
+    }
+    if (x)
+      x[count] = pos_x;
+    if (y)
+      y[count] = pos_y;
+  }
 
-      if (run->direction == HB_DIRECTION_LTR)
-      {
-        for (size_t j = i + 1; j < len && next_cluster == curr_cluster; j++)
-          next_cluster = info[j].cluster;
-      }
-      else
-      {
-        for (int j = i - 1; i != 0 && j >= 0 && next_cluster == curr_cluster;
-             j--)
-          next_cluster = info[j].cluster;
-      }
+  *length = count;
 
-      if (next_cluster == curr_cluster)
-        next_cluster = run->pos + run->len;
+  return count <= capacity;
+}
 
-      if (*index < next_cluster && *index >= curr_cluster)
-      {
-        if (run->direction == HB_DIRECTION_RTL)
-          *x -= position[i].x_advance;
-        *index = curr_cluster;
-        goto found;
-      }
-    }
+/* Glyph at which raqm_position_to_index() stops for @x, between @low and
+ * @high: the first one in visual order whose right edge is past @x, or
+ * @high if none is */
+static size_t
+_raqm_cursor_glyph_at (raqm_t *rq,
+                       int     x,
+                       size_t  low,
+                       size_t  high)
+{
+  /* max_end is sorted while the right edges might not be, there being
+   * negative advances, but the first glyph to have either past @x is the
+   * same. */
+  while (low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+
+    if (x < rq->cursor_glyphs[mid].max_end)
+      high = mid;
+    else
+      low = mid + 1;
   }
 
-found:
-  if (rq->text_utf8)
-    *index = _raqm_u32_to_u8_index (rq, *index);
-  RAQM_TEST ("The position is %d at index %zu\n",*x ,*index);
-  return true;
+  return low;
 }
 
 /**
@@ -2088,6 +8368,9 @@ found:
  * If the position is outside the text, the last character is chosen as
  * @index.
  *
+ * @y selects the line, the last one whose position is not below @y, see
+ * #raqm_line_t, and @x is relative to the start of that line.
+ *
  * Return value:
  * `true` if the process was successful, `false` in case of error.
  *
@@ -2099,230 +8382,89 @@ raqm_position_to_index (raqm_t *rq,
                         int y,
                         size_t *index)
 {
-  int delta_x = 0, current_x = 0;
-  (void)y;
+  size_t line = 0, line_start = 0, line_end, glyphs_start, glyphs_end, g;
 
   if (rq == NULL)
     return false;
 
+  line_end = rq->text_len;
+  while (line + 1 < rq->lines_len && rq->lines[line + 1].y <= y)
+    line++;
+  if (rq->lines_len)
+  {
+    line_start = rq->lines[line].start;
+    line_end = line_start + rq->lines[line].len;
+  }
+
   if (x < 0) /* Get leftmost index */
   {
     if (rq->resolved_dir == RAQM_DIRECTION_RTL)
-      *index = rq->text_len;
+      *index = line_end;
     else
-      *index = 0;
+      *index = line_start;
     return true;
   }
 
+  if (!_raqm_build_cursor_index (rq))
+    return false;
+
   RAQM_TEST ("\n");
 
-  for (raqm_run_t *run = rq->runs; run != NULL; run = run->next)
+  glyphs_start = 0;
+  glyphs_end = rq->cursor_glyphs_len;
+  if (rq->lines_len)
   {
-    size_t len;
-    hb_glyph_info_t *info;
-    hb_glyph_position_t *position;
-    len = hb_buffer_get_length (run->buffer);
-    info = hb_buffer_get_glyph_infos (run->buffer, NULL);
-    position = hb_buffer_get_glyph_positions (run->buffer, NULL);
- 
-    for (size_t i = 0; i < len; i++)
-    {
-      delta_x = position[i].x_advance;
-      if (x < (current_x + delta_x))
-      {
-        bool before = false;
-        if (run->direction == HB_DIRECTION_LTR)
-          before = (x < current_x + (delta_x / 2));
-        else
-          before = (x > current_x + (delta_x / 2));
+    glyphs_start = rq->lines[line].glyph_start;
+    glyphs_end = glyphs_start + rq->lines[line].glyph_len;
+  }
 
-        if (before)
-          *index = info[i].cluster;
-        else
-        {
-          uint32_t curr_cluster = info[i].cluster;
-          uint32_t next_cluster = curr_cluster;
-          if (run->direction == HB_DIRECTION_LTR)
-            for (size_t j = i + 1; j < len && next_cluster == curr_cluster; j++)
-              next_cluster = info[j].cluster;
-          else
-          for (int j = i - 1; i != 0 && j >= 0 && next_cluster == curr_cluster;
-                 j--)
-              next_cluster = info[j].cluster;
+  g = _raqm_cursor_glyph_at (rq, x, glyphs_start, glyphs_end);
+  if (g < glyphs_end)
+  {
+    _raqm_cursor_glyph *glyph = &rq->cursor_glyphs[g];
+    raqm_run_t *run = glyph->run;
+    bool before = false;
 
-          if (next_cluster == curr_cluster)
-            next_cluster = run->pos + run->len;
+    if (run->direction == HB_DIRECTION_LTR)
+      before = (x < glyph->x + (glyph->x_advance / 2));
+    else
+      before = (x > glyph->x + (glyph->x_advance / 2));
 
-          *index = next_cluster;
-        }
-        if (_raqm_allowed_grapheme_boundary (rq->text[*index],rq->text[*index + 1]))
-        {
-          RAQM_TEST ("The start-index is %zu  at position %d \n", *index, x);
-            return true;
-        }
+    if (before)
+      *index = glyph->cluster;
+    else
+      *index = glyph->next_cluster;
 
-        while (*index < (unsigned)run->pos + run->len)
-        {
-          if (_raqm_allowed_grapheme_boundary (rq->text[*index],
-                                               rq->text[*index + 1]))
-          {
-            *index += 1;
-            break;
-          }
-          *index += 1;
-        }
-        RAQM_TEST ("The start-index is %zu  at position %d \n", *index, x);
-        return true;
+    if (*index >= rq->text_len || _raqm_grapheme_boundary_after (rq, *index))
+    {
+      RAQM_TEST ("The start-index is %zu  at position %d \n", *index, x);
+      return true;
+    }
+
+    while (*index < (unsigned)run->pos + run->len)
+    {
+      if (_raqm_grapheme_boundary_after (rq, *index))
+      {
+        *index += 1;
+        break;
       }
-      else
-        current_x += delta_x;
+      *index += 1;
     }
+    RAQM_TEST ("The start-index is %zu  at position %d \n", *index, x);
+    return true;
   }
 
   /* Get rightmost index*/
   if (rq->resolved_dir == RAQM_DIRECTION_RTL)
-    *index = 0;
+    *index = line_start;
   else
-    *index = rq->text_len;
+    *index = line_end;
 
   RAQM_TEST ("The start-index is %zu  at position %d \n", *index, x);
 
   return true;
 }
 
-typedef enum
-{
-  RAQM_GRAPHEM_CR,
-  RAQM_GRAPHEM_LF,
-  RAQM_GRAPHEM_CONTROL,
-  RAQM_GRAPHEM_EXTEND,
-  RAQM_GRAPHEM_REGIONAL_INDICATOR,
-  RAQM_GRAPHEM_PREPEND,
-  RAQM_GRAPHEM_SPACING_MARK,
-  RAQM_GRAPHEM_HANGUL_SYLLABLE,
-  RAQM_GRAPHEM_OTHER
-} _raqm_grapheme_t;
-
-static _raqm_grapheme_t
-_raqm_get_grapheme_break (hb_codepoint_t ch,
-                          hb_unicode_general_category_t category);
-
-static bool
-_raqm_allowed_grapheme_boundary (hb_codepoint_t l_char,
-                                 hb_codepoint_t r_char)
-{
-  hb_unicode_general_category_t l_category;
-  hb_unicode_general_category_t r_category;
-  _raqm_grapheme_t l_grapheme, r_grapheme;
-  hb_unicode_funcs_t* unicode_funcs = hb_unicode_funcs_get_default ();
-
-  l_category = hb_unicode_general_category (unicode_funcs, l_char);
-  r_category = hb_unicode_general_category (unicode_funcs, r_char);
-  l_grapheme = _raqm_get_grapheme_break (l_char, l_category);
-  r_grapheme = _raqm_get_grapheme_break (r_char, r_category);
-
-  if (l_grapheme == RAQM_GRAPHEM_CR && r_grapheme == RAQM_GRAPHEM_LF)
-    return false; /*Do not break between a CR and LF GB3*/
-  if (l_grapheme == RAQM_GRAPHEM_CONTROL || l_grapheme == RAQM_GRAPHEM_CR ||
-      l_grapheme == RAQM_GRAPHEM_LF || r_grapheme == RAQM_GRAPHEM_CONTROL ||
-      r_grapheme == RAQM_GRAPHEM_CR || r_grapheme == RAQM_GRAPHEM_LF)
-    return true; /*Break before and after CONTROL GB4, GB5*/
-  if (r_grapheme == RAQM_GRAPHEM_HANGUL_SYLLABLE)
-    return false; /*Do not break Hangul syllable sequences. GB6, GB7, GB8*/
-  if (l_grapheme == RAQM_GRAPHEM_REGIONAL_INDICATOR &&
-      r_grapheme == RAQM_GRAPHEM_REGIONAL_INDICATOR)
-    return false; /*Do not break between regional indicator symbols. GB8a*/
-  if (r_grapheme == RAQM_GRAPHEM_EXTEND)
-    return false; /*Do not break before extending characters. GB9*/
-  /*Do not break before SpacingMarks, or after Prepend characters.GB9a, GB9b*/
-  if (l_grapheme == RAQM_GRAPHEM_PREPEND)
-    return false;
-  if (r_grapheme == RAQM_GRAPHEM_SPACING_MARK)
-    return false;
-  return true; /*Otherwise, break everywhere. GB1, GB2, GB10*/
-}
-
-static _raqm_grapheme_t
-_raqm_get_grapheme_break (hb_codepoint_t ch,
-                          hb_unicode_general_category_t category)
-{
-  _raqm_grapheme_t gb_type;
-
-  gb_type = RAQM_GRAPHEM_OTHER;
-  switch ((int)category)
-  {
-    case HB_UNICODE_GENERAL_CATEGORY_FORMAT:
-      if (ch == 0x200C || ch == 0x200D)
-        gb_type = RAQM_GRAPHEM_EXTEND;
-      else
-        gb_type = RAQM_GRAPHEM_CONTROL;
-      break;
-
-    case HB_UNICODE_GENERAL_CATEGORY_CONTROL:
-      if (ch == 0x000D)
-        gb_type = RAQM_GRAPHEM_CR;
-      else if (ch == 0x000A)
-        gb_type = RAQM_GRAPHEM_LF;
-      else
-        gb_type = RAQM_GRAPHEM_CONTROL;
-      break;
-
-    case HB_UNICODE_GENERAL_CATEGORY_SURROGATE:
-    case HB_UNICODE_GENERAL_CATEGORY_LINE_SEPARATOR:
-    case HB_UNICODE_GENERAL_CATEGORY_PARAGRAPH_SEPARATOR:
-    case HB_UNICODE_GENERAL_CATEGORY_UNASSIGNED:
-      if ((ch >= 0xFFF0 && ch <= 0xFFF8) ||
-          (ch >= 0xE0000 && ch <= 0xE0FFF))
-        gb_type = RAQM_GRAPHEM_CONTROL;
-      break;
-
-    case HB_UNICODE_GENERAL_CATEGORY_NON_SPACING_MARK:
-    case HB_UNICODE_GENERAL_CATEGORY_ENCLOSING_MARK:
-    case HB_UNICODE_GENERAL_CATEGORY_SPACING_MARK:
-      if (ch != 0x102B && ch != 0x102C && ch != 0x1038 &&
-          (ch < 0x1062 || ch > 0x1064) && (ch < 0x1067 || ch > 0x106D) &&
-          ch != 0x1083 && (ch < 0x1087 || ch > 0x108C) && ch != 0x108F &&
-          (ch < 0x109A || ch > 0x109C) && ch != 0x1A61 && ch != 0x1A63 &&
-          ch != 0x1A64 && ch != 0xAA7B && ch != 0xAA70 && ch != 0x11720 &&
-          ch != 0x11721) /**/
-        gb_type = RAQM_GRAPHEM_SPACING_MARK;
-
-      else if (ch == 0x09BE || ch == 0x09D7 ||
-          ch == 0x0B3E || ch == 0x0B57 || ch == 0x0BBE || ch == 0x0BD7 ||
-          ch == 0x0CC2 || ch == 0x0CD5 || ch == 0x0CD6 ||
-          ch == 0x0D3E || ch == 0x0D57 || ch == 0x0DCF || ch == 0x0DDF ||
-          ch == 0x1D165 || (ch >= 0x1D16E && ch <= 0x1D172))
-        gb_type = RAQM_GRAPHEM_EXTEND;
-      break;
-
-    case HB_UNICODE_GENERAL_CATEGORY_OTHER_LETTER:
-      if (ch == 0x0E33 || ch == 0x0EB3)
-        gb_type = RAQM_GRAPHEM_SPACING_MARK;
-      break;
-
-    case HB_UNICODE_GENERAL_CATEGORY_OTHER_SYMBOL:
-      if (ch >= 0x1F1E6 && ch <= 0x1F1FF)
-        gb_type = RAQM_GRAPHEM_REGIONAL_INDICATOR;
-      break;
-
-    default:
-      gb_type = RAQM_GRAPHEM_OTHER;
-      break;
-  }
-
-  if (_raqm_in_hangul_syllable (ch))
-    gb_type = RAQM_GRAPHEM_HANGUL_SYLLABLE;
-
-  return gb_type;
-}
-
-static bool
-_raqm_in_hangul_syllable (hb_codepoint_t ch)
-{
-  (void)ch;
-  return false;
-}
-
 /**
  * raqm_version:
  * @major: (out): Library major version component.
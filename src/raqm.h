@@ -55,6 +55,65 @@ extern "C" {
  */
 typedef struct _raqm raqm_t;
 
+/**
+ * raqm_font_cache_t:
+ *
+ * A cache of HarfBuzz font objects keyed by #FT_Face and FreeType load flags,
+ * that can be shared between several #raqm_t objects. See
+ * raqm_font_cache_create().
+ *
+ * Since: 0.10
+ */
+typedef struct _raqm_font_cache raqm_font_cache_t;
+
+/**
+ * raqm_layout_result_t:
+ *
+ * An immutable copy of the output of a layout, that can be shared between
+ * threads. See raqm_freeze_layout().
+ *
+ * Since: 0.10
+ */
+typedef struct _raqm_layout_result raqm_layout_result_t;
+
+/**
+ * raqm_layout_cache_t:
+ *
+ * A cache of layout results that can be shared between several #raqm_t
+ * objects. See raqm_layout_cache_create().
+ *
+ * Since: 0.10
+ */
+typedef struct _raqm_layout_cache raqm_layout_cache_t;
+
+/**
+ * raqm_feature_set_t:
+ *
+ * A list of parsed font features, that can be added to several #raqm_t
+ * objects. See raqm_feature_set_create().
+ *
+ * Since: 0.10
+ */
+typedef struct _raqm_feature_set raqm_feature_set_t;
+
+/**
+ * raqm_allocator_t:
+ * @malloc_func: a function allocating memory, like malloc().
+ * @realloc_func: a function resizing memory, like realloc().
+ * @free_func: a function freeing memory, like free().
+ * @user_data: data passed to the functions.
+ *
+ * Memory allocation functions for raqm_create_with_allocator().
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_allocator_t {
+    void *(*malloc_func) (size_t size, void *user_data);
+    void *(*realloc_func) (void *ptr, size_t size, void *user_data);
+    void (*free_func) (void *ptr, void *user_data);
+    void *user_data;
+} raqm_allocator_t;
+
 /**
  * raqm_direction_t:
  * @RAQM_DIRECTION_DEFAULT: Detect paragraph direction automatically.
@@ -97,9 +156,362 @@ typedef struct raqm_glyph_t {
     FT_Face ftface;
 } raqm_glyph_t;
 
+/**
+ * raqm_glyph_run_t:
+ * @start: the index of the first glyph of the run.
+ * @len: the number of glyphs in the run.
+ * @direction: the direction of the run.
+ * @ftface: the #FT_Face of the glyphs in the run.
+ *
+ * The structure that holds information about a run of output glyphs, returned
+ * from raqm_get_glyph_runs().
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_glyph_run_t {
+    size_t start;
+    size_t len;
+    raqm_direction_t direction;
+    FT_Face ftface;
+} raqm_glyph_run_t;
+
+/**
+ * raqm_packed_glyph_t:
+ * @index: the index of the glyph in the font file.
+ * @x_advance: the quantized glyph advance width in horizontal text.
+ * @y_advance: the quantized glyph advance width in vertical text.
+ * @x_offset: the quantized horizontal movement of the glyph.
+ * @y_offset: the quantized vertical movement of the glyph.
+ *
+ * A compact glyph record, returned from raqm_get_packed_glyphs().
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_packed_glyph_t {
+    uint16_t index;
+    int16_t x_advance;
+    int16_t y_advance;
+    int16_t x_offset;
+    int16_t y_offset;
+} raqm_packed_glyph_t;
+
+/**
+ * raqm_packed_run_t:
+ * @ftface: the #FT_Face of the glyphs in the run.
+ * @start: the index of the first glyph of the run in the output.
+ * @len: the number of #raqm_packed_glyph_t following this header.
+ * @size: the number of bytes from this header to the next one.
+ * @direction: the direction of the run.
+ *
+ * The header of a run of glyphs, returned from raqm_get_packed_glyphs().
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_packed_run_t {
+    FT_Face ftface;
+    uint32_t start;
+    uint32_t len;
+    uint32_t size;
+    raqm_direction_t direction;
+} raqm_packed_run_t;
+
+/**
+ * raqm_line_t:
+ * @start: the index of the first character of the line.
+ * @len: the number of characters in the line.
+ * @glyph_start: the index of the first glyph of the line.
+ * @glyph_len: the number of glyphs in the line.
+ * @width: the sum of the advances of the glyphs of the line.
+ * @y: the distance from the baseline of the first line to the baseline of
+ * this one, increasing downwards.
+ *
+ * The structure that holds information about a line of the output, returned
+ * from raqm_get_lines(). The glyph ranges index the output of
+ * raqm_get_glyphs() and raqm_get_glyph_arrays(), and the x positions of the
+ * glyphs of each line start from zero.
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_line_t {
+    size_t start;
+    size_t len;
+    size_t glyph_start;
+    size_t glyph_len;
+    int width;
+    int y;
+} raqm_line_t;
+
+/**
+ * raqm_extents_t:
+ * @x_advance: the sum of the x advances of the glyphs.
+ * @y_advance: the sum of the y advances of the glyphs.
+ * @x_min: the left of the ink box.
+ * @y_min: the bottom of the ink box.
+ * @x_max: the right of the ink box.
+ * @y_max: the top of the ink box.
+ *
+ * The logical advance and ink box of some glyphs, returned from
+ * raqm_get_extents() and raqm_get_glyph_run_extents().
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_extents_t {
+    int x_advance;
+    int y_advance;
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+} raqm_extents_t;
+
+/**
+ * raqm_layout_item_t:
+ * @text: a UTF-8 encoded text string.
+ * @len: the length of @text in bytes.
+ * @face: the #FT_Face to use for @text.
+ * @direction: the paragraph direction of @text.
+ * @language: (nullable): a BCP47 language code for @text, or `NULL`.
+ *
+ * A paragraph to be laid out with raqm_layout_batch().
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_layout_item_t {
+    const char *text;
+    size_t len;
+    FT_Face face;
+    raqm_direction_t direction;
+    const char *language;
+} raqm_layout_item_t;
+
+/**
+ * raqm_paragraph_func_t:
+ * @rq: the #raqm_t, laid out with the paragraph.
+ * @offset: the byte offset of the paragraph in the whole text.
+ * @len: the length of the paragraph in bytes, including its separator.
+ * @user_data: the user data passed to raqm_layout_paragraphs().
+ *
+ * A function called for each paragraph laid out by raqm_layout_paragraphs()
+ * or raqm_layout_paragraphs_from_func().
+ *
+ * Return value:
+ * `true` to go on with the next paragraph, `false` to stop.
+ *
+ * Since: 0.10
+ */
+typedef bool (*raqm_paragraph_func_t) (raqm_t *rq,
+                                       size_t  offset,
+                                       size_t  len,
+                                       void   *user_data);
+
+/**
+ * raqm_read_func_t:
+ * @buffer: (out caller-allocates) (array length=size): the buffer to read into.
+ * @size: the size of @buffer.
+ * @user_data: the user data passed to raqm_layout_paragraphs_from_func().
+ *
+ * A function reading up to @size bytes of UTF-8 text into @buffer, see
+ * raqm_layout_paragraphs_from_func().
+ *
+ * Return value:
+ * The number of bytes read, or 0 at the end of the text.
+ *
+ * Since: 0.10
+ */
+typedef size_t (*raqm_read_func_t) (char   *buffer,
+                                    size_t  size,
+                                    void   *user_data);
+
+/**
+ * raqm_bidi_func_t:
+ * @text: (array length=len): the UTF-32 text of the paragraph.
+ * @len: the length of @text.
+ * @base_dir: the paragraph direction set with raqm_set_par_direction(), one
+ * of #RAQM_DIRECTION_DEFAULT, #RAQM_DIRECTION_LTR and #RAQM_DIRECTION_RTL.
+ * @levels: (out) (array length=len): the embedding levels of the characters.
+ * @par_level: (out): the embedding level of the paragraph.
+ * @user_data: the user data passed to raqm_set_bidi_func().
+ *
+ * A function running the [Unicode Bidirectional
+ * Algorithm](https://unicode.org/reports/tr9/) on @text as a single line, up
+ * to and including rule L1, and setting @levels to the resulting levels. Raqm
+ * then splits the text into runs of equal levels and reorders them itself.
+ * See raqm_set_bidi_func().
+ *
+ * Return value:
+ * `true` if no errors happened, `false` otherwise.
+ *
+ * Since: 0.10
+ */
+typedef bool (*raqm_bidi_func_t) (const uint32_t   *text,
+                                  size_t            len,
+                                  raqm_direction_t  base_dir,
+                                  uint8_t          *levels,
+                                  uint8_t          *par_level,
+                                  void             *user_data);
+
+/**
+ * raqm_task_func_t:
+ * @data: the task data.
+ *
+ * A function performing a single task, see #raqm_run_tasks_func_t.
+ *
+ * Since: 0.10
+ */
+typedef void (*raqm_task_func_t) (void *data);
+
+/**
+ * raqm_run_tasks_func_t:
+ * @func: the function performing the tasks.
+ * @tasks: (array length=tasks_len): the data of each task.
+ * @tasks_len: the number of tasks.
+ * @user_data: the user data passed to raqm_set_shape_tasks_func().
+ *
+ * A function that calls @func once for each element of @tasks, in any order
+ * and possibly concurrently (e.g. on a thread pool), and returns only once all
+ * of them are finished. See raqm_set_shape_tasks_func().
+ *
+ * Since: 0.10
+ */
+typedef void (*raqm_run_tasks_func_t) (raqm_task_func_t   func,
+                                       void             **tasks,
+                                       size_t             tasks_len,
+                                       void              *user_data);
+
+/**
+ * raqm_phase_t:
+ * @RAQM_PHASE_SCRIPTS: script resolution.
+ * @RAQM_PHASE_BIDI: the Unicode Bidirectional Algorithm.
+ * @RAQM_PHASE_RUNS: splitting the text into runs by script and font.
+ * @RAQM_PHASE_SHAPE: shaping the runs.
+ * @RAQM_PHASE_LINES: breaking the paragraph into lines.
+ * @RAQM_PHASE_GLYPHS: building the output of raqm_get_glyphs().
+ * @RAQM_PHASE_COUNT: the number of phases.
+ *
+ * The phases of the layout process, see raqm_get_stats() and
+ * raqm_set_trace_func().
+ *
+ * Since: 0.10
+ */
+typedef enum
+{
+    RAQM_PHASE_SCRIPTS,
+    RAQM_PHASE_BIDI,
+    RAQM_PHASE_RUNS,
+    RAQM_PHASE_SHAPE,
+    RAQM_PHASE_LINES,
+    RAQM_PHASE_GLYPHS,
+    RAQM_PHASE_COUNT
+} raqm_phase_t;
+
+/**
+ * raqm_stats_t:
+ * @phase_ns: nanoseconds spent in each #raqm_phase_t.
+ * @layouts: number of calls to raqm_layout() and raqm_relayout().
+ * @bidi_runs: number of bidi runs, before script itemization.
+ * @runs: number of runs after script itemization.
+ * @glyphs: number of glyphs.
+ * @reused_runs: number of runs reused from the previous layout, see
+ * raqm_replace_text().
+ * @reused_bidi_runs: number of bidi runs reused from the previous layout,
+ * when neither the text nor the paragraph direction changed.
+ * @shape_cache_hits: number of runs found in the shape cache.
+ * @shape_cache_misses: number of runs not found in the shape cache.
+ * @allocs: number of memory allocations made by the #raqm_t.
+ * @alloc_bytes: total number of bytes allocated by the #raqm_t.
+ *
+ * Statistics about the layouts done with a #raqm_t, returned from
+ * raqm_get_stats().
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_stats_t {
+    uint64_t phase_ns[RAQM_PHASE_COUNT];
+    size_t layouts;
+    size_t bidi_runs;
+    size_t runs;
+    size_t glyphs;
+    size_t reused_runs;
+    size_t reused_bidi_runs;
+    size_t shape_cache_hits;
+    size_t shape_cache_misses;
+    size_t allocs;
+    size_t alloc_bytes;
+} raqm_stats_t;
+
+/**
+ * raqm_memory_usage_t:
+ * @text_bytes: bytes of the text, its scripts and its index tables.
+ * @glyph_bytes: bytes of the arrays returned from raqm_get_glyphs() and
+ * raqm_layout_batch().
+ * @runs: number of runs, in use and pooled.
+ * @pooled_runs: number of pooled runs, kept for the next layouts.
+ * @run_bytes: bytes of the runs.
+ * @buffer_bytes: estimated bytes of the HarfBuzz buffers of the runs.
+ * @scratch_bytes: bytes of the memory for temporary arrays of the layout.
+ * @other_bytes: bytes of all other arrays.
+ * @total_bytes: the sum of all the bytes above, and of the #raqm_t itself.
+ *
+ * The memory held by a #raqm_t, returned from raqm_get_memory_usage().
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_memory_usage_t {
+    size_t text_bytes;
+    size_t glyph_bytes;
+    size_t runs;
+    size_t pooled_runs;
+    size_t run_bytes;
+    size_t buffer_bytes;
+    size_t scratch_bytes;
+    size_t other_bytes;
+    size_t total_bytes;
+} raqm_memory_usage_t;
+
+/**
+ * raqm_layout_cache_stats_t:
+ * @hits: number of layouts found in the cache.
+ * @misses: number of layouts not found in the cache.
+ * @evictions: number of layouts dropped to stay within the memory budget.
+ * @entries: number of layouts in the cache.
+ * @bytes: memory used by the layouts in the cache.
+ *
+ * Statistics about a #raqm_layout_cache_t, returned from
+ * raqm_layout_cache_get_stats().
+ *
+ * Since: 0.10
+ */
+typedef struct raqm_layout_cache_stats_t {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+} raqm_layout_cache_stats_t;
+
+/**
+ * raqm_trace_func_t:
+ * @rq: the #raqm_t doing the layout.
+ * @phase: the phase that just finished.
+ * @ns: the time the phase took, in nanoseconds.
+ * @user_data: the user data passed to raqm_set_trace_func().
+ *
+ * A function called at the end of each layout phase, see
+ * raqm_set_trace_func().
+ *
+ * Since: 0.10
+ */
+typedef void (*raqm_trace_func_t) (raqm_t       *rq,
+                                   raqm_phase_t  phase,
+                                   uint64_t      ns,
+                                   void         *user_data);
+
 RAQM_API raqm_t *
 raqm_create (void);
 
+RAQM_API raqm_t *
+raqm_create_with_allocator (const raqm_allocator_t *allocator);
+
 RAQM_API raqm_t *
 raqm_reference (raqm_t *rq);
 
@@ -119,10 +531,27 @@ raqm_set_text_utf8 (raqm_t     *rq,
                     const char *text,
                     size_t      len);
 
+RAQM_API bool
+raqm_set_text_utf16 (raqm_t         *rq,
+                     const uint16_t *text,
+                     size_t          len);
+
+RAQM_API bool
+raqm_replace_text (raqm_t         *rq,
+                   size_t          start,
+                   size_t          len,
+                   const uint32_t *text,
+                   size_t          text_len);
+
 RAQM_API bool
 raqm_set_par_direction (raqm_t          *rq,
                         raqm_direction_t dir);
 
+RAQM_API bool
+raqm_set_bidi_func (raqm_t           *rq,
+                    raqm_bidi_func_t  func,
+                    void             *user_data);
+
 RAQM_API bool
 raqm_set_language (raqm_t       *rq,
                    const char   *lang,
@@ -134,6 +563,31 @@ raqm_add_font_feature  (raqm_t     *rq,
                         const char *feature,
                         int         len);
 
+RAQM_API bool
+raqm_add_font_feature_range (raqm_t     *rq,
+                             const char *feature,
+                             int         len,
+                             size_t      start,
+                             size_t      range_len);
+
+RAQM_API raqm_feature_set_t *
+raqm_feature_set_create (void);
+
+RAQM_API raqm_feature_set_t *
+raqm_feature_set_reference (raqm_feature_set_t *set);
+
+RAQM_API void
+raqm_feature_set_destroy (raqm_feature_set_t *set);
+
+RAQM_API bool
+raqm_feature_set_add (raqm_feature_set_t *set,
+                      const char         *feature,
+                      int                 len);
+
+RAQM_API bool
+raqm_add_font_feature_set (raqm_t                   *rq,
+                           const raqm_feature_set_t *set);
+
 RAQM_API bool
 raqm_set_freetype_face (raqm_t *rq,
                         FT_Face face);
@@ -154,17 +608,191 @@ raqm_set_freetype_load_flags_range (raqm_t *rq,
                                     size_t  start,
                                     size_t  len);
 
+RAQM_API bool
+raqm_set_fallback_faces (raqm_t        *rq,
+                         const FT_Face *faces,
+                         size_t         len);
+
 RAQM_API bool
 raqm_set_invisible_glyph (raqm_t *rq,
                           int gid);
 
+RAQM_API bool
+raqm_set_line_width (raqm_t *rq,
+                     int     width);
+
+RAQM_API raqm_font_cache_t *
+raqm_font_cache_create (void);
+
+RAQM_API raqm_font_cache_t *
+raqm_font_cache_reference (raqm_font_cache_t *cache);
+
+RAQM_API void
+raqm_font_cache_destroy (raqm_font_cache_t *cache);
+
+RAQM_API void
+raqm_font_cache_invalidate (raqm_font_cache_t *cache,
+                            FT_Face            face);
+
+RAQM_API bool
+raqm_set_font_cache (raqm_t            *rq,
+                     raqm_font_cache_t *cache);
+
+RAQM_API bool
+raqm_set_shape_cache_size (raqm_t *rq,
+                           size_t  max_entries);
+
+RAQM_API bool
+raqm_get_shape_cache_stats (raqm_t *rq,
+                            size_t *hits,
+                            size_t *misses);
+
+RAQM_API bool
+raqm_set_shape_tasks_func (raqm_t                *rq,
+                           raqm_run_tasks_func_t  func,
+                           void                  *user_data,
+                           size_t                 min_text_len);
+
+RAQM_API bool
+raqm_set_stats_enabled (raqm_t *rq,
+                        bool    enabled);
+
+RAQM_API bool
+raqm_get_stats (raqm_t       *rq,
+                raqm_stats_t *stats);
+
+RAQM_API void
+raqm_reset_stats (raqm_t *rq);
+
+RAQM_API bool
+raqm_get_memory_usage (raqm_t              *rq,
+                       raqm_memory_usage_t *usage);
+
+RAQM_API bool
+raqm_trim_memory (raqm_t *rq,
+                  size_t  max_bytes);
+
+RAQM_API bool
+raqm_set_trace_func (raqm_t            *rq,
+                     raqm_trace_func_t  func,
+                     void              *user_data);
+
 RAQM_API bool
 raqm_layout (raqm_t *rq);
 
+RAQM_API bool
+raqm_relayout (raqm_t *rq,
+               bool    scale);
+
 RAQM_API raqm_glyph_t *
 raqm_get_glyphs (raqm_t *rq,
                  size_t *length);
 
+RAQM_API bool
+raqm_get_glyph_arrays (raqm_t       *rq,
+                       size_t       *length,
+                       unsigned int *indices,
+                       int          *x_advances,
+                       int          *y_advances,
+                       int          *x_offsets,
+                       int          *y_offsets,
+                       uint32_t     *clusters);
+
+RAQM_API bool
+raqm_get_glyph_runs (raqm_t           *rq,
+                     raqm_glyph_run_t *runs,
+                     size_t           *length);
+
+RAQM_API bool
+raqm_get_packed_glyphs (raqm_t       *rq,
+                        unsigned int  shift,
+                        void         *buffer,
+                        size_t       *size);
+
+RAQM_API bool
+raqm_get_lines (raqm_t      *rq,
+                raqm_line_t *lines,
+                size_t      *length);
+
+RAQM_API bool
+raqm_get_extents (raqm_t         *rq,
+                  raqm_extents_t *extents);
+
+RAQM_API bool
+raqm_get_glyph_run_extents (raqm_t         *rq,
+                            size_t          index,
+                            raqm_extents_t *extents);
+
+RAQM_API raqm_layout_result_t *
+raqm_freeze_layout (raqm_t *rq);
+
+RAQM_API raqm_layout_result_t *
+raqm_layout_result_reference (raqm_layout_result_t *result);
+
+RAQM_API void
+raqm_layout_result_destroy (raqm_layout_result_t *result);
+
+RAQM_API const raqm_glyph_t *
+raqm_layout_result_get_glyphs (const raqm_layout_result_t *result,
+                               size_t                     *length);
+
+RAQM_API const raqm_glyph_run_t *
+raqm_layout_result_get_glyph_runs (const raqm_layout_result_t *result,
+                                   size_t                     *length);
+
+RAQM_API const raqm_line_t *
+raqm_layout_result_get_lines (const raqm_layout_result_t *result,
+                              size_t                     *length);
+
+RAQM_API raqm_direction_t
+raqm_layout_result_get_par_resolved_direction (const raqm_layout_result_t *result);
+
+RAQM_API raqm_layout_cache_t *
+raqm_layout_cache_create (size_t max_bytes);
+
+RAQM_API raqm_layout_cache_t *
+raqm_layout_cache_reference (raqm_layout_cache_t *cache);
+
+RAQM_API void
+raqm_layout_cache_destroy (raqm_layout_cache_t *cache);
+
+RAQM_API void
+raqm_layout_cache_clear (raqm_layout_cache_t *cache);
+
+RAQM_API bool
+raqm_layout_cache_get_stats (raqm_layout_cache_t       *cache,
+                             raqm_layout_cache_stats_t *stats);
+
+RAQM_API bool
+raqm_set_layout_cache (raqm_t              *rq,
+                       raqm_layout_cache_t *cache);
+
+RAQM_API raqm_layout_result_t *
+raqm_layout_cached (raqm_t *rq);
+
+RAQM_API raqm_glyph_t *
+raqm_layout_batch (raqm_t                   *rq,
+                   const raqm_layout_item_t *items,
+                   size_t                    items_len,
+                   size_t                   *offsets,
+                   size_t                   *length);
+
+RAQM_API bool
+raqm_layout_paragraphs (raqm_t                *rq,
+                        const char            *text,
+                        size_t                 len,
+                        FT_Face                face,
+                        raqm_paragraph_func_t  func,
+                        void                  *user_data);
+
+RAQM_API bool
+raqm_layout_paragraphs_from_func (raqm_t                *rq,
+                                  raqm_read_func_t       read_func,
+                                  void                  *read_data,
+                                  FT_Face                face,
+                                  raqm_paragraph_func_t  func,
+                                  void                  *user_data);
+
 RAQM_API raqm_direction_t
 raqm_get_par_resolved_direction (raqm_t *rq);
 
@@ -184,6 +812,13 @@ raqm_position_to_index (raqm_t *rq,
                         int y,
                         size_t *index);
 
+RAQM_API bool
+raqm_get_grapheme_positions (raqm_t *rq,
+                             size_t *indices,
+                             int    *x,
+                             int    *y,
+                             size_t *length);
+
 RAQM_API void
 raqm_version (unsigned int *major,
               unsigned int *minor,
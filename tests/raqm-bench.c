@@ -0,0 +1,425 @@
+/*
+ * Copyright © 2015 Information Technology Authority (ITA) <foss@ita.gov.om>
+ * Copyright © 2016-2022 Khaled Hosny <khaled@aliftype.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+#ifdef __GNUC__
+#define  _DEFAULT_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "raqm.h"
+
+#ifndef RAQM_BENCH_BIDI
+#define RAQM_BENCH_BIDI "unknown"
+#endif
+
+/* Like assert (), but also in builds with NDEBUG defined */
+#define CHECK(expr) \
+  do { \
+    if (!(expr)) \
+    { \
+      fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+      exit (1); \
+    } \
+  } while (0)
+
+/* Fonts from tests/fonts */
+#define FONT_AMIRI "fonts/sha1sum/bcb3b98eb67ece19b8b709f77143d91bcb3d95eb.ttf"
+#define FONT_ARABIC "fonts/sha1sum/a22e097e7f3cefffd1a602674dff5108efa0eec2.ttf"
+#define FONT_HEBREW "fonts/sha1sum/d46a2549d27c32605024201abf801bb9a9273da3.ttf"
+
+static const char *labels[] = {
+  "OK", "Cancel", "Apply", "Settings", "File", "Edit", "View", "Help",
+  "Open…", "Save as", "Close window", "Preferences", "About", "Quit",
+  "Zoom in", "Zoom out",
+};
+
+static const char arabic_sentence[] =
+  "اللغة العربية هي أكثر اللغات السامية تحدثًا، وإحدى أكثر اللغات انتشارًا "
+  "في العالم، يتحدثها أكثر من ٤٦٧ مليون نسمة. ";
+
+static const char hebrew_sentence[] =
+  "עברית היא שפה שמית ממשפחת השפות האפרו-אסיאתיות (Afroasiatic), "
+  "הידועה כשפתם של היהודים מאז ימי קדם. ";
+
+static const char mixed_sentence[] =
+  "The word عربي means Arabic, עברית means Hebrew, and 123 + ٤٥٦ "
+  "are numbers (مثال example דוגמה). ";
+
+static const char latin_sentence[] =
+  "The quick brown fox jumps over the lazy dog, again and again. ";
+
+typedef enum {
+  BENCH_LABELS,
+  BENCH_LABELS_BATCH,
+  BENCH_PARAGRAPH,
+  BENCH_PARAGRAPH_UTF32,
+  BENCH_MULTI_FONT,
+  BENCH_CURSOR,
+} bench_kind_t;
+
+typedef struct {
+  const char   *name;
+  bench_kind_t  kind;
+  const char   *font;
+  const char   *sentence;
+  int           repeat;
+} bench_case_t;
+
+static const bench_case_t cases[] = {
+  { "latin-labels",        BENCH_LABELS,          FONT_AMIRI,  NULL,            0 },
+  { "latin-labels-batch",  BENCH_LABELS_BATCH,    FONT_AMIRI,  NULL,            0 },
+  { "latin-paragraph",     BENCH_PARAGRAPH,       FONT_AMIRI,  latin_sentence,  20 },
+  { "arabic-paragraph",    BENCH_PARAGRAPH,       FONT_AMIRI,  arabic_sentence, 20 },
+  { "hebrew-bidi",         BENCH_PARAGRAPH,       FONT_HEBREW, hebrew_sentence, 20 },
+  { "mixed-script-utf8",   BENCH_PARAGRAPH,       FONT_HEBREW, mixed_sentence,  20 },
+  { "mixed-script-utf32",  BENCH_PARAGRAPH_UTF32, FONT_HEBREW, mixed_sentence,  20 },
+  { "multi-font",          BENCH_MULTI_FONT,      FONT_AMIRI,  mixed_sentence,  20 },
+  { "cursor",              BENCH_CURSOR,          FONT_AMIRI,  mixed_sentence,  5 },
+};
+
+typedef struct {
+  size_t allocs;
+} alloc_stats_t;
+
+static void *
+counting_malloc (size_t size, void *user_data)
+{
+  ((alloc_stats_t *) user_data)->allocs++;
+  return malloc (size);
+}
+
+static void *
+counting_realloc (void *ptr, size_t size, void *user_data)
+{
+  ((alloc_stats_t *) user_data)->allocs++;
+  return realloc (ptr, size);
+}
+
+static void
+counting_free (void *ptr, void *user_data)
+{
+  (void) user_data;
+  free (ptr);
+}
+
+static double
+now (void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double) clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+static char *
+repeat_text (const char *sentence,
+             int         repeat)
+{
+  size_t len = strlen (sentence);
+  char *text = malloc (len * repeat + 1);
+
+  for (int i = 0; i < repeat; i++)
+    memcpy (text + len * i, sentence, len);
+  text[len * repeat] = '\0';
+
+  return text;
+}
+
+static uint32_t *
+decode_utf8 (const char *s,
+             size_t     *len)
+{
+  const unsigned char *p = (const unsigned char *) s;
+  uint32_t *ret = malloc (sizeof (uint32_t) * (strlen (s) + 1));
+
+  *len = 0;
+  while (*p)
+  {
+    if (*p >= 0xf0)
+    {
+      ret[*len] = ((p[0] & 0x07) << 18) | ((p[1] & 0x3f) << 12) |
+                  ((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+      p += 4;
+    }
+    else if (*p >= 0xe0)
+    {
+      ret[*len] = ((p[0] & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+      p += 3;
+    }
+    else if (*p >= 0xc0)
+    {
+      ret[*len] = ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+      p += 2;
+    }
+    else
+    {
+      ret[*len] = *p;
+      p += 1;
+    }
+    (*len)++;
+  }
+
+  return ret;
+}
+
+static FT_Face
+load_face (FT_Library  library,
+           const char *fontsdir,
+           const char *font)
+{
+  char path[4096];
+  FT_Face face;
+
+  snprintf (path, sizeof (path), "%s/%s", fontsdir, font);
+  if (FT_New_Face (library, path, 0, &face))
+  {
+    fprintf (stderr, "Can't load font: %s\n", path);
+    exit (1);
+  }
+  CHECK (!FT_Set_Char_Size (face, face->units_per_EM, 0, 0, 0));
+
+  return face;
+}
+
+/* Do one iteration of @bench, returning the number of layouts done and
+ * adding the number of glyphs to @glyphs */
+static size_t
+run_case (raqm_t             *rq,
+          const bench_case_t *bench,
+          FT_Face             face,
+          FT_Face             arabic_face,
+          const char         *text,
+          const uint32_t     *unicode,
+          size_t              unicode_len,
+          size_t             *glyphs)
+{
+  size_t count;
+  size_t nlabels = sizeof (labels) / sizeof (labels[0]);
+
+  switch (bench->kind)
+  {
+    case BENCH_LABELS:
+      for (size_t i = 0; i < nlabels; i++)
+      {
+        raqm_clear_contents (rq);
+        CHECK (raqm_set_text_utf8 (rq, labels[i], strlen (labels[i])));
+        CHECK (raqm_set_freetype_face (rq, face));
+        CHECK (raqm_layout (rq));
+        raqm_get_glyphs (rq, &count);
+        *glyphs += count;
+      }
+      return nlabels;
+
+    case BENCH_LABELS_BATCH:
+    {
+      raqm_layout_item_t items[sizeof (labels) / sizeof (labels[0])];
+      size_t offsets[sizeof (labels) / sizeof (labels[0]) + 1];
+
+      for (size_t i = 0; i < nlabels; i++)
+      {
+        items[i].text = labels[i];
+        items[i].len = strlen (labels[i]);
+        items[i].face = face;
+        items[i].direction = RAQM_DIRECTION_DEFAULT;
+        items[i].language = NULL;
+      }
+
+      CHECK (raqm_layout_batch (rq, items, nlabels, offsets, &count));
+      *glyphs += count;
+      return nlabels;
+    }
+
+    case BENCH_PARAGRAPH:
+    case BENCH_CURSOR:
+      raqm_clear_contents (rq);
+      CHECK (raqm_set_text_utf8 (rq, text, strlen (text)));
+      CHECK (raqm_set_freetype_face (rq, face));
+      CHECK (raqm_layout (rq));
+      raqm_get_glyphs (rq, &count);
+      *glyphs += count;
+
+      if (bench->kind == BENCH_CURSOR)
+      {
+        size_t len = strlen (text);
+        int x, y;
+
+        for (size_t i = 0; i < len; i++)
+        {
+          size_t index = i;
+          CHECK (raqm_index_to_position (rq, &index, &x, &y));
+        }
+
+        for (int pos = 0; pos < 200000; pos += 1000)
+        {
+          size_t index;
+          CHECK (raqm_position_to_index (rq, pos, 0, &index));
+        }
+      }
+      return 1;
+
+    case BENCH_PARAGRAPH_UTF32:
+      raqm_clear_contents (rq);
+      CHECK (raqm_set_text (rq, unicode, unicode_len));
+      CHECK (raqm_set_freetype_face (rq, face));
+      CHECK (raqm_layout (rq));
+      raqm_get_glyphs (rq, &count);
+      *glyphs += count;
+      return 1;
+
+    case BENCH_MULTI_FONT:
+    {
+      /* Use the Arabic face for every other word */
+      size_t start = 0;
+      bool arabic = false;
+
+      raqm_clear_contents (rq);
+      CHECK (raqm_set_text (rq, unicode, unicode_len));
+      for (size_t i = 0; i <= unicode_len; i++)
+      {
+        if (i == unicode_len || unicode[i] == ' ')
+        {
+          CHECK (raqm_set_freetype_face_range (rq,
+                                                arabic ? arabic_face : face,
+                                                start, i - start));
+          start = i;
+          arabic = !arabic;
+        }
+      }
+      CHECK (raqm_layout (rq));
+      raqm_get_glyphs (rq, &count);
+      *glyphs += count;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void
+usage (const char *argv0)
+{
+  fprintf (stderr,
+           "Usage: %s [--time SECONDS] [--case NAME] [FONTS_DIR]\n"
+           "\n"
+           "Runs each benchmark case for about SECONDS (default 0.5) and\n"
+           "reports layouts and glyphs per second and allocations made by\n"
+           "raqm per layout. FONTS_DIR is the directory containing the\n"
+           "fonts/ directory of the test suite (default: .).\n",
+           argv0);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *fontsdir = ".";
+  const char *only = NULL;
+  double duration = 0.5;
+  FT_Library library;
+  FT_Face amiri, arabic, hebrew;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp (argv[i], "--time") == 0 && i + 1 < argc)
+      duration = atof (argv[++i]);
+    else if (strcmp (argv[i], "--case") == 0 && i + 1 < argc)
+      only = argv[++i];
+    else if (argv[i][0] == '-')
+    {
+      usage (argv[0]);
+      return 1;
+    }
+    else
+      fontsdir = argv[i];
+  }
+
+  CHECK (!FT_Init_FreeType (&library));
+  amiri = load_face (library, fontsdir, FONT_AMIRI);
+  arabic = load_face (library, fontsdir, FONT_ARABIC);
+  hebrew = load_face (library, fontsdir, FONT_HEBREW);
+
+  printf ("Raqm %s, bidi: %s\n\n", RAQM_VERSION_STRING, RAQM_BENCH_BIDI);
+  printf ("%-20s %12s %14s %14s\n",
+          "case", "layouts/s", "glyphs/s", "allocs/layout");
+
+  for (size_t c = 0; c < sizeof (cases) / sizeof (cases[0]); c++)
+  {
+    const bench_case_t *bench = &cases[c];
+    alloc_stats_t stats = { 0 };
+    raqm_allocator_t allocator = {
+      counting_malloc, counting_realloc, counting_free, &stats
+    };
+    FT_Face face = strcmp (bench->font, FONT_HEBREW) == 0 ? hebrew : amiri;
+    char *text = NULL;
+    uint32_t *unicode = NULL;
+    size_t unicode_len = 0;
+    size_t layouts = 0, glyphs = 0, allocs;
+    double start, elapsed;
+    raqm_t *rq;
+
+    if (only && strcmp (only, bench->name) != 0)
+      continue;
+
+    if (bench->sentence)
+    {
+      text = repeat_text (bench->sentence, bench->repeat);
+      unicode = decode_utf8 (text, &unicode_len);
+    }
+
+    rq = raqm_create_with_allocator (&allocator);
+    CHECK (rq);
+
+    /* Warm up, so that steady state allocations are measured */
+    run_case (rq, bench, face, arabic, text, unicode, unicode_len, &glyphs);
+    glyphs = 0;
+    allocs = stats.allocs;
+
+    start = now ();
+    do
+    {
+      layouts += run_case (rq, bench, face, arabic, text, unicode,
+                           unicode_len, &glyphs);
+      elapsed = now () - start;
+    } while (elapsed < duration);
+
+    printf ("%-20s %12.0f %14.0f %14.2f\n", bench->name,
+            layouts / elapsed, glyphs / elapsed,
+            (double) (stats.allocs - allocs) / layouts);
+
+    raqm_destroy (rq);
+    free (text);
+    free (unicode);
+  }
+
+  FT_Done_Face (amiri);
+  FT_Done_Face (arabic);
+  FT_Done_Face (hebrew);
+  FT_Done_FreeType (library);
+
+  return 0;
+}
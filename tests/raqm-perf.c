@@ -0,0 +1,424 @@
+/*
+ * Copyright © 2015 Information Technology Authority (ITA) <foss@ita.gov.om>
+ * Copyright © 2016-2022 Khaled Hosny <khaled@aliftype.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Performance regression tests for inputs with input-dependent worst cases.
+ * Each case lays out a generated text of some length and of eight times that
+ * length, and fails if the allocations of raqm grow much faster than the
+ * text, i.e. if some code path became super-linear. With --time, the time is
+ * checked the same way, which is only meaningful on an otherwise idle machine
+ * and without sanitizers or valgrind, so it is run as a benchmark.
+ */
+
+#ifdef __GNUC__
+#define  _DEFAULT_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "raqm.h"
+
+/* Like assert (), but also in builds with NDEBUG defined */
+#define CHECK(expr) \
+  do { \
+    if (!(expr)) \
+    { \
+      fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+      exit (1); \
+    } \
+  } while (0)
+
+/* Fonts from tests/fonts */
+#define FONT_AMIRI "fonts/sha1sum/bcb3b98eb67ece19b8b709f77143d91bcb3d95eb.ttf"
+#define FONT_ARABIC "fonts/sha1sum/a22e097e7f3cefffd1a602674dff5108efa0eec2.ttf"
+
+/* How much longer the long text of each case is */
+#define PERF_SCALE 8
+
+/* Linear code takes PERF_SCALE times longer for the long text, and quadratic
+ * code PERF_SCALE^2 times. The budgets leave room for noise and for caches
+ * that the short text fits in. */
+#define PERF_TIME_RATIO (PERF_SCALE * 2.5)
+#define PERF_ALLOC_RATIO (PERF_SCALE * 1.5)
+
+/* Times this short are too noisy to compare */
+#define PERF_MIN_TIME 0.0005
+
+/* How many times each text is laid out to find its best time */
+#define PERF_RUNS 3
+
+typedef void (*make_text_func_t) (uint32_t *text,
+                                  size_t    len);
+
+typedef struct {
+  const char      *name;
+  make_text_func_t make_text;
+  /* Alternate between two faces for every character */
+  bool             font_ranges;
+  /* Query the position of every character, and the character at many
+   * positions */
+  bool             cursor;
+} perf_case_t;
+
+static const uint32_t openers[] = { 0x0028, 0x005b, 0x007b, 0x00ab };
+static const uint32_t closers[] = { 0x0029, 0x005d, 0x007d, 0x00bb };
+
+/* Nested paired brackets of alternating scripts, whose closing brackets only
+ * match every other opening one, so that the script detection pops its
+ * bracket stack in a loop */
+static void
+make_brackets (uint32_t *text,
+               size_t    len)
+{
+  size_t half = len / 2;
+
+  for (size_t i = 0; i < half; i++)
+  {
+    if (i % 2)
+      text[i] = openers[(i / 2) % 4];
+    else
+      text[i] = (i / 2) % 2 ? 0x0628 : 'a';
+  }
+
+  for (size_t i = half; i < len; i++)
+  {
+    size_t depth = (len - i) % 4;
+
+    text[i] = closers[(depth + (i % 2)) % 4];
+  }
+}
+
+/* Latin and Arabic letters one after the other, so that each character is a
+ * bidi run and a script run of its own */
+static void
+make_alternating_scripts (uint32_t *text,
+                          size_t    len)
+{
+  for (size_t i = 0; i < len; i++)
+    text[i] = i % 2 ? 0x0628 + (i / 2) % 18 : 'a' + (i / 2) % 26;
+}
+
+/* Latin and Arabic words, to use with a face range for each character */
+static void
+make_words (uint32_t *text,
+            size_t    len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    if (i % 8 == 7)
+      text[i] = ' ';
+    else
+      text[i] = (i / 8) % 2 ? 0x0628 + i % 18 : 'a' + i % 26;
+  }
+}
+
+/* Base letters each followed by a long sequence of combining marks */
+static void
+make_combining_marks (uint32_t *text,
+                      size_t    len)
+{
+  for (size_t i = 0; i < len; i++)
+    text[i] = i % 64 ? 0x0300 + i % 0x70 : 'a' + (i / 64) % 26;
+}
+
+/* A single base letter followed by combining marks only */
+static void
+make_one_cluster (uint32_t *text,
+                  size_t    len)
+{
+  text[0] = 'a';
+  for (size_t i = 1; i < len; i++)
+    text[i] = 0x0301;
+}
+
+static const perf_case_t cases[] = {
+  { "bracket-nesting",     make_brackets,            false, false },
+  { "alternating-scripts", make_alternating_scripts, false, true },
+  { "font-ranges",         make_words,               true,  false },
+  { "combining-marks",     make_combining_marks,     false, true },
+  { "one-cluster",         make_one_cluster,         false, false },
+};
+
+typedef struct {
+  size_t allocs;
+  size_t bytes;
+} alloc_stats_t;
+
+static void *
+counting_malloc (size_t size, void *user_data)
+{
+  ((alloc_stats_t *) user_data)->allocs++;
+  ((alloc_stats_t *) user_data)->bytes += size;
+  return malloc (size);
+}
+
+static void *
+counting_realloc (void *ptr, size_t size, void *user_data)
+{
+  ((alloc_stats_t *) user_data)->allocs++;
+  ((alloc_stats_t *) user_data)->bytes += size;
+  return realloc (ptr, size);
+}
+
+static void
+counting_free (void *ptr, void *user_data)
+{
+  (void) user_data;
+  free (ptr);
+}
+
+static double
+now (void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double) clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+static FT_Face
+load_face (FT_Library  library,
+           const char *fontsdir,
+           const char *font)
+{
+  char path[4096];
+  FT_Face face;
+
+  snprintf (path, sizeof (path), "%s/%s", fontsdir, font);
+  if (FT_New_Face (library, path, 0, &face))
+  {
+    fprintf (stderr, "Can't load font: %s\n", path);
+    exit (1);
+  }
+  CHECK (!FT_Set_Char_Size (face, face->units_per_EM, 0, 0, 0));
+
+  return face;
+}
+
+/* Lay @text out with @rq as @perf says */
+static void
+run_case (raqm_t            *rq,
+          const perf_case_t *perf,
+          FT_Face            face,
+          FT_Face            other_face,
+          const uint32_t    *text,
+          size_t             len)
+{
+  raqm_extents_t extents;
+  size_t count;
+  int x, y;
+
+  raqm_clear_contents (rq);
+  CHECK (raqm_set_text (rq, text, len));
+  if (perf->font_ranges)
+  {
+    for (size_t i = 0; i < len; i++)
+      CHECK (raqm_set_freetype_face_range (rq, i % 2 ? other_face : face,
+                                           i, 1));
+  }
+  else
+    CHECK (raqm_set_freetype_face (rq, face));
+  CHECK (raqm_layout (rq));
+  CHECK (raqm_get_glyphs (rq, &count) || count == 0);
+
+  if (perf->cursor)
+  {
+    CHECK (raqm_get_extents (rq, &extents));
+
+    for (size_t i = 0; i < len; i++)
+    {
+      size_t index = i;
+      CHECK (raqm_index_to_position (rq, &index, &x, &y));
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+      size_t index;
+      CHECK (raqm_position_to_index (rq, (int) (i * 500), 0, &index));
+    }
+  }
+}
+
+typedef struct {
+  double time;
+  size_t allocs;
+  size_t bytes;
+} perf_result_t;
+
+/* Lay a text of @len characters out with a new raqm_t, counting its
+ * allocations, and then, if @timed, again to find its best time */
+static perf_result_t
+measure (const perf_case_t *perf,
+         FT_Face            face,
+         FT_Face            other_face,
+         size_t             len,
+         bool               timed)
+{
+  alloc_stats_t stats = { 0, 0 };
+  raqm_allocator_t allocator = {
+    counting_malloc, counting_realloc, counting_free, &stats
+  };
+  perf_result_t result;
+  uint32_t *text = malloc (sizeof (uint32_t) * len);
+  raqm_t *rq;
+
+  CHECK (text);
+  perf->make_text (text, len);
+
+  rq = raqm_create_with_allocator (&allocator);
+  CHECK (rq);
+  run_case (rq, perf, face, other_face, text, len);
+  result.allocs = stats.allocs;
+  result.bytes = stats.bytes;
+
+  result.time = -1;
+  for (int i = 0; timed && i < PERF_RUNS; i++)
+  {
+    double start = now ();
+    double elapsed;
+
+    run_case (rq, perf, face, other_face, text, len);
+    elapsed = now () - start;
+    if (result.time < 0 || elapsed < result.time)
+      result.time = elapsed;
+  }
+
+  raqm_destroy (rq);
+  free (text);
+
+  return result;
+}
+
+static void
+usage (const char *argv0)
+{
+  fprintf (stderr,
+           "Usage: %s [--len CHARACTERS] [--time] [--max-time SECONDS]\n"
+           "          [--case NAME] [FONTS_DIR]\n"
+           "\n"
+           "Lays out each case with texts of CHARACTERS (default 2000) and\n"
+           "%d times more characters, and fails if the allocations grow more\n"
+           "than %.0f times. With --time, also fails if the time grows more\n"
+           "than %.0f times, or if the long text takes more than SECONDS\n"
+           "(default 5). FONTS_DIR is the directory containing the fonts/\n"
+           "directory of the test suite (default: .).\n",
+           argv0, PERF_SCALE, PERF_ALLOC_RATIO, PERF_TIME_RATIO);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *fontsdir = ".";
+  const char *only = NULL;
+  size_t len = 2000;
+  double max_time = 5;
+  bool timed = false;
+  FT_Library library;
+  FT_Face amiri, arabic;
+  int failed = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp (argv[i], "--len") == 0 && i + 1 < argc)
+      len = strtoul (argv[++i], NULL, 10);
+    else if (strcmp (argv[i], "--time") == 0)
+      timed = true;
+    else if (strcmp (argv[i], "--max-time") == 0 && i + 1 < argc)
+      max_time = atof (argv[++i]);
+    else if (strcmp (argv[i], "--case") == 0 && i + 1 < argc)
+      only = argv[++i];
+    else if (argv[i][0] == '-')
+    {
+      usage (argv[0]);
+      return 1;
+    }
+    else
+      fontsdir = argv[i];
+  }
+
+  if (len < 2)
+  {
+    usage (argv[0]);
+    return 1;
+  }
+
+  CHECK (!FT_Init_FreeType (&library));
+  amiri = load_face (library, fontsdir, FONT_AMIRI);
+  arabic = load_face (library, fontsdir, FONT_ARABIC);
+
+  printf ("Raqm %s\n\n", RAQM_VERSION_STRING);
+  printf ("%-20s %10s %10s %8s %8s %8s\n",
+          "case", "time", "long time", "time x", "allocs x", "bytes x");
+
+  for (size_t c = 0; c < sizeof (cases) / sizeof (cases[0]); c++)
+  {
+    const perf_case_t *perf = &cases[c];
+    perf_result_t small, large;
+    double time_ratio, allocs_ratio, bytes_ratio;
+    bool ok;
+
+    if (only && strcmp (only, perf->name) != 0)
+      continue;
+
+    small = measure (perf, amiri, arabic, len, timed);
+    large = measure (perf, amiri, arabic, len * PERF_SCALE, timed);
+
+    allocs_ratio = (double) large.allocs / (small.allocs ? small.allocs : 1);
+    bytes_ratio = (double) large.bytes / (small.bytes ? small.bytes : 1);
+    ok = allocs_ratio <= PERF_ALLOC_RATIO && bytes_ratio <= PERF_ALLOC_RATIO;
+
+    if (timed)
+    {
+      time_ratio = large.time /
+                   (small.time > PERF_MIN_TIME ? small.time : PERF_MIN_TIME);
+      ok = ok &&
+           (time_ratio <= PERF_TIME_RATIO || large.time <= PERF_MIN_TIME) &&
+           large.time <= max_time;
+
+      printf ("%-20s %9.4fs %9.4fs %8.1f", perf->name,
+              small.time, large.time, time_ratio);
+    }
+    else
+    {
+      printf ("%-20s %10s %10s %8s", perf->name, "-", "-", "-");
+    }
+
+    if (!ok)
+      failed++;
+
+    printf (" %8.1f %8.1f %s\n", allocs_ratio, bytes_ratio,
+            ok ? "ok" : "FAIL");
+  }
+
+  FT_Done_Face (amiri);
+  FT_Done_Face (arabic);
+  FT_Done_FreeType (library);
+
+  return failed ? 1 : 0;
+}
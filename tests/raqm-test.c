@@ -27,9 +27,15 @@
 #include <assert.h>
 #include <errno.h>
 #include <locale.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <hb.h>
+#ifdef RAQM_TEST_SHEENBIDI
+#include <SheenBidi.h>
+#else
+#include <fribidi.h>
+#endif
 
 #include "raqm.h"
 
@@ -39,10 +45,309 @@ static char *fonts = NULL;
 static char *languages = NULL;
 static char *direction = NULL;
 static char *features = NULL;
+static bool feature_set = false;
+static char *range_features = NULL;
 static char *require = NULL;
 static int cluster = -1;
 static int position = -1;
 static int invisible_glyph = 0;
+static bool font_cache = false;
+static bool shape_cache = false;
+static bool shape_tasks = false;
+static bool batch = false;
+static char *replace = NULL;
+static bool allocator = false;
+static bool stats = false;
+static int line_width = 0;
+static bool relayout = false;
+static bool utf16 = false;
+static char *fallback_fonts = NULL;
+static bool freeze = false;
+static bool layout_cache = false;
+static bool paragraphs = false;
+static bool extents = false;
+static bool bidi_func = false;
+static bool trim_memory = false;
+static bool packed = false;
+static FT_Face fallback_faces[8];
+static size_t fallback_faces_len = 0;
+
+/* Run the shaping tasks serially in reverse order, to make sure the output
+ * does not depend on the order they run in. */
+static void
+run_tasks_reversed (raqm_task_func_t   func,
+                    void             **tasks,
+                    size_t             tasks_len,
+                    void              *user_data)
+{
+  size_t *tasks_count = user_data;
+
+  for (size_t i = tasks_len; i > 0; i--)
+    func (tasks[i - 1]);
+
+  *tasks_count += tasks_len;
+}
+
+/* Allocation functions counting the allocations made by raqm */
+typedef struct {
+  size_t allocs;
+  size_t live;
+} alloc_stats_t;
+
+static void *
+counting_malloc (size_t size, void *user_data)
+{
+  alloc_stats_t *stats = user_data;
+  void *ptr = malloc (size);
+
+  if (ptr)
+  {
+    stats->allocs++;
+    stats->live++;
+  }
+
+  return ptr;
+}
+
+static void *
+counting_realloc (void *ptr, size_t size, void *user_data)
+{
+  alloc_stats_t *stats = user_data;
+  void *new_ptr = realloc (ptr, size);
+
+  if (new_ptr)
+  {
+    stats->allocs++;
+    if (!ptr)
+      stats->live++;
+  }
+
+  return new_ptr;
+}
+
+static void
+counting_free (void *ptr, void *user_data)
+{
+  alloc_stats_t *stats = user_data;
+
+  if (ptr)
+    stats->live--;
+
+  free (ptr);
+}
+
+static void
+count_phases (raqm_t       *rq,
+              raqm_phase_t  phase,
+              uint64_t      ns,
+              void         *user_data)
+{
+  size_t *phases = user_data;
+
+  (void) rq;
+  (void) ns;
+  assert (phase < RAQM_PHASE_COUNT);
+  phases[phase]++;
+}
+
+/* Make sure raqm_get_glyph_arrays() and raqm_get_glyph_runs() agree with
+ * raqm_get_glyphs(). */
+static void
+check_glyph_arrays (raqm_t       *rq,
+                    raqm_glyph_t *glyphs,
+                    size_t        count)
+{
+  unsigned int *indices;
+  int *x_advances, *y_advances, *x_offsets, *y_offsets;
+  uint32_t *clusters;
+  raqm_glyph_run_t *runs;
+  size_t len, runs_len = 0;
+
+  assert (raqm_get_glyph_arrays (rq, &len, NULL, NULL, NULL, NULL, NULL, NULL));
+  assert (len == count);
+
+  indices = malloc (sizeof (unsigned int) * count + 1);
+  x_advances = malloc (sizeof (int) * count + 1);
+  y_advances = malloc (sizeof (int) * count + 1);
+  x_offsets = malloc (sizeof (int) * count + 1);
+  y_offsets = malloc (sizeof (int) * count + 1);
+  clusters = malloc (sizeof (uint32_t) * count + 1);
+
+  assert (raqm_get_glyph_arrays (rq, &len, indices, x_advances, y_advances,
+                                 x_offsets, y_offsets, clusters));
+  for (size_t i = 0; i < count; i++)
+  {
+    assert (indices[i] == glyphs[i].index);
+    assert (x_advances[i] == glyphs[i].x_advance);
+    assert (y_advances[i] == glyphs[i].y_advance);
+    assert (x_offsets[i] == glyphs[i].x_offset);
+    assert (y_offsets[i] == glyphs[i].y_offset);
+    assert (clusters[i] == glyphs[i].cluster);
+  }
+
+  assert (!raqm_get_glyph_runs (rq, NULL, &runs_len));
+  runs = malloc (sizeof (raqm_glyph_run_t) * runs_len + 1);
+  assert (raqm_get_glyph_runs (rq, runs, &runs_len));
+
+  len = 0;
+  for (size_t i = 0; i < runs_len; i++)
+  {
+    assert (runs[i].start == len);
+    for (size_t j = runs[i].start; j < runs[i].start + runs[i].len; j++)
+      assert (glyphs[j].ftface == runs[i].ftface);
+    len += runs[i].len;
+  }
+  assert (len == count);
+
+  free (indices);
+  free (x_advances);
+  free (y_advances);
+  free (x_offsets);
+  free (y_offsets);
+  free (clusters);
+  free (runs);
+}
+
+/* Make sure the lines from raqm_get_lines() cover the text and the glyphs
+ * in order. */
+static void
+check_lines (raqm_t             *rq,
+             const raqm_glyph_t *glyphs,
+             size_t              count)
+{
+  raqm_line_t *lines;
+  size_t lines_len = 0, start = 0, glyph_start = 0;
+
+  raqm_get_lines (rq, NULL, &lines_len);
+  lines = malloc (sizeof (raqm_line_t) * lines_len + 1);
+  assert (raqm_get_lines (rq, lines, &lines_len));
+
+  for (size_t i = 0; i < lines_len; i++)
+  {
+    bool first = false;
+
+    assert (lines[i].start == start);
+    assert (lines[i].len > 0);
+    assert (lines[i].glyph_start == glyph_start);
+    assert (i == 0 ? lines[i].y == 0 : lines[i].y >= lines[i - 1].y);
+
+    /* The glyphs of a line come from its characters, and lines do not
+     * start inside a cluster */
+    for (size_t j = 0; j < lines[i].glyph_len; j++)
+    {
+      uint32_t cluster = glyphs[lines[i].glyph_start + j].cluster;
+      assert (cluster >= lines[i].start &&
+              cluster < lines[i].start + lines[i].len);
+      if (cluster == lines[i].start)
+        first = true;
+    }
+    assert (first || lines[i].glyph_len == 0);
+    start += lines[i].len;
+    glyph_start += lines[i].glyph_len;
+  }
+  assert (glyph_start == count);
+
+  /* Runs of white space at the end of a line, other than the last one, have
+   * the paragraph direction (rule L1) */
+  if (lines_len > 1 && !utf16)
+  {
+    raqm_direction_t par_dir = raqm_get_par_resolved_direction (rq);
+    raqm_glyph_run_t *runs;
+    size_t runs_len = 0, line = 0;
+
+    raqm_get_glyph_runs (rq, NULL, &runs_len);
+    runs = malloc (sizeof (raqm_glyph_run_t) * runs_len + 1);
+    assert (raqm_get_glyph_runs (rq, runs, &runs_len));
+
+    for (size_t i = 0; i < runs_len; i++)
+    {
+      size_t end, ws;
+      bool spaces = runs[i].len > 0;
+
+      while (runs[i].start >= lines[line].glyph_start + lines[line].glyph_len)
+        line++;
+      if (line + 1 == lines_len)
+        break;
+
+      end = lines[line].start + lines[line].len;
+      for (ws = end; ws > lines[line].start && text[ws - 1] == ' '; ws--)
+        ;
+
+      for (size_t j = runs[i].start; j < runs[i].start + runs[i].len; j++)
+      {
+        if (glyphs[j].cluster < ws)
+          spaces = false;
+      }
+      assert (!spaces || runs[i].direction == par_dir);
+    }
+
+    free (runs);
+  }
+
+  free (lines);
+}
+
+/* Make sure a frozen layout result matches the layout of @rq, and return a
+ * copy of its glyphs. */
+static raqm_glyph_t *
+check_result (raqm_t                     *rq,
+              const raqm_layout_result_t *result)
+{
+  const raqm_glyph_t *glyphs;
+  const raqm_glyph_run_t *result_runs;
+  const raqm_line_t *result_lines;
+  raqm_glyph_run_t *runs;
+  raqm_line_t *lines;
+  raqm_glyph_t *copy;
+  size_t count, len, runs_len = 0, lines_len = 0;
+  unsigned int *indices;
+  uint32_t *clusters;
+
+  glyphs = raqm_layout_result_get_glyphs (result, &count);
+  assert (glyphs != NULL || count == 0);
+  assert (raqm_get_glyph_arrays (rq, &len, NULL, NULL, NULL, NULL, NULL, NULL));
+  assert (len == count);
+
+  indices = malloc (sizeof (unsigned int) * count + 1);
+  clusters = malloc (sizeof (uint32_t) * count + 1);
+  assert (raqm_get_glyph_arrays (rq, &len, indices, NULL, NULL, NULL, NULL,
+                                 clusters));
+  for (size_t i = 0; i < count; i++)
+  {
+    assert (indices[i] == glyphs[i].index);
+    assert (clusters[i] == glyphs[i].cluster);
+  }
+
+  raqm_get_glyph_runs (rq, NULL, &runs_len);
+  runs = malloc (sizeof (raqm_glyph_run_t) * runs_len + 1);
+  assert (raqm_get_glyph_runs (rq, runs, &runs_len));
+  result_runs = raqm_layout_result_get_glyph_runs (result, &len);
+  assert (len == runs_len);
+  assert (len == 0 ||
+          memcmp (runs, result_runs, sizeof (raqm_glyph_run_t) * len) == 0);
+
+  raqm_get_lines (rq, NULL, &lines_len);
+  lines = malloc (sizeof (raqm_line_t) * lines_len + 1);
+  assert (raqm_get_lines (rq, lines, &lines_len));
+  result_lines = raqm_layout_result_get_lines (result, &len);
+  assert (len == lines_len);
+  assert (len == 0 ||
+          memcmp (lines, result_lines, sizeof (raqm_line_t) * len) == 0);
+
+  assert (raqm_layout_result_get_par_resolved_direction (result) ==
+          raqm_get_par_resolved_direction (rq));
+
+  copy = malloc (sizeof (raqm_glyph_t) * count + 1);
+  if (count)
+    memcpy (copy, glyphs, sizeof (raqm_glyph_t) * count);
+
+  free (indices);
+  free (clusters);
+  free (runs);
+  free (lines);
+
+  return copy;
+}
 
 /* Special exit code, recognized by automake that we're skipping a test. */
 static const int skip_exit_status = 77;
@@ -80,6 +385,548 @@ encode_bytes (const char *bytes)
   return ret;
 }
 
+static uint32_t *
+decode_utf8 (const char *s,
+             size_t     *len)
+{
+  const unsigned char *p = (const unsigned char *) s;
+  uint32_t *ret = malloc (sizeof (uint32_t) * (strlen (s) + 1));
+
+  *len = 0;
+  while (*p)
+  {
+    if (*p >= 0xf0)
+    {
+      ret[*len] = ((p[0] & 0x07) << 18) | ((p[1] & 0x3f) << 12) |
+                  ((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+      p += 4;
+    }
+    else if (*p >= 0xe0)
+    {
+      ret[*len] = ((p[0] & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+      p += 3;
+    }
+    else if (*p >= 0xc0)
+    {
+      ret[*len] = ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+      p += 2;
+    }
+    else
+    {
+      ret[*len] = *p;
+      p += 1;
+    }
+    (*len)++;
+  }
+
+  return ret;
+}
+
+/* Set the text of @rq, encoded in UTF-16 if --utf16 was given */
+static void
+set_text (raqm_t *rq)
+{
+  size_t len, utf16_len = 0;
+  uint32_t *unicode;
+  uint16_t *utf16_text;
+
+  if (!utf16)
+  {
+    assert (raqm_set_text_utf8 (rq, text, strlen (text)));
+    return;
+  }
+
+  unicode = decode_utf8 (text, &len);
+  utf16_text = malloc (sizeof (uint16_t) * (len * 2 + 1));
+  for (size_t i = 0; i < len; i++)
+  {
+    if (unicode[i] >= 0x10000)
+    {
+      utf16_text[utf16_len++] = 0xD800 + ((unicode[i] - 0x10000) >> 10);
+      utf16_text[utf16_len++] = 0xDC00 + ((unicode[i] - 0x10000) & 0x3FF);
+    }
+    else
+      utf16_text[utf16_len++] = unicode[i];
+  }
+
+  assert (raqm_set_text_utf16 (rq, utf16_text, utf16_len));
+  free (utf16_text);
+  free (unicode);
+}
+
+/* Convert an index in the units of the text to the index of the codepoint
+ * containing it, as raqm does */
+static size_t
+codepoint_index (size_t units)
+{
+  size_t index = 0, i = 0, len;
+  uint32_t *unicode;
+
+  if (!utf16)
+  {
+    for (; i < units && text[i]; i++)
+      if ((text[i] & 0xC0) != 0x80)
+        index++;
+    if (i == units && (text[i] & 0xC0) == 0x80)
+      index--;
+    return index;
+  }
+
+  unicode = decode_utf8 (text, &len);
+  for (; i < units && index < len; index++)
+    i += unicode[index] >= 0x10000 ? 2 : 1;
+  if (i > units)
+    index--;
+  free (unicode);
+
+  return index;
+}
+
+/* Add the --font-features to @rq, through a feature set with
+ * --feature-set */
+static void
+add_features (raqm_t *rq)
+{
+  raqm_feature_set_t *set = NULL;
+  char *copy;
+
+  if (!features)
+    return;
+
+  copy = strdup (features);
+  if (feature_set)
+    set = raqm_feature_set_create ();
+  for (char *tok = strtok (copy, ","); tok; tok = strtok (NULL, ","))
+  {
+    if (set)
+      assert (raqm_feature_set_add (set, tok, -1));
+    else
+      assert (raqm_add_font_feature (rq, tok, -1));
+  }
+  if (set)
+  {
+    assert (raqm_add_font_feature_set (rq, set));
+    raqm_feature_set_destroy (set);
+  }
+  free (copy);
+}
+
+/* Add the --range-features to @rq, or with @as_strings the same features
+ * with their codepoint ranges in the feature strings */
+static void
+add_range_features (raqm_t *rq,
+                    bool    as_strings)
+{
+  char *copy;
+
+  if (!range_features)
+    return;
+
+  if (!as_strings)
+  {
+    /* Ranges that overflow or do not fit the text must be rejected, and so
+     * must any range when there is no text */
+    raqm_t *empty = raqm_create ();
+
+    assert (!raqm_add_font_feature_range (empty, "kern", -1, 0, 1));
+    raqm_destroy (empty);
+    assert (!raqm_add_font_feature_range (rq, "kern", -1, 1, SIZE_MAX));
+    if (SIZE_MAX > UINT32_MAX)
+      assert (!raqm_add_font_feature_range (rq, "kern", -1,
+                                            (size_t) UINT32_MAX + 1, 0));
+  }
+
+  copy = strdup (range_features);
+  for (char *tok = strtok (copy, ","); tok; tok = strtok (NULL, ","))
+  {
+    size_t start, length;
+    char feature[64];
+
+    start = atoi (strtok (NULL, ","));
+    length = atoi (strtok (NULL, ","));
+    if (!as_strings)
+    {
+      assert (raqm_add_font_feature_range (rq, tok, -1, start, length));
+      continue;
+    }
+
+    snprintf (feature, sizeof (feature), "%s[%zu:%zu]", tok,
+              codepoint_index (start), codepoint_index (start + length));
+    assert (raqm_add_font_feature (rq, feature, -1));
+  }
+  free (copy);
+}
+
+/* Round @value to a multiple of 2^@shift, divided by 2^@shift */
+static long
+quantize (int          value,
+          unsigned int shift)
+{
+  long rounded = value + (shift ? 1L << (shift - 1) : 0);
+  long unit = 1L << shift;
+
+  /* Division rounding down, for negative values too */
+  if (rounded >= 0)
+    return rounded / unit;
+  return -((unit - 1 - rounded) / unit);
+}
+
+static bool
+fits_int16 (long value)
+{
+  return value >= INT16_MIN && value <= INT16_MAX;
+}
+
+/* Make sure the packed glyphs match the glyphs and runs of the layout, with
+ * exact and whole pixel positions */
+static void
+check_packed_glyphs (raqm_t             *rq,
+                     const raqm_glyph_t *glyphs,
+                     size_t              count)
+{
+  raqm_glyph_run_t *runs;
+  size_t runs_len = 0;
+
+  raqm_get_glyph_runs (rq, NULL, &runs_len);
+  runs = malloc (sizeof (raqm_glyph_run_t) * runs_len);
+  assert (raqm_get_glyph_runs (rq, runs, &runs_len));
+
+  for (unsigned int shift = 0; shift <= 6; shift += 6)
+  {
+    size_t size = 0;
+    char *buffer, *p;
+    bool fits = true;
+
+    for (size_t i = 0; i < count; i++)
+    {
+      fits = fits && glyphs[i].index <= UINT16_MAX &&
+             fits_int16 (quantize (glyphs[i].x_advance, shift)) &&
+             fits_int16 (quantize (glyphs[i].y_advance, shift)) &&
+             fits_int16 (quantize (glyphs[i].x_offset, shift)) &&
+             fits_int16 (quantize (glyphs[i].y_offset, shift));
+    }
+
+    assert (raqm_get_packed_glyphs (rq, shift, NULL, &size) == (size == 0));
+    buffer = malloc (size);
+    assert (raqm_get_packed_glyphs (rq, shift, buffer, &size) == fits);
+    if (!fits)
+    {
+      assert (size == 0);
+      free (buffer);
+      continue;
+    }
+
+    p = buffer;
+    for (size_t i = 0; i < runs_len; i++)
+    {
+      const raqm_packed_run_t *header = (const raqm_packed_run_t *) p;
+      const raqm_packed_glyph_t *packed_glyphs =
+        (const raqm_packed_glyph_t *) (header + 1);
+
+      assert (header->ftface == runs[i].ftface);
+      assert (header->start == runs[i].start);
+      assert (header->len == runs[i].len);
+      assert (header->direction == runs[i].direction);
+      assert (header->size >= sizeof (raqm_packed_run_t) +
+                              sizeof (raqm_packed_glyph_t) * header->len);
+
+      for (size_t j = 0; j < header->len; j++)
+      {
+        const raqm_glyph_t *glyph = &glyphs[header->start + j];
+
+        assert (packed_glyphs[j].index == glyph->index);
+        assert (packed_glyphs[j].x_advance == quantize (glyph->x_advance, shift));
+        assert (packed_glyphs[j].y_advance == quantize (glyph->y_advance, shift));
+        assert (packed_glyphs[j].x_offset == quantize (glyph->x_offset, shift));
+        assert (packed_glyphs[j].y_offset == quantize (glyph->y_offset, shift));
+      }
+
+      p += header->size;
+    }
+    assert (p == buffer + size);
+
+    /* A short buffer only gets the size */
+    if (size)
+    {
+      size_t short_size = size - 1;
+      assert (!raqm_get_packed_glyphs (rq, shift, buffer, &short_size));
+      assert (short_size == size);
+    }
+
+    free (buffer);
+  }
+
+  free (runs);
+}
+
+/* Make sure the extents of the layout match its glyphs and the extents of
+ * its runs */
+static void
+check_extents (raqm_t             *rq,
+               const raqm_glyph_t *glyphs,
+               size_t              count)
+{
+  raqm_extents_t layout_extents, again, run_extents;
+  raqm_glyph_run_t *runs;
+  size_t runs_len = 0, lines_len = 0;
+  int x_advance = 0, y_advance = 0, x = 0, y = 0;
+  bool has_ink = false;
+
+  assert (raqm_get_extents (rq, &layout_extents));
+  for (size_t i = 0; i < count; i++)
+  {
+    x_advance += glyphs[i].x_advance;
+    y_advance += glyphs[i].y_advance;
+  }
+  assert (layout_extents.x_advance == x_advance);
+  assert (layout_extents.y_advance == y_advance);
+  assert (layout_extents.x_min <= layout_extents.x_max);
+  assert (layout_extents.y_min <= layout_extents.y_max);
+
+  /* The second time comes from the extents cache */
+  assert (raqm_get_extents (rq, &again));
+  assert (memcmp (&layout_extents, &again, sizeof (raqm_extents_t)) == 0);
+
+  raqm_get_glyph_runs (rq, NULL, &runs_len);
+  runs = malloc (sizeof (raqm_glyph_run_t) * runs_len + 1);
+  assert (raqm_get_glyph_runs (rq, runs, &runs_len));
+  assert (!raqm_get_glyph_run_extents (rq, runs_len, &run_extents));
+  raqm_get_lines (rq, NULL, &lines_len);
+
+  /* On a single line, the runs follow each other */
+  for (size_t i = 0; i < runs_len; i++)
+  {
+    int run_x_advance = 0, run_y_advance = 0;
+
+    assert (raqm_get_glyph_run_extents (rq, i, &run_extents));
+    for (size_t j = runs[i].start; j < runs[i].start + runs[i].len; j++)
+    {
+      run_x_advance += glyphs[j].x_advance;
+      run_y_advance += glyphs[j].y_advance;
+    }
+    assert (run_extents.x_advance == run_x_advance);
+    assert (run_extents.y_advance == run_y_advance);
+
+    if (lines_len == 1 &&
+        (run_extents.x_min != run_extents.x_max ||
+         run_extents.y_min != run_extents.y_max))
+    {
+      assert (run_extents.x_min + x >= layout_extents.x_min);
+      assert (run_extents.x_max + x <= layout_extents.x_max);
+      assert (run_extents.y_min + y >= layout_extents.y_min);
+      assert (run_extents.y_max + y <= layout_extents.y_max);
+      if (run_extents.x_min + x == layout_extents.x_min ||
+          run_extents.x_max + x == layout_extents.x_max)
+        has_ink = true;
+    }
+
+    x += run_x_advance;
+    y += run_y_advance;
+  }
+  assert (lines_len != 1 || has_ink ||
+          (layout_extents.x_min == 0 && layout_extents.x_max == 0));
+  free (runs);
+}
+
+/* The state of the paragraphs checked by check_paragraph () */
+typedef struct {
+  FT_Face face;
+  raqm_direction_t dir;
+  size_t offset;
+  size_t count;
+} paragraphs_t;
+
+/* Make sure each paragraph follows the previous one, and matches a layout of
+ * its text alone */
+static bool
+check_paragraph (raqm_t *rq,
+                 size_t  offset,
+                 size_t  len,
+                 void   *user_data)
+{
+  paragraphs_t *state = user_data;
+  raqm_t *fresh;
+  raqm_glyph_t *glyphs, *fresh_glyphs;
+  size_t count, fresh_count;
+
+  assert (offset == state->offset);
+  assert (len > 0 && offset + len <= strlen (text));
+
+  fresh = raqm_create ();
+  assert (raqm_set_text_utf8 (fresh, text + offset, len));
+  assert (raqm_set_par_direction (fresh, state->dir));
+  assert (raqm_set_freetype_face (fresh, state->face));
+  assert (raqm_set_fallback_faces (fresh, fallback_faces, fallback_faces_len));
+  add_features (fresh);
+  if (invisible_glyph)
+    assert (raqm_set_invisible_glyph (fresh, invisible_glyph));
+  if (line_width)
+    assert (raqm_set_line_width (fresh, line_width));
+  assert (raqm_layout (fresh));
+
+  glyphs = raqm_get_glyphs (rq, &count);
+  fresh_glyphs = raqm_get_glyphs (fresh, &fresh_count);
+  assert (fresh_count == count);
+  assert (count == 0 ||
+          memcmp (glyphs, fresh_glyphs, sizeof (raqm_glyph_t) * count) == 0);
+  raqm_destroy (fresh);
+
+  state->offset += len;
+  state->count++;
+
+  return true;
+}
+
+/* Read the text a few bytes at a time, to split separators between reads */
+static size_t
+read_text (char   *buffer,
+           size_t  size,
+           void   *user_data)
+{
+  size_t *pos = user_data;
+  size_t len = strlen (text) - *pos;
+
+  if (len > 3)
+    len = 3;
+  if (len > size)
+    len = size;
+
+  memcpy (buffer, text + *pos, len);
+  *pos += len;
+
+  return len;
+}
+
+/* The raqm_bidi_func_t used with --bidi-func, calling the bidi library
+ * directly and counting its calls in @user_data */
+static bool
+library_bidi (const uint32_t   *text,
+              size_t            len,
+              raqm_direction_t  base_dir,
+              uint8_t          *levels,
+              uint8_t          *par_level,
+              void             *user_data)
+{
+  size_t *calls = user_data;
+#ifdef RAQM_TEST_SHEENBIDI
+  SBCodepointSequence input = { SBStringEncodingUTF32, (void *) text, len };
+  SBLevel base_level = SBLevelDefaultLTR;
+  SBAlgorithmRef bidi;
+  SBParagraphRef par;
+  SBLineRef line;
+  const SBRun *runs;
+
+  if (base_dir == RAQM_DIRECTION_RTL)
+    base_level = 1;
+  else if (base_dir == RAQM_DIRECTION_LTR)
+    base_level = 0;
+
+  bidi = SBAlgorithmCreate (&input);
+  par = SBAlgorithmCreateParagraph (bidi, 0, INT32_MAX, base_level);
+  line = SBParagraphCreateLine (par, 0, SBParagraphGetLength (par));
+  runs = SBLineGetRunsPtr (line);
+  for (size_t i = 0; i < SBLineGetRunCount (line); i++)
+    memset (levels + runs[i].offset, runs[i].level, runs[i].length);
+  *par_level = SBParagraphGetBaseLevel (par);
+
+  SBLineRelease (line);
+  SBParagraphRelease (par);
+  SBAlgorithmRelease (bidi);
+#else
+  FriBidiParType par_type = FRIBIDI_PAR_ON;
+  FriBidiCharType *types = malloc (sizeof (FriBidiCharType) * len);
+  FriBidiBracketType *btypes = malloc (sizeof (FriBidiBracketType) * len);
+  FriBidiLevel *fribidi_levels = malloc (sizeof (FriBidiLevel) * len);
+
+  assert (types && btypes && fribidi_levels);
+
+  if (base_dir == RAQM_DIRECTION_RTL)
+    par_type = FRIBIDI_PAR_RTL;
+  else if (base_dir == RAQM_DIRECTION_LTR)
+    par_type = FRIBIDI_PAR_LTR;
+
+  fribidi_get_bidi_types (text, len, types);
+  fribidi_get_bracket_types (text, len, types, btypes);
+  assert (fribidi_get_par_embedding_levels_ex (types, btypes, len, &par_type,
+                                               fribidi_levels));
+
+  /* Rule L1, for trailing white space */
+  for (size_t i = len;
+       i > 0 && FRIBIDI_IS_EXPLICIT_OR_BN_OR_WS (types[i - 1]); i--)
+    fribidi_levels[i - 1] = FRIBIDI_DIR_TO_LEVEL (par_type);
+
+  for (size_t i = 0; i < len; i++)
+    levels[i] = fribidi_levels[i];
+  *par_level = FRIBIDI_DIR_TO_LEVEL (par_type);
+
+  free (types);
+  free (btypes);
+  free (fribidi_levels);
+#endif
+
+  (*calls)++;
+
+  return true;
+}
+
+/* A raqm_bidi_func_t that puts all the text at level 0, to get levels that
+ * differ from the bidi library */
+static bool
+ltr_bidi (const uint32_t   *text,
+          size_t            len,
+          raqm_direction_t  base_dir,
+          uint8_t          *levels,
+          uint8_t          *par_level,
+          void             *user_data)
+{
+  (void) text;
+  (void) base_dir;
+  (void) user_data;
+
+  memset (levels, 0, len);
+  *par_level = 0;
+
+  return true;
+}
+
+/* Lay the text out with a new raqm_t, using the face at its current size */
+static raqm_t *
+layout_fresh (FT_Face          face,
+              raqm_direction_t dir)
+{
+  raqm_t *rq = raqm_create ();
+
+  set_text (rq);
+  assert (raqm_set_par_direction (rq, dir));
+  assert (raqm_set_freetype_face (rq, face));
+  assert (raqm_set_fallback_faces (rq, fallback_faces, fallback_faces_len));
+  if (invisible_glyph)
+    assert (raqm_set_invisible_glyph (rq, invisible_glyph));
+  if (line_width)
+    assert (raqm_set_line_width (rq, line_width));
+  assert (raqm_layout (rq));
+
+  return rq;
+}
+
+/* Lay the text out with @rq, using @face up to the UTF-8 offset @split and
+ * @second after it */
+static void
+layout_split (raqm_t           *rq,
+              FT_Face           face,
+              FT_Face           second,
+              size_t            split,
+              raqm_direction_t  dir)
+{
+  raqm_clear_contents (rq);
+  set_text (rq);
+  assert (raqm_set_par_direction (rq, dir));
+  assert (raqm_set_freetype_face (rq, face));
+  assert (raqm_set_freetype_face_range (rq, second, split,
+                                        strlen (text) - split));
+  assert (raqm_layout (rq));
+}
+
 static bool
 parse_args (int argc, char **argv)
 {
@@ -100,6 +947,10 @@ parse_args (int argc, char **argv)
       direction = argv[++i];
     else if (strcmp (argv[i], "--font-features") == 0)
       features = argv[++i];
+    else if (strcmp (argv[i], "--feature-set") == 0)
+      feature_set = true;
+    else if (strcmp (argv[i], "--range-features") == 0)
+      range_features = argv[++i];
     else if (strcmp (argv[i], "--require") == 0)
       require = argv[++i];
     else if (strcmp (argv[i], "--cluster") == 0)
@@ -108,6 +959,42 @@ parse_args (int argc, char **argv)
       position = atoi (argv[++i]);
     else if (strcmp (argv[i], "--invisible-glyph") == 0)
       invisible_glyph = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--font-cache") == 0)
+      font_cache = true;
+    else if (strcmp (argv[i], "--shape-cache") == 0)
+      shape_cache = true;
+    else if (strcmp (argv[i], "--shape-tasks") == 0)
+      shape_tasks = true;
+    else if (strcmp (argv[i], "--batch") == 0)
+      batch = true;
+    else if (strcmp (argv[i], "--replace") == 0)
+      replace = argv[++i];
+    else if (strcmp (argv[i], "--allocator") == 0)
+      allocator = true;
+    else if (strcmp (argv[i], "--stats") == 0)
+      stats = true;
+    else if (strcmp (argv[i], "--line-width") == 0)
+      line_width = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--relayout") == 0)
+      relayout = true;
+    else if (strcmp (argv[i], "--utf16") == 0)
+      utf16 = true;
+    else if (strcmp (argv[i], "--fallback-fonts") == 0)
+      fallback_fonts = argv[++i];
+    else if (strcmp (argv[i], "--freeze") == 0)
+      freeze = true;
+    else if (strcmp (argv[i], "--layout-cache") == 0)
+      layout_cache = true;
+    else if (strcmp (argv[i], "--paragraphs") == 0)
+      paragraphs = true;
+    else if (strcmp (argv[i], "--extents") == 0)
+      extents = true;
+    else if (strcmp (argv[i], "--bidi-func") == 0)
+      bidi_func = true;
+    else if (strcmp (argv[i], "--trim-memory") == 0)
+      trim_memory = true;
+    else if (strcmp (argv[i], "--packed") == 0)
+      packed = true;
     else
     {
       fprintf (stderr, "Unknown option: %s\n", argv[i]);
@@ -146,6 +1033,11 @@ main (int argc, char **argv)
   FT_Face face;
 
   raqm_t *rq;
+  raqm_font_cache_t *cache = NULL;
+  size_t tasks_count = 0;
+  size_t bidi_calls = 0;
+  alloc_stats_t alloc_stats = { 0, 0 };
+  size_t phases[RAQM_PHASE_COUNT] = { 0 };
   raqm_glyph_t *glyphs;
   size_t count, start_index, index;
   raqm_direction_t dir;
@@ -189,8 +1081,107 @@ main (int argc, char **argv)
   else if (direction && strcmp(direction, "ttb") == 0)
     dir = RAQM_DIRECTION_TTB;
 
-  rq = raqm_create ();
-  assert (raqm_set_text_utf8 (rq, text, strlen (text)));
+  if ((font_cache || shape_cache || allocator) && (fonts || languages))
+  {
+    fprintf (stderr, "--font-cache, --shape-cache and --allocator can't be "
+                     "used with --fonts or --languages.\n");
+    return 1;
+  }
+
+  if (replace &&
+      (fonts || languages || features || font_cache || shape_cache || batch))
+  {
+    fprintf (stderr, "--replace can't be used with --fonts, --languages, "
+                     "--font-features, --font-cache, --shape-cache or "
+                     "--batch.\n");
+    return 1;
+  }
+
+  if (batch && (fonts || languages || font_cache || shape_cache))
+  {
+    fprintf (stderr, "--batch can't be used with --fonts, --languages, "
+                     "--font-cache or --shape-cache.\n");
+    return 1;
+  }
+
+  if (relayout && (fonts || languages || features || replace || batch))
+  {
+    fprintf (stderr, "--relayout can't be used with --fonts, --languages, "
+                     "--font-features, --replace or --batch.\n");
+    return 1;
+  }
+
+  if (range_features && (fonts || languages || replace || relayout || batch))
+  {
+    fprintf (stderr, "--range-features can't be used with --fonts, "
+                     "--languages, --replace, --relayout or --batch.\n");
+    return 1;
+  }
+
+  if (paragraphs && (fonts || languages || range_features))
+  {
+    fprintf (stderr, "--paragraphs can't be used with --fonts, --languages "
+                     "or --range-features.\n");
+    return 1;
+  }
+
+  if (bidi_func &&
+      (fonts || languages || features || range_features || replace || batch ||
+       paragraphs))
+  {
+    fprintf (stderr, "--bidi-func can't be used with --fonts, --languages, "
+                     "--font-features, --range-features, --replace, --batch "
+                     "or --paragraphs.\n");
+    return 1;
+  }
+
+  if (trim_memory && (fonts || languages || replace || batch || paragraphs))
+  {
+    fprintf (stderr, "--trim-memory can't be used with --fonts, --languages, "
+                     "--replace, --batch or --paragraphs.\n");
+    return 1;
+  }
+
+  if (utf16 && (replace || batch))
+  {
+    fprintf (stderr, "--utf16 can't be used with --replace or --batch.\n");
+    return 1;
+  }
+
+  if (allocator)
+  {
+    raqm_allocator_t funcs = {
+      counting_malloc, counting_realloc, counting_free, &alloc_stats
+    };
+    rq = raqm_create_with_allocator (&funcs);
+  }
+  else
+    rq = raqm_create ();
+  if (font_cache)
+  {
+    cache = raqm_font_cache_create ();
+    assert (raqm_set_font_cache (rq, cache));
+  }
+  if (shape_cache)
+    assert (raqm_set_shape_cache_size (rq, 64));
+  if (stats)
+  {
+    assert (raqm_set_stats_enabled (rq, true));
+    assert (raqm_set_trace_func (rq, count_phases, phases));
+  }
+  if (shape_tasks)
+    assert (raqm_set_shape_tasks_func (rq, run_tasks_reversed, &tasks_count, 0));
+  if (bidi_func)
+    assert (raqm_set_bidi_func (rq, library_bidi, &bidi_calls));
+  if (replace)
+  {
+    size_t len;
+    uint32_t *unicode = decode_utf8 (text, &len);
+    assert (raqm_set_text (rq, unicode, len));
+    free (unicode);
+  }
+  else
+    set_text (rq);
   assert (raqm_set_par_direction (rq, dir));
   assert (!FT_Init_FreeType (&library));
 
@@ -211,6 +1202,19 @@ main (int argc, char **argv)
     assert (raqm_set_freetype_face (rq, face));
   }
 
+  if (fallback_fonts)
+  {
+    for (char *tok = strtok (fallback_fonts, ","); tok; tok = strtok (NULL, ","))
+    {
+      FT_Face *fallback_face = &fallback_faces[fallback_faces_len++];
+      assert (fallback_faces_len <= 8);
+      assert (!FT_New_Face (library, tok, 0, fallback_face));
+      assert (!FT_Set_Char_Size (*fallback_face, (*fallback_face)->units_per_EM,
+                                 0, 0, 0));
+    }
+    assert (raqm_set_fallback_faces (rq, fallback_faces, fallback_faces_len));
+  }
+
   if (languages)
   {
     for (char *tok = strtok (languages, ","); tok; tok = strtok (NULL, ","))
@@ -222,33 +1226,578 @@ main (int argc, char **argv)
     }
   }
 
-  if (features)
-  {
-    for (char *tok = strtok (features, ","); tok; tok = strtok (NULL, ","))
-      assert (raqm_add_font_feature (rq, tok, -1));
-  }
+  add_features (rq);
+  add_range_features (rq, false);
 
   if (invisible_glyph)
   {
     assert (raqm_set_invisible_glyph (rq, invisible_glyph));
   }
 
+  if (line_width)
+    assert (raqm_set_line_width (rq, line_width));
+
   assert (raqm_layout (rq));
+  assert (!shape_tasks || tasks_count > 0);
 
   glyphs = raqm_get_glyphs (rq, &count);
   assert (glyphs != NULL || count == 0);
+  check_glyph_arrays (rq, glyphs, count);
+  check_lines (rq, glyphs, count);
+  if (extents)
+    check_extents (rq, glyphs, count);
+  if (packed)
+    check_packed_glyphs (rq, glyphs, count);
+
+  if (stats)
+  {
+    raqm_stats_t layout_stats;
+
+    assert (raqm_get_stats (rq, &layout_stats));
+    assert (layout_stats.layouts == 1);
+    assert (layout_stats.glyphs == count);
+    assert (layout_stats.runs >= layout_stats.bidi_runs);
+    for (int i = 0; i < RAQM_PHASE_COUNT; i++)
+      assert (phases[i] == 1);
+  }
+
+  if (bidi_func)
+  {
+    /* The output must match the built-in bidi implementation, and laying the
+     * text out again with a new face must reuse the bidi runs */
+    raqm_t *fresh;
+    raqm_glyph_t *fresh_glyphs;
+    size_t fresh_count;
+    size_t calls = bidi_calls;
+
+    assert (calls <= 1);
+
+    assert (raqm_set_freetype_face (rq, face));
+    assert (raqm_layout (rq));
+    assert (bidi_calls == calls);
+
+    glyphs = raqm_get_glyphs (rq, &count);
+    fresh = layout_fresh (face, dir);
+    fresh_glyphs = raqm_get_glyphs (fresh, &fresh_count);
+    assert (fresh_count == count);
+    assert (count == 0 ||
+            memcmp (glyphs, fresh_glyphs, sizeof (raqm_glyph_t) * count) == 0);
+    raqm_destroy (fresh);
+
+    /* A new paragraph direction runs the bidi algorithm again */
+    assert (raqm_set_par_direction (rq, dir == RAQM_DIRECTION_RTL ?
+                                        RAQM_DIRECTION_LTR :
+                                        RAQM_DIRECTION_RTL));
+    assert (raqm_set_par_direction (rq, dir));
+    assert (raqm_layout (rq));
+    assert (bidi_calls == calls * 2);
+    glyphs = raqm_get_glyphs (rq, &count);
+  }
+
+  if (trim_memory)
+  {
+    /* Trimming must keep the current layout and free the memory kept for
+     * reuse once the text is cleared, and laying the text out again must
+     * give the same output */
+    raqm_memory_usage_t usage, trimmed;
+    raqm_glyph_t *kept_glyphs;
+    size_t kept_count;
+
+    assert (raqm_get_memory_usage (rq, &usage));
+    assert (usage.total_bytes > usage.text_bytes + usage.glyph_bytes +
+                                usage.run_bytes + usage.buffer_bytes +
+                                usage.scratch_bytes + usage.other_bytes);
+    assert (usage.runs >= usage.pooled_runs);
+    assert (usage.glyph_bytes >= sizeof (raqm_glyph_t) * count);
+    assert (count == 0 || usage.buffer_bytes > 0);
+
+    assert (raqm_trim_memory (rq, 0));
+    assert (raqm_get_memory_usage (rq, &trimmed));
+    assert (trimmed.text_bytes == usage.text_bytes);
+    assert (trimmed.glyph_bytes == usage.glyph_bytes);
+    assert (trimmed.pooled_runs == 0);
+    assert (trimmed.scratch_bytes == 0);
+
+    kept_glyphs = raqm_get_glyphs (rq, &kept_count);
+    assert (kept_count == count);
+    assert (count == 0 ||
+            memcmp (glyphs, kept_glyphs, sizeof (raqm_glyph_t) * count) == 0);
+    glyphs = malloc (sizeof (raqm_glyph_t) * count);
+    if (count)
+      memcpy (glyphs, kept_glyphs, sizeof (raqm_glyph_t) * count);
+
+    raqm_clear_contents (rq);
+    assert (raqm_get_memory_usage (rq, &usage));
+    assert (raqm_trim_memory (rq, SIZE_MAX));
+    assert (raqm_get_memory_usage (rq, &trimmed));
+    assert (memcmp (&usage, &trimmed, sizeof (raqm_memory_usage_t)) == 0);
+
+    assert (raqm_trim_memory (rq, 0));
+    assert (raqm_get_memory_usage (rq, &trimmed));
+    assert (trimmed.text_bytes == 0);
+    assert (trimmed.glyph_bytes == 0);
+    assert (trimmed.runs == 0);
+    assert (trimmed.buffer_bytes == 0);
+    assert (trimmed.scratch_bytes == 0);
+
+    set_text (rq);
+    assert (raqm_set_freetype_face (rq, face));
+    add_range_features (rq, false);
+    assert (raqm_layout (rq));
+
+    kept_glyphs = raqm_get_glyphs (rq, &kept_count);
+    assert (kept_count == count);
+    assert (count == 0 ||
+            memcmp (glyphs, kept_glyphs, sizeof (raqm_glyph_t) * count) == 0);
+    free (glyphs);
+    glyphs = kept_glyphs;
+  }
+
+  if (font_cache || shape_cache || allocator)
+  {
+    /* Lay the text out again, reusing the cached fonts or shaping results,
+     * and make sure the output did not change. */
+    raqm_glyph_t *cached_glyphs;
+    size_t cached_count;
+    size_t hits, misses;
+    size_t allocs = alloc_stats.allocs;
+
+    cached_glyphs = glyphs;
+    glyphs = malloc (sizeof (raqm_glyph_t) * count);
+    memcpy (glyphs, cached_glyphs, sizeof (raqm_glyph_t) * count);
+
+    raqm_clear_contents (rq);
+    set_text (rq);
+    assert (raqm_set_freetype_face (rq, face));
+    add_range_features (rq, false);
+    assert (raqm_layout (rq));
+
+    cached_glyphs = raqm_get_glyphs (rq, &cached_count);
+    assert (cached_count == count);
+    assert (count == 0 ||
+            memcmp (glyphs, cached_glyphs, sizeof (raqm_glyph_t) * count) == 0);
+    free (glyphs);
+
+    /* Laying out the same text again should reuse all memory */
+    assert (alloc_stats.allocs == allocs);
+
+    if (shape_cache)
+    {
+      assert (raqm_get_shape_cache_stats (rq, &hits, &misses));
+      assert (count == 0 || hits > 0 || range_features);
+    }
+  }
+
+  if (shape_cache && !utf16)
+  {
+    /* Split the text between two faces at each character in turn, and make
+     * sure runs at the same position but of another length, whose context
+     * ends at the end of the text, do not get each other's glyphs */
+    raqm_t *cached = raqm_create ();
+    FT_Face second;
+
+    assert (raqm_set_shape_cache_size (cached, 64));
+    assert (!FT_New_Face (library, font, 0, &second));
+    assert (!FT_Set_Char_Size (second, second->units_per_EM, 0, 0, 0));
+
+    for (size_t split = 1; split < strlen (text); split++)
+    {
+      raqm_t *fresh;
+      raqm_glyph_t *cached_glyphs, *fresh_glyphs;
+      size_t cached_count, fresh_count;
+
+      if ((text[split] & 0xC0) == 0x80)
+        continue;
+
+      fresh = raqm_create ();
+      layout_split (cached, face, second, split, dir);
+      layout_split (fresh, face, second, split, dir);
+
+      cached_glyphs = raqm_get_glyphs (cached, &cached_count);
+      fresh_glyphs = raqm_get_glyphs (fresh, &fresh_count);
+      assert (cached_count == fresh_count);
+      for (size_t i = 0; i < fresh_count; i++)
+      {
+        assert (cached_glyphs[i].index == fresh_glyphs[i].index);
+        assert (cached_glyphs[i].cluster == fresh_glyphs[i].cluster);
+        assert (cached_glyphs[i].x_advance == fresh_glyphs[i].x_advance);
+        assert (cached_glyphs[i].ftface == fresh_glyphs[i].ftface);
+      }
+
+      raqm_destroy (fresh);
+    }
+
+    raqm_destroy (cached);
+    FT_Done_Face (second);
+  }
+
+  if (range_features)
+  {
+    /* Lay the text out again with the ranges in the feature strings, and
+     * make sure the output did not change. */
+    raqm_t *fresh;
+    raqm_glyph_t *fresh_glyphs;
+    size_t fresh_count;
+
+    fresh = raqm_create ();
+    set_text (fresh);
+    assert (raqm_set_par_direction (fresh, dir));
+    assert (raqm_set_freetype_face (fresh, face));
+    assert (raqm_set_fallback_faces (fresh, fallback_faces,
+                                     fallback_faces_len));
+    add_features (fresh);
+    add_range_features (fresh, true);
+    if (invisible_glyph)
+      assert (raqm_set_invisible_glyph (fresh, invisible_glyph));
+    if (line_width)
+      assert (raqm_set_line_width (fresh, line_width));
+    assert (raqm_layout (fresh));
+
+    glyphs = raqm_get_glyphs (rq, &count);
+    fresh_glyphs = raqm_get_glyphs (fresh, &fresh_count);
+    assert (fresh_count == count);
+    assert (count == 0 ||
+            memcmp (glyphs, fresh_glyphs, sizeof (raqm_glyph_t) * count) == 0);
+    raqm_destroy (fresh);
+  }
 
   if (cluster >= 0)
   {
+    size_t graphemes_len = 0, *indices;
+    int *xs, *ys;
+    bool found = false;
+
     index = cluster;
     assert (raqm_index_to_position (rq, &index, &x, &y));
+
+    /* The position must be one of those of all graphemes */
+    raqm_get_grapheme_positions (rq, NULL, NULL, NULL, &graphemes_len);
+    indices = malloc (sizeof (size_t) * (graphemes_len + 1));
+    xs = malloc (sizeof (int) * (graphemes_len + 1));
+    ys = malloc (sizeof (int) * (graphemes_len + 1));
+    assert (raqm_get_grapheme_positions (rq, indices, xs, ys,
+                                         &graphemes_len));
+    for (size_t i = 0; i < graphemes_len; i++)
+      if (indices[i] == index && xs[i] == x && ys[i] == y)
+        found = true;
+    assert (found);
+    free (indices);
+    free (xs);
+    free (ys);
   }
   
   if (position)
     assert (raqm_position_to_index (rq, position, 0, &start_index));
 
+  if (replace)
+  {
+    /* Edit the text and lay it out again, and make sure the output matches a
+     * layout of the edited text from scratch. */
+    raqm_t *fresh;
+    raqm_glyph_t *fresh_glyphs;
+    raqm_stats_t layout_stats;
+    size_t fresh_count, start, len, replacement_len, edited_len;
+    uint32_t *replacement, *edited;
+    char *tok;
+
+    start = atoi (strtok (replace, ","));
+    len = atoi (strtok (NULL, ","));
+    tok = strtok (NULL, ",");
+    replacement = decode_utf8 (tok ? tok : "", &replacement_len);
+
+    assert (raqm_replace_text (rq, start, len, replacement, replacement_len));
+    assert (raqm_layout (rq));
+    glyphs = raqm_get_glyphs (rq, &count);
+    assert (glyphs != NULL || count == 0);
+
+    edited = decode_utf8 (text, &edited_len);
+    memmove (edited + start + replacement_len, edited + start + len,
+             sizeof (uint32_t) * (edited_len - start - len));
+    memcpy (edited + start, replacement, sizeof (uint32_t) * replacement_len);
+    edited_len = edited_len - len + replacement_len;
+
+    fresh = raqm_create ();
+    assert (raqm_set_text (fresh, edited, edited_len));
+    assert (raqm_set_par_direction (fresh, dir));
+    assert (raqm_set_freetype_face (fresh, face));
+    assert (raqm_set_fallback_faces (fresh, fallback_faces,
+                                     fallback_faces_len));
+    if (invisible_glyph)
+      assert (raqm_set_invisible_glyph (fresh, invisible_glyph));
+    assert (raqm_layout (fresh));
+
+    fresh_glyphs = raqm_get_glyphs (fresh, &fresh_count);
+    assert (fresh_count == count);
+    assert (count == 0 ||
+            memcmp (glyphs, fresh_glyphs, sizeof (raqm_glyph_t) * count) == 0);
+
+    raqm_destroy (fresh);
+
+    /* Only the first layout after the edit reuses runs */
+    assert (raqm_set_stats_enabled (rq, true));
+    raqm_reset_stats (rq);
+    assert (raqm_layout (rq));
+    assert (raqm_get_stats (rq, &layout_stats));
+    assert (layout_stats.reused_runs == 0);
+    glyphs = raqm_get_glyphs (rq, &count);
+    assert (count == fresh_count);
+
+    free (replacement);
+    free (edited);
+  }
+
+  if (relayout)
+  {
+    /* Lay the text out again at twice the size, and make sure the output
+     * matches a full layout. Then scale it to three times the size, which
+     * may only differ from a full layout by rounding. */
+    raqm_t *fresh;
+    raqm_glyph_t *fresh_glyphs;
+    size_t fresh_count;
+    raqm_stats_t layout_stats;
+
+    assert (raqm_set_stats_enabled (rq, true));
+    raqm_reset_stats (rq);
+    assert (!FT_Set_Char_Size (face, face->units_per_EM * 2, 0, 0, 0));
+    assert (raqm_relayout (rq, false));
+    glyphs = raqm_get_glyphs (rq, &count);
+    assert (glyphs != NULL || count == 0);
+    check_glyph_arrays (rq, glyphs, count);
+    check_lines (rq, glyphs, count);
+
+    /* Without scaling, no runs are reused */
+    assert (raqm_get_stats (rq, &layout_stats));
+    assert (layout_stats.reused_runs == 0);
+
+    fresh = layout_fresh (face, dir);
+    fresh_glyphs = raqm_get_glyphs (fresh, &fresh_count);
+    assert (fresh_count == count);
+    assert (count == 0 ||
+            memcmp (glyphs, fresh_glyphs, sizeof (raqm_glyph_t) * count) == 0);
+    raqm_destroy (fresh);
+
+    raqm_reset_stats (rq);
+    assert (!FT_Set_Char_Size (face, face->units_per_EM * 3, 0, 0, 0));
+    assert (raqm_relayout (rq, true));
+    glyphs = raqm_get_glyphs (rq, &count);
+    assert (glyphs != NULL || count == 0);
+    check_glyph_arrays (rq, glyphs, count);
+    check_lines (rq, glyphs, count);
+
+    /* Runs not split by line breaking must all have been scaled */
+    assert (raqm_get_stats (rq, &layout_stats));
+    assert (layout_stats.bidi_runs == 0);
+    assert (line_width || layout_stats.reused_runs == layout_stats.runs);
+
+    fresh = layout_fresh (face, dir);
+    fresh_glyphs = raqm_get_glyphs (fresh, &fresh_count);
+    assert (fresh_count == count);
+    for (size_t i = 0; i < count; i++)
+    {
+      assert (glyphs[i].index == fresh_glyphs[i].index);
+      assert (glyphs[i].cluster == fresh_glyphs[i].cluster);
+      assert (glyphs[i].ftface == fresh_glyphs[i].ftface);
+      assert (abs (glyphs[i].x_advance - fresh_glyphs[i].x_advance) <= 1);
+      assert (abs (glyphs[i].y_advance - fresh_glyphs[i].y_advance) <= 1);
+      assert (abs (glyphs[i].x_offset - fresh_glyphs[i].x_offset) <= 1);
+      assert (abs (glyphs[i].y_offset - fresh_glyphs[i].y_offset) <= 1);
+    }
+    raqm_destroy (fresh);
+  }
+
+  if (batch)
+  {
+    /* Lay the text out twice in one batch, and make sure both copies match
+     * the output of raqm_layout(). */
+    raqm_layout_item_t items[2];
+    raqm_glyph_t *batch_glyphs;
+    size_t offsets[3], batch_count;
+
+    batch_glyphs = glyphs;
+    glyphs = malloc (sizeof (raqm_glyph_t) * count);
+    memcpy (glyphs, batch_glyphs, sizeof (raqm_glyph_t) * count);
+
+    for (size_t i = 0; i < 2; i++)
+    {
+      items[i].text = text;
+      items[i].len = strlen (text);
+      items[i].face = face;
+      items[i].direction = dir;
+      items[i].language = NULL;
+    }
+
+    batch_glyphs = raqm_layout_batch (rq, items, 2, offsets, &batch_count);
+    assert (batch_count == count * 2);
+    assert (offsets[0] == 0 && offsets[1] == count && offsets[2] == count * 2);
+    for (size_t i = 0; i < 2 && count; i++)
+      assert (memcmp (glyphs, batch_glyphs + offsets[i],
+                      sizeof (raqm_glyph_t) * count) == 0);
+    free (glyphs);
+  }
+
+  if (paragraphs)
+  {
+    /* Lay the text out paragraph by paragraph, from memory and then read a
+     * few bytes at a time, and make sure both cover the whole text with the
+     * same paragraphs. */
+    raqm_t *para;
+    paragraphs_t state = { face, dir, 0, 0 };
+    size_t count, pos = 0;
+
+    para = raqm_create ();
+    assert (raqm_set_par_direction (para, dir));
+    assert (raqm_set_fallback_faces (para, fallback_faces, fallback_faces_len));
+    add_features (para);
+    if (invisible_glyph)
+      assert (raqm_set_invisible_glyph (para, invisible_glyph));
+    if (line_width)
+      assert (raqm_set_line_width (para, line_width));
+
+    assert (raqm_layout_paragraphs (para, text, strlen (text), face,
+                                    check_paragraph, &state));
+    assert (state.offset == strlen (text));
+    count = state.count;
+
+    state.offset = state.count = 0;
+    assert (raqm_layout_paragraphs_from_func (para, read_text, &pos, face,
+                                              check_paragraph, &state));
+    assert (state.offset == strlen (text));
+    assert (state.count == count);
+
+    raqm_destroy (para);
+  }
+
+  if (layout_cache)
+  {
+    /* Lay the text out through a layout cache twice, and make sure the
+     * first time matches the layout and the second is a hit. Then make sure
+     * a cache too small for the result does not keep it. */
+    raqm_layout_cache_t *cache;
+    raqm_layout_cache_stats_t cache_stats;
+    raqm_layout_result_t *result, *cached;
+    raqm_glyph_t *result_glyphs;
+    size_t result_count;
+
+    cache = raqm_layout_cache_create (1 << 20);
+    assert (raqm_set_layout_cache (rq, cache));
+
+    result = raqm_layout_cached (rq);
+    assert (result != NULL);
+    result_glyphs = check_result (rq, result);
+    free (result_glyphs);
+
+    cached = raqm_layout_cached (rq);
+    assert (cached == result);
+    raqm_layout_result_destroy (cached);
+
+    assert (raqm_layout_cache_get_stats (cache, &cache_stats));
+    assert (cache_stats.hits == 1 && cache_stats.misses == 1);
+    assert (cache_stats.entries == 1 && cache_stats.bytes > 0);
+    assert (cache_stats.evictions == 0);
+
+    /* A new size of the face needs a new layout */
+    raqm_layout_result_get_glyphs (result, &result_count);
+    if (result_count)
+    {
+      assert (!FT_Set_Char_Size (face, face->units_per_EM * 4, 0, 0, 0));
+      cached = raqm_layout_cached (rq);
+      assert (cached != NULL && cached != result);
+      raqm_layout_result_destroy (cached);
+
+      assert (raqm_layout_cache_get_stats (cache, &cache_stats));
+      assert (cache_stats.hits == 1 && cache_stats.misses == 2);
+      assert (cache_stats.entries == 2);
+    }
+
+    /* A raqm_t with another bidi function must not get the layouts of the
+     * other bidi function from the cache */
+    if (bidi_func)
+    {
+      raqm_layout_cache_stats_t other_stats;
+      raqm_t *other = raqm_create ();
+      raqm_glyph_t *other_glyphs;
+
+      set_text (other);
+      assert (raqm_set_par_direction (other, dir));
+      assert (raqm_set_freetype_face (other, face));
+      assert (raqm_set_bidi_func (other, ltr_bidi, NULL));
+      assert (raqm_set_layout_cache (other, cache));
+
+      cached = raqm_layout_cached (other);
+      assert (cached != NULL && cached != result);
+      assert (raqm_layout_cache_get_stats (cache, &other_stats));
+      assert (other_stats.hits == cache_stats.hits);
+      assert (other_stats.misses == cache_stats.misses + 1);
+      other_glyphs = check_result (other, cached);
+      free (other_glyphs);
+      raqm_layout_result_destroy (cached);
+
+      /* A hit again for the bidi function of the first layout */
+      cached = raqm_layout_cached (rq);
+      assert (cached != NULL);
+      assert (raqm_layout_cache_get_stats (cache, &other_stats));
+      assert (other_stats.hits == cache_stats.hits + 1);
+      raqm_layout_result_destroy (cached);
+
+      assert (raqm_set_layout_cache (other, NULL));
+      raqm_destroy (other);
+    }
+
+    raqm_layout_cache_clear (cache);
+    assert (raqm_layout_cache_get_stats (cache, &cache_stats));
+    assert (cache_stats.entries == 0 && cache_stats.bytes == 0);
+    raqm_layout_cache_destroy (cache);
+
+    cache = raqm_layout_cache_create (1);
+    assert (raqm_set_layout_cache (rq, cache));
+    cached = raqm_layout_cached (rq);
+    assert (cached != NULL && cached != result);
+    assert (raqm_layout_cache_get_stats (cache, &cache_stats));
+    assert (cache_stats.misses == 1 && cache_stats.entries == 0);
+    assert (raqm_set_layout_cache (rq, NULL));
+    raqm_layout_cache_destroy (cache);
+
+    raqm_layout_result_destroy (cached);
+    raqm_layout_result_destroy (result);
+  }
+
+  if (freeze)
+  {
+    /* Freeze the final layout, then make sure the result does not change
+     * when the raqm_t is cleared and destroyed. */
+    raqm_layout_result_t *result;
+    raqm_glyph_t *result_glyphs;
+    const raqm_glyph_t *frozen_glyphs;
+    size_t result_count, frozen_count;
+
+    result = raqm_freeze_layout (rq);
+    assert (result != NULL);
+    result_glyphs = check_result (rq, result);
+    raqm_layout_result_get_glyphs (result, &result_count);
+
+    raqm_clear_contents (rq);
+    raqm_destroy (rq);
+    rq = NULL;
+
+    assert (raqm_layout_result_reference (result) == result);
+    raqm_layout_result_destroy (result);
+
+    frozen_glyphs = raqm_layout_result_get_glyphs (result, &frozen_count);
+    assert (frozen_count == result_count);
+    assert (result_count == 0 ||
+            memcmp (frozen_glyphs, result_glyphs,
+                    sizeof (raqm_glyph_t) * result_count) == 0);
+
+    raqm_layout_result_destroy (result);
+    free (result_glyphs);
+  }
+
   free (text);
   raqm_destroy (rq);
+  assert (alloc_stats.live == 0);
+  raqm_font_cache_destroy (cache);
+  for (size_t i = 0; i < fallback_faces_len; i++)
+    FT_Done_Face (fallback_faces[i]);
   FT_Done_Face (face);
   FT_Done_FreeType (library);
 
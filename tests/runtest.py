@@ -37,6 +37,8 @@ for filename in sys.argv[3:]:
     text = lines[1].replace(r'\r', "\r").replace(r'\n', '\n')
     text = " ".join(f"{b:04X}" for b in text.encode("utf-8"))
     opts = lines[2] and lines[2].split(" ") or []
+    opts = [",".join(os.path.join(srcdir, f) if f.endswith((".ttf", ".otf"))
+                     else f for f in opt.split(",")) for opt in opts]
     expected = "\n".join(lines[3:])
     if "," in font:
         fonts = []